@@ -7,12 +7,20 @@
 
 class TextBuffer;
 
+/* How much a modify handler needs to be told about the deleted text */
+enum DeletedTextNeeds {
+	DELETED_NOTHING,    // neither nDeletedLines nor deletedText
+	DELETED_LINE_COUNT, // nDeletedLines only
+	DELETED_TEXT        // nDeletedLines and deletedText
+};
+
 struct ModifyEvent {
-	int pos;
-	int nInserted;
-	int nDeleted;
-	int nRestyled;
-	const char_type *deletedText;
+	pos_type pos;
+	pos_type nInserted;
+	pos_type nDeleted;
+	pos_type nRestyled;
+	pos_type nDeletedLines;       // newlines in the deleted text
+	const char_type *deletedText; // nullptr unless a handler needs DELETED_TEXT
 	TextBuffer *buffer;
 };
 
@@ -21,6 +29,27 @@ public:
 	virtual ~IBufferModifiedHandler() {
 	}
 	virtual void bufferModified(const ModifyEvent *event) = 0;
+
+	// called instead of bufferModified, for a handler added with a range
+	// (see TextBuffer::BufAddRangedModifyCB), when the change is entirely
+	// before that range; the text in the range only moved
+	virtual void bufferShifted(const ModifyEvent *event) {
+		(void)event;
+	}
+
+	// called instead of bufferModified when the whole text was replaced by
+	// TextBuffer::BufLoad.  The deleted text is never given (deletedText is
+	// nullptr), so a handler which needs it should override this to start
+	// afresh instead
+	virtual void bufferLoaded(const ModifyEvent *event) {
+		bufferModified(event);
+	}
+
+	// what the handler looks at of the deleted text; the buffer only copies
+	// deleted text (which may be huge) when some handler needs all of it
+	virtual DeletedTextNeeds deletedTextNeeds() const {
+		return DELETED_TEXT;
+	}
 };
 
 #endif
@@ -2,10 +2,12 @@
 #ifndef IHIGHLIGHT_HANDLER_H
 #define IHIGHLIGHT_HANDLER_H
 
+#include "Types.h"
+
 class TextBuffer;
 
 struct HighlightEvent {
-	int pos;
+	pos_type pos;
 	TextBuffer *buffer;
 };
 
@@ -2,11 +2,13 @@
 #ifndef IPRE_DELETE_HANDLER_H
 #define IPRE_DELETE_HANDLER_H
 
+#include "Types.h"
+
 class TextBuffer;
 
 struct PreDeleteEvent {
-	int pos;
-	int nDeleted;
+	pos_type pos;
+	pos_type nDeleted;
 	TextBuffer *buffer;
 };
 
@@ -15,6 +17,12 @@ public:
 	virtual ~IPreDeleteHandler() {
 	}
 	virtual void preDelete(const PreDeleteEvent *event) = 0;
+
+	// return true if preDelete must be followed by a bufferModified call
+	// for exactly the same change, so that batched changes can't be merged
+	virtual bool preDeleteNeedsExactModify() const {
+		return false;
+	}
 };
 
 #endif
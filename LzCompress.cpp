@@ -0,0 +1,221 @@
+
+#include "LzCompress.h"
+#include <cstring>
+#include <vector>
+
+namespace {
+
+const size_t MIN_MATCH     = 4;
+const size_t MAX_OFFSET    = 65535;
+const int HASH_BITS        = 14;
+
+/* The last bytes of a block are always literals, and no match starts in the
+   last MATCH_FIND_LIMIT, so a 4 byte read never goes past the end */
+const size_t LAST_LITERALS    = 5;
+const size_t MATCH_FIND_LIMIT = 12;
+
+/* After this many misses in a row, the search starts skipping ahead, so that
+   data which doesn't compress is got through quickly */
+const unsigned SKIP_TRIGGER = 6;
+
+uint32_t read32(const uint8_t *p) {
+	uint32_t value;
+	std::memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+uint32_t hash(uint32_t sequence) {
+	return (sequence * 2654435761u) >> (32 - HASH_BITS);
+}
+
+/*
+** Write the part of a length which doesn't fit in its 4 bits of a token
+*/
+uint8_t *writeLength(uint8_t *op, size_t length) {
+	while (length >= 255) {
+		*op++ = 255;
+		length -= 255;
+	}
+
+	*op++ = static_cast<uint8_t>(length);
+	return op;
+}
+
+/*
+** Read the part of a length which didn't fit in its 4 bits of a token,
+** returning false if it runs off the end of the input
+*/
+bool readLength(const uint8_t **ip, const uint8_t *end, size_t *length) {
+	uint8_t b;
+	do {
+		if (*ip == end) {
+			return false;
+		}
+		b = *(*ip)++;
+		*length += b;
+	} while (b == 255);
+
+	return true;
+}
+
+/*
+** Write a sequence: the literals from "literals" to "ip", then (unless this
+** is the last sequence, "matchLength" being 0) a match "offset" back
+*/
+uint8_t *writeSequence(uint8_t *op, const uint8_t *literals, const uint8_t *ip, size_t offset, size_t matchLength) {
+
+	const size_t literalLength = static_cast<size_t>(ip - literals);
+	uint8_t *const token = op++;
+
+	*token = static_cast<uint8_t>((literalLength < 15 ? literalLength : 15) << 4);
+	if (literalLength >= 15) {
+		op = writeLength(op, literalLength - 15);
+	}
+
+	if (literalLength != 0) {
+		std::memcpy(op, literals, literalLength);
+		op += literalLength;
+	}
+
+	if (matchLength != 0) {
+		*op++ = static_cast<uint8_t>(offset);
+		*op++ = static_cast<uint8_t>(offset >> 8);
+
+		const size_t length = matchLength - MIN_MATCH;
+		*token |= static_cast<uint8_t>(length < 15 ? length : 15);
+		if (length >= 15) {
+			op = writeLength(op, length - 15);
+		}
+	}
+
+	return op;
+}
+
+}
+
+/*
+** Most bytes lzCompress can write for "length" bytes of input
+*/
+size_t lzCompressBound(size_t length) {
+	return length + length / 255 + 16;
+}
+
+/*
+** Compress the "length" bytes of "src" into "dst" (which must have room for
+** lzCompressBound(length) bytes), returning how many bytes were written
+*/
+size_t lzCompress(const uint8_t *src, size_t length, uint8_t *dst) {
+
+	const uint8_t *const end = src + length;
+	const uint8_t *ip = src;
+	const uint8_t *anchor = src;
+	uint8_t *op = dst;
+
+	if (length > MATCH_FIND_LIMIT) {
+		std::vector<uint32_t> table(1u << HASH_BITS, 0);
+		const uint8_t *const findLimit = end - MATCH_FIND_LIMIT;
+		const uint8_t *const matchLimit = end - LAST_LITERALS;
+		unsigned misses = 0;
+
+		while (ip <= findLimit) {
+			const uint32_t sequence = read32(ip);
+			uint32_t &entry = table[hash(sequence)];
+			const uint8_t *match = src + entry;
+			entry = static_cast<uint32_t>(ip - src);
+
+			if (match >= ip || static_cast<size_t>(ip - match) > MAX_OFFSET || read32(match) != sequence) {
+				ip += 1 + (misses++ >> SKIP_TRIGGER);
+				continue;
+			}
+
+			misses = 0;
+
+			/* take in any matching bytes before and after the 4 found */
+			while (ip > anchor && match > src && ip[-1] == match[-1]) {
+				ip--;
+				match--;
+			}
+
+			const uint8_t *matchEnd = ip + MIN_MATCH;
+			const uint8_t *ref = match + MIN_MATCH;
+			while (matchEnd < matchLimit && *matchEnd == *ref) {
+				matchEnd++;
+				ref++;
+			}
+
+			op = writeSequence(op, anchor, ip, static_cast<size_t>(ip - match), static_cast<size_t>(matchEnd - ip));
+			ip = matchEnd;
+			anchor = ip;
+		}
+	}
+
+	op = writeSequence(op, anchor, end, 0, 0);
+	return static_cast<size_t>(op - dst);
+}
+
+/*
+** Decompress the "srcLength" bytes of "src", which must come to exactly
+** "dstLength" bytes, into "dst".  Returns false if the data is corrupt.
+*/
+bool lzDecompress(const uint8_t *src, size_t srcLength, uint8_t *dst, size_t dstLength) {
+
+	const uint8_t *ip = src;
+	const uint8_t *const ipEnd = src + srcLength;
+	uint8_t *op = dst;
+	uint8_t *const opEnd = dst + dstLength;
+
+	while (ip < ipEnd) {
+		const uint8_t token = *ip++;
+
+		size_t literalLength = token >> 4;
+		if (literalLength == 15 && !readLength(&ip, ipEnd, &literalLength)) {
+			return false;
+		}
+
+		if (literalLength > static_cast<size_t>(ipEnd - ip) || literalLength > static_cast<size_t>(opEnd - op)) {
+			return false;
+		}
+
+		if (literalLength != 0) {
+			std::memcpy(op, ip, literalLength);
+			ip += literalLength;
+			op += literalLength;
+		}
+
+		/* the last sequence has no match */
+		if (ip == ipEnd) {
+			break;
+		}
+
+		if (ipEnd - ip < 2) {
+			return false;
+		}
+
+		const size_t offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+
+		size_t matchLength = token & 15;
+		if (matchLength == 15 && !readLength(&ip, ipEnd, &matchLength)) {
+			return false;
+		}
+		matchLength += MIN_MATCH;
+
+		if (offset == 0 || offset > static_cast<size_t>(op - dst) || matchLength > static_cast<size_t>(opEnd - op)) {
+			return false;
+		}
+
+		/* a match may overlap the bytes it produces (a run of one byte is a
+		   match at offset 1), in which case it is copied a byte at a time */
+		const uint8_t *ref = op - offset;
+		if (offset >= matchLength) {
+			std::memcpy(op, ref, matchLength);
+			op += matchLength;
+		} else {
+			for (size_t i = 0; i < matchLength; i++) {
+				*op++ = *ref++;
+			}
+		}
+	}
+
+	return op == opEnd;
+}
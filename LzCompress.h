@@ -0,0 +1,18 @@
+
+#ifndef LZ_COMPRESS_H_
+#define LZ_COMPRESS_H_
+
+#include <cstddef>
+#include <cstdint>
+
+/* A fast LZ77 block compressor, for data which must be held on to but is
+   rarely looked at again (such as the text of big undo records).  The block
+   format is that of LZ4: sequences of a run of literal bytes followed by a
+   copy of at least 4 bytes from up to 64K back.  Source code comes out at
+   around 40% of its size, compressed at a couple of hundred MB a second and
+   decompressed about three times as fast. */
+size_t lzCompressBound(size_t length);
+size_t lzCompress(const uint8_t *src, size_t length, uint8_t *dst);
+bool lzDecompress(const uint8_t *src, size_t srcLength, uint8_t *dst, size_t dstLength);
+
+#endif
@@ -0,0 +1,369 @@
+
+#include "MarkerStore.h"
+#include <algorithm>
+
+namespace {
+
+/*
+** Where position "x" ends up when "nDeleted" characters at "pos" are
+** replaced by "nInserted" others.  Text inserted at a position goes before
+** it, and positions inside the deleted text collapse to its start.  This
+** never changes the order of two positions, so the treap stays ordered.
+*/
+pos_type movePosition(pos_type x, pos_type pos, pos_type nDeleted, pos_type nInserted) {
+	if (x < pos) {
+		return x;
+	}
+
+	if (x >= pos + nDeleted) {
+		return x + nInserted - nDeleted;
+	}
+
+	return pos;
+}
+
+}
+
+MarkerStore::MarkerStore() : root_(-1), seed_(0x9e3779b9) {
+}
+
+/*
+** Add a marker from "start" to "end" (which must not be before "start"),
+** returning its id.  Ids of removed markers are reused.
+*/
+int MarkerStore::add(pos_type start, pos_type end, int type) {
+
+	Node node;
+	node.start = start;
+	node.end = end;
+	node.maxEnd = end;
+	node.shift = 0;
+	node.left = -1;
+	node.right = -1;
+	node.parent = -1;
+	node.type = type;
+	node.priority = nextPriority();
+	node.used = true;
+
+	int id;
+	if (!free_.empty()) {
+		id = free_.back();
+		free_.pop_back();
+		nodes_[id] = node;
+	} else {
+		id = static_cast<int>(nodes_.size());
+		nodes_.push_back(node);
+	}
+
+	int left;
+	int right;
+	split(root_, start, &left, &right);
+	root_ = merge(merge(left, id), right);
+	nodes_[root_].parent = -1;
+	return id;
+}
+
+/*
+** Remove marker "id"
+*/
+void MarkerStore::remove(int id) {
+
+	if (id < 0 || id >= static_cast<int>(nodes_.size()) || !nodes_[id].used) {
+		return;
+	}
+
+	/* the shifts pending above the node must reach its children before
+	   they are moved up in its place */
+	std::vector<int> path;
+	for (int node = nodes_[id].parent; node != -1; node = nodes_[node].parent) {
+		path.push_back(node);
+	}
+
+	for (auto it = path.rbegin(); it != path.rend(); ++it) {
+		push(*it);
+	}
+
+	push(id);
+
+	const int parent = nodes_[id].parent;
+	const int subtree = merge(nodes_[id].left, nodes_[id].right);
+
+	if (parent == -1) {
+		root_ = subtree;
+		if (subtree != -1) {
+			nodes_[subtree].parent = -1;
+		}
+	} else {
+		if (nodes_[parent].left == id) {
+			nodes_[parent].left = subtree;
+		} else {
+			nodes_[parent].right = subtree;
+		}
+
+		for (int node : path) {
+			pull(node);
+		}
+	}
+
+	nodes_[id].used = false;
+	free_.push_back(id);
+}
+
+/*
+** Get the current position of marker "id", returning false if there is no
+** such marker
+*/
+bool MarkerStore::get(int id, pos_type *start, pos_type *end) const {
+
+	if (id < 0 || id >= static_cast<int>(nodes_.size()) || !nodes_[id].used) {
+		return false;
+	}
+
+	pos_type offset = 0;
+	for (int node = nodes_[id].parent; node != -1; node = nodes_[node].parent) {
+		offset += nodes_[node].shift;
+	}
+
+	*start = nodes_[id].start + offset;
+	*end = nodes_[id].end + offset;
+	return true;
+}
+
+/*
+** Number of markers in the store
+*/
+int MarkerStore::size() const {
+	return static_cast<int>(nodes_.size() - free_.size());
+}
+
+/*
+** Bytes used by the store
+*/
+size_t MarkerStore::memoryUsage() const {
+	return nodes_.capacity() * sizeof(Node) + free_.capacity() * sizeof(int);
+}
+
+/*
+** Remove all of the markers
+*/
+void MarkerStore::clear() {
+	nodes_.clear();
+	free_.clear();
+	root_ = -1;
+}
+
+/*
+** Find the markers which touch the range from "start" to "end" (that is,
+** which start no later than "end" and end no earlier than "start"), in order
+** of their start positions, replacing the contents of "markers"
+*/
+void MarkerStore::query(pos_type start, pos_type end, std::vector<Marker> *markers) const {
+	markers->clear();
+	query(root_, 0, start, end, markers);
+}
+
+void MarkerStore::query(int node, pos_type offset, pos_type start, pos_type end, std::vector<Marker> *markers) const {
+
+	while (node != -1) {
+		const Node &n = nodes_[node];
+
+		if (n.maxEnd + offset < start) {
+			return;
+		}
+
+		const pos_type childOffset = offset + n.shift;
+		query(n.left, childOffset, start, end, markers);
+
+		if (n.start + offset > end) {
+			return;
+		}
+
+		if (n.end + offset >= start) {
+			markers->push_back(Marker{node, n.start + offset, n.end + offset, n.type});
+		}
+
+		/* loop rather than recurse down the right, to save stack */
+		node = n.right;
+		offset = childOffset;
+	}
+}
+
+/*
+** Update the markers for the replacement of "nDeleted" characters at "pos"
+** with "nInserted" others (see movePosition)
+*/
+void MarkerStore::update(pos_type pos, pos_type nDeleted, pos_type nInserted) {
+
+	if (root_ == -1 || (nDeleted == 0 && nInserted == 0)) {
+		return;
+	}
+
+	/* split into the markers starting before the change, in the deleted
+	   text, and after it */
+	int before;
+	int inside;
+	int after;
+	split(root_, pos, &before, &inside);
+	split(inside, pos + nDeleted, &inside, &after);
+
+	shift(after, nInserted - nDeleted);
+	collapse(inside, pos, nDeleted, nInserted);
+	moveEnds(before, pos, nDeleted, nInserted);
+
+	root_ = merge(merge(before, inside), after);
+	if (root_ != -1) {
+		nodes_[root_].parent = -1;
+	}
+}
+
+/*
+** Move every marker of subtree "node", all of which start in the deleted
+** text, for the change (see update)
+*/
+void MarkerStore::collapse(int node, pos_type pos, pos_type nDeleted, pos_type nInserted) {
+
+	if (node == -1) {
+		return;
+	}
+
+	push(node);
+	nodes_[node].start = pos;
+	nodes_[node].end = movePosition(nodes_[node].end, pos, nDeleted, nInserted);
+	collapse(nodes_[node].left, pos, nDeleted, nInserted);
+	collapse(nodes_[node].right, pos, nDeleted, nInserted);
+	pull(node);
+}
+
+/*
+** Move the ends of the markers of subtree "node", all of which start before
+** the change, for the change (see update).  Only subtrees holding a marker
+** which reaches the change are visited.
+*/
+void MarkerStore::moveEnds(int node, pos_type pos, pos_type nDeleted, pos_type nInserted) {
+
+	if (node == -1 || nodes_[node].maxEnd < pos) {
+		return;
+	}
+
+	push(node);
+	nodes_[node].end = movePosition(nodes_[node].end, pos, nDeleted, nInserted);
+	moveEnds(nodes_[node].left, pos, nDeleted, nInserted);
+	moveEnds(nodes_[node].right, pos, nDeleted, nInserted);
+	pull(node);
+}
+
+/*
+** Join the trees "left" and "right", all of whose markers start no earlier
+** than those in "left"
+*/
+int MarkerStore::merge(int left, int right) {
+
+	if (left == -1) {
+		return right;
+	}
+
+	if (right == -1) {
+		return left;
+	}
+
+	if (nodes_[left].priority > nodes_[right].priority) {
+		push(left);
+		nodes_[left].right = merge(nodes_[left].right, right);
+		pull(left);
+		return left;
+	} else {
+		push(right);
+		nodes_[right].left = merge(left, nodes_[right].left);
+		pull(right);
+		return right;
+	}
+}
+
+/*
+** Split tree "node" into the markers starting before position "pos"
+** ("left") and the rest ("right")
+*/
+void MarkerStore::split(int node, pos_type pos, int *left, int *right) {
+
+	if (node == -1) {
+		*left = -1;
+		*right = -1;
+		return;
+	}
+
+	push(node);
+
+	if (nodes_[node].start < pos) {
+		split(nodes_[node].right, pos, &nodes_[node].right, right);
+		*left = node;
+	} else {
+		split(nodes_[node].left, pos, left, &nodes_[node].left);
+		*right = node;
+	}
+
+	pull(node);
+
+	if (*left != -1) {
+		nodes_[*left].parent = -1;
+	}
+
+	if (*right != -1) {
+		nodes_[*right].parent = -1;
+	}
+}
+
+/*
+** Move every marker of subtree "node" by "amount"
+*/
+void MarkerStore::shift(int node, pos_type amount) {
+
+	if (node == -1 || amount == 0) {
+		return;
+	}
+
+	nodes_[node].start += amount;
+	nodes_[node].end += amount;
+	nodes_[node].maxEnd += amount;
+	nodes_[node].shift += amount;
+}
+
+/*
+** Pass the shift pending at "node" on to its children
+*/
+void MarkerStore::push(int node) {
+
+	if (nodes_[node].shift != 0) {
+		shift(nodes_[node].left, nodes_[node].shift);
+		shift(nodes_[node].right, nodes_[node].shift);
+		nodes_[node].shift = 0;
+	}
+}
+
+/*
+** Recompute what "node" holds about its subtree after its children changed
+*/
+void MarkerStore::pull(int node) {
+
+	Node &n = nodes_[node];
+	n.maxEnd = n.end;
+
+	if (n.left != -1) {
+		n.maxEnd = std::max(n.maxEnd, nodes_[n.left].maxEnd);
+		nodes_[n.left].parent = node;
+	}
+
+	if (n.right != -1) {
+		n.maxEnd = std::max(n.maxEnd, nodes_[n.right].maxEnd);
+		nodes_[n.right].parent = node;
+	}
+}
+
+/*
+** Return a pseudo-random treap priority (xorshift)
+*/
+unsigned MarkerStore::nextPriority() {
+	seed_ ^= seed_ << 13;
+	seed_ ^= seed_ >> 17;
+	seed_ ^= seed_ << 5;
+	return seed_;
+}
@@ -0,0 +1,69 @@
+
+#ifndef MARKER_STORE_H_
+#define MARKER_STORE_H_
+
+#include "Types.h"
+#include <vector>
+
+/* A marked range of text, as returned by MarkerStore::query */
+struct Marker {
+	int id;
+	pos_type start;
+	pos_type end;
+	int type; // what the marker is for (bookmark, error, diff hunk...), up to the caller
+};
+
+/* Positions in a text (bookmarks, error markers, diff hunks...) which follow
+   the edits made to it.  The markers are kept in a treap ordered by start
+   position, each subtree holding the furthest end position in it and a
+   shift still to be applied to it.  An edit then moves every marker after it
+   with a single shift of a subtree, and only visits the markers which
+   actually overlap it, so it costs O(log n + affected) however many markers
+   there are.  The same bound holds for finding the markers in a range. */
+class MarkerStore {
+public:
+	MarkerStore();
+
+public:
+	bool get(int id, pos_type *start, pos_type *end) const;
+	int add(pos_type start, pos_type end, int type);
+	int size() const;
+	size_t memoryUsage() const;
+	void clear();
+	void query(pos_type start, pos_type end, std::vector<Marker> *markers) const;
+	void remove(int id);
+	void update(pos_type pos, pos_type nDeleted, pos_type nInserted);
+
+private:
+	struct Node {
+		pos_type start;
+		pos_type end;
+		pos_type maxEnd;   // largest end in this subtree
+		pos_type shift;    // still to be added to the positions in both children
+		int left;
+		int right;
+		int parent;
+		int type;
+		unsigned priority; // treap priority, never smaller than that of either child
+		bool used;         // false for nodes on the free list
+	};
+
+private:
+	int merge(int left, int right);
+	unsigned nextPriority();
+	void collapse(int node, pos_type pos, pos_type nDeleted, pos_type nInserted);
+	void moveEnds(int node, pos_type pos, pos_type nDeleted, pos_type nInserted);
+	void pull(int node);
+	void push(int node);
+	void query(int node, pos_type offset, pos_type start, pos_type end, std::vector<Marker> *markers) const;
+	void shift(int node, pos_type amount);
+	void split(int node, pos_type pos, int *left, int *right);
+
+private:
+	std::vector<Node> nodes_; // indexed by marker id
+	std::vector<int> free_;   // ids of removed markers, to be reused
+	int root_;                // -1 when there are no markers
+	unsigned seed_;           // state of the treap priority generator
+};
+
+#endif
@@ -1,9 +1,12 @@
 
 #include "NirvanaQt.h"
+#include "Rangeset.h"
 #include "SyntaxHighlighter.h"
+#include "TextScan.h"
 #include "X11Colors.h"
 #include <QApplication>
 #include <QClipboard>
+#include <QFile>
 #include <QFontMetrics>
 #include <QKeyEvent>
 #include <QMenu>
@@ -26,6 +29,8 @@ const QString DefaultFont      = "Courier";
 const int SelectThreshold = 5;
 
 const int CursorInterval       = 500;
+const int MemoryCheckInterval  = 1000;
+const int HistorySlackDivisor  = 4;
 const int DefaultFontSize      = 12;
 const int DefaultWidth         = 80;
 const int DefaultHeight        = 20;
@@ -40,15 +45,7 @@ int countLines(const char_type *string) {
         return 0;
     }
 
-    int lineCount = 0;
-
-    for (const char_type *c = string; *c != _T('\0'); ++c) {
-        if (*c == _T('\n')) {
-            ++lineCount;
-        }
-    }
-
-    return lineCount;
+    return static_cast<int>(countNewlines(string, traits_type::length(string)));
 }
 
 #define UNDO_OP_LIMIT 400 /* normal limit for length of undo list */
@@ -65,15 +62,11 @@ int countLines(const char_type *string) {
    UNDO_OP_TRIMTO in length (when the list reaches UNDO_OP_LIMIT, it is
    trimmed to UNDO_OP_TRIMTO then allowed to grow back to UNDO_OP_LIMIT).
    When there are very large amounts of saved text held in the list,
-   UNDO_WORRY_LIMIT and UNDO_PURGE_LIMIT take over and cause the list to
-   be trimmed back further to keep its size down. */
-#define UNDO_PURGE_LIMIT                                                                                               \
-    15000000                /* If undo list gets this large (in bytes),                                                \
-               trim it to length of UNDO_PURGE_TRIMTO */
-#define UNDO_PURGE_TRIMTO 1 /* Amount to trim the undo list in a purge */
-#define UNDO_WORRY_LIMIT                                                                                               \
-    2000000 /* If undo list gets this large (in bytes),                                                                \
-trim it to length of UNDO_WORRY_TRIMTO */
+   UNDO_MEMORY_LIMIT takes over and causes the oldest records to be dropped
+   until the list fits in it again (though the newest one is always kept, so
+   that the last edit can be undone however big it was). */
+#define UNDO_MEMORY_LIMIT                                                                                              \
+    2000000 /* Most memory (in bytes) the undo list is allowed to use */
 #define UNDO_WORRY_TRIMTO                                                                                              \
     5                     /* Amount to trim the undo list when memory                                                  \
                  use begins to get serious */
@@ -81,6 +74,8 @@ trim it to length of UNDO_WORRY_TRIMTO */
 #define UNDO_OP_TRIMTO                                                                                                 \
     200 /* size undo list is normally trimmed to                                                                       \
 when it exceeds UNDO_OP_TRIMTO in length */
+#define UNDO_DIFF_THRESHOLD 1024 /* replacements of this much text are recorded
+                                   as only the ranges which changed */
 
 enum SearchDirection { SEARCH_FORWARD, SEARCH_BACKWARD };
 
@@ -126,6 +121,35 @@ bool isPrintableText(const QString &text) {
     return !text.isEmpty() && (text.at(0).isPrint() || text.at(0) == QLatin1Char('\t'));
 }
 
+/*
+** Whether undoing (or redoing) the newest record of "list" makes the very
+** change journal "entry" records
+*/
+bool newestRecordMakes(UndoList *list, const JournalEntry &entry) {
+
+    const UndoInfo &undo = list->newest();
+    std::vector<char_type> oldText;
+    list->newestText(&oldText);
+
+    if (undo.type != MULTI_REPLACE) {
+        return entry.pos == undo.startPos && entry.nDeleted == undo.endPos - undo.startPos && entry.text == oldText;
+    }
+
+    /* the ranges are put back in one batch, which reports them as the one
+       replacement covering them all */
+    std::vector<UndoDelta> deltas;
+    std::vector<char_type> text;
+    unpackDeltas(undo.startPos, oldText, &deltas, &text);
+
+    pos_type growth = 0;
+    for (const UndoDelta &delta : deltas) {
+        growth += delta.oldLen - delta.newLen;
+    }
+
+    const pos_type nDeleted = deltas.back().pos + deltas.back().newLen - deltas.front().pos;
+    return entry.pos == deltas.front().pos && entry.nDeleted == nDeleted && static_cast<pos_type>(entry.text.size()) == nDeleted + growth;
+}
+
 const char_type Delimiters[] = _T("(.,/\\`'!|@#%^&*()-=+{}[]\":;<>?~ \t\n)");
 
 }
@@ -135,7 +159,7 @@ const char_type Delimiters[] = _T("(.,/\\`'!|@#%^&*()-=+{}[]\":;<>?~ \t\n)");
 //------------------------------------------------------------------------------
 NirvanaQt::NirvanaQt(QWidget *parent)
     : QAbstractScrollArea(parent), cursorTimer_(new QTimer(this)), clickTimer_(new QTimer(this)),
-      autoScrollTimer_(new QTimer(this)) {
+      autoScrollTimer_(new QTimer(this)), memoryTimer_(new QTimer(this)) {
 
     QPalette pal(viewport()->palette());
 
@@ -164,6 +188,9 @@ NirvanaQt::NirvanaQt(QWidget *parent)
     autoScrollTimer_->setSingleShot(true);
     connect(autoScrollTimer_, SIGNAL(timeout()), this, SLOT(autoScrollTimeout()));
 
+    memoryTimer_->setSingleShot(true);
+    connect(memoryTimer_, SIGNAL(timeout()), this, SLOT(memoryTimeout()));
+
     buffer_ = new TextBuffer();
     syntaxHighlighter_ = new SyntaxHighlighter();
     absTopLineNum_ = 1;
@@ -213,17 +240,16 @@ NirvanaQt::NirvanaQt(QWidget *parent)
     wrapMargin_ = 0;
     modifyingTabDist_ = false;
     matchSyntaxBased_ = false;
-    undo_ = nullptr;
-    redo_ = nullptr;
     undoModifiesSelection_ = true;
-    undoOpCount_ = 0;
-    undoMemUsed_ = 0;
     ignoreModify_ = false;
     autoSave_ = false;
     wasSelected_ = false;
     autoSaveCharCount_ = 0;
     autoSaveOpCount_ = 0;
     fileChanged_ = false;
+    memoryLimit_ = 0;
+    followMode_ = false;
+    historyLimit_ = 0;
 
 
     lineStarts_.resize(nVisibleLines_);
@@ -272,6 +298,262 @@ void NirvanaQt::clickTimeout() {
     clickCount_ = 0;
 }
 
+//------------------------------------------------------------------------------
+// Name: memoryTimeout
+//------------------------------------------------------------------------------
+void NirvanaQt::memoryTimeout() {
+    checkMemoryLimit();
+}
+
+//------------------------------------------------------------------------------
+// Name: memoryUsage
+//------------------------------------------------------------------------------
+EditorMemoryUsage NirvanaQt::memoryUsage() const {
+
+    EditorMemoryUsage usage;
+    usage.text = buffer_->BufMemoryUsage();
+    usage.styles = syntaxHighlighter_->styleMemoryUsage();
+    usage.patterns = syntaxHighlighter_->patternMemoryUsage();
+
+    usage.undo = undo_.memoryUsage() + redo_.memoryUsage();
+
+    usage.display = lineStarts_.capacity() * sizeof(pos_type);
+    usage.total = usage.text.total + usage.styles + usage.patterns + usage.undo + usage.display;
+    return usage;
+}
+
+//------------------------------------------------------------------------------
+// Name: setMemoryLimit
+// Desc: sets a soft limit on the memory used by the editor (0 for none).  It
+//       is checked shortly after each edit, and when the editor is hidden.
+//------------------------------------------------------------------------------
+void NirvanaQt::setMemoryLimit(size_t bytes) {
+    memoryLimit_ = bytes;
+    checkMemoryLimit();
+}
+
+/*
+** If the editor uses more memory than its limit, give back what it can, in
+** order of how little it costs the user: spare room in the text and style
+** buffers, then all but the last few undo operations, then (if the editor
+** isn't visible) the syntax highlighting styles, which are reparsed when it
+** is shown again.  The limit is soft: the text itself is never touched.
+*/
+void NirvanaQt::checkMemoryLimit() {
+
+    if (memoryLimit_ == 0 || memoryUsage().total <= memoryLimit_) {
+        return;
+    }
+
+    buffer_->BufCompact();
+    syntaxHighlighter_->compactStyles();
+    undo_.compact();
+    redo_.compact();
+    lineStarts_.squeeze();
+    if (memoryUsage().total <= memoryLimit_) {
+        return;
+    }
+
+    trimUndoList(UNDO_WORRY_TRIMTO);
+    if (memoryUsage().total <= memoryLimit_) {
+        return;
+    }
+
+    if (!isVisible()) {
+        syntaxHighlighter_->releaseStyles();
+    }
+}
+
+//------------------------------------------------------------------------------
+// Name: appendText
+// Desc: adds text to the end of the buffer, as when following a log file or
+//       the output of a process.  Appends are not recorded for undo, their
+//       highlighting is put off until they are drawn, and only the lines
+//       added are counted, so each costs time in proportion to its length.
+//------------------------------------------------------------------------------
+void NirvanaQt::appendText(const char_type *text, pos_type length) {
+
+    syntaxHighlighter_->parseLater(buffer_, buffer_->BufGetLength());
+
+    const bool ignoreModify = ignoreModify_;
+    ignoreModify_ = true;
+    buffer_->BufAppend(text, length);
+    trimHistory();
+    ignoreModify_ = ignoreModify;
+
+    updateLineNumDisp();
+
+    if (followMode_) {
+        scrollToEnd();
+    }
+}
+
+//------------------------------------------------------------------------------
+// Name: setFollowMode
+// Desc: when on, the display scrolls to keep the end of the text in view as
+//       text is appended (see appendText)
+//------------------------------------------------------------------------------
+void NirvanaQt::setFollowMode(bool follow) {
+    followMode_ = follow;
+
+    if (followMode_) {
+        scrollToEnd();
+    }
+}
+
+//------------------------------------------------------------------------------
+// Name: setHistoryLimit
+// Desc: sets the most text kept as text is appended (0 for no limit), the
+//       oldest lines being dropped to make room
+//------------------------------------------------------------------------------
+void NirvanaQt::setHistoryLimit(pos_type maxLength) {
+    historyLimit_ = maxLength;
+
+    const bool ignoreModify = ignoreModify_;
+    ignoreModify_ = true;
+    trimHistory();
+    ignoreModify_ = ignoreModify;
+}
+
+//------------------------------------------------------------------------------
+// Name: startJournal
+// Desc: starts recording every change to the text in a journal at "path",
+//       from which they can be recovered after a crash or a restart (see
+//       recoverFromJournal).  Call it when the text has just been loaded from
+//       or saved to its file, the journal being of changes to that text.
+//       Starting a journal replaces the one before, so undo history only
+//       survives a restart back to the last save: what was undoable before
+//       it is lost once the editor is closed.
+//------------------------------------------------------------------------------
+void NirvanaQt::startJournal(const QString &path) {
+    journal_.start(QFile::encodeName(path).constData(), buffer_->BufSnapshot());
+    autoSave_ = true;
+    autoSaveCharCount_ = 0;
+    autoSaveOpCount_ = 0;
+}
+
+//------------------------------------------------------------------------------
+// Name: recoverFromJournal
+// Desc: replays the journal at "path" (see startJournal) onto the text, which
+//       should be as it was last saved, redoing the changes made since along
+//       with their undo history, then carries on journaling there (dropping
+//       whatever it couldn't replay).  Returns false, leaving the text alone,
+//       if the journal isn't one of changes to this text.
+//------------------------------------------------------------------------------
+bool NirvanaQt::recoverFromJournal(const QString &path) {
+
+    const QByteArray name = QFile::encodeName(path);
+
+    std::vector<JournalEntry> entries;
+    std::vector<int64_t> offsets;
+    if (!UndoJournal::read(name.constData(), buffer_->BufSnapshot(), &entries, &offsets)) {
+        return false;
+    }
+
+    journal_.close();
+
+    size_t nReplayed = 0;
+    for (const JournalEntry &entry : entries) {
+        const pos_type nInserted = static_cast<pos_type>(entry.text.size());
+
+        if (entry.pos < 0 || entry.nDeleted < 0 || entry.pos + entry.nDeleted > buffer_->BufGetLength()) {
+            break;
+        }
+
+        /* undoing and redoing are done over again rather than as edits, so
+           that the undo and redo lists come out as they were, as long as the
+           newest record makes the change journaled.  It won't when undoing
+           went back past the save the journal started at, to records this
+           editor never had: the change is then made as it was journaled,
+           and the undo lists (out of step with the text from there on) are
+           dropped. */
+        if (entry.kind == JOURNAL_UNDO && !undo_.empty() && newestRecordMakes(&undo_, entry)) {
+            Undo();
+        } else if (entry.kind == JOURNAL_REDO && !redo_.empty() && newestRecordMakes(&redo_, entry)) {
+            Redo();
+        } else {
+            const bool ignoreModify = ignoreModify_;
+            ignoreModify_ = (entry.kind != JOURNAL_EDIT);
+
+            if (entry.kind == JOURNAL_TRIM) {
+                undo_.cutHead(entry.nDeleted);
+                redo_.cutHead(entry.nDeleted);
+            } else if (entry.kind != JOURNAL_EDIT && entry.kind != JOURNAL_APPEND) {
+                ClearUndoList();
+                ClearRedoList();
+            }
+
+            buffer_->BufReplace(entry.pos, entry.pos + entry.nDeleted, entry.text.data(), nInserted);
+            ignoreModify_ = ignoreModify;
+        }
+
+        nReplayed++;
+    }
+
+    /* the journal is cut back to the entries replayed, so that anything after
+       them is never replayed on top of changes made from here on */
+    journal_.resume(name.constData(), offsets[nReplayed]);
+    autoSave_ = true;
+    autoSaveCharCount_ = 0;
+    autoSaveOpCount_ = 0;
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// Name: stopJournal
+// Desc: stops journaling changes to the text, leaving the journal as it is
+//------------------------------------------------------------------------------
+void NirvanaQt::stopJournal() {
+    journal_.close();
+    autoSave_ = false;
+}
+
+/*
+** Scroll so that the last line of the text is at the bottom of the display
+*/
+void NirvanaQt::scrollToEnd() {
+    const int lastTopLine = qMax(1, nBufferLines_ - (nVisibleLines_ - 2) + cursorVPadding_);
+
+    if (lastTopLine != topLineNum_) {
+        TextDSetScroll(lastTopLine, horizOffset_);
+    }
+}
+
+/*
+** Drop whole lines from the start of the text once it is longer than the
+** history limit.  Removing from the start means moving the gap there, which
+** costs as much as the text kept, so nothing is dropped until the text is a
+** good deal (1/HistorySlackDivisor) over the limit: that makes it amortized
+** O(1) per character appended.  Every position moves back by the same
+** amount, so the undo records after the cut are moved with it; only those
+** which changed the text dropped (and the older ones behind them) go.
+*/
+void NirvanaQt::trimHistory() {
+
+    const pos_type length = buffer_->BufGetLength();
+
+    if (historyLimit_ == 0 || length - historyLimit_ <= historyLimit_ / HistorySlackDivisor) {
+        return;
+    }
+
+    pos_type cut = buffer_->BufEndOfLine(length - historyLimit_);
+    cut = (cut < length) ? cut + 1 : length - historyLimit_;
+
+    undo_.cutHead(cut);
+    redo_.cutHead(cut);
+
+    buffer_->BufRemove(0, cut);
+    UpdateMarkTable(0, 0, cut);
+}
+
+//------------------------------------------------------------------------------
+// Name: buffer
+// Desc: the text being edited, to read
+//------------------------------------------------------------------------------
+const TextBuffer *NirvanaQt::buffer() const {
+    return buffer_;
+}
+
 //------------------------------------------------------------------------------
 // Name: font
 //------------------------------------------------------------------------------
@@ -522,6 +804,29 @@ int NirvanaQt::visibleColumns() const {
     return count;
 }
 
+//------------------------------------------------------------------------------
+// Name: showEvent
+//------------------------------------------------------------------------------
+void NirvanaQt::showEvent(QShowEvent *event) {
+
+    /* bring back the styles if they were dropped while hidden */
+    syntaxHighlighter_->restoreStyles(buffer_);
+    QAbstractScrollArea::showEvent(event);
+}
+
+//------------------------------------------------------------------------------
+// Name: hideEvent
+//------------------------------------------------------------------------------
+void NirvanaQt::hideEvent(QHideEvent *event) {
+
+    QAbstractScrollArea::hideEvent(event);
+
+    /* a hidden editor may give up more memory, see checkMemoryLimit */
+    if (memoryLimit_ != 0) {
+        memoryTimer_->start(MemoryCheckInterval);
+    }
+}
+
 //------------------------------------------------------------------------------
 // Name: resizeEvent
 //------------------------------------------------------------------------------
@@ -539,7 +844,7 @@ void NirvanaQt::resizeEvent(QResizeEvent *event) {
        lines in the buffer, and can leave the top line number incorrect, and
        the top character no longer pointing at a valid line start */
     if (continuousWrap_ && wrapMargin_ == 0 && viewport()->width() != oldWidth) {
-        int oldFirstChar = firstChar_;
+        pos_type oldFirstChar = firstChar_;
         nBufferLines_ = TextDCountLines(0, buffer_->BufGetLength(), true);
         firstChar_ = TextDStartOfLine(firstChar_);
         topLineNum_ = TextDCountLines(0, firstChar_, true) + 1;
@@ -681,14 +986,14 @@ void NirvanaQt::mousePressEvent(QMouseEvent *event) {
         viewport()->update();
     } else if (event->button() == Qt::MiddleButton) {
         Selection *sel = &buffer_->BufGetSecondarySelection();
-        int anchor;
+        pos_type anchor;
         int row;
         int column;
 
         /* Find the new anchor point and make the new selection */
-        const int pos = TextDXYToPosition(event->x(), event->y());
+        const pos_type pos = TextDXYToPosition(event->x(), event->y());
         if (sel->selected) {
-            if (abs(pos - sel->start) < abs(pos - sel->end)) {
+            if (qAbs(pos - sel->start) < qAbs(pos - sel->end)) {
                 anchor = sel->end;
             } else {
                 anchor = sel->start;
@@ -878,7 +1183,7 @@ void NirvanaQt::customContextMenuRequested(const QPoint &pos) {
 ** used as a wrap point, and just guesses that it wasn't.  So if an exact
 ** accounting is necessary, don't use this function.
 */
-bool NirvanaQt::wrapUsesCharacter(int lineEndPos) {
+bool NirvanaQt::wrapUsesCharacter(pos_type lineEndPos) {
     if (!continuousWrap_ || lineEndPos == buffer_->BufGetLength())
         return true;
 
@@ -891,27 +1196,27 @@ bool NirvanaQt::wrapUsesCharacter(int lineEndPos) {
 ** entries in the line starts array rather than by scanning for newlines
 */
 int NirvanaQt::visLineLength(int visLineNum) {
-    int lineStartPos = lineStarts_[visLineNum];
+    pos_type lineStartPos = lineStarts_[visLineNum];
 
     if (lineStartPos == -1) {
         return 0;
     }
 
     if (visLineNum + 1 >= nVisibleLines_) {
-        return lastChar_ - lineStartPos;
+        return static_cast<int>(lastChar_ - lineStartPos);
     }
 
-    int nextLineStart = lineStarts_[visLineNum + 1];
+    pos_type nextLineStart = lineStarts_[visLineNum + 1];
 
     if (nextLineStart == -1) {
-        return lastChar_ - lineStartPos;
+        return static_cast<int>(lastChar_ - lineStartPos);
     }
 
     if (wrapUsesCharacter(nextLineStart - 1)) {
-        return nextLineStart - 1 - lineStartPos;
+        return static_cast<int>(nextLineStart - 1 - lineStartPos);
     }
 
-    return nextLineStart - lineStartPos;
+    return static_cast<int>(nextLineStart - lineStartPos);
 }
 
 /*
@@ -937,7 +1242,7 @@ void NirvanaQt::redisplayLine(QPainter *painter, int visLineNum, int leftClip, i
     int dispIndexOffset;
     char_type expandedChar[MAX_EXP_CHAR_LEN];
     char_type outStr[MaxDisplayLineLength];
-	String lineStr;
+	TextView lineStr;
 
     /* If line is not displayed, skip it */
     if (visLineNum < 0 || visLineNum >= nVisibleLines_) {
@@ -956,13 +1261,13 @@ void NirvanaQt::redisplayLine(QPainter *painter, int visLineNum, int leftClip, i
     int y = top_ + visLineNum * (viewport()->fontMetrics().ascent() + viewport()->fontMetrics().descent());
 
     /* Get the text, length, and  buffer position of the line to display */
-    int lineStartPos = lineStarts_[visLineNum];
+    pos_type lineStartPos = lineStarts_[visLineNum];
     if (lineStartPos == -1) {
         lineLen = 0;
-        lineStr = String();
+        lineStr = TextView();
     } else {
         lineLen = visLineLength(visLineNum);
-        lineStr = buffer_->BufGetRange(lineStartPos, lineStartPos + lineLen);
+        lineStr = buffer_->BufGetView(lineStartPos, lineStartPos + lineLen);
     }
 
     /* Space beyond the end of the line is still counted in units of characters
@@ -1109,7 +1414,7 @@ void NirvanaQt::redisplayLine(QPainter *painter, int visLineNum, int leftClip, i
 ** Return true if the selection "sel" is rectangular, and touches a
 ** buffer position withing "rangeStart" to "rangeEnd"
 */
-bool NirvanaQt::rangeTouchesRectSel(Selection *sel, int rangeStart, int rangeEnd) {
+bool NirvanaQt::rangeTouchesRectSel(Selection *sel, pos_type rangeStart, pos_type rangeEnd) {
     return sel->selected && sel->rectangular && sel->end >= rangeStart && sel->start <= rangeEnd;
 }
 
@@ -1155,11 +1460,11 @@ int NirvanaQt::stringWidth(const char_type *string, const int length, const int
 ** Note that style is a somewhat incorrect name, drawing method would
 ** be more appropriate.
 */
-int NirvanaQt::styleOfPos(int lineStartPos, int lineLen, int lineIndex, int dispIndex, char_type thisChar) {
+int NirvanaQt::styleOfPos(pos_type lineStartPos, int lineLen, int lineIndex, int dispIndex, char_type thisChar) {
 
     Q_UNUSED(thisChar);
 
-    int pos;
+    pos_type pos;
     int style = 0;
     TextBuffer *styleBuffer = syntaxHighlighter_->styleBuffer();
 
@@ -1177,6 +1482,14 @@ int NirvanaQt::styleOfPos(int lineStartPos, int lineLen, int lineIndex, int disp
             /* encountered "unfinished" style, trigger parsing */
             emitUnfinishedHighlightEncountered(pos);
             style = static_cast<unsigned char>(styleBuffer->BufGetCharacter(pos));
+
+            /* parsing text put off until now can restyle the text before it
+               (see SyntaxHighlighter::parseUpTo), which has to be redrawn */
+            Selection &restyled = styleBuffer->BufGetPrimarySelection();
+            if (restyled.selected && restyled.start < pos) {
+                restyled.selected = false;
+                viewport()->update();
+            }
         }
     }
 
@@ -1192,13 +1505,13 @@ int NirvanaQt::styleOfPos(int lineStartPos, int lineLen, int lineIndex, int disp
         style |= SECONDARY_MASK;
     }
 
-/* store in the RANGESET_MASK portion of style the rangeset index for pos */
-#if 0
-    if (buf->rangesetTable) {
-        int rangesetIndex = RangesetIndex1ofPos(buf->rangesetTable, pos, true);
+    /* store in the RANGESET_MASK portion of style the rangeset index for pos */
+    if (RangesetTable *rangesetTable = buffer_->BufGetRangesetTable()) {
+        int rangesetIndex = rangesetTable->indexOfPos(pos, true);
         style |= ((rangesetIndex << RANGESET_SHIFT) & RANGESET_MASK);
     }
 
+#if 0
     /* store in the BACKLIGHT_MASK portion of style the background color class
      * of the character thisChar
      */
@@ -1209,11 +1522,39 @@ int NirvanaQt::styleOfPos(int lineStartPos, int lineLen, int lineIndex, int disp
     return style;
 }
 
+/*
+** Return the color of the rangeset whose index is in the RANGESET_MASK
+** portion of "style"
+*/
+QColor NirvanaQt::rangesetColor(int style) const {
+
+    const int rangesetIndex = (style & RANGESET_MASK) >> RANGESET_SHIFT;
+
+    if (RangesetTable *rangesetTable = buffer_->BufGetRangesetTable()) {
+        if (Rangeset *rangeset = rangesetTable->rangeset(rangesetIndex)) {
+
+            /* the color is only parsed again when its name changes, rather
+               than for every run of text drawn in it */
+            RangesetColor &cached = rangesetColors_[rangesetIndex];
+            if (cached.name != rangeset->color()) {
+                cached.name = rangeset->color();
+                cached.color = X11Colors::fromString(QString::fromLatin1(cached.name.c_str()));
+            }
+
+            if (cached.color.isValid()) {
+                return cached.color;
+            }
+        }
+    }
+
+    return Qt::green;
+}
+
 /*
 ** Return true if position "pos" with indentation "dispIndex" is in
 ** selection "sel"
 */
-bool NirvanaQt::inSelection(const Selection *sel, int pos, int lineStartPos, int dispIndex) {
+bool NirvanaQt::inSelection(const Selection *sel, pos_type pos, pos_type lineStartPos, int dispIndex) {
     return sel->selected && ((!sel->rectangular && pos >= sel->start && pos < sel->end) ||
                              (sel->rectangular && pos >= sel->start && lineStartPos <= sel->end &&
                               dispIndex >= sel->rectStart && dispIndex < sel->rectEnd));
@@ -1255,7 +1596,7 @@ void NirvanaQt::drawString(QPainter *painter, int style, int x, int y, int toX,
                 painter->fillRect(rect, Qt::lightGray);
             } else if (style & RANGESET_MASK) {
                 painter->setPen(viewport()->palette().highlightedText().color());
-                painter->fillRect(rect, Qt::green);
+                painter->fillRect(rect, rangesetColor(style));
             }
         }
     } else if (nChars > 0) {
@@ -1270,7 +1611,7 @@ void NirvanaQt::drawString(QPainter *painter, int style, int x, int y, int toX,
             painter->fillRect(rect, Qt::lightGray);
         } else if (style & RANGESET_MASK) {
             painter->setPen(viewport()->palette().highlightedText().color());
-            painter->fillRect(rect, Qt::green);
+            painter->fillRect(rect, rangesetColor(style));
         } else if (style & BACKLIGHT_MASK) {
             painter->setPen(viewport()->palette().highlightedText().color());
             painter->fillRect(rect, Qt::darkYellow);
@@ -1414,10 +1755,10 @@ void NirvanaQt::drawCursor(QPainter *painter, int x, int y) {
 ** "startLine" and "endLine" are acceptable.
 */
 void NirvanaQt::calcLineStarts(int startLine, int endLine) {
-    const int bufLen = buffer_->BufGetLength();
+    const pos_type bufLen = buffer_->BufGetLength();
     int line;
     int nVis = nVisibleLines_;
-    int *lineStarts = lineStarts_.data();
+    pos_type *lineStarts = lineStarts_.data();
 
     /* Clean up (possibly) messy input parameters */
     if (nVis == 0) {
@@ -1450,7 +1791,7 @@ void NirvanaQt::calcLineStarts(int startLine, int endLine) {
         startLine = 1;
     }
 
-    int startPos = lineStarts[startLine - 1];
+    pos_type startPos = lineStarts[startLine - 1];
 
     /* If the starting position is already past the end of the text,
     fill in -1's (means no text on line) and return */
@@ -1465,8 +1806,8 @@ void NirvanaQt::calcLineStarts(int startLine, int endLine) {
     start of the next line in lineStarts */
     for (line = startLine; line <= endLine; line++) {
 
-        int lineEnd;
-        int nextLineStart;
+        pos_type lineEnd;
+        pos_type nextLineStart;
         findLineEnd(startPos, true, &lineEnd, &nextLineStart);
         startPos = nextLineStart;
         if (startPos >= bufLen) {
@@ -1499,7 +1840,7 @@ void NirvanaQt::calcLineStarts(int startLine, int endLine) {
 ** normal character, and to find that out would otherwise require counting all
 ** the way back to the beginning of the line.
 */
-void NirvanaQt::findLineEnd(int startPos, bool startPosIsLineStart, int *lineEnd, int *nextLineStart) {
+void NirvanaQt::findLineEnd(pos_type startPos, bool startPosIsLineStart, pos_type *lineEnd, pos_type *nextLineStart) {
 
     Q_UNUSED(startPosIsLineStart);
 
@@ -1511,7 +1852,7 @@ void NirvanaQt::findLineEnd(int startPos, bool startPosIsLineStart, int *lineEnd
     }
 
     int retLines;
-    int retLineStart;
+    pos_type retLineStart;
     /* use the wrapped line counter routine to count forward one line */
     wrappedLineCounter(buffer_, startPos, buffer_->BufGetLength(), 1, startPosIsLineStart, 0, nextLineStart, &retLines,
                        &retLineStart, lineEnd);
@@ -1547,7 +1888,7 @@ void NirvanaQt::calcLastChar() {
 ** the start of the next line.  This is also consistent with the model used by
 ** visLineLength.
 */
-int NirvanaQt::TextDEndOfLine(int pos, bool startPosIsLineStart) {
+pos_type NirvanaQt::TextDEndOfLine(pos_type pos, bool startPosIsLineStart) {
     /* If we're not wrapping use more efficient BufEndOfLine */
     if (!continuousWrap_) {
         return buffer_->BufEndOfLine(pos);
@@ -1558,9 +1899,9 @@ int NirvanaQt::TextDEndOfLine(int pos, bool startPosIsLineStart) {
     }
 
     int retLines;
-    int retPos;
-    int retLineStart;
-    int retLineEnd;
+    pos_type retPos;
+    pos_type retLineStart;
+    pos_type retLineEnd;
 
     wrappedLineCounter(buffer_, pos, buffer_->BufGetLength(), 1, startPosIsLineStart, 0, &retPos, &retLines,
                        &retLineStart, &retLineEnd);
@@ -1587,7 +1928,8 @@ bool NirvanaQt::TextDMoveLeft() {
 }
 
 bool NirvanaQt::TextDMoveUp(bool absolute) {
-    int lineStartPos, column, prevLineStartPos, newPos, visLineNum;
+    pos_type lineStartPos, prevLineStartPos, newPos;
+    int column, visLineNum;
 
     /* Find the position of the start of the line.  Use the line starts array
        if possible, to avoid unbounded line-counting in continuous wrap mode */
@@ -1629,10 +1971,10 @@ bool NirvanaQt::TextDMoveUp(bool absolute) {
 }
 
 bool NirvanaQt::TextDMoveDown(bool absolute) {
-    int lineStartPos;
+    pos_type lineStartPos;
     int column;
-    int nextLineStartPos;
-    int newPos;
+    pos_type nextLineStartPos;
+    pos_type newPos;
     int visLineNum;
 
     if (cursorPos_ == buffer_->BufGetLength()) {
@@ -1672,13 +2014,13 @@ bool NirvanaQt::TextDMoveDown(bool absolute) {
 /*
 ** Set the position of the text insertion cursor for text display "textD"
 */
-void NirvanaQt::TextDSetInsertPosition(int newPos) {
+void NirvanaQt::TextDSetInsertPosition(pos_type newPos) {
     /* make sure new position is ok, do nothing if it hasn't changed */
     if (newPos == cursorPos_) {
         return;
     }
 
-    newPos = qBound(0, newPos, buffer_->BufGetLength());
+    newPos = qBound<pos_type>(0, newPos, buffer_->BufGetLength());
 
     /* cursor movement cancels vertical cursor motion column */
     cursorPreferredCol_ = -1;
@@ -1698,17 +2040,17 @@ void NirvanaQt::TextDSetInsertPosition(int newPos) {
 ** Same as BufStartOfLine, but returns the character after last wrap point
 ** rather than the last newline.
 */
-int NirvanaQt::TextDStartOfLine(int pos) {
+pos_type NirvanaQt::TextDStartOfLine(pos_type pos) {
     /* If we're not wrapping, use the more efficient BufStartOfLine */
     if (!continuousWrap_) {
         return buffer_->BufStartOfLine(pos);
     }
 
-    int retLineStart;
+    pos_type retLineStart;
 
     int retLines;
-    int retPos;
-    int retLineEnd;
+    pos_type retPos;
+    pos_type retLineEnd;
 
     wrappedLineCounter(buffer_, buffer_->BufStartOfLine(pos), pos, INT_MAX, true, 0, &retPos, &retLines, &retLineStart,
                        &retLineEnd);
@@ -1719,7 +2061,7 @@ int NirvanaQt::TextDStartOfLine(int pos) {
 ** Find the line number of position "pos" relative to the first line of
 ** displayed text. Returns false if the line is not displayed.
 */
-bool NirvanaQt::posToVisibleLineNum(int pos, int *lineNum) {
+bool NirvanaQt::posToVisibleLineNum(pos_type pos, int *lineNum) {
     if (pos < firstChar_) {
         return false;
     }
@@ -1733,7 +2075,7 @@ bool NirvanaQt::posToVisibleLineNum(int pos, int *lineNum) {
                 }
                 return ++(*lineNum) <= nVisibleLines_ - 1;
             } else {
-                posToVisibleLineNum(qMax(lastChar_ - 1, 0), lineNum);
+                posToVisibleLineNum(qMax<pos_type>(lastChar_ - 1, 0), lineNum);
                 return true;
             }
         }
@@ -1754,21 +2096,21 @@ bool NirvanaQt::posToVisibleLineNum(int pos, int *lineNum) {
 ** Same as BufCountBackwardNLines, but takes in to account line breaks when
 ** wrapping is turned on.
 */
-int NirvanaQt::TextDCountBackwardNLines(int startPos, int nLines) {
+pos_type NirvanaQt::TextDCountBackwardNLines(pos_type startPos, int nLines) {
 
     /* If we're not wrapping, use the more efficient BufCountBackwardNLines */
     if (!continuousWrap_) {
         return buffer_->BufCountBackwardNLines(startPos, nLines);
     }
 
-    int pos = startPos;
+    pos_type pos = startPos;
     while (true) {
-        int lineStart = buffer_->BufStartOfLine(pos);
+        pos_type lineStart = buffer_->BufStartOfLine(pos);
 
         int retLines;
-        int retPos;
-        int retLineStart;
-        int retLineEnd;
+        pos_type retPos;
+        pos_type retLineStart;
+        pos_type retLineEnd;
         wrappedLineCounter(buffer_, lineStart, pos, INT_MAX, true, 0, &retPos, &retLines, &retLineStart, &retLineEnd);
 
         if (retLines > nLines) {
@@ -1792,8 +2134,9 @@ int NirvanaQt::TextDCountBackwardNLines(int startPos, int nLines) {
 ** it can pass "startPosIsLineStart" as true to make the call more efficient
 ** by avoiding the additional step of scanning back to the last newline.
 */
-int NirvanaQt::TextDCountForwardNLines(int startPos, unsigned nLines, bool startPosIsLineStart) {
-    int retLines, retPos, retLineStart, retLineEnd;
+pos_type NirvanaQt::TextDCountForwardNLines(pos_type startPos, unsigned nLines, bool startPosIsLineStart) {
+    int retLines;
+    pos_type retPos, retLineStart, retLineEnd;
 
     /* if we're not wrapping use more efficient BufCountForwardNLines */
     if (!continuousWrap_) {
@@ -1829,19 +2172,19 @@ int NirvanaQt::TextDCountForwardNLines(int startPos, unsigned nLines, bool start
 **   retLineStart:  Start of the line where counting ended
 **   retLineEnd:    End position of the last line traversed
 */
-void NirvanaQt::wrappedLineCounter(const TextBuffer *buf, int startPos, int maxPos, int maxLines,
-                                   bool startPosIsLineStart, int styleBufOffset, int *retPos, int *retLines,
-                                   int *retLineStart, int *retLineEnd) {
-    int lineStart;
-    int newLineStart = 0;
-    int b;
-    int p;
+void NirvanaQt::wrappedLineCounter(const TextBuffer *buf, pos_type startPos, pos_type maxPos, int maxLines,
+                                   bool startPosIsLineStart, pos_type styleBufOffset, pos_type *retPos, int *retLines,
+                                   pos_type *retLineStart, pos_type *retLineEnd) {
+    pos_type lineStart;
+    pos_type newLineStart = 0;
+    pos_type b;
+    pos_type p;
     int colNum;
     int wrapMargin;
     int maxWidth;
     int width;
     int countPixels;
-    int i;
+    pos_type i;
     int foundBreak;
     int nLines = 0;
     int tabDist = buffer_->BufGetTabDistance();
@@ -1980,7 +2323,7 @@ bool NirvanaQt::emptyLinesVisible() {
 ** insertion/deletion, though static display and wrapping and resizing
 ** should now be solid because they are now used for online help display.
 */
-int NirvanaQt::measurePropChar(char_type c, int colNum, int pos) {
+int NirvanaQt::measurePropChar(char_type c, int colNum, pos_type pos) {
     int style;
     char_type expChar[MAX_EXP_CHAR_LEN];
     TextBuffer *styleBuf = syntaxHighlighter_->styleBuffer();
@@ -2025,7 +2368,7 @@ void NirvanaQt::TextDUnblankCursor() {
 ** after pos, including blank lines which are not technically part of
 ** any range of characters.
 */
-void NirvanaQt::textDRedisplayRange(int start, int end) {
+void NirvanaQt::textDRedisplayRange(pos_type start, pos_type end) {
 
     Q_UNUSED(start);
     Q_UNUSED(end);
@@ -2163,7 +2506,7 @@ void NirvanaQt::xyToUnconstrainedPos(int x, int y, int *row, int *column, Positi
 ** Translate a position into a line number (if the position is visible,
 ** if it's not, return false
 */
-bool NirvanaQt::TextPosToLineAndCol(int pos, int *lineNum, int *column) {
+bool NirvanaQt::TextPosToLineAndCol(pos_type pos, int *lineNum, int *column) {
     return TextDPosToLineAndCol(pos, lineNum, column);
 }
 
@@ -2175,7 +2518,7 @@ bool NirvanaQt::TextPosToLineAndCol(int pos, int *lineNum, int *column) {
 ** WORKS FOR DISPLAYED LINES AND, IN CONTINUOUS WRAP MODE, ONLY WHEN THE
 ** ABSOLUTE LINE NUMBER IS BEING MAINTAINED.  Otherwise, it returns false.
 */
-bool NirvanaQt::TextDPosToLineAndCol(int pos, int *lineNum, int *column) {
+bool NirvanaQt::TextDPosToLineAndCol(pos_type pos, int *lineNum, int *column) {
 
     /* In continuous wrap mode, the absolute (non-wrapped) line count is
        maintained separately, as needed.  Only return it if we're actually
@@ -2186,7 +2529,7 @@ bool NirvanaQt::TextDPosToLineAndCol(int pos, int *lineNum, int *column) {
             return false;
         }
 
-        *lineNum = absTopLineNum_ + buffer_->BufCountLines(firstChar_, pos);
+        *lineNum = absTopLineNum_ + static_cast<int>(buffer_->BufCountLines(firstChar_, pos));
         *column = buffer_->BufCountDispChars(buffer_->BufStartOfLine(pos), pos);
         return true;
     }
@@ -2237,14 +2580,14 @@ void NirvanaQt::TextInsertAtCursor(const char_type *chars, bool allowPendingDele
        selections wrap strangely, but this routine should rarely be used for
        them, and even more rarely when they need to be wrapped. */
     const int replaceSel = allowPendingDelete && pendingSelection();
-    const int cursorPos = replaceSel ? buffer_->BufGetPrimarySelection().start : TextDGetInsertPosition();
+    const pos_type cursorPos = replaceSel ? buffer_->BufGetPrimarySelection().start : TextDGetInsertPosition();
 
     /* If the text is only one line and doesn't need to be wrapped, just insert
        it and be done (for efficiency only, this routine is called for each
        character typed). (Of course, it may not be significantly more efficient
        than the more general code below it, so it may be a waste of time!) */
     int wrapMargin = wrapMargin_ != 0 ? wrapMargin_ : viewport()->width() / fixedFontWidth_;
-    int lineStartPos = buffer_->BufStartOfLine(cursorPos);
+    pos_type lineStartPos = buffer_->BufStartOfLine(cursorPos);
     int colNum = buffer_->BufCountDispChars(lineStartPos, cursorPos);
 
     for (c = chars; *c != _T('\0') && *c != '\n'; c++) {
@@ -2286,7 +2629,7 @@ void NirvanaQt::TextInsertAtCursor(const char_type *chars, bool allowPendingDele
     emitCursorMoved();
 }
 
-int NirvanaQt::TextDGetInsertPosition() const {
+pos_type NirvanaQt::TextDGetInsertPosition() const {
     return cursorPos_;
 }
 
@@ -2325,7 +2668,7 @@ void NirvanaQt::simpleInsertAtCursor(const char_type *chars, bool allowPendingDe
 */
 bool NirvanaQt::pendingSelection() {
     Selection *sel = &buffer_->BufGetPrimarySelection();
-    int pos = TextDGetInsertPosition();
+    pos_type pos = TextDGetInsertPosition();
 
     return pendingDelete_ && sel->selected && pos >= sel->start && pos <= sel->end;
 }
@@ -2335,13 +2678,13 @@ bool NirvanaQt::pendingSelection() {
 ** cursor location.
 */
 void NirvanaQt::TextDOverstrike(const char_type *text) {
-    int startPos = cursorPos_;
+    pos_type startPos = cursorPos_;
 
-    const int lineStart = buffer_->BufStartOfLine(startPos);
-    const int textLen = static_cast<int>(traits_type::length(text));
+    const pos_type lineStart = buffer_->BufStartOfLine(startPos);
+    const pos_type textLen = static_cast<pos_type>(traits_type::length(text));
     int i;
-    int p;
-    int endPos;
+    pos_type p;
+    pos_type endPos;
     const char_type *c;
     char_type *paddedText = nullptr;
 
@@ -2394,8 +2737,8 @@ void NirvanaQt::TextDOverstrike(const char_type *text) {
 ** that it's optimized to do less redrawing.
 */
 void NirvanaQt::TextDInsert(const char_type *text) {
-    int pos = cursorPos_;
-    int length = static_cast<int>(traits_type::length(text));
+    pos_type pos = cursorPos_;
+    pos_type length = static_cast<pos_type>(traits_type::length(text));
     cursorToHint_ = pos + length;
     buffer_->BufInsert(pos, text, length);
     cursorToHint_ = NoCursorHint;
@@ -2419,7 +2762,7 @@ void NirvanaQt::TextDMakeInsertPosVisible() {
 
     int x;
     int y;
-    int cursorPos = cursorPos_;
+    pos_type cursorPos = cursorPos_;
     int linesFromTop = 0;
     int cursorVPadding = (int)cursorVPadding_;
 
@@ -2495,28 +2838,30 @@ void NirvanaQt::TextDMakeInsertPosVisible() {
 ** smart indent (which can be triggered by wrapping) can search back farther
 ** in the buffer than just the text in startLine.
 */
-String NirvanaQt::wrapText(const char_type *startLine, const char_type *text, int bufOffset, int wrapMargin,
+String NirvanaQt::wrapText(const char_type *startLine, const char_type *text, pos_type bufOffset, int wrapMargin,
                           int *breakBefore) {
     int startLineLen = static_cast<int>(traits_type::length(startLine));
-    int breakAt;
+    pos_type breakAt;
     int charsAdded;
-    int firstBreak = -1;
+    pos_type firstBreak = -1;
     int tabDist = buffer_->BufGetTabDistance();
     char_type c;
 
     /* Create a temporary text buffer and load it with the strings */
+    pos_type textLen = static_cast<pos_type>(traits_type::length(text));
     auto wrapBuf = new TextBuffer();
+    wrapBuf->BufReserve(startLineLen + textLen);
     wrapBuf->BufInsert(0, startLine, startLineLen);
-    wrapBuf->BufInsert(wrapBuf->BufGetLength(), text);
+    wrapBuf->BufInsert(wrapBuf->BufGetLength(), text, textLen);
 
     /* Scan the buffer for long lines and apply wrapLine when wrapMargin is
        exceeded.  limitPos enforces no breaks in the "startLine" part of the
        string (if requested), and prevents re-scanning of long unbreakable
        lines for each character beyond the margin */
     int colNum = 0;
-    int pos = 0;
-    int lineStartPos = 0;
-    int limitPos = breakBefore == nullptr ? startLineLen : 0;
+    pos_type pos = 0;
+    pos_type lineStartPos = 0;
+    pos_type limitPos = breakBefore == nullptr ? startLineLen : 0;
 
     while (pos < wrapBuf->BufGetLength()) {
         c = wrapBuf->BufGetCharacter(pos);
@@ -2546,7 +2891,7 @@ String NirvanaQt::wrapText(const char_type *startLine, const char_type *text, in
     if (breakBefore == nullptr)
         wrappedText = wrapBuf->BufGetRange(startLineLen, wrapBuf->BufGetLength());
     else {
-        *breakBefore = firstBreak != -1 && firstBreak < startLineLen ? startLineLen - firstBreak : 0;
+        *breakBefore = firstBreak != -1 && firstBreak < startLineLen ? startLineLen - static_cast<int>(firstBreak) : 0;
         wrappedText = wrapBuf->BufGetRange(startLineLen - *breakBefore, wrapBuf->BufGetLength());
     }
     delete wrapBuf;
@@ -2568,9 +2913,9 @@ String NirvanaQt::wrapText(const char_type *startLine, const char_type *text, in
 ** used to decide whether auto-indent should be skipped because the indent
 ** string itself would exceed the wrap margin.
 */
-bool NirvanaQt::wrapLine(TextBuffer *buf, int bufOffset, int lineStartPos, int lineEndPos, int limitPos, int *breakAt,
+bool NirvanaQt::wrapLine(TextBuffer *buf, pos_type bufOffset, pos_type lineStartPos, pos_type lineEndPos, pos_type limitPos, pos_type *breakAt,
                          int *charsAdded) {
-    int p;
+    pos_type p;
     int length;
     int column;
     char_type c;
@@ -2626,9 +2971,9 @@ bool NirvanaQt::wrapLine(TextBuffer *buf, int bufOffset, int lineStartPos, int l
 ** string length is returned in "length" (or "length" can be passed as nullptr,
 ** and the indent column is returned in "column" (if non nullptr).
 */
-String NirvanaQt::createIndentString(TextBuffer *buf, int bufOffset, int lineStartPos, int lineEndPos, int *length,
+String NirvanaQt::createIndentString(TextBuffer *buf, pos_type bufOffset, pos_type lineStartPos, pos_type lineEndPos, int *length,
                                     int *column) {
-    int pos;
+    pos_type pos;
     int indent = -1;
     int tabDist = buffer_->BufGetTabDistance();
     int i;
@@ -2700,12 +3045,13 @@ String NirvanaQt::createIndentString(TextBuffer *buf, int bufOffset, int lineSta
 ** can pass "startPosIsLineStart" as true to make the call more efficient
 ** by avoiding the additional step of scanning back to the last newline.
 */
-int NirvanaQt::TextDCountLines(int startPos, int endPos, bool startPosIsLineStart) {
-    int retLines, retPos, retLineStart, retLineEnd;
+int NirvanaQt::TextDCountLines(pos_type startPos, pos_type endPos, bool startPosIsLineStart) {
+    int retLines;
+    pos_type retPos, retLineStart, retLineEnd;
 
     /* If we're not wrapping use simple (and more efficient) BufCountLines */
     if (!continuousWrap_)
-        return buffer_->BufCountLines(startPos, endPos);
+        return static_cast<int>(buffer_->BufCountLines(startPos, endPos));
 
     wrappedLineCounter(buffer_, startPos, endPos, INT_MAX, startPosIsLineStart, 0, &retPos, &retLines, &retLineStart,
                        &retLineEnd);
@@ -2719,9 +3065,10 @@ int NirvanaQt::TextDCountLines(int startPos, int endPos, bool startPosIsLineStar
 ** of view.  If the position is horizontally out of view, returns the
 ** x coordinate where the position would be if it were visible.
 */
-bool NirvanaQt::TextDPositionToXY(int pos, int *x, int *y) {
-    int charIndex, lineStartPos, fontHeight, lineLen;
+bool NirvanaQt::TextDPositionToXY(pos_type pos, int *x, int *y) {
+    int charIndex, fontHeight, lineLen;
     int visLineNum, charLen, outIndex, xStep;
+    pos_type lineStartPos;
     char_type expandedChar[MAX_EXP_CHAR_LEN];
 
     /* If position is not displayed, return false */
@@ -2744,7 +3091,7 @@ bool NirvanaQt::TextDPositionToXY(int pos, int *x, int *y) {
         return true;
     }
     lineLen = visLineLength(visLineNum);
-    auto lineStr = buffer_->BufGetRange(lineStartPos, lineStartPos + lineLen);
+    auto lineStr = buffer_->BufGetView(lineStartPos, lineStartPos + lineLen);
 
     /* Step through character positions from the beginning of the line
        to "pos" to calculate the x coordinate */
@@ -2766,8 +3113,8 @@ bool NirvanaQt::TextDPositionToXY(int pos, int *x, int *y) {
 ** the modifications are actually made.
 */
 void NirvanaQt::preDelete(const PreDeleteEvent *event) {
-    const int pos = event->pos;
-    const int nDeleted = event->nDeleted;
+    const pos_type pos = event->pos;
+    const pos_type nDeleted = event->nDeleted;
 
     if (continuousWrap_ && (fixedFontWidth_ == -1 || modifyingTabDist_)) {
         /* Note: we must perform this measurement, even if there is not a
@@ -2785,15 +3132,62 @@ void NirvanaQt::preDelete(const PreDeleteEvent *event) {
     }
 }
 
+/*
+** The deleted lines measured by preDelete (in continuous wrap mode with a
+** proportional font) are only valid for the very next modification
+*/
+bool NirvanaQt::preDeleteNeedsExactModify() const {
+    return continuousWrap_ && (fixedFontWidth_ == -1 || modifyingTabDist_);
+}
+
+/*
+** The deleted text itself is only needed to record it for undo, and for
+** re-wrapping around it in continuous wrap mode (unless measureDeletedLines
+** has already been done with it); otherwise counting its lines is enough.
+*/
+DeletedTextNeeds NirvanaQt::deletedTextNeeds() const {
+    if (!ignoreModify_ || (continuousWrap_ && !suppressResync_)) {
+        return DELETED_TEXT;
+    }
+
+    return DELETED_LINE_COUNT;
+}
+
+/*
+** Callback attached to the text buffer for when a whole new text is loaded.
+** Nothing done to the old text can be undone any more, so rather than
+** recording its deletion the undo lists are emptied, and in continuous wrap
+** mode the lines deleted are simply all of them.
+*/
+void NirvanaQt::bufferLoaded(const ModifyEvent *event) {
+
+    /* the journal was of changes to the old text, so it ends here */
+    journal_.close();
+    autoSave_ = false;
+
+    ClearUndoList();
+    ClearRedoList();
+
+    if (continuousWrap_) {
+        nLinesDeleted_ = nBufferLines_;
+        suppressResync_ = true;
+    }
+
+    const bool ignoreModify = ignoreModify_;
+    ignoreModify_ = true;
+    bufferModified(event);
+    ignoreModify_ = ignoreModify;
+}
+
 /*
 ** Callback attached to the text buffer to receive modification information
 */
 void NirvanaQt::bufferModified(const ModifyEvent *event) {
 
-    const int pos                      = event->pos;
-    const int nInserted                = event->nInserted;
-    const int nDeleted                 = event->nDeleted;
-    const int nRestyled                = event->nRestyled;
+    const pos_type pos                 = event->pos;
+    const pos_type nInserted           = event->nInserted;
+    const pos_type nDeleted            = event->nDeleted;
+    const pos_type nRestyled           = event->nRestyled;
     const char_type *const deletedText = event->deletedText;
 
     // NOTE(eteran): a bit of a hack, there were multiple callbacks
@@ -2803,13 +3197,13 @@ void NirvanaQt::bufferModified(const ModifyEvent *event) {
 
     int linesInserted;
     int linesDeleted;
-    int startDispPos;
-    int endDispPos;
-    int oldFirstChar = firstChar_;
+    pos_type startDispPos;
+    pos_type endDispPos;
+    pos_type oldFirstChar = firstChar_;
     bool scrolled;
-    int origCursorPos = cursorPos_;
-    int wrapModStart;
-    int wrapModEnd;
+    pos_type origCursorPos = cursorPos_;
+    pos_type wrapModStart;
+    pos_type wrapModEnd;
 
     TextBuffer *const styleBuffer = syntaxHighlighter_->styleBuffer();
 
@@ -2823,8 +3217,8 @@ void NirvanaQt::bufferModified(const ModifyEvent *event) {
     if (continuousWrap_) {
         findWrapRange(deletedText, pos, nInserted, nDeleted, &wrapModStart, &wrapModEnd, &linesInserted, &linesDeleted);
     } else {
-        linesInserted = nInserted == 0 ? 0 : buffer_->BufCountLines(pos, pos + nInserted);
-        linesDeleted = nDeleted == 0 ? 0 : countLines(deletedText);
+        linesInserted = nInserted == 0 ? 0 : static_cast<int>(buffer_->BufCountLines(pos, pos + nInserted));
+        linesDeleted = static_cast<int>(event->nDeletedLines);
     }
 
     /* Update the line starts and topLineNum */
@@ -2841,17 +3235,19 @@ void NirvanaQt::bufferModified(const ModifyEvent *event) {
     }
 
     /* If we're counting non-wrapped lines as well, maintain the absolute
-     * (non-wrapped) line number of the text displayed */
-    if (maintainingAbsTopLineNum() && (nInserted != 0 || nDeleted != 0)) {
-        if (pos + nDeleted < oldFirstChar) {
-            absTopLineNum_ += buffer_->BufCountLines(pos, pos + nInserted) - countLines(deletedText);
-        } else if (pos < oldFirstChar) {
-            resetAbsLineNum();
-        }
+     * (non-wrapped) line number of the text displayed.  The buffer's line
+     * index makes this cheap wherever the change was */
+    if (maintainingAbsTopLineNum() && (nInserted != 0 || nDeleted != 0) && pos < oldFirstChar) {
+        resetAbsLineNum();
     }
 
-    /* Update the line count for the whole buffer */
-    nBufferLines_ += linesInserted - linesDeleted;
+    /* Update the line count for the whole buffer (without wrapping, the
+     * buffer already knows it) */
+    if (continuousWrap_) {
+        nBufferLines_ += linesInserted - linesDeleted;
+    } else {
+        nBufferLines_ = static_cast<int>(buffer_->BufCountLines(0, buffer_->BufGetLength()));
+    }
 
     /* Update the scroll bar ranges (and value if the value changed).  Note
      * that updating the horizontal scroll bar range requires scanning the
@@ -2962,13 +3358,13 @@ void NirvanaQt::bufferModified(const ModifyEvent *event) {
 ** position where the change began "pos", and the nmubers of characters
 ** and lines inserted and deleted.
 */
-void NirvanaQt::updateLineStarts(int pos, int charsInserted, int charsDeleted, int linesInserted, int linesDeleted, bool *scrolled) {
+void NirvanaQt::updateLineStarts(pos_type pos, pos_type charsInserted, pos_type charsDeleted, int linesInserted, int linesDeleted, bool *scrolled) {
 
     int i;
     int lineOfPos;
     int lineOfEnd;
     const int nVisLines = nVisibleLines_;
-    const int charDelta = charsInserted - charsDeleted;
+    const pos_type charDelta = charsInserted - charsDeleted;
     const int lineDelta = linesInserted - linesDeleted;
 
     /* {   int i;
@@ -3096,7 +3492,7 @@ void NirvanaQt::redrawLineNumbers(QPainter *painter, bool clearAll) {
     int line;
     int visLine;
     int nCols;
-    int lineStart;
+    pos_type lineStart;
     int lineHeight = viewport()->fontMetrics().ascent() + viewport()->fontMetrics().descent();
     int charWidth  = fixedFontWidth_;
 
@@ -3208,25 +3604,27 @@ bool NirvanaQt::updateHScrollBarRange() {
 }
 
 /*
-** Count lines from the beginning of the buffer to reestablish the
-** absolute (non-wrapped) top line number.  If mode is not continuous wrap,
-** or the number is not being maintained, does nothing.
+** Look up the absolute (non-wrapped) top line number in the buffer's line
+** index.  If mode is not continuous wrap, or the number is not being
+** maintained, does nothing.
 */
 void NirvanaQt::resetAbsLineNum() {
-    absTopLineNum_ = 1;
-    offsetAbsLineNum(0);
+
+    if (maintainingAbsTopLineNum()) {
+        absTopLineNum_ = static_cast<int>(buffer_->BufCountLines(0, firstChar_)) + 1;
+    }
 }
 
 /*
 ** Re-calculate absolute top line number for a change in scroll position.
 */
-void NirvanaQt::offsetAbsLineNum(int oldFirstChar) {
+void NirvanaQt::offsetAbsLineNum(pos_type oldFirstChar) {
 
     if (maintainingAbsTopLineNum()) {
         if (firstChar_ < oldFirstChar) {
-            absTopLineNum_ -= buffer_->BufCountLines(firstChar_, oldFirstChar);
+            absTopLineNum_ -= static_cast<int>(buffer_->BufCountLines(firstChar_, oldFirstChar));
         } else {
-            absTopLineNum_ += buffer_->BufCountLines(oldFirstChar, firstChar_);
+            absTopLineNum_ += static_cast<int>(buffer_->BufCountLines(oldFirstChar, firstChar_));
         }
     }
 }
@@ -3266,7 +3664,7 @@ void NirvanaQt::TextDRedisplayRect(int left, int top, int width, int height) {
 ** redraw requests resulting from changes to the attached style buffer (which
 ** contains auxiliary information for coloring or styling text).
 */
-void NirvanaQt::extendRangeForStyleMods(int *start, int *end) {
+void NirvanaQt::extendRangeForStyleMods(pos_type *start, pos_type *end) {
 
     TextBuffer *styleBuffer = syntaxHighlighter_->styleBuffer();
     Selection *sel = &styleBuffer->BufGetPrimarySelection();
@@ -3311,19 +3709,19 @@ void NirvanaQt::extendRangeForStyleMods(int *start, int *end) {
 ** both for delimiting where the line starts need to be recalculated, and
 ** for deciding what part of the text to redisplay.
 */
-void NirvanaQt::findWrapRange(const char_type *deletedText, int pos, int nInserted, int nDeleted, int *modRangeStart,
-                              int *modRangeEnd, int *linesInserted, int *linesDeleted) {
+void NirvanaQt::findWrapRange(const char_type *deletedText, pos_type pos, pos_type nInserted, pos_type nDeleted, pos_type *modRangeStart,
+                              pos_type *modRangeEnd, int *linesInserted, int *linesDeleted) {
 
-    int length;
-    int retPos;
+    pos_type length;
+    pos_type retPos;
     int retLines;
-    int retLineStart;
-    int retLineEnd;
+    pos_type retLineStart;
+    pos_type retLineEnd;
     int nVisLines = nVisibleLines_;
-    int countFrom;
-    int countTo;
-    int lineStart;
-    int adjLineStart;
+    pos_type countFrom;
+    pos_type countTo;
+    pos_type lineStart;
+    pos_type adjLineStart;
     int i;
     int visLineNum = 0;
     int nLines = 0;
@@ -3484,7 +3882,7 @@ void NirvanaQt::findWrapRange(const char_type *deletedText, int pos, int nInsert
 }
 
 void NirvanaQt::deletePreviousCharacterAP() {
-    int insertPos = TextDGetInsertPosition();
+    pos_type insertPos = TextDGetInsertPosition();
     char_type c;
 
     cancelDrag();
@@ -3520,7 +3918,7 @@ void NirvanaQt::deletePreviousCharacterAP() {
 }
 
 void NirvanaQt::deleteNextCharacterAP() {
-    int insertPos = TextDGetInsertPosition();
+    pos_type insertPos = TextDGetInsertPosition();
 
     cancelDrag();
     if (checkReadOnly())
@@ -3616,8 +4014,9 @@ bool NirvanaQt::deletePendingSelection() {
 bool NirvanaQt::deleteEmulatedTab() {
     const int emTabDist = emulateTabs_;
     const int emTabsBeforeCursor = emTabsBeforeCursor_;
-    int startPos;
-    int pos, indent, startPosIndent;
+    pos_type startPos;
+    pos_type pos;
+    int indent, startPosIndent;
     char_type c;
 
     if (emTabDist <= 0 || emTabsBeforeCursor <= 0) {
@@ -3625,8 +4024,8 @@ bool NirvanaQt::deleteEmulatedTab() {
     }
 
     /* Find the position of the previous tab stop */
-    int insertPos = TextDGetInsertPosition();
-    int lineStart = buffer_->BufStartOfLine(insertPos);
+    pos_type insertPos = TextDGetInsertPosition();
+    pos_type lineStart = buffer_->BufStartOfLine(insertPos);
     int startIndent = buffer_->BufCountDispChars(lineStart, insertPos);
     int toIndent = (startIndent - 1) - ((startIndent - 1) % emTabDist);
 
@@ -3679,7 +4078,7 @@ bool NirvanaQt::deleteEmulatedTab() {
 }
 
 void NirvanaQt::beginningOfLineAP(MoveMode mode) {
-    int insertPos = TextDGetInsertPosition();
+    pos_type insertPos = TextDGetInsertPosition();
 
     cancelDrag();
 
@@ -3696,7 +4095,7 @@ void NirvanaQt::beginningOfLineAP(MoveMode mode) {
 }
 
 void NirvanaQt::endOfLineAP(MoveMode mode) {
-    int insertPos = TextDGetInsertPosition();
+    pos_type insertPos = TextDGetInsertPosition();
 
     cancelDrag();
     if (/*hasKey("absolute", args, nArgs)*/ true)
@@ -3710,7 +4109,7 @@ void NirvanaQt::endOfLineAP(MoveMode mode) {
 }
 
 void NirvanaQt::beginningOfFileAP(MoveMode mode) {
-    int insertPos = TextDGetInsertPosition();
+    pos_type insertPos = TextDGetInsertPosition();
 
     cancelDrag();
     if (/*hasKey("scrollbar", args, nArgs)*/ false) {
@@ -3726,7 +4125,7 @@ void NirvanaQt::beginningOfFileAP(MoveMode mode) {
 }
 
 void NirvanaQt::endOfFileAP(MoveMode mode) {
-    int insertPos = TextDGetInsertPosition();
+    pos_type insertPos = TextDGetInsertPosition();
     int lastTopLine;
 
     cancelDrag();
@@ -3749,7 +4148,7 @@ void NirvanaQt::endOfFileAP(MoveMode mode) {
 ** the new cursor position in the selection, and lack of an "extend" keyword
 ** means cancel the existing selection
 */
-void NirvanaQt::checkMoveSelectionChange(int startPos, MoveMode mode) {
+void NirvanaQt::checkMoveSelectionChange(pos_type startPos, MoveMode mode) {
     switch (mode) {
     case MoveExtendRect:
         keyMoveExtendSelection(startPos, true);
@@ -3769,18 +4168,18 @@ void NirvanaQt::checkMoveSelectionChange(int startPos, MoveMode mode) {
 ** selection to include the new cursor position, or begin a new selection
 ** between startPos and the new cursor position with anchor at startPos.
 */
-void NirvanaQt::keyMoveExtendSelection(int origPos, bool rectangular) {
+void NirvanaQt::keyMoveExtendSelection(pos_type origPos, bool rectangular) {
     Selection *sel = &buffer_->BufGetPrimarySelection();
-    int newPos = TextDGetInsertPosition();
-    int startPos;
-    int endPos;
+    pos_type newPos = TextDGetInsertPosition();
+    pos_type startPos;
+    pos_type endPos;
     int startCol;
     int endCol;
     int newCol;
     int origCol;
-    int anchor;
+    pos_type anchor;
     int rectAnchor;
-    int anchorLineStart;
+    pos_type anchorLineStart;
 
     /* Moving the cursor does not take the Motif destination, but as soon as
      * the user selects something, grab it (I'm not sure if this distinction
@@ -3800,7 +4199,7 @@ void NirvanaQt::keyMoveExtendSelection(int origPos, bool rectangular) {
     } else if (sel->selected && rectangular) { /* plain -> rect */
         newCol = buffer_->BufCountDispChars(buffer_->BufStartOfLine(newPos), newPos);
 
-        if (abs(newPos - sel->start) < abs(newPos - sel->end)) {
+        if (qAbs(newPos - sel->start) < qAbs(newPos - sel->end)) {
             anchor = sel->end;
         } else {
             anchor = sel->start;
@@ -3818,7 +4217,7 @@ void NirvanaQt::keyMoveExtendSelection(int origPos, bool rectangular) {
         startPos = buffer_->BufCountForwardDispChars(buffer_->BufStartOfLine(sel->start), sel->rectStart);
         endPos = buffer_->BufCountForwardDispChars(buffer_->BufStartOfLine(sel->end), sel->rectEnd);
 
-        if (abs(origPos - startPos) < abs(origPos - endPos)) {
+        if (qAbs(origPos - startPos) < qAbs(origPos - endPos)) {
             anchor = endPos;
         } else {
             anchor = startPos;
@@ -3827,7 +4226,7 @@ void NirvanaQt::keyMoveExtendSelection(int origPos, bool rectangular) {
         buffer_->BufSelect(anchor, newPos);
     } else if (sel->selected) { /* plain -> plain */
 
-        if (abs(origPos - sel->start) < abs(origPos - sel->end)) {
+        if (qAbs(origPos - sel->start) < qAbs(origPos - sel->end)) {
             anchor = sel->end;
         } else {
             anchor = sel->start;
@@ -3855,7 +4254,7 @@ void NirvanaQt::keyMoveExtendSelection(int origPos, bool rectangular) {
 }
 
 void NirvanaQt::forwardWordAP(MoveMode mode) {
-    int insertPos = TextDGetInsertPosition();
+    pos_type insertPos = TextDGetInsertPosition();
 
     cancelDrag();
     if (insertPos == buffer_->BufGetLength()) {
@@ -3863,7 +4262,7 @@ void NirvanaQt::forwardWordAP(MoveMode mode) {
         ringIfNecessary(silent);
         return;
     }
-    int pos = insertPos;
+    pos_type pos = insertPos;
 
     if (/*hasKey("tail", args, nArgs)*/ false) {
         for (; pos < buffer_->BufGetLength(); pos++) {
@@ -3893,7 +4292,7 @@ void NirvanaQt::forwardWordAP(MoveMode mode) {
 }
 
 void NirvanaQt::backwardWordAP(MoveMode mode) {
-    int insertPos = TextDGetInsertPosition();
+    pos_type insertPos = TextDGetInsertPosition();
 
     cancelDrag();
     if (insertPos == 0) {
@@ -3901,7 +4300,7 @@ void NirvanaQt::backwardWordAP(MoveMode mode) {
         ringIfNecessary(silent);
         return;
     }
-    int pos = qMax(insertPos - 1, 0);
+    pos_type pos = qMax<pos_type>(insertPos - 1, 0);
     while (traits_type::find(Delimiters, sizeof(Delimiters) / sizeof(char_type), buffer_->BufGetCharacter(pos)) != nullptr && pos > 0)
         pos--;
     pos = startOfWord(pos);
@@ -3912,9 +4311,9 @@ void NirvanaQt::backwardWordAP(MoveMode mode) {
     emitCursorMoved();
 }
 
-int NirvanaQt::startOfWord(int pos) {
+pos_type NirvanaQt::startOfWord(pos_type pos) {
 
-    int startPos;
+    pos_type startPos;
     char_type c = buffer_->BufGetCharacter(pos);
 
     if (c == _T(' ') || c == _T('\t')) {
@@ -3934,8 +4333,8 @@ int NirvanaQt::startOfWord(int pos) {
     return qMin(pos, startPos + 1);
 }
 
-int NirvanaQt::endOfWord(int pos) {
-    int endPos;
+pos_type NirvanaQt::endOfWord(pos_type pos) {
+    pos_type endPos;
     char_type c = buffer_->BufGetCharacter(pos);
 
     if (c == _T(' ') || c == _T('\t')) {
@@ -3961,9 +4360,9 @@ int NirvanaQt::endOfWord(int pos) {
 ** result in "foundPos" returns true if found, false if not. If ignoreSpace
 ** is set, then Space, Tab, and Newlines are ignored in searchChars.
 */
-bool NirvanaQt::spanForward(TextBuffer *buf, int startPos, const char_type *searchChars, bool ignoreSpace, int *foundPos) {
+bool NirvanaQt::spanForward(TextBuffer *buf, pos_type startPos, const char_type *searchChars, bool ignoreSpace, pos_type *foundPos) {
 
-    int pos = startPos;
+    pos_type pos = startPos;
     while (pos < buf->BufGetLength()) {
         const char_type *c;
         for (c = searchChars; *c != _T('\0'); c++) {
@@ -3992,14 +4391,14 @@ bool NirvanaQt::spanForward(TextBuffer *buf, int startPos, const char_type *sear
 ** result in "foundPos" returns true if found, false if not. If ignoreSpace is
 ** set, then Space, Tab, and Newlines are ignored in searchChars.
 */
-bool NirvanaQt::spanBackward(TextBuffer *buf, int startPos, const char_type *searchChars, bool ignoreSpace, int *foundPos) {
+bool NirvanaQt::spanBackward(TextBuffer *buf, pos_type startPos, const char_type *searchChars, bool ignoreSpace, pos_type *foundPos) {
 
     if (startPos == 0) {
         *foundPos = 0;
         return false;
     }
 
-    int pos = (startPos == 0) ? 0 : (startPos - 1);
+    pos_type pos = (startPos == 0) ? 0 : (startPos - 1);
     while (pos >= 0) {
         const char_type *c;
         for (c = searchChars; *c != _T('\0'); c++) {
@@ -4023,9 +4422,9 @@ bool NirvanaQt::spanBackward(TextBuffer *buf, int startPos, const char_type *sea
 }
 
 void NirvanaQt::deletePreviousWordAP() {
-    int insertPos = TextDGetInsertPosition();
-    int pos;
-    int lineStart = buffer_->BufStartOfLine(insertPos);
+    pos_type insertPos = TextDGetInsertPosition();
+    pos_type pos;
+    pos_type lineStart = buffer_->BufStartOfLine(insertPos);
     bool silent = /*hasKey("nobell", args, nArgs);*/ false;
 
     cancelDrag();
@@ -4043,7 +4442,7 @@ void NirvanaQt::deletePreviousWordAP() {
         return;
     }
 
-    pos = qMax(insertPos - 1, 0);
+    pos = qMax<pos_type>(insertPos - 1, 0);
     while (traits_type::find(Delimiters, sizeof(Delimiters) / sizeof(char_type), buffer_->BufGetCharacter(pos)) != nullptr && pos != lineStart) {
         pos--;
     }
@@ -4055,8 +4454,8 @@ void NirvanaQt::deletePreviousWordAP() {
 }
 
 void NirvanaQt::deleteNextWordAP() {
-    int insertPos = TextDGetInsertPosition();
-    int pos, lineEnd = buffer_->BufEndOfLine(insertPos);
+    pos_type insertPos = TextDGetInsertPosition();
+    pos_type pos, lineEnd = buffer_->BufEndOfLine(insertPos);
     bool silent = /* hasKey("nobell", args, nArgs); */ false;
 
     cancelDrag();
@@ -4086,7 +4485,7 @@ void NirvanaQt::deleteNextWordAP() {
 }
 
 void NirvanaQt::processUpAP(MoveMode mode) {
-    const int insertPos = TextDGetInsertPosition();
+    const pos_type insertPos = TextDGetInsertPosition();
     const bool silent = /* hasKey("nobell", args, nArgs);   */ false;
     const int abs = /* hasKey("absolute", args, nArgs); */ false;
 
@@ -4102,7 +4501,7 @@ void NirvanaQt::processUpAP(MoveMode mode) {
 }
 
 void NirvanaQt::processDownAP(MoveMode mode) {
-    const int insertPos = TextDGetInsertPosition();
+    const pos_type insertPos = TextDGetInsertPosition();
     const bool silent = /* hasKey("nobell", args, nArgs); */ false;
     const int abs = /* hasKey("absolute", args, nArgs); */ false;
 
@@ -4200,9 +4599,9 @@ void NirvanaQt::InsertClipboard(PasteMode pasteMode) {
 
         /* Insert it in the text widget */
         if (pasteMode == PasteColumnar && !buffer_->BufGetPrimarySelection().selected) {
-            int cursorPos       = TextDGetInsertPosition();
-            int cursorLineStart = buffer_->BufStartOfLine(cursorPos);
-            int column          = buffer_->BufCountDispChars(cursorLineStart, cursorPos);
+            pos_type cursorPos       = TextDGetInsertPosition();
+            pos_type cursorLineStart = buffer_->BufStartOfLine(cursorPos);
+            int column               = buffer_->BufCountDispChars(cursorLineStart, cursorPos);
 
             if (overstrike_) {
                 buffer_->BufOverlayRect(cursorLineStart, column, -1, string, nullptr, nullptr);
@@ -4239,7 +4638,7 @@ void NirvanaQt::CopyToClipboard() {
 	#ifdef USE_WCHAR
 		clipboard->setText(QString::fromWCharArray(text.str, text.len));
 	#else
-		clipboard->setText(QString::fromLatin1(text.str, text.len));
+		clipboard->setText(QString::fromLatin1(text.str, static_cast<int>(text.len)));
 	#endif	
     }
 }
@@ -4361,10 +4760,10 @@ void NirvanaQt::setScroll(int topLineNum, int horizOffset, bool updateVScrollBar
 */
 void NirvanaQt::offsetLineStarts(int newTopLineNum) {
     int oldTopLineNum = topLineNum_;
-    int oldFirstChar = firstChar_;
+    pos_type oldFirstChar = firstChar_;
     int lineDelta = newTopLineNum - oldTopLineNum;
     int nVisLines = nVisibleLines_;
-    int *lineStarts = lineStarts_.data();
+    pos_type *lineStarts = lineStarts_.data();
     int i, lastLineNum;
     TextBuffer *buf = buffer_;
 
@@ -4383,7 +4782,10 @@ void NirvanaQt::offsetLineStarts(int newTopLineNum) {
        known line start (start or end of buffer, or the closest value in the
        lineStarts array) */
     lastLineNum = oldTopLineNum + nVisLines - 1;
-    if (newTopLineNum < oldTopLineNum && newTopLineNum < -lineDelta) {
+    if (!continuousWrap_ && (newTopLineNum < oldTopLineNum || newTopLineNum >= lastLineNum)) {
+        /* without wrapping, the buffer's line index can go straight there */
+        firstChar_ = buf->BufCountForwardNLines(0, newTopLineNum - 1);
+    } else if (newTopLineNum < oldTopLineNum && newTopLineNum < -lineDelta) {
         firstChar_ = TextDCountForwardNLines(0, newTopLineNum - 1, true);
         /* printf("counting forward %d lines from start\n", newTopLineNum-1);*/
     } else if (newTopLineNum < oldTopLineNum) {
@@ -4456,7 +4858,7 @@ int NirvanaQt::measureVisLine(int visLineNum) {
     int len;
     int lineLen = visLineLength(visLineNum);
     int charCount = 0;
-    int lineStartPos = lineStarts_[visLineNum];
+    pos_type lineStartPos = lineStarts_[visLineNum];
     char_type expandedChar[MAX_EXP_CHAR_LEN];
     TextBuffer *styleBuffer = syntaxHighlighter_->styleBuffer();
 
@@ -4498,7 +4900,7 @@ int NirvanaQt::measureVisLine(int visLineNum) {
 }
 
 void NirvanaQt::forwardCharacterAP(MoveMode mode) {
-    int insertPos = TextDGetInsertPosition();
+    pos_type insertPos = TextDGetInsertPosition();
     bool silent = /* hasKey("nobell", args, nArgs); */ false;
 
     cancelDrag();
@@ -4511,7 +4913,7 @@ void NirvanaQt::forwardCharacterAP(MoveMode mode) {
 }
 
 void NirvanaQt::backwardCharacterAP(MoveMode mode) {
-    int insertPos = TextDGetInsertPosition();
+    pos_type insertPos = TextDGetInsertPosition();
     bool silent = /* hasKey("nobell", args, nArgs); */ false;
 
     cancelDrag();
@@ -4555,8 +4957,8 @@ void NirvanaQt::newlineAndIndentAP() {
     /* Create a string containing a newline followed by auto or smart
      * indent string
      */
-    int cursorPos = TextDGetInsertPosition();
-    int lineStartPos = buffer_->BufStartOfLine(cursorPos);
+    pos_type cursorPos = TextDGetInsertPosition();
+    pos_type lineStartPos = buffer_->BufStartOfLine(cursorPos);
 	String indentStr = createIndentString(buffer_, 0, lineStartPos, cursorPos, nullptr, &column);
 
     /* Insert it at the cursor */
@@ -4617,8 +5019,8 @@ void NirvanaQt::processTabAP() {
        instead of the cursor position as the indent.  When replacing
        rectangular selections, tabs are automatically recalculated as
        if the inserted text began at the start of the line */
-    int insertPos = pendingSelection() ? sel->start : TextDGetInsertPosition();
-    int lineStart = buffer_->BufStartOfLine(insertPos);
+    pos_type insertPos = pendingSelection() ? sel->start : TextDGetInsertPosition();
+    pos_type lineStart = buffer_->BufStartOfLine(insertPos);
 
     if (pendingSelection() && sel->rectangular) {
         insertPos = buffer_->BufCountForwardDispChars(lineStart, sel->rectStart);
@@ -4694,7 +5096,7 @@ void NirvanaQt::moveDestinationAP(QMouseEvent *event) {
 /*
 ** Translate window coordinates to the nearest text cursor position.
 */
-int NirvanaQt::TextDXYToPosition(int x, int y) {
+pos_type NirvanaQt::TextDXYToPosition(int x, int y) {
     return xyToPos(x, y, CURSOR_POS);
 }
 
@@ -4705,7 +5107,7 @@ int NirvanaQt::TextDXYToPosition(int x, int y) {
 ** position, and CHARACTER_POS means return the position of the character
 ** closest to (x, y).
 */
-int NirvanaQt::xyToPos(int x, int y, PositionTypes posType) {
+pos_type NirvanaQt::xyToPos(int x, int y, PositionTypes posType) {
     int charIndex, lineStart, lineLen, fontHeight;
     int charWidth, charStyle, visLineNum, xStep, outIndex;
 	char_type expandedChar[MAX_EXP_CHAR_LEN];
@@ -4727,7 +5129,7 @@ int NirvanaQt::xyToPos(int x, int y, PositionTypes posType) {
 
     /* Get the line text and its length */
     lineLen = visLineLength(visLineNum);
-    String lineStr = buffer_->BufGetRange(lineStart, lineStart + lineLen);
+    TextView lineStr = buffer_->BufGetView(lineStart, lineStart + lineLen);
 
     /* Step through character positions from the beginning of the line
        to find the character position corresponding to the x coordinate */
@@ -4761,7 +5163,7 @@ int NirvanaQt::xyToPos(int x, int y, PositionTypes posType) {
 ** invloves character re-counting.
 */
 int NirvanaQt::TextDOffsetWrappedColumn(int row, int column) {
-    int lineStart;
+    pos_type lineStart;
     int dispLineStart;
 
     if (!continuousWrap_ || row < 0 || row > nVisibleLines_) {
@@ -4801,7 +5203,7 @@ void NirvanaQt::moveToAP(QMouseEvent *event) {
     int dragState = dragState_;
     Selection *secondary = &buffer_->BufGetSecondarySelection();
     Selection *primary = &buffer_->BufGetPrimarySelection();
-    int insertPos;
+    pos_type insertPos;
     int rectangular = secondary->rectangular;
     int column;
 
@@ -4827,7 +5229,7 @@ void NirvanaQt::moveToAP(QMouseEvent *event) {
                 TextDSetInsertPosition(buffer_->BufGetCursorPosHint());
             } else if (rectangular) {
                 insertPos = TextDGetInsertPosition();
-                int lineStart = buffer_->BufStartOfLine(insertPos);
+                pos_type lineStart = buffer_->BufStartOfLine(insertPos);
                 column = buffer_->BufCountDispChars(lineStart, insertPos);
                 buffer_->BufInsertCol(column, lineStart, textToCopy.str, nullptr, nullptr);
                 TextDSetInsertPosition(buffer_->BufGetCursorPosHint());
@@ -4938,7 +5340,7 @@ void NirvanaQt::SendSecondarySelection(bool removeAfter) {
 void NirvanaQt::selectWord(int pointerX) {
     int x;
     int y;
-    int insertPos = TextDGetInsertPosition();
+    pos_type insertPos = TextDGetInsertPosition();
 
     TextPosToXY(insertPos, &x, &y);
     if (pointerX < x && insertPos > 0 && buffer_->BufGetCharacter(insertPos - 1) != '\n') {
@@ -4955,7 +5357,7 @@ void NirvanaQt::selectWord(int pointerX) {
 ** of view.  If the position is horizontally out of view, returns the
 ** x coordinate where the position would be if it were visible.
 */
-int NirvanaQt::TextPosToXY(int pos, int *x, int *y) {
+int NirvanaQt::TextPosToXY(pos_type pos, int *x, int *y) {
     return TextDPositionToXY(pos, x, y);
 }
 
@@ -4965,9 +5367,9 @@ int NirvanaQt::TextPosToXY(int pos, int *x, int *y) {
 */
 void NirvanaQt::selectLine() {
 
-    const int insertPos = TextDGetInsertPosition();
-    const int endPos = buffer_->BufEndOfLine(insertPos);
-    const int startPos = buffer_->BufStartOfLine(insertPos);
+    const pos_type insertPos = TextDGetInsertPosition();
+    const pos_type endPos = buffer_->BufEndOfLine(insertPos);
+    const pos_type startPos = buffer_->BufStartOfLine(insertPos);
 
     buffer_->BufSelect(startPos, qMin(endPos + 1, buffer_->BufGetLength()));
     TextDSetInsertPosition(endPos);
@@ -5009,7 +5411,7 @@ void NirvanaQt::extendAdjustAP(QMouseEvent *event) {
 */
 void NirvanaQt::adjustSelection(int x, int y) {
 
-    int newPos = TextDXYToPosition(x, y);
+    pos_type newPos = TextDXYToPosition(x, y);
 
     /* Adjust the selection */
     if (dragState_ == PRIMARY_RECT_DRAG) {
@@ -5019,18 +5421,18 @@ void NirvanaQt::adjustSelection(int x, int y) {
         col = TextDOffsetWrappedColumn(row, col);
         const int startCol = qMin(rectAnchor_, col);
         const int endCol = qMax(rectAnchor_, col);
-        const int startPos = buffer_->BufStartOfLine(qMin(anchor_, newPos));
-        const int endPos = buffer_->BufEndOfLine(qMax(anchor_, newPos));
+        const pos_type startPos = buffer_->BufStartOfLine(qMin(anchor_, newPos));
+        const pos_type endPos = buffer_->BufEndOfLine(qMax(anchor_, newPos));
         buffer_->BufRectSelect(startPos, endPos, startCol, endCol);
     } else if (clickCount_ == 1) {
-        const int startPos = startOfWord(qMin(anchor_, newPos));
-        const int endPos = endOfWord(qMax(anchor_, newPos));
+        const pos_type startPos = startOfWord(qMin(anchor_, newPos));
+        const pos_type endPos = endOfWord(qMax(anchor_, newPos));
         buffer_->BufSelect(startPos, endPos);
         newPos = newPos < anchor_ ? startPos : endPos;
     } else if (clickCount_ == 2) {
-        const int startPos = buffer_->BufStartOfLine(qMin(anchor_, newPos));
-        const int endPos = buffer_->BufEndOfLine(qMax(anchor_, newPos));
-        buffer_->BufSelect(startPos, qMin(endPos + 1, buffer_->BufGetLength()));
+        const pos_type startPos = buffer_->BufStartOfLine(qMin(anchor_, newPos));
+        const pos_type endPos = buffer_->BufEndOfLine(qMax(anchor_, newPos));
+        buffer_->BufSelect(startPos, qMin<pos_type>(endPos + 1, buffer_->BufGetLength()));
         newPos = (newPos < anchor_) ? startPos : endPos;
     } else {
         buffer_->BufSelect(anchor_, newPos);
@@ -5042,7 +5444,7 @@ void NirvanaQt::adjustSelection(int x, int y) {
 }
 
 void NirvanaQt::adjustSecondarySelection(int x, int y) {
-    int newPos = TextDXYToPosition(x, y);
+    pos_type newPos = TextDXYToPosition(x, y);
 
     if (dragState_ == SECONDARY_RECT_DRAG) {
 
@@ -5054,8 +5456,8 @@ void NirvanaQt::adjustSecondarySelection(int x, int y) {
         col = TextDOffsetWrappedColumn(row, col);
         const int startCol = qMin(rectAnchor_, col);
         const int endCol = qMax(rectAnchor_, col);
-        const int startPos = buffer_->BufStartOfLine(qMin(anchor_, newPos));
-        const int endPos = buffer_->BufEndOfLine(qMax(anchor_, newPos));
+        const pos_type startPos = buffer_->BufStartOfLine(qMin(anchor_, newPos));
+        const pos_type endPos = buffer_->BufEndOfLine(qMax(anchor_, newPos));
 
         buffer_->BufSecRectSelect(startPos, endPos, startCol, endCol);
     } else {
@@ -5088,9 +5490,10 @@ void NirvanaQt::checkAutoScroll(int x, int y) {
 
 void NirvanaQt::nextPageAP(MoveMode mode) {
     int lastTopLine = qMax(1, nBufferLines_ - (nVisibleLines_ - 2) + cursorVPadding_);
-    int insertPos = TextDGetInsertPosition();
-    int column = 0, visLineNum, lineStartPos;
-    int pos, targetLine;
+    pos_type insertPos = TextDGetInsertPosition();
+    int column = 0, visLineNum;
+    pos_type lineStartPos, pos;
+    int targetLine;
     int pageForwardCount = qMax(1, nVisibleLines_ - 1);
     int maintainColumn = 0;
     int silent = /* hasKey("nobell", args, nArgs); */ false;
@@ -5177,9 +5580,10 @@ void NirvanaQt::nextPageAP(MoveMode mode) {
 
 void NirvanaQt::previousPageAP(MoveMode mode) {
 
-    int insertPos = TextDGetInsertPosition();
-    int column = 0, visLineNum, lineStartPos;
-    int pos, targetLine;
+    pos_type insertPos = TextDGetInsertPosition();
+    int column = 0, visLineNum;
+    pos_type lineStartPos, pos;
+    int targetLine;
     int pageBackwardCount = qMax(1, nVisibleLines_ - 1);
     int maintainColumn = 0;
     int silent = /* hasKey("nobell", args, nArgs); */ false;
@@ -5259,7 +5663,7 @@ void NirvanaQt::previousPageAP(MoveMode mode) {
 ** visible line index (-1 if not visible) and the lineStartPos
 ** of the current insert position.
 */
-int NirvanaQt::TextDPreferredColumn(int *visLineNum, int *lineStartPos) {
+int NirvanaQt::TextDPreferredColumn(int *visLineNum, pos_type *lineStartPos) {
     int column;
 
     /* Find the position of the start of the line.  Use the line starts array
@@ -5280,8 +5684,8 @@ int NirvanaQt::TextDPreferredColumn(int *visLineNum, int *lineStartPos) {
 ** Return the insert position of the requested column given
 ** the lineStartPos.
 */
-int NirvanaQt::TextDPosOfPreferredCol(int column, int lineStartPos) {
-    int newPos = buffer_->BufCountForwardDispChars(lineStartPos, column);
+pos_type NirvanaQt::TextDPosOfPreferredCol(int column, pos_type lineStartPos) {
+    pos_type newPos = buffer_->BufCountForwardDispChars(lineStartPos, column);
     if (continuousWrap_) {
         newPos = qMin(newPos, TextDEndOfLine(lineStartPos, true));
     }
@@ -5301,7 +5705,7 @@ void NirvanaQt::autoScrollTimeout() {
     /* For vertical autoscrolling just dragging the mouse outside of the top
        or bottom of the window is sufficient, for horizontal (non-rectangular)
        scrolling, see if the position where the CURSOR would go is outside */
-    int newPos = TextDXYToPosition(mouseX_, mouseY_);
+    pos_type newPos = TextDXYToPosition(mouseX_, mouseY_);
     if (dragState_ == PRIMARY_RECT_DRAG) {
         cursorX = mouseX_;
     } else if (!TextDPositionToXY(newPos, &cursorX, &y)) {
@@ -5372,16 +5776,16 @@ void NirvanaQt::TextDGetScroll(int *topLineNum, int *horizOffset) {
 ** can still perform the calculation afterwards (possibly even more
 ** efficiently).
 */
-void NirvanaQt::measureDeletedLines(int pos, int nDeleted) {
-    int retPos;
+void NirvanaQt::measureDeletedLines(pos_type pos, pos_type nDeleted) {
+    pos_type retPos;
     int retLines;
-    int retLineStart;
-    int retLineEnd;
+    pos_type retLineStart;
+    pos_type retLineEnd;
 
     int nVisLines = nVisibleLines_;
-    int *lineStarts = lineStarts_.data();
-    int countFrom;
-    int lineStart;
+    pos_type *lineStarts = lineStarts_.data();
+    pos_type countFrom;
+    pos_type lineStart;
     int nLines = 0;
 
     /*
@@ -5441,7 +5845,7 @@ void NirvanaQt::measureDeletedLines(int pos, int nDeleted) {
 }
 
 void NirvanaQt::forwardParagraphAP(MoveMode mode) {
-    int pos, insertPos = TextDGetInsertPosition();
+    pos_type pos, insertPos = TextDGetInsertPosition();
     char_type c;
     static const char_type whiteChars[] = _T(" \t");
     int silent = /* hasKey("nobell", args, nArgs); */ false;
@@ -5468,7 +5872,7 @@ void NirvanaQt::forwardParagraphAP(MoveMode mode) {
 }
 
 void NirvanaQt::backwardParagraphAP(MoveMode mode) {
-    int parStart, pos, insertPos = TextDGetInsertPosition();
+    pos_type parStart, pos, insertPos = TextDGetInsertPosition();
     char_type c;
     static const char_type whiteChars[] = _T(" \t");
     int silent = /* hasKey("nobell", args, nArgs); */ false;
@@ -5478,8 +5882,8 @@ void NirvanaQt::backwardParagraphAP(MoveMode mode) {
         ringIfNecessary(silent);
         return;
     }
-    parStart = buffer_->BufStartOfLine(qMax(insertPos - 1, 0));
-    pos = qMax(parStart - 2, 0);
+    parStart = buffer_->BufStartOfLine(qMax<pos_type>(insertPos - 1, 0));
+    pos = qMax<pos_type>(parStart - 2, 0);
     while (pos > 0) {
         c = buffer_->BufGetCharacter(pos);
         if (c == _T('\n'))
@@ -5488,7 +5892,7 @@ void NirvanaQt::backwardParagraphAP(MoveMode mode) {
             pos--;
         else {
             parStart = buffer_->BufStartOfLine(pos);
-            pos = qMax(parStart - 2, 0);
+            pos = qMax<pos_type>(parStart - 2, 0);
         }
     }
     TextDSetInsertPosition(parStart);
@@ -5503,7 +5907,7 @@ void NirvanaQt::emitCursorMoved() {
     }
 }
 
-void NirvanaQt::emitUnfinishedHighlightEncountered(int pos) {
+void NirvanaQt::emitUnfinishedHighlightEncountered(pos_type pos) {
 
     HighlightEvent event;
     event.buffer = buffer_;
@@ -5581,10 +5985,11 @@ void NirvanaQt::CancelBlockDrag() {
 ** tab if emulated tabs are turned on, or a hardware tab if not).
 */
 void NirvanaQt::ShiftSelection(ShiftDirection direction, bool byTab) {
-    int selStart, selEnd;
+    pos_type selStart, selEnd;
     bool isRect;
     int rectStart, rectEnd;
-    int shiftedLen, newEndPos, cursorPos, origLength, shiftDist;
+    pos_type shiftedLen, newEndPos, cursorPos, origLength;
+    int shiftDist;
     String text;
 	String shiftedText;
     TextBuffer *buf = buffer_;
@@ -5602,7 +6007,9 @@ void NirvanaQt::ShiftSelection(ShiftDirection direction, bool byTab) {
     } else if (isRect) {
         cursorPos = TextGetCursorPos();
         origLength = buf->BufGetLength();
+        buf->BufBeginBatch();
         shiftRect(direction, byTab, selStart, selEnd, rectStart, rectEnd);
+        buf->BufEndBatch();
         TextSetCursorPos((cursorPos < (selEnd + selStart) / 2) ? selStart
                                                                : cursorPos + (buf->BufGetLength() - origLength));
         return;
@@ -5625,23 +6032,27 @@ void NirvanaQt::ShiftSelection(ShiftDirection direction, bool byTab) {
     }
 
     shiftedText = ShiftText(text, direction, buf->BufGetUseTabs(), buf->BufGetTabDistance(), shiftDist, &shiftedLen);
+
+    /* replace the text and reselect it in one update */
+    buf->BufBeginBatch();
     buf->BufReplaceSelected(shiftedText.str);
 
     newEndPos = selStart + shiftedLen;
     buf->BufSelect(selStart, newEndPos);
+    buf->BufEndBatch();
 }
 
 /*
 ** Return the cursor position
 */
-int NirvanaQt::TextGetCursorPos() {
+pos_type NirvanaQt::TextGetCursorPos() {
     return TextDGetInsertPosition();
 }
 
 /*
 ** Set the cursor position
 */
-void NirvanaQt::TextSetCursorPos(int pos) {
+void NirvanaQt::TextSetCursorPos(pos_type pos) {
     TextDSetInsertPosition(pos);
     checkAutoShowInsertPos();
     emitCursorMoved();
@@ -5651,7 +6062,7 @@ void NirvanaQt::TextSetCursorPos(int pos) {
 ** shift lines left and right in a multi-line text string.  Returns the
 ** shifted text in memory that must be freed by the caller with delete[].
 */
-String NirvanaQt::ShiftText(const String &text, ShiftDirection direction, bool tabsAllowed, int tabDist, int nChars, int *newLen) {
+String NirvanaQt::ShiftText(const String &text, ShiftDirection direction, bool tabsAllowed, int tabDist, int nChars, pos_type *newLen) {
     size_t bufLen;
 
     /*
@@ -5814,7 +6225,7 @@ int NirvanaQt::atTabStop(int pos, int tabDist) {
     return (pos % tabDist == 0);
 }
 
-void NirvanaQt::shiftRect(ShiftDirection direction, bool byTab, int selStart, int selEnd, int rectStart, int rectEnd) {
+void NirvanaQt::shiftRect(ShiftDirection direction, bool byTab, pos_type selStart, pos_type selEnd, int rectStart, int rectEnd) {
     int offset;
     TextBuffer *buf = buffer_;
 
@@ -5854,8 +6265,8 @@ void NirvanaQt::shiftRect(ShiftDirection direction, bool byTab, int selStart, in
 }
 
 void NirvanaQt::deleteToEndOfLineAP() {
-    int insertPos = TextDGetInsertPosition();
-    int endOfLine;
+    pos_type insertPos = TextDGetInsertPosition();
+    pos_type endOfLine;
 
     if (/*hasKey("absolute", args, nArgs)*/ false)
         endOfLine = buffer_->BufEndOfLine(insertPos);
@@ -5878,8 +6289,8 @@ void NirvanaQt::deleteToEndOfLineAP() {
 }
 
 void NirvanaQt::deleteToStartOfLineAP() {
-    int insertPos = TextDGetInsertPosition();
-    int startOfLine;
+    pos_type insertPos = TextDGetInsertPosition();
+    pos_type startOfLine;
 
     if (/*hasKey("wrap", args, nArgs)*/ false)
         startOfLine = TextDStartOfLine(insertPos);
@@ -5915,8 +6326,8 @@ void NirvanaQt::selectToMatching() {
 }
 
 void NirvanaQt::GotoMatchingCharacter() {
-    int selStart, selEnd;
-    int matchPos;
+    pos_type selStart, selEnd;
+    pos_type matchPos;
     TextBuffer *buf = buffer_;
 
     /* get the character to match and its position from the selection, or
@@ -5965,13 +6376,13 @@ void NirvanaQt::GotoMatchingCharacter() {
 ** selection issues for older routines which use selections that won't
 ** span lines.
 */
-bool NirvanaQt::GetSimpleSelection(TextBuffer *buf, int *left, int *right) {
-    int selStart;
-    int selEnd;
+bool NirvanaQt::GetSimpleSelection(TextBuffer *buf, pos_type *left, pos_type *right) {
+    pos_type selStart;
+    pos_type selEnd;
     bool isRect;
     int rectStart;
     int rectEnd;
-    int lineStart;
+    pos_type lineStart;
 
     /* get the character to match and its position from the selection, or
        the character before the insert point if nothing is selected.
@@ -5996,13 +6407,13 @@ bool NirvanaQt::GetSimpleSelection(TextBuffer *buf, int *left, int *right) {
 ** well with rectangular selections.
 */
 void NirvanaQt::MakeSelectionVisible() {
-    int left, right;
+    pos_type left, right;
     bool isRect;
     int rectStart, rectEnd, horizOffset;
     int scrollOffset, leftX, rightX, y, rows, margin;
     int topLineNum, lastLineNum, rightLineNum, leftLineNum, linesToScroll;
-    int topChar = TextFirstVisiblePos();
-    int lastChar = TextLastVisiblePos();
+    pos_type topChar = TextFirstVisiblePos();
+    pos_type lastChar = TextLastVisiblePos();
     int targetLineNum;
     int width;
 
@@ -6082,11 +6493,11 @@ void NirvanaQt::MakeSelectionVisible() {
     UpdateStatsLine();
 }
 
-bool NirvanaQt::findMatchingChar(char_type toMatch, void *styleToMatch, int charPos, int startLimit, int endLimit,
-                                 int *matchPos) {
+bool NirvanaQt::findMatchingChar(char_type toMatch, void *styleToMatch, pos_type charPos, pos_type startLimit, pos_type endLimit,
+                                 pos_type *matchPos) {
     int nestDepth, matchIndex;
     SearchDirection direction;
-    int beginPos, pos;
+    pos_type beginPos, pos;
     char_type matchChar, c;
     void *style = nullptr;
     TextBuffer *buf = buffer_;
@@ -6169,11 +6580,11 @@ int NirvanaQt::TextVisibleWidth() {
 #endif
 }
 
-int NirvanaQt::TextFirstVisiblePos() {
+pos_type NirvanaQt::TextFirstVisiblePos() {
     return firstChar_;
 }
 
-int NirvanaQt::TextLastVisiblePos() {
+pos_type NirvanaQt::TextLastVisiblePos() {
     return lastChar_;
 }
 
@@ -6192,8 +6603,8 @@ void NirvanaQt::TextSetScroll(int topLineNum, int horizOffset) {
 }
 
 void NirvanaQt::SelectToMatchingCharacter() {
-    int selStart, selEnd;
-    int startPos, endPos, matchPos;
+    pos_type selStart, selEnd;
+    pos_type startPos, endPos, matchPos;
     TextBuffer *buf = buffer_;
 
     /* get the character to match and its position from the selection, or
@@ -6243,10 +6654,11 @@ void NirvanaQt::FillSelection() {
     TextBuffer *buf = buffer_;
     String text;
     String filledText;
-    int left, right, nCols, len, rectStart, rectEnd;
+    pos_type left, right, len;
+    int nCols, rectStart, rectEnd;
     bool isRect;
     int rightMargin, wrapMargin;
-    int insertPos = TextGetCursorPos();
+    pos_type insertPos = TextGetCursorPos();
     int hasSelection = buf->BufGetPrimarySelection().selected;
 
     Q_UNUSED(nCols);
@@ -6299,7 +6711,8 @@ void NirvanaQt::FillSelection() {
     filledText = fillParagraphs(text.str, rightMargin, buf->BufGetTabDistance(), buf->BufGetUseTabs(),
                                 buf->BufGetNullSubsChar(), &len, false);
 
-    /* Replace the text in the window */
+    /* Replace the text in the window (and reselect it) in one update */
+    buf->BufBeginBatch();
     if (hasSelection && isRect) {
         buf->BufReplaceRect(left, right, rectStart, INT_MAX, filledText.str);
         buf->BufRectSelect(left, buf->BufEndOfLine(buf->BufCountForwardNLines(left, countLines(filledText.str) /*-1*/)), rectStart, rectEnd);
@@ -6308,6 +6721,7 @@ void NirvanaQt::FillSelection() {
         if (hasSelection)
             buf->BufSelect(left, left + len);
     }
+    buf->BufEndBatch();
 
     /* Find a reasonable cursor position.  Usually insertPos is best, but
        if the text was indented, positions can shift */
@@ -6321,9 +6735,9 @@ void NirvanaQt::FillSelection() {
 /*
 ** Find the boundaries of the paragraph containing pos
 */
-int NirvanaQt::findParagraphEnd(TextBuffer *buf, int startPos) {
+pos_type NirvanaQt::findParagraphEnd(TextBuffer *buf, pos_type startPos) {
     char_type c;
-    int pos;
+    pos_type pos;
     static const char_type whiteChars[] = _T(" \t");
 
     pos = buf->BufEndOfLine(startPos) + 1;
@@ -6339,9 +6753,9 @@ int NirvanaQt::findParagraphEnd(TextBuffer *buf, int startPos) {
     return pos < buf->BufGetLength() ? pos : buf->BufGetLength();
 }
 
-int NirvanaQt::findParagraphStart(TextBuffer *buf, int startPos) {
+pos_type NirvanaQt::findParagraphStart(TextBuffer *buf, pos_type startPos) {
     char_type c;
-    int pos, parStart;
+    pos_type pos, parStart;
     static const char_type whiteChars[] = _T(" \t");
 
     if (startPos == 0)
@@ -6370,8 +6784,8 @@ int NirvanaQt::findParagraphStart(TextBuffer *buf, int startPos) {
 ** previous versions which did all paragraphs together).
 */
 String NirvanaQt::fillParagraphs(char_type *text, int rightMargin, int tabDist, bool useTabs, char_type nullSubsChar,
-                                int *filledLen, int alignWithFirst) {
-    int paraEnd, fillEnd;
+                                pos_type *filledLen, int alignWithFirst) {
+    pos_type paraEnd, fillEnd;
     char_type *c;
     char_type ch;
     char_type *secondLineStart;
@@ -6379,7 +6793,7 @@ String NirvanaQt::fillParagraphs(char_type *text, int rightMargin, int tabDist,
     int firstLineLen;
     int firstLineIndent;
     int leftMargin;
-    int len;
+    pos_type len;
 
     /* Create a buffer to accumulate the filled paragraphs */
     TextBuffer *const buf = new TextBuffer();
@@ -6389,7 +6803,7 @@ String NirvanaQt::fillParagraphs(char_type *text, int rightMargin, int tabDist,
     ** Loop over paragraphs, filling each one, and accumulating the results
     ** in buf
     */
-    int paraStart = 0;
+    pos_type paraStart = 0;
     for (;;) {
 
         /* Skip over white space */
@@ -6452,7 +6866,7 @@ String NirvanaQt::fillParagraphs(char_type *text, int rightMargin, int tabDist,
 ** string as the function result, and the length of the new string in filledLen.
 */
 String NirvanaQt::fillParagraph(char_type *text, int leftMargin, int firstLineIndent, int rightMargin, int tabDist,
-                               bool allowTabs, char_type nullSubsChar, int *filledLen) {
+                               bool allowTabs, char_type nullSubsChar, pos_type *filledLen) {
 
     char_type *outText, *c, *b;
     int col, cleanedLen, indentLen, leadIndentLen, nLines = 1;
@@ -6624,7 +7038,7 @@ void NirvanaQt::redoAP() {
 void NirvanaQt::Undo() {
 
     /* return if nothing to undo */
-    if (!undo_)
+    if (undo_.empty())
         return;
 
     /* BufReplace will eventually call SaveUndoInformation.  This is mostly
@@ -6632,21 +7046,26 @@ void NirvanaQt::Undo() {
        SaveUndoInformation needs to know that it is being called in the context
        of an undo.  The inUndo field in the undo record indicates that this
        record is in the process of being undone. */
-    undo_->inUndo = true;
+    undo_.newest().inUndo = true;
+    const UndoInfo undo = undo_.newest();
+
+    std::vector<char_type> oldText;
+    undo_.newestText(&oldText);
 
     /* use the saved undo information to reverse changes */
-    buffer_->BufReplace(undo_->startPos, undo_->endPos, (undo_->oldText != nullptr ? undo_->oldText : _T("")));
+    pos_type restoredStart;
+    pos_type restoredEnd;
+    restoreUndoText(undo, oldText, &restoredStart, &restoredEnd);
 
-    const int restoredTextLength = undo_->oldText != nullptr ? traits_type::length(undo_->oldText) : 0;
     if (!buffer_->BufGetPrimarySelection().selected || undoModifiesSelection_) {
         /* position the cursor in the focus pane after the changed text
            to show the user where the undo was done */
-        TextSetCursorPos(undo_->startPos + restoredTextLength);
+        TextSetCursorPos(restoredEnd);
     }
 
     if (undoModifiesSelection_) {
-        if (restoredTextLength > 0) {
-            buffer_->BufSelect(undo_->startPos, undo_->startPos + restoredTextLength);
+        if (restoredEnd > restoredStart) {
+            buffer_->BufSelect(restoredStart, restoredEnd);
         } else {
             buffer_->BufUnselect();
         }
@@ -6657,7 +7076,7 @@ void NirvanaQt::Undo() {
        when the change being undone was originally made.  Also, remove
        the backup file, since the text in the buffer is now identical to
        the original file */
-    if (undo_->restoresToSaved) {
+    if (undo.restoresToSaved) {
         SetWindowModified(false);
         RemoveBackupFile();
     }
@@ -6669,28 +7088,33 @@ void NirvanaQt::Undo() {
 void NirvanaQt::Redo() {
 
     /* return if nothing to redo */
-    if (!redo_) {
+    if (redo_.empty()) {
         return;
     }
 
     /* BufReplace will eventually call SaveUndoInformation.  To indicate
        to SaveUndoInformation that this is the context of a redo operation,
        we set the inUndo indicator in the redo record */
-    redo_->inUndo = true;
+    redo_.newest().inUndo = true;
+    const UndoInfo redo = redo_.newest();
+
+    std::vector<char_type> oldText;
+    redo_.newestText(&oldText);
 
     /* use the saved redo information to reverse changes */
-    buffer_->BufReplace(redo_->startPos, redo_->endPos, (redo_->oldText != nullptr ? redo_->oldText : _T("")));
+    pos_type restoredStart;
+    pos_type restoredEnd;
+    restoreUndoText(redo, oldText, &restoredStart, &restoredEnd);
 
-    const int restoredTextLength = redo_->oldText != nullptr ? traits_type::length(redo_->oldText) : 0;
     if (!buffer_->BufGetPrimarySelection().selected || undoModifiesSelection_) {
         /* position the cursor in the focus pane after the changed text
            to show the user where the undo was done */
-        TextSetCursorPos(redo_->startPos + restoredTextLength);
+        TextSetCursorPos(restoredEnd);
     }
     if (undoModifiesSelection_) {
 
-        if (restoredTextLength > 0) {
-            buffer_->BufSelect(redo_->startPos, redo_->startPos + restoredTextLength);
+        if (restoredEnd > restoredStart) {
+            buffer_->BufSelect(restoredStart, restoredEnd);
         } else {
             buffer_->BufUnselect();
         }
@@ -6701,7 +7125,7 @@ void NirvanaQt::Redo() {
        when the change being redone was originally made. Also, remove
        the backup file, since the text in the buffer is now identical to
        the original file */
-    if (redo_->restoresToSaved) {
+    if (redo.restoresToSaved) {
         SetWindowModified(false);
         RemoveBackupFile();
     }
@@ -6710,25 +7134,54 @@ void NirvanaQt::Redo() {
     removeRedoItem();
 }
 
+/*
+** Put back the text replaced by undo (or redo) record "undo", "oldText"
+** being the text saved with it, returning where the text put back starts
+** and ends.  Only the ranges a MULTI_REPLACE changed are put back (the last
+** first, so that the positions of the others still hold), in one batch.
+*/
+void NirvanaQt::restoreUndoText(const UndoInfo &undo, const std::vector<char_type> &oldText, pos_type *start, pos_type *end) {
+
+    if (undo.type != MULTI_REPLACE) {
+        buffer_->BufReplace(undo.startPos, undo.endPos, oldText.data(), static_cast<pos_type>(oldText.size()));
+        *start = undo.startPos;
+        *end = undo.startPos + static_cast<pos_type>(oldText.size());
+        return;
+    }
+
+    std::vector<UndoDelta> deltas;
+    std::vector<char_type> text;
+    unpackDeltas(undo.startPos, oldText, &deltas, &text);
+
+    buffer_->BufBeginBatch();
+    for (auto it = deltas.rbegin(); it != deltas.rend(); ++it) {
+        buffer_->BufReplace(it->pos, it->pos + it->newLen, text.data() + it->oldOffset, it->oldLen);
+    }
+    buffer_->BufEndBatch();
+
+    /* the last range moved by the change in length of all of the others */
+    pos_type shift = 0;
+    for (size_t i = 0; i + 1 < deltas.size(); i++) {
+        shift += deltas[i].oldLen - deltas[i].newLen;
+    }
+
+    *start = deltas.front().pos;
+    *end = deltas.back().pos + shift + deltas.back().oldLen;
+}
+
 /*
 ** Pop (remove and free) the current (front) undo record from the undo list
 */
 void NirvanaQt::removeUndoItem() {
-    UndoInfo *undo = undo_;
 
-    if (undo == nullptr)
+    if (undo_.empty())
         return;
 
-    /* Decrement the operation and memory counts */
-    undoOpCount_--;
-    undoMemUsed_ -= undo->oldLen;
-
-    /* Remove and free the item */
-    undo_ = undo->next;
-    freeUndoRecord(undo);
+    /* Remove the item, its text going with it */
+    undo_.popNewest();
 
     /* if there are no more undo records left, dim the Undo menu item */
-    if (!undo_) {
+    if (undo_.empty()) {
 #if 0
     SetSensitive(window, window->undoItem, false);
     SetBGMenuUndoSensitivity(window, false);
@@ -6740,14 +7193,12 @@ void NirvanaQt::removeUndoItem() {
 ** Pop (remove and free) the current (front) redo record from the redo list
 */
 void NirvanaQt::removeRedoItem() {
-    UndoInfo *redo = redo_;
 
-    /* Remove and free the item */
-    redo_ = redo->next;
-    freeUndoRecord(redo);
+    /* Remove the item, its text going with it */
+    redo_.popNewest();
 
     /* if there are no more redo records left, dim the Redo menu item */
-    if (!redo_) {
+    if (redo_.empty()) {
 #if 0
         SetSensitive(window, window->redoItem, false);
         SetBGMenuRedoSensitivity(window, false);
@@ -6755,14 +7206,6 @@ void NirvanaQt::removeRedoItem() {
     }
 }
 
-void NirvanaQt::freeUndoRecord(UndoInfo *undo) {
-    if (!undo)
-        return;
-
-    delete[] undo->oldText;
-    delete undo;
-}
-
 /*
 ** Remove the backup file associated with this window
 */
@@ -6803,7 +7246,7 @@ void NirvanaQt::SetWindowModified(bool modified) {
     }
 }
 
-void NirvanaQt::modifiedCB(int pos, int nInserted, int nDeleted, int nRestyled, const char_type *deletedText) {
+void NirvanaQt::modifiedCB(pos_type pos, pos_type nInserted, pos_type nDeleted, pos_type nRestyled, const char_type *deletedText) {
 
     Q_UNUSED(nRestyled);
 
@@ -6846,9 +7289,16 @@ void NirvanaQt::modifiedCB(int pos, int nInserted, int nDeleted, int nRestyled,
 #endif
     }
 
+    if (nDeleted == 0 && nInserted == 0)
+        return;
+
+    /* Record the change in the journal, even if it isn't recorded for undo,
+       since the text can't be rebuilt without it */
+    journalModification(pos, nInserted, nDeleted);
+
     /* When the program needs to make a change to a text area without without
        recording it for undo or marking file as changed it sets ignoreModify */
-    if (ignoreModify_ || (nDeleted == 0 && nInserted == 0))
+    if (ignoreModify_)
         return;
 
     /* Make sure line number display is sufficient for new data */
@@ -6974,19 +7424,48 @@ void NirvanaQt::CheckForChangesToFile() {
 }
 
 /*
-** Create a backup file for the current window.  The name for the backup file
-** is generated using the name and path stored in the window and adding a
-** tilde (~) on UNIX and underscore (_) on VMS to the beginning of the name.
+** Rather than writing out a copy of the whole text, the journal of changes
+** made to it (see startJournal) serves as the backup, and this just asks for
+** what has been recorded there to be synced to disk promptly.  The journal
+** is written (and synced at least once a second) by a thread of its own, so
+** this never waits for the disk.
 */
 bool NirvanaQt::WriteBackupFile() {
-    return true;
+    journal_.sync();
+    return journal_.complete();
+}
+
+/*
+** Record a change to the text in the journal (see startJournal), noting
+** whether it was an edit, the undoing or redoing of one, or one of the
+** changes made without recording them for undo: text appended, or old text
+** dropped from the start (see appendText and trimHistory)
+*/
+void NirvanaQt::journalModification(pos_type pos, pos_type nInserted, pos_type nDeleted) {
+
+    if (!journal_.isOpen()) {
+        return;
+    }
+
+    JournalKind kind = JOURNAL_EDIT;
+    if (ignoreModify_) {
+        kind = (nDeleted == 0) ? JOURNAL_APPEND : JOURNAL_TRIM;
+    } else if (!undo_.empty() && undo_.newest().inUndo) {
+        kind = JOURNAL_UNDO;
+    } else if (!redo_.empty() && redo_.newest().inUndo) {
+        kind = JOURNAL_REDO;
+    }
+
+    std::vector<char_type> text(static_cast<size_t>(nInserted));
+    buffer_->BufGetView(pos, pos + nInserted).copy(text.data());
+    journal_.record(kind, pos, nDeleted, std::move(text));
 }
 
 /*
 ** Keep the marks in the windows book-mark table up to date across
 ** changes to the underlying buffer
 */
-void NirvanaQt::UpdateMarkTable(int pos, int nInserted, int nDeleted) {
+void NirvanaQt::UpdateMarkTable(pos_type pos, pos_type nInserted, pos_type nDeleted) {
     Q_UNUSED(pos);
     Q_UNUSED(nInserted);
     Q_UNUSED(nDeleted);
@@ -7010,18 +7489,18 @@ void NirvanaQt::UpdateMarkTable(int pos, int nInserted, int nDeleted) {
 ** Note: This routine must be kept efficient.  It is called for every
 **       character typed.
 */
-void NirvanaQt::SaveUndoInformation(int pos, int nInserted, int nDeleted, const char_type *deletedText) {
+void NirvanaQt::SaveUndoInformation(pos_type pos, pos_type nInserted, pos_type nDeleted, const char_type *deletedText) {
 
     UndoTypes newType;
     UndoTypes oldType;
-    UndoInfo *u, *undo = undo_;
+    UndoInfo *undo = undo_.empty() ? nullptr : &undo_.newest();
     int isUndo = (undo != nullptr && undo->inUndo);
-    int isRedo = (redo_ != nullptr && redo_->inUndo);
+    int isRedo = (!redo_.empty() && redo_.newest().inUndo);
 
     /* redo operations become invalid once the user begins typing or does
        other editing.  If this is not a redo or undo operation and a redo
        list still exists, clear it and dim the redo menu item */
-    if (!(isUndo || isRedo) && redo_ != nullptr)
+    if (!(isUndo || isRedo) && !redo_.empty())
         ClearRedoList();
 
     /* figure out what kind of editing operation this is, and recall
@@ -7071,24 +7550,31 @@ void NirvanaQt::SaveUndoInformation(int pos, int nInserted, int nDeleted, const
         }
     }
 
+    /* a big replacement is recorded as only the ranges which changed */
+    std::vector<char_type> deltas;
+    if (newType == BLOCK_REPLACE && nDeleted >= UNDO_DIFF_THRESHOLD) {
+        newType = narrowReplacement(&pos, &nInserted, &nDeleted, &deletedText, &deltas);
+        if (newType == UNDO_NOOP)
+            return;
+    }
+
     /*
     ** The user has started a new operation, create a new undo record
     ** and save the new undo data.
     */
-    undo = new UndoInfo;
-    undo->oldLen = 0;
-    undo->oldText = nullptr;
-    undo->type = newType;
-    undo->inUndo = false;
-    undo->restoresToSaved = false;
-    undo->startPos = pos;
-    undo->endPos = pos + nInserted;
-
-    /* if text was deleted, save it */
-    if (nDeleted > 0) {
-        undo->oldLen = nDeleted + 1; /* +1 is for null at end */
-        undo->oldText = new char_type[nDeleted + 1];
-        traits_type::copy(undo->oldText, deletedText, undo->oldLen);
+    UndoInfo newUndo;
+    newUndo.type = newType;
+    newUndo.inUndo = false;
+    newUndo.restoresToSaved = false;
+    newUndo.startPos = pos;
+    newUndo.endPos = pos + nInserted;
+
+    /* if text was deleted, it is saved with the record (or for several
+       ranges, their positions and text) */
+    newUndo.oldLen = nDeleted;
+    if (newType == MULTI_REPLACE) {
+        newUndo.oldLen = static_cast<pos_type>(deltas.size());
+        deletedText = deltas.data();
     }
 
     /* increment the operation count for the autosave feature */
@@ -7097,20 +7583,18 @@ void NirvanaQt::SaveUndoInformation(int pos, int nInserted, int nDeleted, const
     /* if the window is currently unmodified, remove the previous
        restoresToSaved marker, and set it on this record */
     if (!fileChanged_) {
-        undo->restoresToSaved = true;
-        for (u = undo_; u != nullptr; u = u->next)
-            u->restoresToSaved = false;
-        for (u = redo_; u != nullptr; u = u->next)
-            u->restoresToSaved = false;
+        newUndo.restoresToSaved = true;
+        undo_.clearRestoresToSaved();
+        redo_.clearRestoresToSaved();
     }
 
     /* Add the new record to the undo list  unless SaveUndoInfo is
        saving information generated by an Undo operation itself, in
        which case, add the new record to the redo list. */
     if (isUndo)
-        addRedoItem(undo);
+        addRedoItem(newUndo, deletedText);
     else
-        addUndoItem(undo);
+        addUndoItem(newUndo, deletedText);
 }
 
 /*
@@ -7120,23 +7604,23 @@ void NirvanaQt::SaveUndoInformation(int pos, int nInserted, int nDeleted, const
 ** lists and adjusting the edit menu accordingly
 */
 void NirvanaQt::ClearUndoList() {
-    while (undo_ != NULL)
-        removeUndoItem();
+    undo_.clear();
 }
 void NirvanaQt::ClearRedoList() {
-    while (redo_ != NULL)
-        removeRedoItem();
+    redo_.clear();
 }
 
 /*
-** Add an undo record (already allocated by the caller) to the window's undo
-** list if the item pushes the undo operation or character counts past the
-** limits, trim the undo list to an acceptable length.
+** Add an undo record, with the "undo.oldLen" characters of "oldText" it
+** replaced, to the window's undo list if the item pushes the undo operation
+** or character counts past the limits, trim the undo list to an acceptable
+** length.  With a memory limit set, schedule a check of it (batching up the
+** edits made in the meantime).
 */
-void NirvanaQt::addUndoItem(UndoInfo *undo) {
+void NirvanaQt::addUndoItem(const UndoInfo &undo, const char_type *oldText) {
 
     /* Make the undo menu item sensitive now that there's something to undo */
-    if (undo_ == NULL) {
+    if (undo_.empty()) {
 #if 0
         SetSensitive(window, window->undoItem, True);
     SetBGMenuUndoSensitivity(window, True);
@@ -7144,28 +7628,26 @@ void NirvanaQt::addUndoItem(UndoInfo *undo) {
     }
 
     /* Add the item to the beginning of the list */
-    undo->next = undo_;
-    undo_ = undo;
-
-    /* Increment the operation and memory counts */
-    undoOpCount_++;
-    undoMemUsed_ += undo->oldLen;
+    undo_.push(undo, oldText, undo.oldLen);
 
-    /* Trim the list if it exceeds any of the limits */
-    if (undoOpCount_ > UNDO_OP_LIMIT)
+    /* Trim the list if it exceeds any of the limits.  Records come off the
+       old end of the list one at a time, each in O(1) */
+    if (undo_.size() > UNDO_OP_LIMIT)
         trimUndoList(UNDO_OP_TRIMTO);
-    if (undoMemUsed_ > UNDO_WORRY_LIMIT)
-        trimUndoList(UNDO_WORRY_TRIMTO);
-    if (undoMemUsed_ > UNDO_PURGE_LIMIT)
-        trimUndoList(UNDO_PURGE_TRIMTO);
+    while (undo_.bytesUsed() > UNDO_MEMORY_LIMIT && undo_.size() > 1)
+        undo_.popOldest();
+
+    if (memoryLimit_ != 0 && !memoryTimer_->isActive())
+        memoryTimer_->start(MemoryCheckInterval);
 }
 
 /*
-** Add an item (already allocated by the caller) to the window's redo list.
+** Add an item, with the "redo.oldLen" characters of "oldText" it replaced, to
+** the window's redo list.
 */
-void NirvanaQt::addRedoItem(UndoInfo *redo) {
+void NirvanaQt::addRedoItem(const UndoInfo &redo, const char_type *oldText) {
     /* Make the redo menu item sensitive now that there's something to redo */
-    if (redo_ == NULL) {
+    if (redo_.empty()) {
 #if 0
         SetSensitive(window, window->redoItem, True);
     SetBGMenuRedoSensitivity(window, True);
@@ -7173,11 +7655,58 @@ void NirvanaQt::addRedoItem(UndoInfo *redo) {
     }
 
     /* Add the item to the beginning of the list */
-    redo->next = redo_;
-    redo_ = redo;
+    redo_.push(redo, oldText, redo.oldLen);
 }
 
-UndoTypes NirvanaQt::determineUndoType(int nInserted, int nDeleted) {
+/*
+** Narrow down the replacement of "nDeleted" characters of "deletedText" at
+** "pos" by "nInserted" others to what really changed (see findDeltas).  If
+** that is a single range, the arguments are changed to it and BLOCK_REPLACE
+** returned.  If it is several, they are packed into "deltas" and
+** MULTI_REPLACE returned, unless that wouldn't be any smaller than the
+** single range covering them all.  If nothing changed, UNDO_NOOP is
+** returned.
+*/
+UndoTypes NirvanaQt::narrowReplacement(pos_type *pos, pos_type *nInserted, pos_type *nDeleted, const char_type **deletedText, std::vector<char_type> *deltas) {
+
+    /* right after the replacement the gap is at the end of the new text, so
+       it can be read where it is, without a second copy of what may be the
+       whole file (should it be split anyway, as at the end of a batch, it
+       is joined into one) */
+    const TextView view = buffer_->BufGetView(*pos, *pos + *nInserted);
+    const char_type *newText = view.text1;
+
+    std::vector<char_type> joined;
+    if (view.length2 != 0) {
+        joined.resize(static_cast<size_t>(view.length()));
+        view.copy(joined.data());
+        newText = joined.data();
+    }
+
+    std::vector<UndoDelta> ranges;
+    findDeltas(*pos, *deletedText, *nDeleted, newText, *nInserted, &ranges);
+
+    if (ranges.empty())
+        return UNDO_NOOP;
+
+    const UndoDelta &first = ranges.front();
+    const UndoDelta &last = ranges.back();
+    const pos_type oldSpan = last.oldOffset + last.oldLen - first.oldOffset;
+
+    if (ranges.size() > 1) {
+        packDeltas(*pos, ranges, *deletedText, deltas);
+        if (static_cast<pos_type>(deltas->size()) < oldSpan)
+            return MULTI_REPLACE;
+    }
+
+    *deletedText += first.oldOffset;
+    *nInserted = last.pos + last.newLen - first.pos;
+    *nDeleted = oldSpan;
+    *pos = first.pos;
+    return BLOCK_REPLACE;
+}
+
+UndoTypes NirvanaQt::determineUndoType(pos_type nInserted, pos_type nDeleted) {
     int textDeleted, textInserted;
 
     textDeleted = (nDeleted > 0);
@@ -7213,33 +7742,15 @@ UndoTypes NirvanaQt::determineUndoType(int nInserted, int nDeleted) {
 ** for continuing of a string of one character deletes or replaces, but will
 ** work with more than one character.
 */
-void NirvanaQt::appendDeletedText(const char_type *deletedText, int deletedLen, int direction) {
-    UndoInfo *undo = undo_;
-    char_type *comboText;
-
-    /* re-allocate, adding space for the new character(s) */
-    comboText = new char_type[undo->oldLen + deletedLen + 1];
+void NirvanaQt::appendDeletedText(const char_type *deletedText, pos_type deletedLen, int direction) {
 
-    /* copy the new character and the already deleted text to the new memory */
+    /* the list extends the text in place (see UndoList), rather than it
+       being copied for every character */
     if (direction == FORWARD) {
-	
-		std::copy_n(undo->oldText, undo->oldLen, comboText);
-		std::copy_n(deletedText, deletedLen, comboText + undo->oldLen);
-		comboText[undo->oldLen + deletedLen] = _T('\0');
+        undo_.appendText(deletedText, deletedLen);
     } else {
-	
-		std::copy_n(deletedText, deletedLen, comboText);
-		std::copy_n(undo->oldText, undo->oldLen, comboText + deletedLen);
-		comboText[undo->oldLen + deletedLen] = _T('\0');
+        undo_.prependText(deletedText, deletedLen);
     }
-
-    /* keep track of the additional memory now used by the undo list */
-    undoMemUsed_++;
-
-    /* free the old saved text and attach the new */
-    delete[] undo->oldText;
-    undo->oldText = comboText;
-    undo->oldLen += deletedLen;
 }
 
 /*
@@ -7247,27 +7758,8 @@ void NirvanaQt::appendDeletedText(const char_type *deletedText, int deletedLen,
 ** maxLength
 */
 void NirvanaQt::trimUndoList(int maxLength) {
-    int i;
-    UndoInfo *u, *lastRec;
-
-    if (undo_ == NULL)
-        return;
-
-    /* Find last item on the list to leave intact */
-    for (i = 1, u = undo_; i < maxLength && u != NULL; i++, u = u->next)
-        ;
-    if (u == NULL)
-        return;
-
-    /* Trim off all subsequent entries */
-    lastRec = u;
-    while (lastRec->next != NULL) {
-        u = lastRec->next;
-        lastRec->next = u->next;
-        undoOpCount_--;
-        undoMemUsed_ -= u->oldLen;
-        freeUndoRecord(u);
-    }
+    while (undo_.size() > qMax(maxLength, 1))
+        undo_.popOldest();
 }
 
 /*
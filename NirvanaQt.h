@@ -8,6 +8,9 @@
 #include "IBufferModifiedHandler.h"
 #include "IPreDeleteHandler.h"
 #include "IHighlightHandler.h"
+#include "Rangeset.h"
+#include "UndoJournal.h"
+#include "UndoList.h"
 #include <QAbstractScrollArea>
 #include <QList>
 
@@ -19,16 +22,6 @@ enum CursorStyles { NORMAL_CURSOR, CARET_CURSOR, DIM_CURSOR, BLOCK_CURSOR, HEAVY
 
 enum PositionTypes { CURSOR_POS, CHARACTER_POS };
 
-enum UndoTypes {
-	UNDO_NOOP,
-	ONE_CHAR_INSERT,
-	ONE_CHAR_REPLACE,
-	ONE_CHAR_DELETE,
-	BLOCK_INSERT,
-	BLOCK_REPLACE,
-	BLOCK_DELETE
-};
-
 enum DragStates {
 	NOT_CLICKED,
 	PRIMARY_CLICKED,
@@ -47,22 +40,14 @@ enum MoveMode { MoveNoExtend, MoveExtend, MoveExtendRect };
 
 enum PasteMode { PasteStandard, PasteColumnar };
 
-/* Record on undo list */
-struct UndoInfo {
-	UndoInfo *next; /* pointer to the next undo record */
-	UndoTypes type;
-	int startPos;
-	int endPos;
-	int oldLen;
-	char_type *oldText;
-	bool inUndo;          /* flag to indicate undo command on
-	                     this record in progress.  Redirects
-	                     SaveUndoInfo to save the next mod-
-	                     ifications on the redo list instead
-	                     of the undo list. */
-	bool restoresToSaved; /* flag to indicate undoing this
-	                                 operation will restore file to
-	                                 last saved (unmodified) state */
+/* Memory used by an editor, in bytes (see NirvanaQt::memoryUsage) */
+struct EditorMemoryUsage {
+	TextBufferMemoryUsage text; // the text buffer, by component
+	size_t styles;              // the syntax highlighting style buffer
+	size_t patterns;            // the compiled highlighting patterns
+	size_t undo;                // the undo and redo lists
+	size_t display;             // the line starts of the display
+	size_t total;
 };
 
 class NirvanaQt : public QAbstractScrollArea, public IBufferModifiedHandler, public IPreDeleteHandler {
@@ -73,13 +58,18 @@ public:
 
 public:
 	virtual void bufferModified(const ModifyEvent *event) override;
+	virtual void bufferLoaded(const ModifyEvent *event) override;
+	virtual DeletedTextNeeds deletedTextNeeds() const override;
 	virtual void preDelete(const PreDeleteEvent *event) override;
+	virtual bool preDeleteNeedsExactModify() const override;
 
 protected:
 	virtual void paintEvent(QPaintEvent *event) override;
 	virtual void keyPressEvent(QKeyEvent *event) override;
 	virtual void keyReleaseEvent(QKeyEvent *event) override;
 	virtual void resizeEvent(QResizeEvent *event) override;
+	virtual void showEvent(QShowEvent *event) override;
+	virtual void hideEvent(QHideEvent *event) override;
 	virtual void mouseDoubleClickEvent(QMouseEvent *event) override;
 	virtual void mouseMoveEvent(QMouseEvent *event) override;
 	virtual void mousePressEvent(QMouseEvent *event) override;
@@ -103,81 +93,99 @@ public Q_SLOTS:
 	void selectToMatching();
 
 public:
+	const TextBuffer *buffer() const;
 	const QFont &font() const;
 	void setFont(const QFont &font);
+	EditorMemoryUsage memoryUsage() const;
+	void setMemoryLimit(size_t bytes);
+	void appendText(const char_type *text, pos_type length);
+	void setFollowMode(bool follow);
+	void setHistoryLimit(pos_type maxLength);
+	void startJournal(const QString &path);
+	bool recoverFromJournal(const QString &path);
+	void stopJournal();
+
+private:
+	/* A rangeset's color, parsed from its name */
+	struct RangesetColor {
+		std::string name;
+		QColor color;
+	};
 
 private:
 	int visibleColumns() const;
 	int visibleRows() const;
 
 private:
-	static bool inSelection(const Selection *sel, int pos, int lineStartPos, int dispIndex);
-	static bool rangeTouchesRectSel(Selection *sel, int rangeStart, int rangeEnd);
+	static bool inSelection(const Selection *sel, pos_type pos, pos_type lineStartPos, int dispIndex);
+	static bool rangeTouchesRectSel(Selection *sel, pos_type rangeStart, pos_type rangeEnd);
 
 private:
-	String ShiftText(const String &text, ShiftDirection direction, bool tabsAllowed, int tabDist, int nChars, int *newLen);
-	String createIndentString(TextBuffer *buf, int bufOffset, int lineStartPos, int lineEndPos, int *length, int *column);
-	String fillParagraph(char_type *text, int leftMargin, int firstLineIndent, int rightMargin, int tabDist, bool allowTabs, char_type nullSubsChar, int *filledLen);
-	String fillParagraphs(char_type *text, int rightMargin, int tabDist, bool useTabs, char_type nullSubsChar, int *filledLen, int alignWithFirst);
+	String ShiftText(const String &text, ShiftDirection direction, bool tabsAllowed, int tabDist, int nChars, pos_type *newLen);
+	String createIndentString(TextBuffer *buf, pos_type bufOffset, pos_type lineStartPos, pos_type lineEndPos, int *length, int *column);
+	String fillParagraph(char_type *text, int leftMargin, int firstLineIndent, int rightMargin, int tabDist, bool allowTabs, char_type nullSubsChar, pos_type *filledLen);
+	String fillParagraphs(char_type *text, int rightMargin, int tabDist, bool useTabs, char_type nullSubsChar, pos_type *filledLen, int alignWithFirst);
 	String makeIndentString(int indent, int tabDist, bool allowTabs, int *nChars);
 	String shiftLineLeft(const char_type *line, int lineLen, int tabDist, int nChars);
 	String shiftLineRight(const char_type *line, int lineLen, bool tabsAllowed, int tabDist, int nChars);
-	String wrapText(const char_type *startLine, const char_type *text, int bufOffset, int wrapMargin, int *breakBefore);
-	UndoTypes determineUndoType(int nInserted, int nDeleted);
-	bool GetSimpleSelection(TextBuffer *buf, int *left, int *right);
+	String wrapText(const char_type *startLine, const char_type *text, pos_type bufOffset, int wrapMargin, int *breakBefore);
+	UndoTypes determineUndoType(pos_type nInserted, pos_type nDeleted);
+	UndoTypes narrowReplacement(pos_type *pos, pos_type *nInserted, pos_type *nDeleted, const char_type **deletedText, std::vector<char_type> *deltas);
+	bool GetSimpleSelection(TextBuffer *buf, pos_type *left, pos_type *right);
 	bool TextDMoveDown(bool absolute);
 	bool TextDMoveLeft();
 	bool TextDMoveRight();
 	bool TextDMoveUp(bool absolute);
-	bool TextDPosToLineAndCol(int pos, int *lineNum, int *column);
-	bool TextDPositionToXY(int pos, int *x, int *y);
-	bool TextPosToLineAndCol(int pos, int *lineNum, int *column);
+	bool TextDPosToLineAndCol(pos_type pos, int *lineNum, int *column);
+	bool TextDPositionToXY(pos_type pos, int *x, int *y);
+	bool TextPosToLineAndCol(pos_type pos, int *lineNum, int *column);
 	bool WriteBackupFile();
 	bool checkReadOnly();
 	bool clickTracker(QMouseEvent *event, bool inDoubleClickHandler);
 	bool deleteEmulatedTab();
 	bool deletePendingSelection();
 	bool emptyLinesVisible();
-	bool findMatchingChar(char_type toMatch, void *styleToMatch, int charPos, int startLimit, int endLimit, int *matchPos);
+	bool findMatchingChar(char_type toMatch, void *styleToMatch, pos_type charPos, pos_type startLimit, pos_type endLimit, pos_type *matchPos);
 	bool maintainingAbsTopLineNum();
 	bool pendingSelection();
-	bool posToVisibleLineNum(int pos, int *lineNum);
-	bool spanBackward(TextBuffer *buf, int startPos, const char_type *searchChars, bool ignoreSpace, int *foundPos);
-	bool spanForward(TextBuffer *buf, int startPos, const char_type *searchChars, bool ignoreSpace, int *foundPos);
+	bool posToVisibleLineNum(pos_type pos, int *lineNum);
+	bool spanBackward(TextBuffer *buf, pos_type startPos, const char_type *searchChars, bool ignoreSpace, pos_type *foundPos);
+	bool spanForward(TextBuffer *buf, pos_type startPos, const char_type *searchChars, bool ignoreSpace, pos_type *foundPos);
 	bool updateHScrollBarRange();
-	bool wrapLine(TextBuffer *buf, int bufOffset, int lineStartPos, int lineEndPos, int limitPos, int *breakAt, int *charsAdded);
-	bool wrapUsesCharacter(int lineEndPos);
-	int TextDCountBackwardNLines(int startPos, int nLines);
-	int TextDCountForwardNLines(int startPos, unsigned nLines, bool startPosIsLineStart);
-	int TextDCountLines(int startPos, int endPos, bool startPosIsLineStart);
-	int TextDEndOfLine(int pos, bool startPosIsLineStart);
-	int TextDGetInsertPosition() const;
+	bool wrapLine(TextBuffer *buf, pos_type bufOffset, pos_type lineStartPos, pos_type lineEndPos, pos_type limitPos, pos_type *breakAt, int *charsAdded);
+	bool wrapUsesCharacter(pos_type lineEndPos);
+	pos_type TextDCountBackwardNLines(pos_type startPos, int nLines);
+	pos_type TextDCountForwardNLines(pos_type startPos, unsigned nLines, bool startPosIsLineStart);
+	int TextDCountLines(pos_type startPos, pos_type endPos, bool startPosIsLineStart);
+	pos_type TextDEndOfLine(pos_type pos, bool startPosIsLineStart);
+	pos_type TextDGetInsertPosition() const;
 	int TextDOffsetWrappedColumn(int row, int column);
-	int TextDPosOfPreferredCol(int column, int lineStartPos);
-	int TextDPreferredColumn(int *visLineNum, int *lineStartPos);
-	int TextDStartOfLine(int pos);
-	int TextDXYToPosition(int x, int y);
+	pos_type TextDPosOfPreferredCol(int column, pos_type lineStartPos);
+	int TextDPreferredColumn(int *visLineNum, pos_type *lineStartPos);
+	pos_type TextDStartOfLine(pos_type pos);
+	pos_type TextDXYToPosition(int x, int y);
 	int TextFirstVisibleLine();
-	int TextFirstVisiblePos();
-	int TextGetCursorPos();
-	int TextLastVisiblePos();
+	pos_type TextFirstVisiblePos();
+	pos_type TextGetCursorPos();
+	pos_type TextLastVisiblePos();
 	int TextNumVisibleLines();
-	int TextPosToXY(int pos, int *x, int *y);
+	int TextPosToXY(pos_type pos, int *x, int *y);
 	int TextVisibleWidth();
 	int atTabStop(int pos, int tabDist);
-	int endOfWord(int pos);
+	pos_type endOfWord(pos_type pos);
 	int findLeftMargin(char_type *text, int length, int tabDist);
-	int findParagraphEnd(TextBuffer *buf, int startPos);
-	int findParagraphStart(TextBuffer *buf, int startPos);
-	int measurePropChar(char_type c, int colNum, int pos);
+	pos_type findParagraphEnd(TextBuffer *buf, pos_type startPos);
+	pos_type findParagraphStart(TextBuffer *buf, pos_type startPos);
+	int measurePropChar(char_type c, int colNum, pos_type pos);
 	int measureVisLine(int visLineNum);
 	int nextTab(int pos, int tabDist);
-	int startOfWord(int pos);
+	pos_type startOfWord(pos_type pos);
 	int stringWidth(const char_type *string, const int length, const int style);
-	int styleOfPos(int lineStartPos, int lineLen, int lineIndex, int dispIndex, char_type thisChar);
+	int styleOfPos(pos_type lineStartPos, int lineLen, int lineIndex, int dispIndex, char_type thisChar);
 	int updateLineNumDisp();
 	int visLineLength(int visLineNum);
-	int xyToPos(int x, int y, PositionTypes posType);
+	pos_type xyToPos(int x, int y, PositionTypes posType);
+	QColor rangesetColor(int style) const;
 	void CancelBlockDrag();
 	void CheckForChangesToFile();
 	void ClearRedoList();
@@ -191,7 +199,7 @@ private:
 	void MovePrimarySelection(PasteMode pasteMode);
 	void Redo();
 	void RemoveBackupFile();
-	void SaveUndoInformation(int pos, int nInserted, int nDeleted, const char_type *deletedText);
+	void SaveUndoInformation(pos_type pos, pos_type nInserted, pos_type nDeleted, const char_type *deletedText);
 	void SelectToMatchingCharacter();
 	void SendSecondarySelection(bool removeAfter);
 	void SetWindowModified(bool modified);
@@ -206,23 +214,23 @@ private:
 	void TextDMakeInsertPosVisible();
 	void TextDOverstrike(const char_type *text);
 	void TextDRedisplayRect(int left, int top, int width, int height);
-	void TextDSetInsertPosition(int newPos);
+	void TextDSetInsertPosition(pos_type newPos);
 	void TextDSetScroll(int topLineNum, int horizOffset);
 	void TextDUnblankCursor();
 	void TextDXYToUnconstrainedPosition(int x, int y, int *row, int *column);
 	void TextGetScroll(int *topLineNum, int *horizOffset);
 	void TextInsertAtCursor(const char_type *chars, bool allowPendingDelete, bool allowWrap);
 	void TextPasteClipboard();
-	void TextSetCursorPos(int pos);
+	void TextSetCursorPos(pos_type pos);
 	void TextSetScroll(int topLineNum, int horizOffset);
 	void Undo();
-	void UpdateMarkTable(int pos, int nInserted, int nDeleted);
+	void UpdateMarkTable(pos_type pos, pos_type nInserted, pos_type nDeleted);
 	void UpdateStatsLine();
-	void addRedoItem(UndoInfo *redo);
-	void addUndoItem(UndoInfo *undo);
+	void addRedoItem(const UndoInfo &redo, const char_type *oldText);
+	void addUndoItem(const UndoInfo &undo, const char_type *oldText);
 	void adjustSecondarySelection(int x, int y);
 	void adjustSelection(int x, int y);
-	void appendDeletedText(const char_type *deletedText, int deletedLen, int direction);
+	void appendDeletedText(const char_type *deletedText, pos_type deletedLen, int direction);
 	void backwardCharacterAP(MoveMode mode);
 	void backwardParagraphAP(MoveMode mode);
 	void backwardWordAP(MoveMode mode);
@@ -233,8 +241,10 @@ private:
 	void calcLineStarts(int startLine, int endLine);
 	void cancelDrag();
 	void checkAutoScroll(int x, int y);
+	void checkMemoryLimit();
+	void scrollToEnd();
 	void checkAutoShowInsertPos();
-	void checkMoveSelectionChange(int startPos, MoveMode mode);
+	void checkMoveSelectionChange(pos_type startPos, MoveMode mode);
 	void copyClipboardAP();
 	void cutClipboardAP();
 	void deleteNextCharacterAP();
@@ -247,23 +257,23 @@ private:
 	void drawCursor(QPainter *painter, int x, int y);
 	void drawString(QPainter *painter, int style, int x, int y, int toX, char_type *string, int nChars);
 	void emitCursorMoved();
-	void emitUnfinishedHighlightEncountered(int pos);
+	void emitUnfinishedHighlightEncountered(pos_type pos);
 	void endDrag();
 	void endDragAP();
 	void endOfFileAP(MoveMode mode);
 	void endOfLineAP(MoveMode mode);
 	void extendAdjustAP(QMouseEvent *event);
-	void extendRangeForStyleMods(int *start, int *end);
-	void findLineEnd(int startPos, bool startPosIsLineStart, int *lineEnd, int *nextLineStart);
-	void findWrapRange(const char_type *deletedText, int pos, int nInserted, int nDeleted, int *modRangeStart, int *modRangeEnd, int *linesInserted, int *linesDeleted);
+	void extendRangeForStyleMods(pos_type *start, pos_type *end);
+	void findLineEnd(pos_type startPos, bool startPosIsLineStart, pos_type *lineEnd, pos_type *nextLineStart);
+	void findWrapRange(const char_type *deletedText, pos_type pos, pos_type nInserted, pos_type nDeleted, pos_type *modRangeStart, pos_type *modRangeEnd, int *linesInserted, int *linesDeleted);
 	void forwardCharacterAP(MoveMode mode);
 	void forwardParagraphAP(MoveMode mode);
 	void forwardWordAP(MoveMode mode);
-	void freeUndoRecord(UndoInfo *undo);
 	void hideOrShowHScrollBar();
-	void keyMoveExtendSelection(int origPos, bool rectangular);
-	void measureDeletedLines(int pos, int nDeleted);
-	void modifiedCB(int pos, int nInserted, int nDeleted, int nRestyled, const char_type *deletedText);
+	void journalModification(pos_type pos, pos_type nInserted, pos_type nDeleted);
+	void keyMoveExtendSelection(pos_type origPos, bool rectangular);
+	void measureDeletedLines(pos_type pos, pos_type nDeleted);
+	void modifiedCB(pos_type pos, pos_type nInserted, pos_type nDeleted, pos_type nRestyled, const char_type *deletedText);
 	void moveDestinationAP(QMouseEvent *event);
 	void moveToAP(QMouseEvent *event);
 	void moveToOrEndDragAP(QMouseEvent *event);
@@ -271,7 +281,7 @@ private:
 	void newlineAndIndentAP();
 	void newlineNoIndentAP();
 	void nextPageAP(MoveMode mode);
-	void offsetAbsLineNum(int oldFirstChar);
+	void offsetAbsLineNum(pos_type oldFirstChar);
 	void offsetLineStarts(int newTopLineNum);
 	void pasteClipboardAP(PasteMode pasteMode);
 	void previousPageAP(MoveMode mode);
@@ -283,20 +293,22 @@ private:
 	void removeRedoItem();
 	void removeUndoItem();
 	void resetAbsLineNum();
+	void restoreUndoText(const UndoInfo &undo, const std::vector<char_type> &oldText, pos_type *start, pos_type *end);
 	void ringIfNecessary(bool silent);
 	void secondaryAdjustAP(QMouseEvent *event);
 	void selectAllAP();
 	void selectLine();
 	void selectWord(int pointerX);
 	void setScroll(int topLineNum, int horizOffset, bool updateVScrollBar, bool updateHScrollBar);
-	void shiftRect(ShiftDirection direction, bool byTab, int selStart, int selEnd, int rectStart, int rectEnd);
+	void shiftRect(ShiftDirection direction, bool byTab, pos_type selStart, pos_type selEnd, int rectStart, int rectEnd);
 	void simpleInsertAtCursor(const char_type *chars, bool allowPendingDelete);
-	void textDRedisplayRange(int start, int end);
+	void textDRedisplayRange(pos_type start, pos_type end);
+	void trimHistory();
 	void trimUndoList(int maxLength);
 	void undoAP();
-	void updateLineStarts(int pos, int charsInserted, int charsDeleted, int linesInserted, int linesDeleted, bool *scrolled);
+	void updateLineStarts(pos_type pos, pos_type charsInserted, pos_type charsDeleted, int linesInserted, int linesDeleted, bool *scrolled);
 	void updateVScrollBarRange();
-	void wrappedLineCounter(const TextBuffer *buf, int startPos, int maxPos, int maxLines, bool startPosIsLineStart, int styleBufOffset, int *retPos, int *retLines, int *retLineStart, int *retLineEnd);
+	void wrappedLineCounter(const TextBuffer *buf, pos_type startPos, pos_type maxPos, int maxLines, bool startPosIsLineStart, pos_type styleBufOffset, pos_type *retPos, int *retLines, pos_type *retLineStart, pos_type *retLineEnd);
 	void xyToUnconstrainedPos(int x, int y, int *row, int *column, PositionTypes posType);
     int getAbsTopLineNum();
     void redrawLineNumbers(QPainter *painter, bool clearAll);
@@ -305,17 +317,18 @@ private Q_SLOTS:
 	void clickTimeout();
 	void autoScrollTimeout();
 	void cursorTimeout();
+	void memoryTimeout();
 
 private:
 	bool matchSyntaxBased_;
 	TextBuffer *buffer_;
-	int cursorPos_;
+	pos_type cursorPos_;
 	int left_;
     int lineNumLeft_;
 	int top_;
-	QVector<int> lineStarts_;
-	int firstChar_;
-	int lastChar_;
+	QVector<pos_type> lineStarts_;
+	pos_type firstChar_;
+	pos_type lastChar_;
 	bool continuousWrap_;
 	char_type unfinishedStyle_;
 	int cursorX_;
@@ -330,7 +343,7 @@ private:
 	bool needAbsTopLineNum_;
 	int lineNumWidth_;
 	bool pendingDelete_;
-	int cursorToHint_;
+	pos_type cursorToHint_;
 	bool autoShowInsertPos_;
 	int cursorVPadding_;
 	int horizOffset_;
@@ -340,7 +353,7 @@ private:
 	int emulateTabs_;
 	int emTabsBeforeCursor_;
 	bool autoWrapPastedText_;
-	int anchor_;
+	pos_type anchor_;
 	int rectAnchor_;
 	bool autoWrap_;
 	int overstrike_;
@@ -355,22 +368,26 @@ private:
 	int mouseX_;
 	int mouseY_;
 	bool modifyingTabDist_;
-	UndoInfo *undo_;
-	UndoInfo *redo_;
+	UndoList undo_;
+	UndoList redo_;
+	UndoJournal journal_; /* record of changes since the text was saved, for recovery */
 	bool undoModifiesSelection_;
-	int undoOpCount_; /* count of stored undo operations */
-	int undoMemUsed_; /* amount of memory (in bytes) dedicated to the undo list */
 	bool ignoreModify_;
 	bool autoSave_;
 	bool wasSelected_;
 	int autoSaveCharCount_;
 	int autoSaveOpCount_;
 	bool fileChanged_;
+	size_t memoryLimit_; /* soft limit on memoryUsage().total, 0 for none */
+	bool followMode_; /* keep the end of the text in view as text is appended */
+	pos_type historyLimit_; /* most text kept as text is appended, 0 for no limit */
+	mutable RangesetColor rangesetColors_[N_RANGESETS + 1]; /* by rangeset index, see rangesetColor */
 
 private:
 	QTimer *cursorTimer_;
 	QTimer *clickTimer_;
 	QTimer *autoScrollTimer_;
+	QTimer *memoryTimer_;
 	int clickCount_;
 	QPoint clickPos_;
 	QList<IHighlightHandler *> highlightHandlers_;
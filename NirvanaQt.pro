@@ -22,6 +22,13 @@ linux-g++ {
 HEADERS += \
     NirvanaQt.h   \
     TextBuffer.h \
+    PieceTable.h \
+    MarkerStore.h \
+    LzCompress.h \
+    Rangeset.h \
+    UndoList.h \
+    UndoJournal.h \
+    TextScan.h \
     Selection.h     \
     ICursorMoveHandler.h \
     IHighlightHandler.h \
@@ -39,6 +46,13 @@ SOURCES += \
     main.cpp          \
     NirvanaQt.cpp   \
     TextBuffer.cpp \
+    PieceTable.cpp \
+    MarkerStore.cpp \
+    LzCompress.cpp \
+    Rangeset.cpp \
+    UndoList.cpp \
+    UndoJournal.cpp \
+    TextScan.cpp \
     Selection.cpp \
     SyntaxHighlighter.cpp \
     X11Colors.cpp \
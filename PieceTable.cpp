@@ -0,0 +1,504 @@
+
+#include "PieceTable.h"
+#include "TextScan.h"
+#include <algorithm>
+#include <cassert>
+
+/* Size of the blocks inserted text is appended to.  Inserts which don't fit
+ * in the current block start a new one (of at least this size) */
+#define ADD_BLOCK_SIZE 65536
+
+/* Longest piece ever created.  Splitting a piece requires counting the
+ * newlines in one of the halves, so this bounds the cost of an edit */
+#define MAX_PIECE_LENGTH 4096
+
+struct PieceTable::Node {
+	NodePtr left;
+	NodePtr right;
+	Piece piece;
+	pos_type totalLength;     // characters in this subtree
+	pos_type totalLines;      // newlines in this subtree
+	pos_type totalCodePoints; // UTF-8 characters in this subtree
+	unsigned priority;   // treap priority, never smaller than that of either child
+};
+
+namespace {
+
+template <class Ptr>
+pos_type totalLength(const Ptr &node) {
+	return node ? node->totalLength : 0;
+}
+
+template <class Ptr>
+pos_type totalLines(const Ptr &node) {
+	return node ? node->totalLines : 0;
+}
+
+template <class Ptr>
+pos_type totalCodePoints(const Ptr &node) {
+	return node ? node->totalCodePoints : 0;
+}
+
+template <class Ptr>
+size_t countNodes(const Ptr &node) {
+	return node ? 1 + countNodes(node->left) + countNodes(node->right) : 0;
+}
+
+}
+
+/*
+** Create an empty piece table
+*/
+PieceTable::PieceTable() : addSize_(0), addUsed_(0), seed_(0x9e3779b9) {
+}
+
+/*
+** Create a piece table holding a copy of "text"
+*/
+PieceTable::PieceTable(const char_type *text, pos_type length) : PieceTable() {
+	insert(0, text, length);
+}
+
+/*
+** Create a piece table directly over the "length" characters of "block",
+** which must never be modified afterwards.  The block is shared, not copied.
+*/
+PieceTable::PieceTable(const std::shared_ptr<const char_type> &block, pos_type length) : PieceTable() {
+	std::vector<Piece> pieces;
+	appendPieces(block, block.get(), length, &pieces);
+	root_ = build(pieces, 0, static_cast<int>(pieces.size()));
+}
+
+/*
+** Copies share the whole tree and all of the text blocks (there is no need
+** to copy them as neither ever changes), but not the unused part of the add
+** block, so that both may be edited independently.
+*/
+PieceTable::PieceTable(const PieceTable &other) : root_(other.root_), addSize_(0), addUsed_(0), seed_(other.seed_) {
+}
+
+PieceTable &PieceTable::operator=(const PieceTable &rhs) {
+	root_ = rhs.root_;
+	addBlock_ = nullptr;
+	addSize_ = 0;
+	addUsed_ = 0;
+	return *this;
+}
+
+/*
+** Return the number of characters in the table
+*/
+pos_type PieceTable::length() const {
+	return totalLength(root_);
+}
+
+/*
+** Return the number of newlines in the table
+*/
+pos_type PieceTable::lineCount() const {
+	return totalLines(root_);
+}
+
+/*
+** Return the character at position "pos", which must be inside the text
+*/
+char_type PieceTable::at(pos_type pos) const {
+	const Node *node = find(&pos);
+	return node->piece.text[pos];
+}
+
+/*
+** Return a pointer to the text starting at position "pos" and, in
+** "spanLength", how many characters can be read from it contiguously (at
+** least one, unless "pos" is the end of the text, which returns nullptr)
+*/
+const char_type *PieceTable::span(pos_type pos, pos_type *spanLength) const {
+	if (pos < 0 || pos >= length()) {
+		*spanLength = 0;
+		return nullptr;
+	}
+
+	const Node *node = find(&pos);
+	*spanLength = node->piece.length - pos;
+	return node->piece.text + pos;
+}
+
+/*
+** Like span(), but for the contiguous text ending just before position
+** "pos".  The returned pointer is to the start of the span, so the character
+** at "pos" - 1 is at index "spanLength" - 1.
+*/
+const char_type *PieceTable::spanBefore(pos_type pos, pos_type *spanLength) const {
+	if (pos <= 0 || pos > length()) {
+		*spanLength = 0;
+		return nullptr;
+	}
+
+	pos--;
+	const Node *node = find(&pos);
+	*spanLength = pos + 1;
+	return node->piece.text;
+}
+
+/*
+** Return the number of newlines before position "pos"
+*/
+pos_type PieceTable::countLines(pos_type pos) const {
+	pos_type lineCount = 0;
+	const Node *node = root_.get();
+
+	while (node) {
+		const pos_type leftLength = totalLength(node->left);
+
+		if (pos < leftLength) {
+			node = node->left.get();
+		} else if (pos < leftLength + node->piece.length) {
+			return lineCount + totalLines(node->left) + countNewlines(node->piece.text, pos - leftLength);
+		} else {
+			pos -= leftLength + node->piece.length;
+			lineCount += totalLines(node->left) + node->piece.lines;
+			node = node->right.get();
+		}
+	}
+
+	return lineCount;
+}
+
+/*
+** Return the position of the first character after the "nLines"th newline
+** of the text.  There must be at least "nLines" (>= 1) newlines.
+*/
+pos_type PieceTable::findLine(pos_type nLines) const {
+	pos_type pos = 0;
+	const Node *node = root_.get();
+
+	while (node) {
+		const pos_type leftLines = totalLines(node->left);
+
+		if (nLines <= leftLines) {
+			node = node->left.get();
+		} else if (nLines <= leftLines + node->piece.lines) {
+			nLines -= leftLines;
+			pos += totalLength(node->left);
+
+			for (int i = 0; i < node->piece.length; i++) {
+				if (node->piece.text[i] == '\n' && --nLines == 0) {
+					return pos + i + 1;
+				}
+			}
+			break;
+		} else {
+			nLines -= leftLines + node->piece.lines;
+			pos += totalLength(node->left) + node->piece.length;
+			node = node->right.get();
+		}
+	}
+
+	assert(!"Internal consistency check ptline1 failed");
+	return length();
+}
+
+/*
+** Return the number of UTF-8 characters (see countCodePoints) before
+** position "pos"
+*/
+pos_type PieceTable::codePointIndex(pos_type pos) const {
+	pos_type index = 0;
+	const Node *node = root_.get();
+
+	while (node) {
+		const pos_type leftLength = totalLength(node->left);
+
+		if (pos < leftLength) {
+			node = node->left.get();
+		} else if (pos < leftLength + node->piece.length) {
+			return index + totalCodePoints(node->left) + countCodePoints(node->piece.text, pos - leftLength);
+		} else {
+			pos -= leftLength + node->piece.length;
+			index += totalCodePoints(node->left) + node->piece.codePoints;
+			node = node->right.get();
+		}
+	}
+
+	return index;
+}
+
+/*
+** Return the position of UTF-8 character number "index" (counting from 0) of
+** the text, which must have more than "index" characters
+*/
+pos_type PieceTable::findCodePoint(pos_type index) const {
+	pos_type pos = 0;
+	const Node *node = root_.get();
+
+	while (node) {
+		const pos_type leftCodePoints = totalCodePoints(node->left);
+
+		if (index < leftCodePoints) {
+			node = node->left.get();
+		} else if (index < leftCodePoints + node->piece.codePoints) {
+			index -= leftCodePoints;
+			pos += totalLength(node->left);
+
+			for (int i = 0; i < node->piece.length; i++) {
+				if (!isUtf8Continuation(node->piece.text[i]) && index-- == 0) {
+					return pos + i;
+				}
+			}
+			break;
+		} else {
+			index -= leftCodePoints + node->piece.codePoints;
+			pos += totalLength(node->left) + node->piece.length;
+			node = node->right.get();
+		}
+	}
+
+	assert(!"Internal consistency check ptcode1 failed");
+	return length();
+}
+
+/*
+** Copy the text between "start" and "end" to "outStr" (which is not
+** null-terminated)
+*/
+void PieceTable::copy(pos_type start, pos_type end, char_type *outStr) const {
+	while (start < end) {
+		pos_type spanLength;
+		const char_type *text = span(start, &spanLength);
+		spanLength = std::min(spanLength, end - start);
+		outStr = std::copy_n(text, spanLength, outStr);
+		start += spanLength;
+	}
+}
+
+/*
+** Insert "length" characters of "text" at position "pos"
+*/
+void PieceTable::insert(pos_type pos, const char_type *text, pos_type length) {
+	if (length <= 0) {
+		return;
+	}
+
+	NodePtr left;
+	NodePtr right;
+	split(root_, pos, &left, &right);
+
+	/* Text typed character by character ends up contiguous in the add block,
+	   so grow the piece just before it instead of piling up new ones */
+	const Node *last = left.get();
+	while (last && last->right) {
+		last = last->right.get();
+	}
+
+	if (last && addBlock_ && last->piece.text + last->piece.length == addBlock_.get() + addUsed_ &&
+	    length <= addSize_ - addUsed_ && last->piece.length + length <= MAX_PIECE_LENGTH) {
+
+		std::copy_n(text, length, addBlock_.get() + addUsed_);
+		addUsed_ += length;
+		const int extra = static_cast<int>(length);
+		root_ = merge(extendLast(left, extra, static_cast<int>(countNewlines(text, extra)), static_cast<int>(countCodePoints(text, extra))), right);
+		return;
+	}
+
+	/* Otherwise, copy the text into the add block (starting a new one if it
+	   doesn't fit) and make new pieces for it */
+	if (!addBlock_ || length > addSize_ - addUsed_) {
+		addSize_ = std::max<pos_type>(length, ADD_BLOCK_SIZE);
+		addBlock_ = std::shared_ptr<char_type>(new char_type[addSize_], std::default_delete<char_type[]>());
+		addUsed_ = 0;
+	}
+
+	char_type *const addText = addBlock_.get() + addUsed_;
+	std::copy_n(text, length, addText);
+	addUsed_ += length;
+
+	std::vector<Piece> pieces;
+	appendPieces(addBlock_, addText, length, &pieces);
+	root_ = merge(merge(left, build(pieces, 0, static_cast<int>(pieces.size()))), right);
+}
+
+/*
+** Remove the text between "start" and "end"
+*/
+void PieceTable::remove(pos_type start, pos_type end) {
+	NodePtr left;
+	NodePtr rest;
+	NodePtr removed;
+	NodePtr right;
+
+	split(root_, start, &left, &rest);
+	split(rest, end - start, &removed, &right);
+	root_ = merge(left, right);
+}
+
+/*
+** Break "length" characters of "text", which lives in "block", into pieces
+** of at most MAX_PIECE_LENGTH characters and append them to "pieces"
+*/
+void PieceTable::appendPieces(const std::shared_ptr<const char_type> &block, const char_type *text, pos_type length, std::vector<Piece> *pieces) {
+	while (length > 0) {
+		const int pieceLength = static_cast<int>(std::min<pos_type>(length, MAX_PIECE_LENGTH));
+		pieces->push_back(Piece{block, text, pieceLength, static_cast<int>(countNewlines(text, pieceLength)), static_cast<int>(countCodePoints(text, pieceLength))});
+		text += pieceLength;
+		length -= pieceLength;
+	}
+}
+
+/*
+** Build a balanced tree from pieces "first" to "last" (exclusive)
+*/
+PieceTable::NodePtr PieceTable::build(const std::vector<Piece> &pieces, int first, int last) {
+	if (first >= last) {
+		return nullptr;
+	}
+
+	const int middle = first + (last - first) / 2;
+	NodePtr left = build(pieces, first, middle);
+	NodePtr right = build(pieces, middle + 1, last);
+
+	unsigned priority = nextPriority();
+	priority = std::max(priority, left ? left->priority : 0);
+	priority = std::max(priority, right ? right->priority : 0);
+
+	return makeNode(left, right, pieces[middle], priority);
+}
+
+/*
+** Return a copy of the subtree "node" with its last piece "length"
+** characters (of which "lines" are newlines, and which hold "codePoints"
+** UTF-8 characters) longer
+*/
+PieceTable::NodePtr PieceTable::extendLast(const NodePtr &node, int length, int lines, int codePoints) {
+	if (node->right) {
+		return makeNode(node->left, extendLast(node->right, length, lines, codePoints), node->piece, node->priority);
+	}
+
+	Piece piece = node->piece;
+	piece.length += length;
+	piece.lines += lines;
+	piece.codePoints += codePoints;
+	return makeNode(node->left, nullptr, piece, node->priority);
+}
+
+/*
+** Create a tree node, calculating its subtree totals
+*/
+PieceTable::NodePtr PieceTable::makeNode(const NodePtr &left, const NodePtr &right, const Piece &piece, unsigned priority) const {
+	auto node = std::make_shared<Node>();
+	node->left = left;
+	node->right = right;
+	node->piece = piece;
+	node->totalLength = totalLength(left) + piece.length + totalLength(right);
+	node->totalLines = totalLines(left) + piece.lines + totalLines(right);
+	node->totalCodePoints = totalCodePoints(left) + piece.codePoints + totalCodePoints(right);
+	node->priority = priority;
+	return node;
+}
+
+/*
+** Concatenate two trees
+*/
+PieceTable::NodePtr PieceTable::merge(const NodePtr &left, const NodePtr &right) {
+	if (!left) {
+		return right;
+	}
+
+	if (!right) {
+		return left;
+	}
+
+	if (left->priority > right->priority) {
+		return makeNode(left->left, merge(left->right, right), left->piece, left->priority);
+	} else {
+		return makeNode(merge(left, right->left), right->right, right->piece, right->priority);
+	}
+}
+
+/*
+** Split tree "node" into the text before position "pos" ("left") and the
+** rest ("right").  A piece straddling "pos" is split in two.
+*/
+void PieceTable::split(const NodePtr &node, pos_type pos, NodePtr *left, NodePtr *right) {
+	if (!node) {
+		*left = nullptr;
+		*right = nullptr;
+		return;
+	}
+
+	const pos_type leftLength = totalLength(node->left);
+
+	if (pos <= leftLength) {
+		NodePtr subtree;
+		split(node->left, pos, left, &subtree);
+		*right = makeNode(subtree, node->right, node->piece, node->priority);
+	} else if (pos >= leftLength + node->piece.length) {
+		NodePtr subtree;
+		split(node->right, pos - leftLength - node->piece.length, &subtree, right);
+		*left = makeNode(node->left, subtree, node->piece, node->priority);
+	} else {
+		const int offset = static_cast<int>(pos - leftLength);
+
+		Piece head = node->piece;
+		head.length = offset;
+		head.lines = static_cast<int>(countNewlines(head.text, offset));
+		head.codePoints = static_cast<int>(countCodePoints(head.text, offset));
+
+		Piece tail = node->piece;
+		tail.text += offset;
+		tail.length -= offset;
+		tail.lines -= head.lines;
+		tail.codePoints -= head.codePoints;
+
+		/* the head takes the place of the original piece, the tail becomes a
+		   new node (so that repeatedly splitting a piece doesn't leave a chain
+		   of nodes with the same priority) */
+		*left = makeNode(node->left, nullptr, head, node->priority);
+		*right = merge(makeNode(nullptr, nullptr, tail, nextPriority()), node->right);
+	}
+}
+
+/*
+** Find the node holding position "pos", and change "pos" to be relative to
+** the start of its piece
+*/
+const PieceTable::Node *PieceTable::find(pos_type *pos) const {
+	const Node *node = root_.get();
+
+	while (node) {
+		const pos_type leftLength = totalLength(node->left);
+
+		if (*pos < leftLength) {
+			node = node->left.get();
+		} else if (*pos < leftLength + node->piece.length) {
+			*pos -= leftLength;
+			return node;
+		} else {
+			*pos -= leftLength + node->piece.length;
+			node = node->right.get();
+		}
+	}
+
+	assert(!"Internal consistency check ptfind1 failed");
+	return nullptr;
+}
+
+/*
+** Find the memory used by the tree ("nodeBytes", which takes O(n) to count)
+** and the room left in the current add block ("spareBytes").  The blocks
+** themselves hold the text, along with any deleted text still referenced by
+** the undo history or snapshots.
+*/
+void PieceTable::memoryUsage(size_t *nodeBytes, size_t *spareBytes) const {
+	*nodeBytes = countNodes(root_) * sizeof(Node);
+	*spareBytes = static_cast<size_t>(addSize_ - addUsed_);
+}
+
+/*
+** Return a pseudo-random treap priority (xorshift)
+*/
+unsigned PieceTable::nextPriority() {
+	seed_ ^= seed_ << 13;
+	seed_ ^= seed_ >> 17;
+	seed_ ^= seed_ << 5;
+	return seed_;
+}
@@ -0,0 +1,72 @@
+
+#ifndef PIECE_TABLE_H_
+#define PIECE_TABLE_H_
+
+#include "Types.h"
+#include <memory>
+#include <vector>
+
+/* Alternative text storage for TextBuffer.  The text is a sequence of
+   "pieces", each referring to a span of an immutable block of characters:
+   either the original text or one of the append-only "add" blocks where
+   inserted text is written.  The pieces are kept in a balanced (treap) tree
+   holding the length, newline count and UTF-8 character count of each
+   subtree, so that edits,
+   character access and line queries are all O(log n) no matter where in the
+   text they happen.  Nodes are never modified once built, which makes
+   copying a PieceTable an O(1) operation. */
+class PieceTable {
+public:
+	PieceTable();
+	PieceTable(const char_type *text, pos_type length);
+	PieceTable(const std::shared_ptr<const char_type> &block, pos_type length);
+	PieceTable(const PieceTable &other);
+	PieceTable &operator=(const PieceTable &rhs);
+
+public:
+	char_type at(pos_type pos) const;
+	const char_type *span(pos_type pos, pos_type *spanLength) const;
+	const char_type *spanBefore(pos_type pos, pos_type *spanLength) const;
+	pos_type codePointIndex(pos_type pos) const;
+	pos_type countLines(pos_type pos) const;
+	pos_type findCodePoint(pos_type index) const;
+	pos_type findLine(pos_type nLines) const;
+	pos_type length() const;
+	pos_type lineCount() const;
+	void copy(pos_type start, pos_type end, char_type *outStr) const;
+	void memoryUsage(size_t *nodeBytes, size_t *spareBytes) const;
+	void insert(pos_type pos, const char_type *text, pos_type length);
+	void remove(pos_type start, pos_type end);
+
+private:
+	struct Node;
+	typedef std::shared_ptr<const Node> NodePtr;
+
+	struct Piece {
+		std::shared_ptr<const char_type> block; // keeps the characters alive
+		const char_type *text;
+		int length;
+		int lines;                              // newlines in the piece
+		int codePoints;                         // UTF-8 characters in the piece
+	};
+
+private:
+	NodePtr build(const std::vector<Piece> &pieces, int first, int last);
+	NodePtr extendLast(const NodePtr &node, int length, int lines, int codePoints);
+	NodePtr makeNode(const NodePtr &left, const NodePtr &right, const Piece &piece, unsigned priority) const;
+	NodePtr merge(const NodePtr &left, const NodePtr &right);
+	const Node *find(pos_type *pos) const;
+	unsigned nextPriority();
+	void appendPieces(const std::shared_ptr<const char_type> &block, const char_type *text, pos_type length, std::vector<Piece> *pieces);
+	void split(const NodePtr &node, pos_type pos, NodePtr *left, NodePtr *right);
+
+private:
+	NodePtr root_;
+	std::shared_ptr<char_type> addBlock_; // block new text is appended to (never shared
+	                                      // between copies, so each may write to its own)
+	pos_type addSize_;                    // allocated size of addBlock_
+	pos_type addUsed_;                    // characters of addBlock_ already handed out to pieces
+	unsigned seed_;                       // state of the treap priority generator
+};
+
+#endif
@@ -0,0 +1,380 @@
+
+#include "Rangeset.h"
+#include "TextBuffer.h"
+#include <algorithm>
+
+/* How far includes() walks forward from the last position looked up before
+   falling back on a binary search */
+#define CURSOR_STEPS 4
+
+/*
+** Create an empty rangeset of the text of "buffer"
+*/
+Rangeset::Rangeset(TextBuffer *buffer) : buffer_(buffer), shift_(0), shiftFrom_(0), cursor_(0) {
+}
+
+/*
+** Return true if position "pos" is in one of the ranges.  Looking up
+** positions in order is fast: the search starts from the last one.
+*/
+bool Rangeset::includes(pos_type pos) const {
+
+	const int n = static_cast<int>(boundaries_.size());
+	int below = std::min(cursor_, n);
+
+	if (below > 0 && boundary(below - 1) > pos) {
+		below = countBelow(pos + 1);
+	} else {
+		for (int steps = 0; below < n && boundary(below) <= pos; steps++) {
+			if (steps == CURSOR_STEPS) {
+				below = countBelow(pos + 1);
+				break;
+			}
+			below++;
+		}
+	}
+
+	/* inside a range if an odd number of boundaries are at or before pos */
+	cursor_ = below;
+	return (below % 2) != 0;
+}
+
+/*
+** Get range number "index" (in order of position), returning false if there
+** is no such range
+*/
+bool Rangeset::range(int index, pos_type *start, pos_type *end) const {
+
+	if (index < 0 || index >= count()) {
+		return false;
+	}
+
+	*start = boundary(2 * index);
+	*end = boundary(2 * index + 1);
+	return true;
+}
+
+/*
+** Name of the color the ranges are drawn in, empty if they aren't drawn
+*/
+const std::string &Rangeset::color() const {
+	return color_;
+}
+
+void Rangeset::setColor(const std::string &color) {
+
+	color_ = color;
+
+	if (!boundaries_.empty()) {
+		buffer_->BufCheckDisplay(boundary(0), boundary(static_cast<int>(boundaries_.size()) - 1));
+	}
+}
+
+/*
+** Number of ranges in the set
+*/
+int Rangeset::count() const {
+	return static_cast<int>(boundaries_.size() / 2);
+}
+
+/*
+** Bytes used by the set
+*/
+size_t Rangeset::memoryUsage() const {
+	return sizeof(Rangeset) + boundaries_.capacity() * sizeof(pos_type) + color_.capacity();
+}
+
+/*
+** Add the text from "start" to "end" to the set, joining it with any ranges
+** it overlaps or touches
+*/
+void Rangeset::add(pos_type start, pos_type end) {
+
+	if (start >= end) {
+		return;
+	}
+
+	/* the boundaries from first to last are swallowed by the new range,
+	   whose own boundaries are only needed if they aren't in a range */
+	const int first = countBelow(start);
+	const int last = countBelow(end + 1);
+
+	pos_type newBoundaries[2];
+	int nNew = 0;
+
+	if (first % 2 == 0) {
+		newBoundaries[nNew++] = start;
+	}
+
+	if (last % 2 == 0) {
+		newBoundaries[nNew++] = end;
+	}
+
+	replaceBoundaries(first, last, newBoundaries, nNew);
+	redisplay(start, end);
+}
+
+/*
+** Take the text from "start" to "end" out of the set, cutting short or
+** splitting any ranges it overlaps
+*/
+void Rangeset::remove(pos_type start, pos_type end) {
+
+	if (start >= end) {
+		return;
+	}
+
+	/* as for add, but a range cut by either end of the text removed gets
+	   a new boundary there */
+	const int first = countBelow(start);
+	const int last = countBelow(end + 1);
+
+	pos_type newBoundaries[2];
+	int nNew = 0;
+
+	if (first % 2 != 0) {
+		newBoundaries[nNew++] = start;
+	}
+
+	if (last % 2 != 0) {
+		newBoundaries[nNew++] = end;
+	}
+
+	replaceBoundaries(first, last, newBoundaries, nNew);
+	redisplay(start, end);
+}
+
+/*
+** Remove all of the ranges
+*/
+void Rangeset::clear() {
+
+	if (!boundaries_.empty()) {
+		redisplay(boundary(0), boundary(static_cast<int>(boundaries_.size()) - 1));
+	}
+
+	boundaries_.clear();
+	shift_ = 0;
+	shiftFrom_ = 0;
+	cursor_ = 0;
+}
+
+/*
+** Update the ranges for the replacement of "nDeleted" characters at "pos"
+** with "nInserted" others.  Ranges after the change move with it, ranges
+** overlapping it shrink, and text inserted inside a range (but not at
+** either end of it) becomes part of it.
+*/
+void Rangeset::update(pos_type pos, pos_type nDeleted, pos_type nInserted) {
+
+	/* a replacement is a deletion followed by an insertion */
+	if (nDeleted != 0 && nInserted != 0) {
+		update(pos, nDeleted, 0);
+		update(pos, 0, nInserted);
+		return;
+	}
+
+	const int n = static_cast<int>(boundaries_.size());
+	int first = countBelow(pos);
+
+	/* the end of a range is left behind by text inserted right after it */
+	if (nDeleted == 0 && first < n && first % 2 != 0 && boundary(first) == pos) {
+		first++;
+	}
+
+	if (first == n) {
+		return;
+	}
+
+	/* boundaries in the deleted text collapse to its start, the rest move
+	   (lazily) by the change in length */
+	const int last = std::max(first, countBelow(pos + nDeleted));
+
+	moveShift(last);
+	std::fill(boundaries_.begin() + first, boundaries_.begin() + last, pos);
+	shift_ += nInserted - nDeleted;
+
+	/* then the boundaries now at pos either all go (an emptied range, or
+	   two ranges now touching) or, if there's an odd number, all but one */
+	int runEnd = last;
+	if (runEnd < n && boundary(runEnd) == pos) {
+		runEnd++;
+	}
+
+	const int keep = (runEnd - first) % 2;
+	if (runEnd - first > 1) {
+		boundaries_.erase(boundaries_.begin() + first + keep, boundaries_.begin() + runEnd);
+		shiftFrom_ = first + keep;
+	}
+}
+
+/*
+** Number of range boundaries before position "pos"
+*/
+int Rangeset::countBelow(pos_type pos) const {
+
+	int low = 0;
+	int high = static_cast<int>(boundaries_.size());
+
+	while (low < high) {
+		const int middle = low + (high - low) / 2;
+		if (boundary(middle) < pos) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+
+	return low;
+}
+
+/*
+** Position of boundary "index", with the pending shift applied
+*/
+pos_type Rangeset::boundary(int index) const {
+	return boundaries_[index] + (index >= shiftFrom_ ? shift_ : 0);
+}
+
+/*
+** Make the pending shift apply from boundary "index" on, like moving the
+** gap of a text buffer: only the boundaries in between are touched
+*/
+void Rangeset::moveShift(int index) {
+
+	if (shift_ != 0) {
+		for (int i = shiftFrom_; i < index; i++) {
+			boundaries_[i] += shift_;
+		}
+
+		for (int i = index; i < shiftFrom_; i++) {
+			boundaries_[i] -= shift_;
+		}
+	}
+
+	shiftFrom_ = index;
+
+	if (shiftFrom_ == static_cast<int>(boundaries_.size())) {
+		shift_ = 0;
+	}
+}
+
+/*
+** Replace boundaries "first" to "last" with the "count" in "boundaries"
+*/
+void Rangeset::replaceBoundaries(int first, int last, const pos_type *boundaries, int count) {
+
+	/* the new boundaries are stored, like those after them, without the
+	   pending shift */
+	moveShift(first);
+
+	const int nCommon = std::min(last - first, count);
+	for (int i = 0; i < nCommon; i++) {
+		boundaries_[first + i] = boundaries[i] - shift_;
+	}
+
+	if (count > nCommon) {
+		std::vector<pos_type> stored(boundaries + nCommon, boundaries + count);
+		for (pos_type &b : stored) {
+			b -= shift_;
+		}
+		boundaries_.insert(boundaries_.begin() + last, stored.begin(), stored.end());
+	} else {
+		boundaries_.erase(boundaries_.begin() + first + nCommon, boundaries_.begin() + last);
+	}
+}
+
+/*
+** Redraw the text between "start" and "end" if the set is drawn
+*/
+void Rangeset::redisplay(pos_type start, pos_type end) {
+	if (!color_.empty()) {
+		buffer_->BufCheckDisplay(start, end);
+	}
+}
+
+/*
+** Create an empty rangeset table for "buffer"
+*/
+RangesetTable::RangesetTable(TextBuffer *buffer) : buffer_(buffer) {
+}
+
+/*
+** Return the rangeset with index "index", or nullptr if there is none
+*/
+Rangeset *RangesetTable::rangeset(int index) const {
+
+	if (index < 1 || index > N_RANGESETS) {
+		return nullptr;
+	}
+
+	return sets_[index].get();
+}
+
+/*
+** Create a new, empty, rangeset drawn over all of the others, returning its
+** index (or 0 if the table is full)
+*/
+int RangesetTable::create() {
+
+	for (int index = 1; index <= N_RANGESETS; index++) {
+		if (!sets_[index]) {
+			sets_[index].reset(new Rangeset(buffer_));
+			order_.insert(order_.begin(), index);
+			return index;
+		}
+	}
+
+	return 0;
+}
+
+/*
+** Remove the rangeset with index "index", which may then be reused
+*/
+void RangesetTable::forget(int index) {
+
+	if (!rangeset(index)) {
+		return;
+	}
+
+	sets_[index]->clear();
+	sets_[index].reset();
+	order_.erase(std::find(order_.begin(), order_.end(), index));
+}
+
+/*
+** Return the index of the topmost rangeset including position "pos" (only
+** counting those with a color if "needsColor" is true), or 0 if there is none
+*/
+int RangesetTable::indexOfPos(pos_type pos, bool needsColor) const {
+
+	for (int index : order_) {
+		const Rangeset *set = sets_[index].get();
+		if ((!needsColor || !set->color().empty()) && set->includes(pos)) {
+			return index;
+		}
+	}
+
+	return 0;
+}
+
+/*
+** Bytes used by the table and its rangesets
+*/
+size_t RangesetTable::memoryUsage() const {
+
+	size_t bytes = sizeof(RangesetTable) + order_.capacity() * sizeof(int);
+	for (int index : order_) {
+		bytes += sets_[index]->memoryUsage();
+	}
+
+	return bytes;
+}
+
+/*
+** Update all of the rangesets for a change to the text (see Rangeset::update)
+*/
+void RangesetTable::update(pos_type pos, pos_type nDeleted, pos_type nInserted) {
+	for (int index : order_) {
+		sets_[index]->update(pos, nDeleted, nInserted);
+	}
+}
@@ -0,0 +1,78 @@
+
+#ifndef RANGESET_H_
+#define RANGESET_H_
+
+#include "Types.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+class TextBuffer;
+
+/* Most rangesets a buffer can have at once (as many as fit in the
+   RANGESET_MASK bits of a drawing style, index 0 meaning none) */
+#define N_RANGESETS 63
+
+/* A set of ranges of a buffer's text, drawn in a color of their own (search
+   hits, diff regions, coverage data...).  The ranges are kept as a sorted
+   array of their start and end positions.  Like the gap in the text buffer,
+   edits are applied lazily: the positions from some index on are stored
+   without the last shift, which is only carried over to the positions
+   between there and the next edit when that edit happens somewhere else.
+   Successive edits in one place then cost O(log n) however many ranges
+   there are, and looking positions up in order (as drawing a line does)
+   costs O(1) each. */
+class Rangeset {
+public:
+	explicit Rangeset(TextBuffer *buffer);
+
+public:
+	bool includes(pos_type pos) const;
+	bool range(int index, pos_type *start, pos_type *end) const;
+	const std::string &color() const;
+	int count() const;
+	size_t memoryUsage() const;
+	void add(pos_type start, pos_type end);
+	void clear();
+	void remove(pos_type start, pos_type end);
+	void setColor(const std::string &color);
+	void update(pos_type pos, pos_type nDeleted, pos_type nInserted);
+
+private:
+	int countBelow(pos_type pos) const;
+	pos_type boundary(int index) const;
+	void moveShift(int index);
+	void redisplay(pos_type start, pos_type end);
+	void replaceBoundaries(int first, int last, const pos_type *boundaries, int count);
+
+private:
+	TextBuffer *buffer_;
+	std::vector<pos_type> boundaries_; // start and end of each range, in order (ranges
+	                                   // never overlap or touch, nor are they empty)
+	std::string color_;                // color name, empty if the set isn't drawn
+	pos_type shift_;                   // still to be added to the boundaries from
+	int shiftFrom_;                    // this index on
+	mutable int cursor_;               // boundaries before the last position looked up
+};
+
+/* The rangesets of a buffer, by index (1 to N_RANGESETS) */
+class RangesetTable {
+public:
+	explicit RangesetTable(TextBuffer *buffer);
+
+public:
+	Rangeset *rangeset(int index) const;
+	int create();
+	int indexOfPos(pos_type pos, bool needsColor) const;
+	size_t memoryUsage() const;
+	void forget(int index);
+	void update(pos_type pos, pos_type nDeleted, pos_type nInserted);
+
+private:
+	TextBuffer *buffer_;
+	std::unique_ptr<Rangeset> sets_[N_RANGESETS + 1]; // by index, sets_[0] is never used
+	std::vector<int> order_;                          // indexes of the sets, the one drawn
+	                                                  // on top (the newest) first
+};
+
+#endif
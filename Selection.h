@@ -2,6 +2,8 @@
 #ifndef SELECTION_H_
 #define SELECTION_H_
 
+#include "Types.h"
+
 class Selection {
 public:
 	Selection();
@@ -14,9 +16,9 @@ public:
 	bool zeroWidth;   // Width 0 selections aren't "real" selections, but they can
 	                  // be useful when creating rectangular selections from the
 	                  // keyboard.
-	int start;        // Pos. of start of Selection, or if rectangular start of line
+	pos_type start;   // Pos. of start of Selection, or if rectangular start of line
 	                  // containing it.
-	int end;          // Pos. of end of Selection, or if rectangular end of line containing
+	pos_type end;     // Pos. of end of Selection, or if rectangular end of line containing
 	                  // it.
 	int rectStart;    // Indent of left edge of rect. Selection
 	int rectEnd;      // Indent of right edge of rect. Selection
@@ -36,6 +36,12 @@ const int MAX_TITLE_FORMAT_LEN  = 50;
 /* How much re-parsing to do when an unfinished style is encountered */
 const int PASS_2_REPARSE_CHUNK_SIZE = 1000;
 
+/* How much of a loaded text to parse at a time, as it is first drawn */
+const int PASS_1_PARSE_CHUNK_SIZE = 65536;
+
+/* parsedTo_ when there is no unparsed text */
+const pos_type PARSED_ALL = INT64_MAX;
+
 /* Initial forward expansion of parsing region in incremental reparsing,
    when style changes propagate forward beyond the original modification.
    This distance is increased by a factor of two for each subsequent step. */
@@ -68,10 +74,23 @@ const char_type delimiters[] = _T(".,/\\`'!|@#%^&*()-=+{}[]\":;<>?~ \t\n");
 /*
 ** Get the character before position "pos" in buffer "buf"
 */
-char_type getPrevChar(TextBuffer *buf, int pos) {
+char_type getPrevChar(TextBuffer *buf, pos_type pos) {
 	return pos == 0 ? _T('\0') : buf->BufGetCharacter(pos - 1);
 }
 
+/*
+** Copy the text between "start" and "end" of buffer "buf" into "storage",
+** null-terminated, and return a pointer to it.  The storage is kept from one
+** parse to the next, so this normally doesn't need to allocate.
+*/
+char_type *copyRangeInto(TextBuffer *buf, pos_type start, pos_type end, std::vector<char_type> *storage) {
+	const TextView view = buf->BufGetView(start, end);
+	storage->resize(view.length() + 1);
+	view.copy(storage->data());
+	(*storage)[view.length()] = _T('\0');
+	return storage->data();
+}
+
 }
 
 struct LanguageModeRec {
@@ -158,7 +177,7 @@ struct HighlightData {
 	PatternSet          *patternSetForWindow;
 };
 
-SyntaxHighlighter::SyntaxHighlighter() {
+SyntaxHighlighter::SyntaxHighlighter() : highlightData_(nullptr), stylesReleased_(false), parsedTo_(PARSED_ALL), loadedText_(nullptr) {
 
     Regex::SetDefaultWordDelimiters(".,/\\`'!|@#%^&*()-=+{}[]\":;<>?");
 
@@ -202,7 +221,7 @@ SyntaxHighlighter::~SyntaxHighlighter() {
 }
 
 TextBuffer *SyntaxHighlighter::styleBuffer() const {
-    if (highlightData_) {
+    if (highlightData_ && !stylesReleased_) {
         return highlightData_->styleBuffer;
     }
 
@@ -210,11 +229,11 @@ TextBuffer *SyntaxHighlighter::styleBuffer() const {
 }
 
 void SyntaxHighlighter::bufferModified(const ModifyEvent *event) {
-    const int nInserted = event->nInserted;
-    const int nDeleted  = event->nDeleted;
-    const int pos       = event->pos;
+    const pos_type nInserted = event->nInserted;
+    const pos_type nDeleted  = event->nDeleted;
+    const pos_type pos       = event->pos;
 
-    if (!highlightData_) {
+    if (!highlightData_ || stylesReleased_) {
         return;
     }
 
@@ -246,12 +265,207 @@ void SyntaxHighlighter::bufferModified(const ModifyEvent *event) {
        changes that are already scheduled for redraw */
     highlightData_->styleBuffer->BufSelect(pos, pos + nInserted);
 
-    /* Re-parse around the changed region */
-    if (highlightData_->pass1Patterns) {
+    /* Re-parse around the changed region, unless it is in the part of a
+       loaded text which hasn't been parsed yet.  A change reaching into that
+       part just leaves the rest to parseUpTo, rather than parsing on through
+       the unfinished styles after it. */
+    if (highlightData_->pass1Patterns && pos < parsedTo_) {
+        if (parsedTo_ != PARSED_ALL && pos + nDeleted >= parsedTo_) {
+            parsedTo_ = pos;
+            return;
+        }
+
+        if (parsedTo_ != PARSED_ALL) {
+            parsedTo_ = std::max(pos + nInserted, parsedTo_ + nInserted - nDeleted);
+        }
+
         incrementalReparse(highlightData_, event->buffer, pos, nInserted, delimiters);
     }
 }
 
+/*
+** A whole new text was loaded (see TextBuffer::BufLoad).  Rather than being
+** parsed all at once, which for a big file would take much longer than
+** reading it, the text is parsed from the start as far as it is drawn (see
+** parseUpTo), and the style buffer starts out as all UNFINISHED_STYLE.
+*/
+void SyntaxHighlighter::bufferLoaded(const ModifyEvent *event) {
+
+    if (!highlightData_ || stylesReleased_) {
+        return;
+    }
+
+    highlightData_->styleBuffer->BufLoadFilled(UNFINISHED_STYLE, event->nInserted);
+
+    if (highlightData_->pass1Patterns) {
+        parsedTo_ = 0;
+        loadedText_ = event->buffer;
+    }
+}
+
+/*
+** Leave the text of "buf" from position "pos" on, such as text about to be
+** appended, to be parsed when it is drawn (see parseUpTo).  Text streaming
+** in is then parsed once, when the display gets to it, rather than a little
+** more of it being reparsed as each piece arrives.
+*/
+void SyntaxHighlighter::parseLater(TextBuffer *buf, pos_type pos) {
+
+    if (!highlightData_ || stylesReleased_ || !highlightData_->pass1Patterns) {
+        return;
+    }
+
+    if (pos < parsedTo_) {
+        parsedTo_ = pos;
+        loadedText_ = buf;
+    }
+}
+
+/*
+** Do the pass 1 parsing of a loaded text (see bufferLoaded) which has been
+** put off, from where it got to as far as position "pos".  This goes a chunk
+** at a time, as if each chunk had just been typed in.
+*/
+void SyntaxHighlighter::parseUpTo(pos_type pos) {
+
+    TextBuffer *const styleBuf = highlightData_->styleBuffer;
+    const pos_type length = loadedText_->BufGetLength();
+    const pos_type first = parsedTo_;
+    pos_type restyledFrom = first;
+
+    while (parsedTo_ <= pos && parsedTo_ < length) {
+        const pos_type from = parsedTo_;
+        const pos_type n = std::min<pos_type>(PASS_1_PARSE_CHUNK_SIZE, length - from);
+
+        parsedTo_ = from + n;
+        styleBuf->BufSelect(from, from + n);
+        incrementalReparse(highlightData_, loadedText_, from, n, delimiters);
+        restyledFrom = std::min(restyledFrom, styleBuf->BufGetPrimarySelection().start);
+    }
+
+    /* this is done while drawing, which picks up the new styles as it goes,
+       except for those of any text before the unparsed part: that is left
+       selected, to be drawn again (see NirvanaQt::styleOfPos) */
+    if (restyledFrom < first) {
+        styleBuf->BufSelect(restyledFrom, first);
+    } else {
+        styleBuf->BufUnselect();
+    }
+
+    if (parsedTo_ >= length) {
+        parsedTo_ = PARSED_ALL;
+        loadedText_ = nullptr;
+    }
+}
+
+/*
+** Bytes used by the style buffer and the copies of the text and styles kept
+** for parsing
+*/
+size_t SyntaxHighlighter::styleMemoryUsage() const {
+
+    if (!highlightData_) {
+        return 0;
+    }
+
+    const size_t scratch = parseText_.capacity() + parseStyle_.capacity() + pass2Text_.capacity() + pass2Style_.capacity();
+    return highlightData_->styleBuffer->BufMemoryUsage().total + scratch * sizeof(char_type);
+}
+
+/*
+** Bytes used by the compiled regular expressions of the patterns
+*/
+size_t SyntaxHighlighter::patternMemoryUsage() const {
+
+    if (!highlightData_) {
+        return 0;
+    }
+
+    size_t bytes = 0;
+    for (const HighlightDataRecord *patterns : {highlightData_->pass1Patterns, highlightData_->pass2Patterns}) {
+        if (!patterns) {
+            continue;
+        }
+
+        for (int i = 0; patterns[i].style != 0; i++) {
+            for (const Regex *re : {patterns[i].startRE, patterns[i].endRE, patterns[i].errorRE, patterns[i].subPatternRE}) {
+                if (re) {
+                    bytes += re->MemoryUsage();
+                }
+            }
+
+            for (const Regex *re : patterns[i].subPatternsRE) {
+                if (re) {
+                    bytes += re->MemoryUsage();
+                }
+            }
+        }
+    }
+
+    return bytes;
+}
+
+/*
+** Give back the memory the style buffer and the parse copies hold on to
+** without needing it
+*/
+void SyntaxHighlighter::compactStyles() {
+
+    if (highlightData_) {
+        highlightData_->styleBuffer->BufCompact();
+    }
+
+    std::vector<char_type>().swap(parseText_);
+    std::vector<char_type>().swap(parseStyle_);
+    std::vector<char_type>().swap(pass2Text_);
+    std::vector<char_type>().swap(pass2Style_);
+}
+
+/*
+** Throw away the styles of the whole text, for when memory is short and the
+** text isn't being shown.  Until restoreStyles is called, changes to the text
+** are ignored and nothing is highlighted.
+*/
+void SyntaxHighlighter::releaseStyles() {
+
+    if (!highlightData_ || stylesReleased_) {
+        return;
+    }
+
+    highlightData_->styleBuffer->BufSetAll(_T(""));
+    compactStyles();
+    stylesReleased_ = true;
+    parsedTo_ = PARSED_ALL;
+    loadedText_ = nullptr;
+}
+
+/*
+** Bring back the styles thrown away by releaseStyles, by parsing the text of
+** "buf" again as if it had just been loaded
+*/
+void SyntaxHighlighter::restoreStyles(TextBuffer *buf) {
+
+    if (!stylesReleased_) {
+        return;
+    }
+
+    stylesReleased_ = false;
+
+    ModifyEvent event = {};
+    event.buffer    = buf;
+    event.pos       = 0;
+    event.nInserted = buf->BufGetLength();
+    bufferLoaded(&event);
+}
+
+/*
+** The style buffer follows the text buffer by position only, so nothing
+** about deleted text is needed
+*/
+DeletedTextNeeds SyntaxHighlighter::deletedTextNeeds() const {
+    return DELETED_NOTHING;
+}
+
 void SyntaxHighlighter::loadLanguages(const QString &filename) {
 
     QFile file(filename);
@@ -358,7 +572,7 @@ void SyntaxHighlighter::loadStyles(const QString &filename) {
 ** been presented to the patterns.  Changes the style buffer in "highlightData"
 ** with the parsing result.
 */
-void SyntaxHighlighter::incrementalReparse(HighlightData *highlightData, TextBuffer *buf, int pos, int nInserted,
+void SyntaxHighlighter::incrementalReparse(HighlightData *highlightData, TextBuffer *buf, pos_type pos, pos_type nInserted,
                                            const char_type *delimiters) {
 
     TextBuffer *const styleBuf               = highlightData_->styleBuffer;
@@ -370,14 +584,14 @@ void SyntaxHighlighter::incrementalReparse(HighlightData *highlightData, TextBuf
     /* Find the position "beginParse" at which to begin reparsing.  This is
        far enough back in the buffer such that the guranteed number of
        lines and characters of context are examined. */
-    int beginParse = pos;
+    pos_type beginParse = pos;
     int parseInStyle = findSafeParseRestartPos(buf, highlightData, &beginParse);
 
     /* Find the position "endParse" at which point it is safe to stop
        parsing, unless styles are getting changed beyond the last
        modification */
-    int lastMod = pos + nInserted;
-    int endParse = forwardOneContext(buf, context, lastMod);
+    pos_type lastMod = pos + nInserted;
+    pos_type endParse = forwardOneContext(buf, context, lastMod);
 
     /*
     ** Parse the buffer from beginParse, until styles compare
@@ -399,7 +613,7 @@ void SyntaxHighlighter::incrementalReparse(HighlightData *highlightData, TextBuf
         if (!startPattern) {
             startPattern = pass1Patterns;
         }
-        int endAt = parseBufferRange(startPattern, pass2Patterns, buf, styleBuf, context, beginParse, endParse, delimiters);
+        pos_type endAt = parseBufferRange(startPattern, pass2Patterns, buf, styleBuf, context, beginParse, endParse, delimiters);
 
         /* If parse completed at this level, move one style up in the
            hierarchy and start again from where the previous parse left off. */
@@ -421,7 +635,7 @@ void SyntaxHighlighter::incrementalReparse(HighlightData *highlightData, TextBuf
             reparse until nothing changes */
         } else {
             lastMod  = lastModified(styleBuf);
-            endParse = qMin(buf->BufGetLength(), forwardOneContext(buf, context, lastMod) + (REPARSE_CHUNK_SIZE << nPasses));
+            endParse = qMin(buf->BufGetLength(), forwardOneContext(buf, context, lastMod) + (static_cast<pos_type>(REPARSE_CHUNK_SIZE) << nPasses));
         }
     }
 }
@@ -438,13 +652,13 @@ void SyntaxHighlighter::incrementalReparse(HighlightData *highlightData, TextBuf
 ** only one extra character, but I'm not sure, and my brain hurts from
 ** thinking about it).
 */
-int SyntaxHighlighter::backwardOneContext(TextBuffer *buf, ReparseContext *context, int fromPos) {
+pos_type SyntaxHighlighter::backwardOneContext(TextBuffer *buf, ReparseContext *context, pos_type fromPos) {
     if (context->nLines == 0) {
-        return qMax(0, fromPos - context->nChars);
+        return qMax<pos_type>(0, fromPos - context->nChars);
     } else if (context->nChars == 0) {
-        return qMax(0, buf->BufCountBackwardNLines(fromPos, context->nLines - 1) - 1);
+        return qMax<pos_type>(0, buf->BufCountBackwardNLines(fromPos, context->nLines - 1) - 1);
     } else {
-        return qMax(0, qMin(qMax(0, buf->BufCountBackwardNLines(fromPos, context->nLines - 1) - 1), fromPos - context->nChars));
+        return qMax<pos_type>(0, qMin<pos_type>(qMax<pos_type>(0, buf->BufCountBackwardNLines(fromPos, context->nLines - 1) - 1), fromPos - context->nChars));
     }
 }
 
@@ -456,13 +670,13 @@ int SyntaxHighlighter::backwardOneContext(TextBuffer *buf, ReparseContext *conte
 ** next line, rather than the newline character at the end (see notes in
 ** backwardOneContext).
 */
-int SyntaxHighlighter::forwardOneContext(TextBuffer *buf, ReparseContext *context, int fromPos) {
+pos_type SyntaxHighlighter::forwardOneContext(TextBuffer *buf, ReparseContext *context, pos_type fromPos) {
     if (context->nLines == 0) {
-        return qMin(buf->BufGetLength(), fromPos + context->nChars);
+        return qMin<pos_type>(buf->BufGetLength(), fromPos + context->nChars);
     } else if (context->nChars == 0) {
         return qMin(buf->BufGetLength(), buf->BufCountForwardNLines(fromPos, context->nLines));
     } else {
-        return qMin(buf->BufGetLength(), qMax(buf->BufCountForwardNLines(fromPos, context->nLines), fromPos + context->nChars));
+        return qMin(buf->BufGetLength(), qMax<pos_type>(buf->BufCountForwardNLines(fromPos, context->nLines), fromPos + context->nChars));
     }
 }
 
@@ -480,9 +694,9 @@ int SyntaxHighlighter::forwardOneContext(TextBuffer *buf, ReparseContext *contex
 ** result in an incorrect re-parse.  However this will happen very rarely,
 ** and, if it does, is unlikely to result in incorrect highlighting.
 */
-int SyntaxHighlighter::findSafeParseRestartPos(TextBuffer *buf, HighlightData *highlightData, int *pos) {
-    int checkBackTo;
-    int safeParseStart;
+int SyntaxHighlighter::findSafeParseRestartPos(TextBuffer *buf, HighlightData *highlightData, pos_type *pos) {
+    pos_type checkBackTo;
+    pos_type safeParseStart;
 
     char_type *const parentStyles            = highlightData->parentStyles;
     HighlightDataRecord *const pass1Patterns = highlightData->pass1Patterns;
@@ -527,7 +741,7 @@ int SyntaxHighlighter::findSafeParseRestartPos(TextBuffer *buf, HighlightData *h
     }
 
     int runningStyle = startStyle;
-    for (int i = *pos - 1;; i--) {
+    for (pos_type i = *pos - 1;; i--) {
 
         /* The start of the buffer is certainly a safe place to parse from */
         if (i == 0) {
@@ -641,15 +855,15 @@ HighlightDataRecord *SyntaxHighlighter::patternOfStyle(HighlightDataRecord *patt
 ** finished (this will normally be endParse, unless the pass1Patterns is a
 ** pattern which does end and the end is reached).
 */
-int SyntaxHighlighter::parseBufferRange(const HighlightDataRecord *pass1Patterns, const HighlightDataRecord *pass2Patterns,
-                                        TextBuffer *buf, TextBuffer *styleBuf, ReparseContext *contextRequirements,
-                                        int beginParse, int endParse, const char_type *delimiters) {
-    int endSafety;
-    int endPass2Safety;
-    int startPass2Safety;
-    int modStart;
-    int modEnd;
-    int beginSafety;
+pos_type SyntaxHighlighter::parseBufferRange(const HighlightDataRecord *pass1Patterns, const HighlightDataRecord *pass2Patterns,
+                                             TextBuffer *buf, TextBuffer *styleBuf, ReparseContext *contextRequirements,
+                                             pos_type beginParse, pos_type endParse, const char_type *delimiters) {
+    pos_type endSafety;
+    pos_type endPass2Safety;
+    pos_type startPass2Safety;
+    pos_type modStart;
+    pos_type modEnd;
+    pos_type beginSafety;
     int style;
     int firstPass2Style = !pass2Patterns ? INT_MAX : (unsigned char)pass2Patterns[1].style;
 
@@ -657,7 +871,7 @@ int SyntaxHighlighter::parseBufferRange(const HighlightDataRecord *pass1Patterns
     int beginStyle = pass1Patterns->style;
     if (canCrossLineBoundaries(contextRequirements)) {
         beginSafety = backwardOneContext(buf, contextRequirements, beginParse);
-        for (int p = beginParse; p >= beginSafety; p--) {
+        for (pos_type p = beginParse; p >= beginSafety; p--) {
             style = styleBuf->BufGetCharacter(p - 1);
             if (!equivalentStyle(style, beginStyle, firstPass2Style)) {
                 beginSafety = p;
@@ -665,7 +879,7 @@ int SyntaxHighlighter::parseBufferRange(const HighlightDataRecord *pass1Patterns
             }
         }
     } else {
-        for (beginSafety = qMax(0, beginParse - 1); beginSafety > 0; beginSafety--) {
+        for (beginSafety = qMax<pos_type>(0, beginParse - 1); beginSafety > 0; beginSafety--) {
             style = styleBuf->BufGetCharacter(beginSafety);
             if (!equivalentStyle(style, beginStyle, firstPass2Style) || buf->BufGetCharacter(beginSafety) == '\n') {
                 beginSafety++;
@@ -690,8 +904,8 @@ int SyntaxHighlighter::parseBufferRange(const HighlightDataRecord *pass1Patterns
     }
 
     /* copy the buffer range into a string */
-    String string      = buf     ->BufGetRange(beginSafety, endSafety);
-	String styleString = styleBuf->BufGetRange(beginSafety, endSafety);
+    char_type *const string      = copyRangeInto(buf,      beginSafety, endSafety, &parseText_);
+    char_type *const styleString = copyRangeInto(styleBuf, beginSafety, endSafety, &parseStyle_);
 
     /* Parse it with pass 1 patterns */
     /* qDebug("parsing from %d thru %d\n", beginSafety, endSafety); */
@@ -699,10 +913,10 @@ int SyntaxHighlighter::parseBufferRange(const HighlightDataRecord *pass1Patterns
     const char_type *stringPtr = &string[beginParse - beginSafety];
     char_type *stylePtr        = &styleString[beginParse - beginSafety];
 
-    parseString(pass1Patterns, &stringPtr, &stylePtr, endParse - beginParse, &prevChar, MatchFlags::FlagNone, delimiters, string.str, nullptr);
+    parseString(pass1Patterns, &stringPtr, &stylePtr, endParse - beginParse, &prevChar, MatchFlags::FlagNone, delimiters, string, nullptr);
 
     /* On non top-level patterns, parsing can end early */
-    endParse = qMin<long>(endParse, stringPtr - string.str + beginSafety);
+    endParse = qMin<pos_type>(endParse, stringPtr - string + beginSafety);
 
     /* If there are no pass 2 patterns, we're done */
     if (!pass2Patterns) {
@@ -740,15 +954,15 @@ int SyntaxHighlighter::parseBufferRange(const HighlightDataRecord *pass1Patterns
 		
         prevChar = getPrevChar(buf, beginSafety);
         if (endPass2Safety == endSafety) {
-            passTwoParseString(pass2Patterns, string.str, styleString.str, endParse - beginSafety, &prevChar, delimiters, string.str, nullptr);
+            passTwoParseString(pass2Patterns, string, styleString, endParse - beginSafety, &prevChar, delimiters, string, nullptr);
             goto parseDone;
         } else {
-            int tempLen = endPass2Safety - modStart;
+            pos_type tempLen = endPass2Safety - modStart;
             char_type *const temp = new char_type[tempLen];
 			
             _strncpy(temp, &styleString[modStart - beginSafety], tempLen);
 
-            passTwoParseString(pass2Patterns, string.str, styleString.str, modStart - beginSafety, &prevChar, delimiters, string.str, nullptr);
+            passTwoParseString(pass2Patterns, string, styleString, modStart - beginSafety, &prevChar, delimiters, string, nullptr);
             _strncpy(&styleString[modStart - beginSafety], temp, tempLen);
 
             delete[] temp;
@@ -761,15 +975,15 @@ int SyntaxHighlighter::parseBufferRange(const HighlightDataRecord *pass1Patterns
     if (endParse > modEnd) {
         if (beginSafety > modEnd) {
             prevChar = getPrevChar(buf, beginSafety);
-            passTwoParseString(pass2Patterns, string.str, styleString.str, endParse - beginSafety, &prevChar, delimiters, string.str, nullptr);
+            passTwoParseString(pass2Patterns, string, styleString, endParse - beginSafety, &prevChar, delimiters, string, nullptr);
         } else {
             startPass2Safety = qMax(beginSafety, backwardOneContext(buf, contextRequirements, modEnd));
-            int tempLen = modEnd - startPass2Safety;
+            pos_type tempLen = modEnd - startPass2Safety;
             char_type *const temp = new char_type[tempLen];
             _strncpy(temp, &styleString[startPass2Safety - beginSafety], tempLen);
 
             prevChar = getPrevChar(buf, startPass2Safety);
-            passTwoParseString(pass2Patterns, &string[startPass2Safety - beginSafety], &styleString[startPass2Safety - beginSafety], endParse - startPass2Safety, &prevChar, delimiters, string.str, nullptr);
+            passTwoParseString(pass2Patterns, &string[startPass2Safety - beginSafety], &styleString[startPass2Safety - beginSafety], endParse - startPass2Safety, &prevChar, delimiters, string, nullptr);
 							   
             _strncpy(&styleString[startPass2Safety - beginSafety], temp, tempLen);
 
@@ -793,9 +1007,9 @@ parseDone:
 ** by the convention used for conveying modification information to the
 ** text widget, which is selecting the text)
 */
-int SyntaxHighlighter::lastModified(TextBuffer *styleBuf) const {
+pos_type SyntaxHighlighter::lastModified(TextBuffer *styleBuf) const {
     if (styleBuf->BufGetPrimarySelection().selected) {
-        return qMax(0, styleBuf->BufGetPrimarySelection().end);
+        return qMax<pos_type>(0, styleBuf->BufGetPrimarySelection().end);
     }
     return 0;
 }
@@ -831,7 +1045,7 @@ int SyntaxHighlighter::patternIsParsable(const HighlightDataRecord *pattern) {
 ** have the same meaning as in parseString, except that strings aren't doubly
 ** indirect and string pointers are not updated.
 */
-void SyntaxHighlighter::passTwoParseString(const HighlightDataRecord *pattern, char_type *string, char_type *styleString, int length,
+void SyntaxHighlighter::passTwoParseString(const HighlightDataRecord *pattern, char_type *string, char_type *styleString, pos_type length,
                                            char_type *prevChar, const char_type *delimiters, const char_type *lookBehindTo,
                                            const char_type *match_till) {
 
@@ -898,7 +1112,7 @@ void SyntaxHighlighter::passTwoParseString(const HighlightDataRecord *pattern, c
 ** the error pattern matched, if the end of the string was reached without
 ** matching the end expression, or in the unlikely event of an internal error.
 */
-bool SyntaxHighlighter::parseString(const HighlightDataRecord *pattern, const char_type **string, char_type **styleString, int length,
+bool SyntaxHighlighter::parseString(const HighlightDataRecord *pattern, const char_type **string, char_type **styleString, pos_type length,
                                     char_type *prevChar, MatchFlags flags, const char_type *delimiters, const char_type *lookBehindTo,
                                     const char_type *match_till) {
     int i;
@@ -1088,15 +1302,15 @@ bool SyntaxHighlighter::parseString(const HighlightDataRecord *pattern, const ch
 ** for distinguishing pass 2 styles which compare as equal to the unfinished
 ** style in the original buffer, from pass1 styles which signal a change.
 */
-void SyntaxHighlighter::modifyStyleBuf(TextBuffer *styleBuf, char_type *styleString, int startPos, int endPos,
+void SyntaxHighlighter::modifyStyleBuf(TextBuffer *styleBuf, char_type *styleString, pos_type startPos, pos_type endPos,
                                        int firstPass2Style) {
     char_type *c;
     char_type bufChar;
-    int pos;
-    int modStart;
-    int modEnd;
-    int minPos = INT_MAX;
-    int maxPos = 0;
+    pos_type pos;
+    pos_type modStart;
+    pos_type modEnd;
+    pos_type minPos = INT64_MAX;
+    pos_type maxPos = 0;
     Selection *sel = &styleBuf->BufGetPrimarySelection();
 
     /* Skip the range already marked for redraw */
@@ -1122,7 +1336,7 @@ void SyntaxHighlighter::modifyStyleBuf(TextBuffer *styleBuf, char_type *styleStr
                 maxPos = pos;
         }
     }
-    for (c = &styleString[qMax(0, modEnd - startPos)], pos = qMax(modEnd, startPos); pos < endPos; c++, pos++) {
+    for (c = &styleString[qMax<pos_type>(0, modEnd - startPos)], pos = qMax(modEnd, startPos); pos < endPos; c++, pos++) {
         bufChar = styleBuf->BufGetCharacter(pos);
         if (*c != bufChar &&
             !(bufChar == UNFINISHED_STYLE && (*c == PLAIN_STYLE || (unsigned char)*c >= firstPass2Style))) {
@@ -1150,13 +1364,13 @@ void SyntaxHighlighter::modifyStyleBuf(TextBuffer *styleBuf, char_type *styleStr
 */
 void SyntaxHighlighter::fillStyleString(const char_type *&stringPtr, char_type *&stylePtr, const char_type *toPtr, char_type style, char_type *prevChar) {
 
-    int len = toPtr - stringPtr;
+    pos_type len = toPtr - stringPtr;
 
     if (stringPtr >= toPtr) {
         return;
     }
 
-    for (int i = 0; i < len; i++) {
+    for (pos_type i = 0; i < len; i++) {
         *stylePtr++ = style;
     }
 
@@ -1898,9 +2112,25 @@ StyleTableEntry *SyntaxHighlighter::styleEntry(int index) const {
 */
 void SyntaxHighlighter::unfinishedHighlightEncountered(const HighlightEvent *event) {
 
+    if (!highlightData_ || stylesReleased_) {
+        return;
+    }
+
     TextBuffer *buf = event->buffer;
 	
 	TextBuffer *styleBuf                     = highlightData_->styleBuffer;
+
+    /* the display has dealt with any restyling marked by the selection, so
+       anything selected from here on is restyling done by parseUpTo */
+    styleBuf->BufUnselect();
+
+    /* past the part of a loaded text parsed so far, pass 1 comes first */
+    if (event->pos >= parsedTo_) {
+        parseUpTo(event->pos);
+        if (styleBuf->BufGetCharacter(event->pos) != UNFINISHED_STYLE) {
+            return;
+        }
+    }
 	ReparseContext *context                  = &highlightData_->contextRequirements;
 	const HighlightDataRecord *pass2Patterns = highlightData_->pass2Patterns;
     
@@ -1915,10 +2145,10 @@ void SyntaxHighlighter::unfinishedHighlightEncountered(const HighlightEvent *eve
     /* Find the point at which to begin parsing to ensure that the character at
        pos is parsed correctly (beginSafety), at most one context distance back
        from pos, unless there is a pass 1 section from which to start */
-    const int beginParse  = event->pos;
-    int beginSafety = backwardOneContext(buf, context, beginParse);
+    const pos_type beginParse  = event->pos;
+    pos_type beginSafety = backwardOneContext(buf, context, beginParse);
 
-    for (int p = beginParse; p >= beginSafety; p--) {
+    for (pos_type p = beginParse; p >= beginSafety; p--) {
         char_type c = styleBuf->BufGetCharacter(p);
         if (c != UNFINISHED_STYLE && c != PLAIN_STYLE && (unsigned char)c < firstPass2Style) {
     	    beginSafety = p + 1;
@@ -1930,9 +2160,9 @@ void SyntaxHighlighter::unfinishedHighlightEncountered(const HighlightEvent *eve
        necessary to ensure that the changes at endParse are correct.  Stop at
        the end of the unfinished region, or a max. of PASS_2_REPARSE_CHUNK_SIZE
        characters forward from the requested position */
-    int endParse  = qMin(buf->BufGetLength(), event->pos + PASS_2_REPARSE_CHUNK_SIZE);
-    int endSafety = forwardOneContext(buf, context, endParse);
-    for (int p = event->pos; p < endSafety; p++) {
+    pos_type endParse  = qMin<pos_type>(buf->BufGetLength(), event->pos + PASS_2_REPARSE_CHUNK_SIZE);
+    pos_type endSafety = forwardOneContext(buf, context, endParse);
+    for (pos_type p = event->pos; p < endSafety; p++) {
         char_type c = styleBuf->BufGetCharacter(p);
         if (c != UNFINISHED_STYLE && c != PLAIN_STYLE && (unsigned char)c < firstPass2Style) {
             endParse = qMin(endParse, p);
@@ -1952,15 +2182,15 @@ void SyntaxHighlighter::unfinishedHighlightEncountered(const HighlightEvent *eve
     /* Copy the buffer range into a string */
     /* qDebug("callback pass2 parsing from %d thru %d w/ safety from %d thru %d\n", beginParse, endParse, beginSafety, endSafety); */
 
-    String string              = buf->BufGetRange(beginSafety, endSafety);
-    const char_type *stringPtr = string.str;
+    char_type *const string     = copyRangeInto(buf, beginSafety, endSafety, &pass2Text_);
+    const char_type *stringPtr = string;
 
-    String styleString  = styleBuf->BufGetRange(beginSafety, endSafety);
-    char_type *stylePtr = styleString.str;
+    char_type *const styleString = copyRangeInto(styleBuf, beginSafety, endSafety, &pass2Style_);
+    char_type *stylePtr          = styleString;
     
     /* Parse it with pass 2 patterns */
     char_type prevChar = getPrevChar(buf, beginSafety);
-    parseString(pass2Patterns, &stringPtr, &stylePtr, endParse - beginSafety, &prevChar, MatchFlags::FlagNone, delimiters, string.str, nullptr);
+    parseString(pass2Patterns, &stringPtr, &stylePtr, endParse - beginSafety, &prevChar, MatchFlags::FlagNone, delimiters, string, nullptr);
 
     /* Update the style buffer the new style information, but only between
        beginParse and endParse.  Skip the safety region */
@@ -1978,10 +2208,10 @@ void SyntaxHighlighter::unfinishedHighlightEncountered(const HighlightEvent *eve
 ** pointer is returned for two positions, the corresponding characters have
 ** the same highlight style.
 **/
-void* SyntaxHighlighter::GetHighlightInfo(int pos) {
+void* SyntaxHighlighter::GetHighlightInfo(pos_type pos) {
     HighlightDataRecord *pattern = nullptr;
 
-    if (!highlightData_) {
+    if (!highlightData_ || stylesReleased_) {
         return nullptr;
     }
 
@@ -2009,7 +2239,7 @@ void* SyntaxHighlighter::GetHighlightInfo(int pos) {
 	return reinterpret_cast<void *>(pattern->userStyleIndex);
 }
 
-void SyntaxHighlighter::handleUnparsedRegion(TextBuffer *styleBuffer, int pos) {
+void SyntaxHighlighter::handleUnparsedRegion(TextBuffer *styleBuffer, pos_type pos) {
 	HighlightEvent event;
 	event.buffer = styleBuffer;
 	event.pos    = pos;
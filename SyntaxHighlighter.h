@@ -13,6 +13,7 @@
 #include <QMap>
 #include <QStringList>
 #include <memory>
+#include <vector>
 
 /* Maximum allowed number of styles (also limited by representation of
    styles as a byte - 'b') */
@@ -84,12 +85,20 @@ public:
 
 public:
 	virtual void bufferModified(const ModifyEvent *event) override;
+	virtual void bufferLoaded(const ModifyEvent *event) override;
+	virtual DeletedTextNeeds deletedTextNeeds() const override;
     virtual void unfinishedHighlightEncountered(const HighlightEvent *event) override;
 
 public:
 	TextBuffer *styleBuffer() const;
 	StyleTableEntry *styleEntry(int index) const;
-	void* GetHighlightInfo(int pos);
+	void* GetHighlightInfo(pos_type pos);
+	size_t patternMemoryUsage() const;
+	size_t styleMemoryUsage() const;
+	void compactStyles();
+	void releaseStyles();
+	void parseLater(TextBuffer *buf, pos_type pos);
+	void restoreStyles(TextBuffer *buf);
 
 private:
 	HighlightData *createHighlightData(PatternSet *patSet);
@@ -106,24 +115,25 @@ private:
 	bool FontOfNamedStyleIsItalic(const QString &styleName);
 	bool NamedStyleExists(const QString &styleName);
 	bool isParentStyle(const char_type *parentStyles, int style1, int style2);
-	bool parseString(const HighlightDataRecord *pattern, const char_type **string, char_type **styleString, int length, char_type *prevChar, MatchFlags flags, const char_type *delimiters, const char_type *lookBehindTo, const char_type *match_till);
+	bool parseString(const HighlightDataRecord *pattern, const char_type **string, char_type **styleString, pos_type length, char_type *prevChar, MatchFlags flags, const char_type *delimiters, const char_type *lookBehindTo, const char_type *match_till);
 	int IndexOfNamedStyle(const QString &styleName) const;
-	int backwardOneContext(TextBuffer *buf, ReparseContext *context, int fromPos);
-	int findSafeParseRestartPos(TextBuffer *buf, HighlightData *highlightData, int *pos);
+	pos_type backwardOneContext(TextBuffer *buf, ReparseContext *context, pos_type fromPos);
+	int findSafeParseRestartPos(TextBuffer *buf, HighlightData *highlightData, pos_type *pos);
 	int findTopLevelParentIndex(const QVector<HighlightPattern> &patList, int nPats, int index) const;
-	int forwardOneContext(TextBuffer *buf, ReparseContext *context, int fromPos);
+	pos_type forwardOneContext(TextBuffer *buf, ReparseContext *context, pos_type fromPos);
 	int indexOfNamedPattern(const HighlightPattern *patList, int nPats, const QString &patName) const;
 	int indexOfNamedPattern(const QVector<HighlightPattern> &patList, int nPats, const QString &patName) const;
-	int lastModified(TextBuffer *styleBuf) const;
+	pos_type lastModified(TextBuffer *styleBuf) const;
 	int parentStyleOf(const char_type *parentStyles, int style);
-	int parseBufferRange(const HighlightDataRecord *pass1Patterns, const HighlightDataRecord *pass2Patterns, TextBuffer *buf, TextBuffer *styleBuf, ReparseContext *contextRequirements, int beginParse, int endParse, const char_type *delimiters);
+	pos_type parseBufferRange(const HighlightDataRecord *pass1Patterns, const HighlightDataRecord *pass2Patterns, TextBuffer *buf, TextBuffer *styleBuf, ReparseContext *contextRequirements, pos_type beginParse, pos_type endParse, const char_type *delimiters);
 	int patternIsParsable(const HighlightDataRecord *pattern);
 	static HighlightDataRecord *patternOfStyle(HighlightDataRecord *patterns, int style);
 	void fillStyleString(const char_type *&stringPtr, char_type *&stylePtr, const char_type *toPtr, char_type style, char_type *prevChar);
-	void handleUnparsedRegion(TextBuffer *styleBuffer, int pos);
-	void incrementalReparse(HighlightData *highlightData, TextBuffer *buf, int pos, int nInserted, const char_type *delimiters);
-	void modifyStyleBuf(TextBuffer *styleBuf, char_type *styleString, int startPos, int endPos, int firstPass2Style);
-	void passTwoParseString(const HighlightDataRecord *pattern, char_type *string, char_type *styleString, int length, char_type *prevChar, const char_type *delimiters, const char_type *lookBehindTo, const char_type *match_till);
+	void handleUnparsedRegion(TextBuffer *styleBuffer, pos_type pos);
+	void incrementalReparse(HighlightData *highlightData, TextBuffer *buf, pos_type pos, pos_type nInserted, const char_type *delimiters);
+	void parseUpTo(pos_type pos);
+	void modifyStyleBuf(TextBuffer *styleBuf, char_type *styleString, pos_type startPos, pos_type endPos, int firstPass2Style);
+	void passTwoParseString(const HighlightDataRecord *pattern, char_type *string, char_type *styleString, pos_type length, char_type *prevChar, const char_type *delimiters, const char_type *lookBehindTo, const char_type *match_till);
 	void recolorSubexpr(const std::unique_ptr<RegexMatch> &match, int subexpr, int style, const char_type *string, char_type *styleString);
 
 private:
@@ -141,6 +151,24 @@ private:
 
 	/* list of available highlight styles */
 	QVector<HighlightStyleRec *> highlightStyles_;
+
+	/* copies of the text and styles being parsed, kept between parses so
+	   they don't have to be reallocated each time */
+	std::vector<char_type> parseText_;
+	std::vector<char_type> parseStyle_;
+	std::vector<char_type> pass2Text_;
+	std::vector<char_type> pass2Style_;
+
+	/* true while the style buffer has been emptied to save memory (see
+	   releaseStyles), in which case nothing is highlighted */
+	bool stylesReleased_;
+
+	/* after a text is loaded or appended to (see bufferLoaded and parseLater),
+	   pass 1 parsing has only been done up to parsedTo_ in loadedText_: the
+	   rest of the style buffer is UNFINISHED_STYLE.  PARSED_ALL once the
+	   whole text has been parsed. */
+	pos_type parsedTo_;
+	TextBuffer *loadedText_;
 };
 
 #endif
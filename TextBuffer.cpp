@@ -2,7 +2,9 @@
 #include "TextBuffer.h"
 #include "IBufferModifiedHandler.h"
 #include "IPreDeleteHandler.h"
-//#include "Rangeset.h"
+#include "PieceTable.h"
+#include "Rangeset.h"
+#include "TextScan.h"
 
 #include <cstdio>
 #include <cstring>
@@ -10,17 +12,81 @@
 #include <algorithm>
 #include <memory>
 #include <cassert>
+#include <climits>
+
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(USE_WCHAR)
+#define USE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 /* Initial size for the buffer gap (empty space in the buffer where text might
  * be inserted if the user is typing sequential chars) */
 #define PREFERRED_GAP_SIZE 80
+
+/* When the buffer has to grow, the new gap is (at least) this fraction of the
+   new text length, so that a series of inserts reallocates only O(log n)
+   times rather than once every PREFERRED_GAP_SIZE characters */
+#define GAP_GROWTH_DIVISOR 2
+
+/* A gap larger than both the text and this many characters (left behind by
+   deleting most of a big buffer) is shrunk back down */
+#define GAP_SHRINK_THRESHOLD 65536
+
+/* Granularity (in allocated characters, gap included) of the newline index.
+   Line <-> position queries scan at most one block after an O(log n) walk of
+   the index */
+#define LINE_INDEX_BLOCK_SIZE 2048
 //#define USE_MEMCPY
 //#define USE_STRCPY
 //#define PURIFY
 
 namespace {
 
-void setSelection(Selection *sel, int start, int end) {
+bool isNewline(char_type ch) {
+	return ch == '\n';
+}
+
+bool startsCodePoint(char_type ch) {
+	return !isUtf8Continuation(ch);
+}
+
+/*
+** Turn the plain per block counts in "index" (from element 1 on) into a
+** Fenwick tree in place
+*/
+void makeFenwickTree(std::vector<pos_type> *index) {
+	const pos_type nBlocks = static_cast<pos_type>(index->size()) - 1;
+
+	for (pos_type i = 1; i <= nBlocks; i++) {
+		const pos_type parent = i + (i & -i);
+		if (parent <= nBlocks) {
+			(*index)[parent] += (*index)[i];
+		}
+	}
+}
+
+/*
+** Make sure "out" has room for "length" more characters after the first
+** "used", and return where they go.  The rectangle operations build their
+** output a line at a time with this, so it grows geometrically.
+*/
+char_type *reserveOutput(std::vector<char_type> *out, size_t used, size_t length) {
+	if (out->size() < used + length) {
+		out->resize(std::max(used + length, out->size() * 2));
+	}
+	return out->data() + used;
+}
+
+/* the bit of control character "ch" in a findControlChars mask */
+uint32_t controlCharBit(char_type ch) {
+	const auto c = static_cast<unsigned>(ch);
+	return (c < 32) ? (1u << c) : 0;
+}
+
+void setSelection(Selection *sel, pos_type start, pos_type end) {
 	sel->selected = start != end;
 	sel->zeroWidth = start == end;
 	sel->rectangular = false;
@@ -28,7 +94,7 @@ void setSelection(Selection *sel, int start, int end) {
 	sel->end = std::max(start, end);
 }
 
-void setRectSelect(Selection *sel, int start, int end, int rectStart, int rectEnd) {
+void setRectSelect(Selection *sel, pos_type start, pos_type end, int rectStart, int rectEnd) {
 	sel->selected = rectStart < rectEnd;
 	sel->zeroWidth = rectStart == rectEnd;
 	sel->rectangular = true;
@@ -38,7 +104,81 @@ void setRectSelect(Selection *sel, int start, int end, int rectStart, int rectEn
 	sel->rectEnd = rectEnd;
 }
 
-bool getSelectionPos(const Selection &sel, int *start, int *end, bool *isRect, int *rectStart, int *rectEnd) {
+/*
+** Make the contents of file "path" available as a block of "length"
+** characters which is never going to change.  Where possible the file is
+** mapped rather than read, in which case the block unmaps it when freed.
+** Returns nullptr if the file can't be read.
+*/
+std::shared_ptr<const char_type> loadFileBlock(const char *path, pos_type *length) {
+#ifdef USE_MMAP
+	const int fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		return nullptr;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size > PTRDIFF_MAX) {
+		close(fd);
+		return nullptr;
+	}
+
+	const size_t size = static_cast<size_t>(st.st_size);
+
+	/* mmap won't map an empty file */
+	if (size == 0) {
+		close(fd);
+		*length = 0;
+		return std::shared_ptr<const char_type>(new char_type[1], std::default_delete<char_type[]>());
+	}
+
+	void *addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) {
+		return nullptr;
+	}
+
+	*length = static_cast<pos_type>(size);
+	return std::shared_ptr<const char_type>(static_cast<const char_type *>(addr), [size](const char_type *p) {
+		munmap(const_cast<char_type *>(p), size);
+	});
+#else
+	FILE *fp = fopen(path, "rb");
+	if (!fp) {
+		return nullptr;
+	}
+
+	std::vector<char_type> text;
+	int ch;
+	while ((ch = fgetc(fp)) != EOF) {
+		text.push_back(static_cast<unsigned char>(ch));
+	}
+	fclose(fp);
+
+	auto block = new char_type[text.size() + 1];
+	std::copy(text.begin(), text.end(), block);
+	*length = static_cast<pos_type>(text.size());
+	return std::shared_ptr<const char_type>(block, std::default_delete<char_type[]>());
+#endif
+}
+
+/*
+** Let the system reclaim the memory holding a block from loadFileBlock()
+** until it's next needed (the block must not have been modified, which is
+** always true for mapped files)
+*/
+void releaseFileBlock(const char_type *block, pos_type length) {
+#if defined(USE_MMAP) && defined(MADV_DONTNEED)
+	if (length != 0) {
+		madvise(const_cast<char_type *>(block), static_cast<size_t>(length), MADV_DONTNEED);
+	}
+#else
+	(void)block;
+	(void)length;
+#endif
+}
+
+bool getSelectionPos(const Selection &sel, pos_type *start, pos_type *end, bool *isRect, int *rectStart, int *rectEnd) {
 	/* Always fill in the parameters (zero-width can be requested too). */
 	*isRect = sel.rectangular;
 	*start = sel.start;
@@ -55,7 +195,7 @@ bool getSelectionPos(const Selection &sel, int *start, int *end, bool *isRect, i
 /*
 ** Update an individual Selection for changes in the corresponding text
 */
-void updateSelection(Selection *sel, int pos, int nDeleted, int nInserted) {
+void updateSelection(Selection *sel, pos_type pos, pos_type nDeleted, pos_type nInserted) {
 	if ((!sel->selected && !sel->zeroWidth) || pos > sel->end) {
 		return;
 	}
@@ -105,7 +245,8 @@ TextBuffer::TextBuffer() : TextBuffer(0) {
 ** avoid unnecessary re-allocation if you know exactly how much the buffer
 ** will need to hold
 */
-TextBuffer::TextBuffer(int requestedSize) {
+TextBuffer::TextBuffer(pos_type requestedSize) {
+	pieces_ = nullptr;
 	length_ = 0;
 	buf_ = new char_type[requestedSize + PREFERRED_GAP_SIZE + 1];
 	buf_[requestedSize + PREFERRED_GAP_SIZE] = _T('\0');
@@ -115,12 +256,25 @@ TextBuffer::TextBuffer(int requestedSize) {
 	tabDist_ = 4;
 	useTabs_ = true;
 	nullSubsChar_ = _T('\0');
-	//    rangesetTable_   = nullptr;
+	rangesetTable_ = nullptr;
 	cursorPosHint_ = 0;
+	batchDepth_ = 0;
+	batchPending_ = false;
+	batchChanged_ = false;
+	batchHasText_ = false;
+	batchStart_ = 0;
+	batchEnd_ = 0;
+	batchDeleted_ = 0;
+	sharedGapStart_ = 0;
+	sharedGapEnd_ = 0;
+	utf8_ = false;
+	controlChars_ = 0;
+	keepNulls_ = false;
 
 #ifdef PURIFY
 	std::fill_n(&buf_[gapStart_], gapEnd_ - gapStart_, '.');
 #endif
+	lineIndexRebuild();
 }
 
 /*
@@ -128,8 +282,9 @@ TextBuffer::TextBuffer(int requestedSize) {
 */
 TextBuffer::~TextBuffer() {
 
-	delete[] buf_;
-	//	delete rangesetTable_;
+	releaseBuf();
+	delete pieces_;
+	delete rangesetTable_;
 }
 
 /*
@@ -139,13 +294,7 @@ TextBuffer::~TextBuffer() {
 String TextBuffer::BufGetAll() const {
 
 	auto text = new char_type[length_ + 1];
-#ifdef USE_MEMCPY
-	memcpy(&text[0], buf_, gapStart_);
-	memcpy(&text[gapStart_], &buf_[gapEnd_], length_ - gapStart_);
-#else
-	std::copy_n(buf_, gapStart_, &text[0]);
-	std::copy_n(&buf_[gapEnd_], length_ - gapStart_, &text[gapStart_]);
-#endif
+	copyRange(0, length_, text);
 	text[length_] = '\0';
 
 	return String(text, length_);
@@ -158,12 +307,21 @@ String TextBuffer::BufGetAll() const {
 ** NB DO NOT ALTER THE TEXT THROUGH THE RETURNED POINTER!
 ** (we make an exception in BufSubstituteNullChars() however)
 ** This function is intended ONLY to provide a searchable string without copying
-** into a temporary buffer.
+** into a temporary buffer.  (In piece table mode a copy has to be made, but it
+** is kept until the buffer is next modified)
 */
 const char_type *TextBuffer::BufAsString() {
-	int bufLen = length_;
-	int leftLen = gapStart_;
-	int rightLen = bufLen - leftLen;
+
+	if (pieces_) {
+		if (!flatText_.str) {
+			flatText_ = BufGetAll();
+		}
+		return flatText_.str;
+	}
+
+	pos_type bufLen = length_;
+	pos_type leftLen = gapStart_;
+	pos_type rightLen = bufLen - leftLen;
 
 	/* find where best to put the gap to minimise memory movement */
 	if (leftLen != 0 && rightLen != 0) {
@@ -174,8 +332,12 @@ const char_type *TextBuffer::BufAsString() {
 	/* get the start position of the actual data */
 	char_type *text = &buf_[(leftLen == 0) ? gapEnd_ : 0];
 
-	/* make sure it's null-terminated */
-	text[bufLen] = '\0';
+	/* make sure it's null-terminated (the end of the storage always is) */
+	if (leftLen != 0) {
+		unshareBuf(gapStart_, gapStart_ + 1);
+		text = buf_;
+		text[bufLen] = '\0';
+	}
 
 	return text;
 }
@@ -184,41 +346,269 @@ const char_type *TextBuffer::BufAsString() {
 ** Replace the entire contents of the text buffer
 */
 void TextBuffer::BufSetAll(const char_type *text) {
-	const int length = static_cast<int>(traits_type::length(text));
+	const pos_type length = static_cast<pos_type>(traits_type::length(text));
 	BufSetAll(text, length);
 }
 
-void TextBuffer::BufSetAll(const char_type *text, int length) {
+void TextBuffer::BufSetAll(const char_type *text, pos_type length) {
 
 	callPreDeleteCBs(0, length_);
 
 	/* Save information for redisplay, and get rid of the old buffer */
-	auto deletedText = BufGetAll();
-	int deletedLength = length_;
-	delete[] buf_;
+	pos_type nDeletedLines;
+	const String deletedText = saveDeletedText(0, length_, &nDeletedLines);
+	pos_type deletedLength = length_;
+
+	loadText(text, _T('\0'), length);
+
+	/* Zero all of the existing selections */
+	updateSelections(0, deletedLength, 0);
+
+	/* Call the saved display routine(s) to update the screen */
+	callModifyCBs(0, deletedLength, length, 0, nDeletedLines, deletedText.str);
+}
+
+/*
+** Replace the entire contents of the text buffer, as when opening a file.
+** Unlike BufSetAll, the old text is not kept for the modify callbacks, which
+** are told with bufferLoaded rather than bufferModified so that they can
+** start afresh instead of working out what changed.  Any pending batch is
+** reported first, and the load itself is never merged into one.
+*/
+void TextBuffer::BufLoad(const char_type *text, pos_type length) {
+
+	flushBatch();
+	callPreDeleteCBs(0, length_);
+
+	const pos_type deletedLength = length_;
+	const pos_type nDeletedLines = BufCountLines(0, length_);
+
+	loadText(text, _T('\0'), length);
+	updateSelections(0, deletedLength, 0);
+	notifyModifyCBs(0, deletedLength, length, 0, nDeletedLines, nullptr, true);
+}
+
+/*
+** Like BufLoad, but the new contents are "length" copies of "ch", e.g. to
+** start off a style buffer for a newly loaded text
+*/
+void TextBuffer::BufLoadFilled(char_type ch, pos_type length) {
+
+	flushBatch();
+	callPreDeleteCBs(0, length_);
+
+	const pos_type deletedLength = length_;
+	const pos_type nDeletedLines = BufCountLines(0, length_);
+
+	loadText(nullptr, ch, length);
+	updateSelections(0, deletedLength, 0);
+	notifyModifyCBs(0, deletedLength, length, 0, nDeletedLines, nullptr, true);
+}
+
+/*
+** Make the contents of the buffer "length" characters copied from "text" or,
+** if "text" is nullptr, "length" copies of "fill", telling nobody.  The text
+** is taken a block of the line index at a time, and each block is counted
+** for the indexes and checked for control characters while it is still in
+** the cache, so the whole text is only gone through once.
+*/
+void TextBuffer::loadText(const char_type *text, char_type fill, pos_type length) {
+
+	keepNulls_ = false;
+
+	if (pieces_) {
+		if (text) {
+			*pieces_ = PieceTable(text, length);
+		} else {
+			const std::vector<char_type> filled(length, fill);
+			*pieces_ = PieceTable(filled.data(), length);
+		}
 
-	/* Start a new buffer with a gap of PREFERRED_GAP_SIZE in the center */
+		flatText_ = String();
+		length_ = length;
+
+		/* found out when first needed (see BufSubstituteNullChars) */
+		controlChars_ = ~0u;
+		return;
+	}
+
+	releaseBuf();
+
+	/* the gap goes at the end, so the text is stored just as it is given */
 	buf_ = new char_type[length + PREFERRED_GAP_SIZE + 1];
 	buf_[length + PREFERRED_GAP_SIZE] = '\0';
 	length_ = length;
-	gapStart_ = length / 2;
-	gapEnd_ = gapStart_ + PREFERRED_GAP_SIZE;
-#ifdef USE_MEMCPY
-	memcpy(buf_, text, gapStart_);
-	memcpy(&buf_[gapEnd_], &text[gapStart_], length - gapStart_);
-#else
-	std::copy_n(text, gapStart_, buf_);
-	std::copy_n(&text[gapStart_], length - gapStart_, &buf_[gapEnd_]);
-#endif
+	gapStart_ = length;
+	gapEnd_ = length + PREFERRED_GAP_SIZE;
 #ifdef PURIFY
 	std::fill_n(&buf_[gapStart_], gapEnd_ - gapStart_, '.');
 #endif
 
+	const pos_type nBlocks = (length + PREFERRED_GAP_SIZE) / LINE_INDEX_BLOCK_SIZE + 1;
+	const CharSet nullSubs(nullSubsChar_);
+
+	lineIndex_.assign(nBlocks + 1, 0);
+	codePointIndex_.assign(utf8_ ? nBlocks + 1 : 0, 0);
+	nullSubsBlocks_.assign(nullSubsChar_ != '\0' ? nBlocks : 0, false);
+	controlChars_ = 0;
+
+	for (pos_type start = 0; start < length; start += LINE_INDEX_BLOCK_SIZE) {
+		const pos_type block = start / LINE_INDEX_BLOCK_SIZE;
+		const pos_type n = std::min<pos_type>(LINE_INDEX_BLOCK_SIZE, length - start);
+		char_type *const chars = &buf_[start];
+
+		if (text) {
+#ifdef USE_MEMCPY
+			memcpy(chars, &text[start], n);
+#else
+			std::copy_n(&text[start], n, chars);
+#endif
+		} else {
+			std::fill_n(chars, n, fill);
+		}
+
+		lineIndex_[block + 1] = countNewlines(chars, n);
+
+		if (utf8_) {
+			codePointIndex_[block + 1] = countCodePoints(chars, n);
+		}
+
+		if (!nullSubsBlocks_.empty()) {
+			nullSubsBlocks_[block] = findFirstOf(chars, n, nullSubs) != nullptr;
+		}
+
+		controlChars_ |= findControlChars(chars, n);
+	}
+
+	makeFenwickTree(&lineIndex_);
+	makeFenwickTree(&codePointIndex_);
+}
+
+/*
+** Replace the entire contents of the text buffer with those of the file
+** "path", switching the buffer to piece table mode (see
+** BufSetUsePieceTable).  Where the system supports it, the file is memory
+** mapped instead of being read in, and the mapping becomes the original text
+** of the piece table: only the text which gets edited is ever copied, so
+** opening even a huge file takes little memory (the file is read through
+** once to index its lines).  The file must not be modified by anyone else
+** while the buffer still refers to it.  NUL characters are not substituted,
+** neither the file's nor those of text later put into the buffer (so the
+** file never has to be scanned or copied for them); files which may contain
+** them should be loaded with BufLoad instead.  The modify callbacks are told
+** as for BufLoad.  Returns false (leaving the buffer unchanged) if the file
+** can't be read.
+*/
+bool TextBuffer::BufLoadMapped(const char *path) {
+
+	pos_type length;
+	auto block = loadFileBlock(path, &length);
+	if (!block) {
+		return false;
+	}
+
+	flushBatch();
+	callPreDeleteCBs(0, length_);
+
+	const pos_type deletedLength = length_;
+	const pos_type nDeletedLines = BufCountLines(0, length_);
+
+	if (!pieces_) {
+		releaseBuf();
+		buf_ = nullptr;
+		gapStart_ = 0;
+		gapEnd_ = 0;
+		lineIndex_.clear();
+		codePointIndex_.clear();
+		nullSubsBlocks_.clear();
+		pieces_ = new PieceTable();
+	}
+
+	*pieces_ = PieceTable(block, length);
+	flatText_ = String();
+	length_ = length;
+
+	/* the control characters of the file are found out when they are first
+	   needed (see BufSubstituteNullChars) */
+	controlChars_ = ~0u;
+	nullSubsChar_ = '\0';
+	keepNulls_ = true;
+
+	/* building the piece table read the whole file, but none of it needs
+	   to stay in memory */
+	releaseFileBlock(block.get(), length);
+
 	/* Zero all of the existing selections */
 	updateSelections(0, deletedLength, 0);
 
 	/* Call the saved display routine(s) to update the screen */
-	callModifyCBs(0, deletedLength, length, 0, deletedText.str);
+	notifyModifyCBs(0, deletedLength, length, 0, nDeletedLines, nullptr, true);
+	return true;
+}
+
+/*
+** Make room for at least "length" more characters to be inserted without the
+** buffer having to be reallocated, e.g. before adding text in many pieces
+** whose total size is known.  The room lasts until it is used up, or until
+** the buffer is replaced (BufSetAll) or shrunk after a large deletion.  Does
+** nothing in piece table mode, where inserts never copy existing text.
+*/
+void TextBuffer::BufReserve(pos_type length) {
+
+	if (pieces_ || length <= gapEnd_ - gapStart_) {
+		return;
+	}
+
+	reallocateBuf(gapStart_, length);
+}
+
+/*
+** Report the memory used by the buffer, by component
+*/
+TextBufferMemoryUsage TextBuffer::BufMemoryUsage() const {
+
+	TextBufferMemoryUsage usage;
+	usage.text = static_cast<size_t>(length_) * sizeof(char_type);
+
+	if (pieces_) {
+		size_t nodeBytes;
+		size_t spareBytes;
+		pieces_->memoryUsage(&nodeBytes, &spareBytes);
+		usage.gap = spareBytes * sizeof(char_type);
+		usage.indexes = nodeBytes;
+	} else {
+		usage.gap = static_cast<size_t>(gapEnd_ - gapStart_ + 1) * sizeof(char_type);
+		usage.indexes = (lineIndex_.capacity() + codePointIndex_.capacity()) * sizeof(pos_type) + nullSubsBlocks_.capacity() / 8;
+	}
+
+	usage.markers = markers_.memoryUsage() + (rangesetTable_ ? rangesetTable_->memoryUsage() : 0);
+	usage.other = static_cast<size_t>(flatText_.len) * sizeof(char_type) + batchText_.capacity() * sizeof(char_type);
+	usage.total = usage.text + usage.gap + usage.indexes + usage.markers + usage.other;
+	return usage;
+}
+
+/*
+** Give back memory the buffer holds on to without needing it: a gap larger
+** than PREFERRED_GAP_SIZE, the copy of the text made by BufAsString in piece
+** table mode (pointers returned by BufAsString are no longer valid), and any
+** spare room in the indexes.  For when memory is short, since growing again
+** will have to reallocate.
+*/
+void TextBuffer::BufCompact() {
+
+	if (pieces_) {
+		flatText_ = String();
+	} else if (gapEnd_ - gapStart_ > PREFERRED_GAP_SIZE) {
+		reallocateBuf(gapStart_, PREFERRED_GAP_SIZE);
+	}
+
+	if (!batchPending_) {
+		std::vector<char_type>().swap(batchText_);
+	}
+
+	lineIndex_.shrink_to_fit();
+	codePointIndex_.shrink_to_fit();
+	nullSubsBlocks_.shrink_to_fit();
 }
 
 /*
@@ -226,9 +616,8 @@ void TextBuffer::BufSetAll(const char_type *text, int length) {
 ** from text buffer "buf".  Positions start at 0, and the range does not
 ** include the character pointed to by "end"
 */
-String TextBuffer::BufGetRange(int start, int end) const {
-	int length;
-	int part1Length;
+String TextBuffer::BufGetRange(pos_type start, pos_type end) const {
+	pos_type length;
 
 	/* Make sure start and end are ok, and allocate memory for returned string.
 	   If start is bad, return "", if end is bad, adjust it. */
@@ -239,7 +628,7 @@ String TextBuffer::BufGetRange(int start, int end) const {
 	}
 
 	if (end < start) {
-		int temp = start;
+		pos_type temp = start;
 		start = end;
 		end = temp;
 	}
@@ -252,172 +641,422 @@ String TextBuffer::BufGetRange(int start, int end) const {
 	auto text = new char_type[length + 1];
 
 	/* Copy the text from the buffer to the returned string */
-#ifdef USE_MEMCPY
-	if (end <= gapStart_) {
-		memcpy(text, &buf_[start], length);
-	} else if (start >= gapStart_) {
-		memcpy(text, &buf_[start + (gapEnd_ - gapStart_)], length);
-	} else {
-		part1Length = gapStart_ - start;
-		memcpy(text, &buf_[start], part1Length);
-		memcpy(&text[part1Length], &buf_[gapEnd_], length - part1Length);
-	}
-#else
-	if (end <= gapStart_) {
-		std::copy_n(&buf_[start], length, text);
-	} else if (start >= gapStart_) {
-		std::copy_n(&buf_[start + (gapEnd_ - gapStart_)], length, text);
-	} else {
-		part1Length = gapStart_ - start;
-		std::copy_n(&buf_[start], part1Length, text);
-		std::copy_n(&buf_[gapEnd_], length - part1Length, &text[part1Length]);
-	}
-#endif
+	copyRange(start, end, text);
 	text[length] = '\0';
 	return String(text, length);
 }
 
 /*
-** Return the character at buffer position "pos".  Positions start at 0.
+** Return a view of the text between "start" and "end" character positions
+** (see BufGetRange) without copying it.  Use this rather than BufGetRange
+** wherever the text is only read.
 */
-char_type TextBuffer::BufGetCharacter(int pos) const {
-	if (pos < 0 || pos >= length_) {
-		return '\0';
+TextView TextBuffer::BufGetView(pos_type start, pos_type end) const {
+	TextView view;
+
+	/* Make sure start and end are ok.  If start is bad, return an empty view,
+	   if end is bad, adjust it. */
+	if (start < 0 || start > length_) {
+		return view;
 	}
 
-	if (pos < gapStart_) {
-		return buf_[pos];
-	} else {
-		return buf_[pos + gapEnd_ - gapStart_];
+	if (end < start) {
+		std::swap(start, end);
 	}
-}
 
-void TextBuffer::BufSetCharacter(int pos, char_type ch) {
-	if (pos < 0 || pos >= length_) {
-		return;
+	if (end > length_) {
+		end = length_;
 	}
 
-	if (pos < gapStart_) {
-		buf_[pos] = ch;
+	const pos_type length = end - start;
+	if (length == 0) {
+		return view;
+	}
+
+	if (pieces_) {
+		view.text1 = pieces_->span(start, &view.length1);
+		if (view.length1 >= length) {
+			view.length1 = length;
+			return view;
+		}
+
+		view.text2 = pieces_->span(start + view.length1, &view.length2);
+		if (view.length1 + view.length2 >= length) {
+			view.length2 = length - view.length1;
+			return view;
+		}
+
+		/* too many pieces, fall back to a copy */
+		view.storage = BufGetRange(start, end);
+		view.text1 = view.storage.str;
+		view.length1 = length;
+		view.text2 = nullptr;
+		view.length2 = 0;
+		return view;
+	}
+
+	if (end <= gapStart_) {
+		view.text1 = &buf_[start];
+		view.length1 = length;
+	} else if (start >= gapStart_) {
+		view.text1 = &buf_[start + (gapEnd_ - gapStart_)];
+		view.length1 = length;
 	} else {
-		buf_[pos + gapEnd_ - gapStart_] = ch;
+		view.text1 = &buf_[start];
+		view.length1 = gapStart_ - start;
+		view.text2 = &buf_[gapEnd_];
+		view.length2 = end - gapStart_;
 	}
+
+	return view;
 }
 
 /*
-** Insert null-terminated string "text" at position "pos" in "buf"
+** Copy the text of the view to "outStr" (which is not null-terminated)
 */
-void TextBuffer::BufInsert(int pos, const char_type *text) {
-	int length = static_cast<int>(traits_type::length(text));
-	BufInsert(pos, text, length);
+void TextView::copy(char_type *outStr) const {
+	std::copy_n(text1, length1, outStr);
+	std::copy_n(text2, length2, outStr + length1);
 }
 
 /*
-** Insert null-terminated string "text" at position "pos" in "buf"
+** Return an unchanging copy of the current text of the buffer (see
+** TextSnapshot), for reading it e.g. from another thread.  Doesn't copy the
+** text, though in gap buffer mode, the buffer has to copy it later if edits
+** reach text that any snapshot still shares.
 */
-void TextBuffer::BufInsert(int pos, const char_type *text, int length) {
-	int nInserted;
+TextSnapshot TextBuffer::BufSnapshot() {
+	TextSnapshot snapshot;
+	snapshot.length_ = length_;
 
-	/* if pos is not contiguous to existing text, make it */
-	if (pos > length_)
-		pos = length_;
-	if (pos < 0)
-		pos = 0;
+	if (pieces_) {
+		snapshot.pieces_ = std::make_shared<const PieceTable>(*pieces_);
+		return snapshot;
+	}
 
-	/* Even if nothing is deleted, we must call these callbacks */
-	callPreDeleteCBs(pos, 0);
+	if (!bufOwner_) {
+		bufOwner_ = std::shared_ptr<char_type>(buf_, std::default_delete<char_type[]>());
+	}
 
-	/* insert and redisplay */
-	nInserted = insert(pos, text, length);
-	cursorPosHint_ = pos + nInserted;
-	callModifyCBs(pos, 0, nInserted, 0, nullptr);
+	/* what is in the gap now can still be overwritten, unless older
+	   snapshots can see it */
+	if (bufOwner_.use_count() > 1) {
+		sharedGapStart_ = std::max(sharedGapStart_, gapStart_);
+		sharedGapEnd_ = std::min(sharedGapEnd_, gapEnd_);
+	} else {
+		sharedGapStart_ = gapStart_;
+		sharedGapEnd_ = gapEnd_;
+	}
+
+	snapshot.block_ = bufOwner_;
+	snapshot.gapStart_ = gapStart_;
+	snapshot.gapEnd_ = gapEnd_;
+	return snapshot;
 }
 
 /*
-** Delete the characters between "start" and "end", and insert the
-** null-terminated string "text" in their place in in "buf"
+** Create an empty snapshot
 */
-void TextBuffer::BufReplace(int start, int end, const char_type *text) {
-	const int length = static_cast<int>(traits_type::length(text));
-	BufReplace(start, end, text, length);
+TextSnapshot::TextSnapshot() : gapStart_(0), gapEnd_(0), length_(0) {
 }
 
 /*
-** Delete the characters between "start" and "end", and insert the
-** null-terminated string "text" in their place in in "buf"
+** Return the number of characters in the snapshot
 */
-void TextBuffer::BufReplace(int start, int end, const char_type *text, int length) {
-	int nInserted = length;
-
-	callPreDeleteCBs(start, end - start);
-	String deletedText = BufGetRange(start, end);
-	deleteRange(start, end);
-	insert(start, text, nInserted);
-	cursorPosHint_ = start + nInserted;
-	callModifyCBs(start, end - start, nInserted, 0, deletedText.str);
+pos_type TextSnapshot::length() const {
+	return length_;
 }
 
-void TextBuffer::BufRemove(int start, int end) {
-	/* Make sure the arguments make sense */
-	if (start > end) {
-		int temp = start;
-		start = end;
-		end = temp;
+/*
+** Return the character at position "pos" ('\0' if outside of the text)
+*/
+char_type TextSnapshot::at(pos_type pos) const {
+	if (pos < 0 || pos >= length_) {
+		return '\0';
 	}
-	if (start > length_)
-		start = length_;
-	if (start < 0)
-		start = 0;
-	if (end > length_)
-		end = length_;
-	if (end < 0)
-		end = 0;
 
-	callPreDeleteCBs(start, end - start);
-	/* Remove and redisplay */
-	String deletedText = BufGetRange(start, end);
-	deleteRange(start, end);
-	cursorPosHint_ = start;
-	callModifyCBs(start, end - start, 0, 0, deletedText.str);
+	if (pieces_) {
+		return pieces_->at(pos);
+	}
+
+	return block_.get()[(pos < gapStart_) ? pos : pos + (gapEnd_ - gapStart_)];
 }
 
-void TextBuffer::BufCopyFromBuf(TextBuffer *toBuf, int fromStart, int fromEnd, int toPos) {
-	const int length = fromEnd - fromStart;
-	int part1Length;
+/*
+** Return a pointer to the text starting at position "pos" and, in
+** "spanLength", how many characters can be read from it contiguously (nullptr
+** and zero at the end of the text)
+*/
+const char_type *TextSnapshot::span(pos_type pos, pos_type *spanLength) const {
+	if (pos < 0 || pos >= length_) {
+		*spanLength = 0;
+		return nullptr;
+	}
 
-	/* Prepare the buffer to receive the new text.  If the new text fits in
-	   the current buffer, just move the gap (if necessary) to where
-	   the text should be inserted.  If the new text is too large, reallocate
-	   the buffer with a gap large enough to accomodate the new text and a
-	   gap of PREFERRED_GAP_SIZE */
-	if (length > toBuf->gapEnd_ - toBuf->gapStart_) {
-		toBuf->reallocateBuf(toPos, length + PREFERRED_GAP_SIZE);
-	} else if (toPos != toBuf->gapStart_) {
-		toBuf->moveGap(toPos);
+	if (pieces_) {
+		return pieces_->span(pos, spanLength);
 	}
 
-	/* Insert the new text (toPos now corresponds to the start of the gap) */
-#ifdef USE_MEMCPY
-	if (fromEnd <= gapStart_) {
-		memcpy(&toBuf->buf_[toPos], &buf_[fromStart], length);
-	} else if (fromStart >= gapStart_) {
-		memcpy(&toBuf->buf_[toPos], &buf_[fromStart + (gapEnd_ - gapStart_)], length);
-	} else {
-		part1Length = gapStart_ - fromStart;
-		memcpy(&toBuf->buf_[toPos], &buf_[fromStart], part1Length);
-		memcpy(&toBuf->buf_[toPos + part1Length], &buf_[gapEnd_], length - part1Length);
+	if (pos < gapStart_) {
+		*spanLength = gapStart_ - pos;
+		return block_.get() + pos;
 	}
-#else
-	if (fromEnd <= gapStart_) {
-		std::copy_n(&buf_[fromStart], length, &toBuf->buf_[toPos]);
-	} else if (fromStart >= gapStart_) {
-		std::copy_n(&buf_[fromStart + (gapEnd_ - gapStart_)], length, &toBuf->buf_[toPos]);
+
+	*spanLength = length_ - pos;
+	return block_.get() + pos + (gapEnd_ - gapStart_);
+}
+
+/*
+** Copy the text between "start" and "end" to "outStr" (which is not
+** null-terminated)
+*/
+void TextSnapshot::copy(pos_type start, pos_type end, char_type *outStr) const {
+	while (start < end) {
+		pos_type spanLength;
+		const char_type *text = span(start, &spanLength);
+		spanLength = std::min(spanLength, end - start);
+		outStr = std::copy_n(text, spanLength, outStr);
+		start += spanLength;
+	}
+}
+
+/*
+** Return a copy of the text between "start" and "end", adjusted like the
+** range of TextBuffer::BufGetRange
+*/
+String TextSnapshot::range(pos_type start, pos_type end) const {
+
+	if (start < 0 || start > length_) {
+		start = end = 0;
+	}
+
+	if (end < start) {
+		std::swap(start, end);
+	}
+
+	end = std::min(end, length_);
+
+	auto text = new char_type[end - start + 1];
+	copy(start, end, text);
+	text[end - start] = '\0';
+	return String(text, end - start);
+}
+
+/*
+** Return the character at buffer position "pos".  Positions start at 0.
+*/
+char_type TextBuffer::BufGetCharacter(pos_type pos) const {
+	if (pos < 0 || pos >= length_) {
+		return '\0';
+	}
+
+	if (pieces_) {
+		return pieces_->at(pos);
+	}
+
+	if (pos < gapStart_) {
+		return buf_[pos];
 	} else {
-		part1Length = gapStart_ - fromStart;
-		std::copy_n(&buf_[fromStart], part1Length, &toBuf->buf_[toPos]);
-		std::copy_n(&buf_[gapEnd_], length - part1Length, &toBuf->buf_[toPos + part1Length]);
+		return buf_[pos + gapEnd_ - gapStart_];
 	}
-#endif
+}
+
+void TextBuffer::BufSetCharacter(pos_type pos, char_type ch) {
+	if (pos < 0 || pos >= length_) {
+		return;
+	}
+
+	controlChars_ |= findControlChars(&ch, 1);
+
+	if (pieces_) {
+		pieces_->remove(pos, pos + 1);
+		pieces_->insert(pos, &ch, 1);
+		flatText_ = String();
+		return;
+	}
+
+	const pos_type physPos = (pos < gapStart_) ? pos : pos + gapEnd_ - gapStart_;
+
+	unshareBuf(physPos, physPos + 1);
+	lineIndexUpdate(physPos, physPos + 1, -1);
+	buf_[physPos] = ch;
+	lineIndexUpdate(physPos, physPos + 1, 1);
+}
+
+/*
+** Insert null-terminated string "text" at position "pos" in "buf"
+*/
+void TextBuffer::BufInsert(pos_type pos, const char_type *text) {
+	pos_type length = static_cast<pos_type>(traits_type::length(text));
+	BufInsert(pos, text, length);
+}
+
+/*
+** Insert null-terminated string "text" at position "pos" in "buf"
+*/
+void TextBuffer::BufInsert(pos_type pos, const char_type *text, pos_type length) {
+	pos_type nInserted;
+
+	/* if pos is not contiguous to existing text, make it */
+	if (pos > length_)
+		pos = length_;
+	if (pos < 0)
+		pos = 0;
+
+	/* Even if nothing is deleted, we must call these callbacks */
+	callPreDeleteCBs(pos, 0);
+
+	/* insert and redisplay */
+	nInserted = insert(pos, text, length);
+	cursorPosHint_ = pos + nInserted;
+	callModifyCBs(pos, 0, nInserted, 0, 0, nullptr);
+}
+
+/*
+** Add "length" characters from "text" to the end of the buffer, for text
+** which arrives a piece at a time (a log file being followed, the output of
+** a process).  Unlike BufInsert, this leaves the cursor position hint alone.
+** The gap stays at the end, growing in proportion to the text when it runs
+** out (see prepareGap), so each append only copies the new text.
+*/
+void TextBuffer::BufAppend(const char_type *text, pos_type length) {
+	const pos_type pos = length_;
+
+	/* Even if nothing is deleted, we must call these callbacks */
+	callPreDeleteCBs(pos, 0);
+
+	const pos_type nInserted = insert(pos, text, length);
+	callModifyCBs(pos, 0, nInserted, 0, 0, nullptr);
+}
+
+/*
+** Delete the characters between "start" and "end", and insert the
+** null-terminated string "text" in their place in in "buf"
+*/
+void TextBuffer::BufReplace(pos_type start, pos_type end, const char_type *text) {
+	const pos_type length = static_cast<pos_type>(traits_type::length(text));
+	BufReplace(start, end, text, length);
+}
+
+/*
+** Delete the characters between "start" and "end", and insert the
+** null-terminated string "text" in their place in in "buf"
+*/
+void TextBuffer::BufReplace(pos_type start, pos_type end, const char_type *text, pos_type length) {
+	pos_type nInserted = length;
+
+	callPreDeleteCBs(start, end - start);
+	pos_type nDeletedLines;
+	const String deletedText = saveDeletedText(start, end, &nDeletedLines);
+	deleteRange(start, end);
+	insert(start, text, nInserted);
+	shrinkGap();
+	cursorPosHint_ = start + nInserted;
+	callModifyCBs(start, end - start, nInserted, 0, nDeletedLines, deletedText.str);
+}
+
+/*
+** Replace several ranges of the buffer at once.  "replacements" must be
+** sorted by position and must not overlap.  The whole area from the start of
+** the first range to the end of the last is rebuilt in a single pass (instead
+** of moving the gap, and maybe reallocating, once per range), and is reported
+** to the modify callbacks as one replacement.  Selections are updated for
+** that area as a whole, but markers and rangesets are moved for each range,
+** so that those on the text in between keep their places.
+*/
+void TextBuffer::BufReplaceMultiple(const TextReplacement *replacements, int nReplacements) {
+
+	if (nReplacements <= 0) {
+		return;
+	}
+
+	const pos_type start = replacements[0].start;
+	const pos_type end = replacements[nReplacements - 1].end;
+	const pos_type oldLength = length_;
+
+	callPreDeleteCBs(start, end - start);
+	pos_type nDeletedLines;
+	const String deletedText = saveDeletedText(start, end, &nDeletedLines);
+
+	for (int i = 0; i < nReplacements; i++) {
+		controlChars_ |= findControlChars(replacements[i].text, replacements[i].length);
+	}
+
+	if (pieces_) {
+		/* going backwards leaves the positions of the earlier ranges valid */
+		for (int i = nReplacements - 1; i >= 0; i--) {
+			const TextReplacement &r = replacements[i];
+			pieces_->remove(r.start, r.end);
+			pieces_->insert(r.start, r.text, r.length);
+			length_ += r.length - (r.end - r.start);
+		}
+		flatText_ = String();
+	} else {
+		replaceRanges(replacements, nReplacements);
+	}
+
+	const pos_type nInserted = end - start + (length_ - oldLength);
+	updateSelection(&primary_, start, end - start, nInserted);
+	updateSelection(&secondary_, start, end - start, nInserted);
+	updateSelection(&highlight_, start, end - start, nInserted);
+
+	for (int i = nReplacements - 1; i >= 0; i--) {
+		const TextReplacement &r = replacements[i];
+		markers_.update(r.start, r.end - r.start, r.length);
+
+		if (rangesetTable_) {
+			rangesetTable_->update(r.start, r.end - r.start, r.length);
+		}
+	}
+
+	shrinkGap();
+	cursorPosHint_ = start + nInserted;
+	callModifyCBs(start, end - start, nInserted, 0, nDeletedLines, deletedText.str);
+}
+
+void TextBuffer::BufRemove(pos_type start, pos_type end) {
+	/* Make sure the arguments make sense */
+	if (start > end) {
+		pos_type temp = start;
+		start = end;
+		end = temp;
+	}
+	if (start > length_)
+		start = length_;
+	if (start < 0)
+		start = 0;
+	if (end > length_)
+		end = length_;
+	if (end < 0)
+		end = 0;
+
+	callPreDeleteCBs(start, end - start);
+	/* Remove and redisplay */
+	pos_type nDeletedLines;
+	const String deletedText = saveDeletedText(start, end, &nDeletedLines);
+	deleteRange(start, end);
+	shrinkGap();
+	cursorPosHint_ = start;
+	callModifyCBs(start, end - start, 0, 0, nDeletedLines, deletedText.str);
+}
+
+void TextBuffer::BufCopyFromBuf(TextBuffer *toBuf, pos_type fromStart, pos_type fromEnd, pos_type toPos) {
+	const pos_type length = fromEnd - fromStart;
+
+	if (toBuf->pieces_) {
+		auto text = BufGetRange(fromStart, fromEnd);
+		toBuf->insert(toPos, text.str, length);
+		return;
+	}
+
+	/* Prepare the buffer to receive the new text */
+	toBuf->prepareGap(toPos, length);
+
+	/* Insert the new text (toPos now corresponds to the start of the gap) */
+	toBuf->controlChars_ |= controlChars_;
+	toBuf->unshareBuf(toPos, toPos + length);
+	copyRange(fromStart, fromEnd, &toBuf->buf_[toPos]);
+	toBuf->lineIndexUpdate(toPos, toPos + length, 1);
 	toBuf->gapStart_ += length;
 	toBuf->length_ += length;
 	toBuf->updateSelections(toPos, 0, length);
@@ -431,19 +1070,20 @@ void TextBuffer::BufCopyFromBuf(TextBuffer *toBuf, int fromStart, int fromEnd, i
 ** number of characters inserted and deleted in the operation (beginning
 ** at startPos) are returned in these arguments
 */
-void TextBuffer::BufInsertCol(int column, int startPos, const char_type *text, int *charsInserted, int *charsDeleted) {
-	int nLines, lineStartPos, nDeleted, insertDeleted, nInserted;
+void TextBuffer::BufInsertCol(int column, pos_type startPos, const char_type *text, pos_type *charsInserted, pos_type *charsDeleted) {
+	pos_type nLines, lineStartPos, nDeleted, insertDeleted, nInserted;
 
 	nLines = countLines(text);
 	lineStartPos = BufStartOfLine(startPos);
 	nDeleted = BufEndOfLine(BufCountForwardNLines(startPos, nLines)) - lineStartPos;
 	callPreDeleteCBs(lineStartPos, nDeleted);
-	String deletedText = BufGetRange(lineStartPos, lineStartPos + nDeleted);
+	pos_type nDeletedLines;
+	const String deletedText = saveDeletedText(lineStartPos, lineStartPos + nDeleted, &nDeletedLines);
 	insertCol(column, lineStartPos, text, &insertDeleted, &nInserted, &cursorPosHint_);
 
 	assert(nDeleted == insertDeleted && "Internal consistency check ins1 failed");
 
-	callModifyCBs(lineStartPos, nDeleted, nInserted, 0, deletedText.str);
+	callModifyCBs(lineStartPos, nDeleted, nInserted, 0, nDeletedLines, deletedText.str);
 
 	if (charsInserted != nullptr)
 		*charsInserted = nInserted;
@@ -458,8 +1098,8 @@ void TextBuffer::BufInsertCol(int column, int startPos, const char_type *text, i
 ** in the operation (beginning at startPos) are returned in these arguments.
 ** If rectEnd equals -1, the width of the inserted text is measured first.
 */
-void TextBuffer::BufOverlayRect(int startPos, int rectStart, int rectEnd, const char_type *text, int *charsInserted, int *charsDeleted) {
-	int nLines, lineStartPos, nDeleted, insertDeleted, nInserted;
+void TextBuffer::BufOverlayRect(pos_type startPos, int rectStart, int rectEnd, const char_type *text, pos_type *charsInserted, pos_type *charsDeleted) {
+	pos_type nLines, lineStartPos, nDeleted, insertDeleted, nInserted;
 
 	nLines = countLines(text);
 	lineStartPos = BufStartOfLine(startPos);
@@ -468,12 +1108,13 @@ void TextBuffer::BufOverlayRect(int startPos, int rectStart, int rectEnd, const
 	lineStartPos = BufStartOfLine(startPos);
 	nDeleted = BufEndOfLine(BufCountForwardNLines(startPos, nLines)) - lineStartPos;
 	callPreDeleteCBs(lineStartPos, nDeleted);
-	String deletedText = BufGetRange(lineStartPos, lineStartPos + nDeleted);
+	pos_type nDeletedLines;
+	const String deletedText = saveDeletedText(lineStartPos, lineStartPos + nDeleted, &nDeletedLines);
 	overlayRect(lineStartPos, rectStart, rectEnd, text, &insertDeleted, &nInserted, &cursorPosHint_);
 
 	assert(nDeleted == insertDeleted && "Internal consistency check ovly1 failed");
 
-	callModifyCBs(lineStartPos, nDeleted, nInserted, 0, deletedText.str);
+	callModifyCBs(lineStartPos, nDeleted, nInserted, 0, nDeletedLines, deletedText.str);
 
 	if (charsInserted != nullptr)
 		*charsInserted = nInserted;
@@ -486,12 +1127,9 @@ void TextBuffer::BufOverlayRect(int startPos, int rectStart, int rectEnd, const
 ** and "rectEnd", with "text".  If "text" is vertically longer than the
 ** rectangle, add extra lines to make room for it.
 */
-void TextBuffer::BufReplaceRect(int start, int end, int rectStart, int rectEnd, const char_type *text, int length) {
+void TextBuffer::BufReplaceRect(pos_type start, pos_type end, int rectStart, int rectEnd, const char_type *text, pos_type length) {
 
-	char_type *insText = nullptr;
-	int i, nInsertedLines, nDeletedLines, hint;
-	int insertDeleted, insertInserted, deleteInserted;
-	int linesPadded = 0;
+	pos_type nInserted;
 
 	/* Make sure start and end refer to complete lines, since the
 	   columnar delete and insert operations will replace whole lines */
@@ -500,128 +1138,35 @@ void TextBuffer::BufReplaceRect(int start, int end, int rectStart, int rectEnd,
 
 	callPreDeleteCBs(start, end - start);
 
-	/* If more lines will be deleted than inserted, pad the inserted text
-	   with newlines to make it as long as the number of deleted lines.  This
-	   will indent all of the text to the right of the rectangle to the same
-	   column.  If more lines will be inserted than deleted, insert extra
-	   lines in the buffer at the end of the rectangle to make room for the
-	   additional lines in "text" */
-	nInsertedLines = countLines(text, length);
-	nDeletedLines = BufCountLines(start, end);
-	if (nInsertedLines < nDeletedLines) {
-
-		size_t insLen = traits_type::length(text);
-		insText = new char_type[insLen + nDeletedLines - nInsertedLines + 1];
-#ifdef USE_STRCPY
-		strcpy(insText, text);
-#else
-		std::copy_n(text, insLen, insText);
-#endif
-		char_type *insPtr = insText + insLen;
-		for (i = 0; i < nDeletedLines - nInsertedLines; i++) {
-			*insPtr++ = '\n';
-		}
-		*insPtr = '\0';
-	} else if (nDeletedLines < nInsertedLines) {
-		linesPadded = nInsertedLines - nDeletedLines;
-		for (i = 0; i < linesPadded; i++) {
-			insert(end, _T("\n"), 1);
-		}
-	} else /* nDeletedLines == nInsertedLines */ {
-	}
-
-	/* Save a copy of the text which will be modified for the modify CBs */
-	String deletedText = BufGetRange(start, end);
+	/* Save what the modify CBs need to know about the text which will be modified */
+	pos_type nDeletedLines;
+	const String deletedText = saveDeletedText(start, end, &nDeletedLines);
 
-	/* Delete then insert */
-	deleteRect(start, end, rectStart, rectEnd, &deleteInserted, &hint);
-	if (insText) {
-		insertCol(rectStart, start, insText, &insertDeleted, &insertInserted, &cursorPosHint_);
-		delete[] insText;
-	} else
-		insertCol(rectStart, start, text, &insertDeleted, &insertInserted, &cursorPosHint_);
-
-	/* Figure out how many chars were inserted and call modify callbacks */
-	assert(insertDeleted == deleteInserted + linesPadded && "Internal consistency check repl1 failed\n");
+	replaceRect(start, end, rectStart, rectEnd, text, length, &nInserted, &cursorPosHint_);
 
-	callModifyCBs(start, end - start, insertInserted, 0, deletedText.str);
+	callModifyCBs(start, end - start, nInserted, 0, nDeletedLines, deletedText.str);
 }
 
-void TextBuffer::BufReplaceRect(int start, int end, int rectStart, int rectEnd, const char_type *text) {
-
-	char_type *insText = nullptr;
-	int i, nInsertedLines, nDeletedLines, hint;
-	int insertDeleted, insertInserted, deleteInserted;
-	int linesPadded = 0;
-
-	/* Make sure start and end refer to complete lines, since the
-	   columnar delete and insert operations will replace whole lines */
-	start = BufStartOfLine(start);
-	end = BufEndOfLine(end);
-
-	callPreDeleteCBs(start, end - start);
-
-	/* If more lines will be deleted than inserted, pad the inserted text
-	   with newlines to make it as long as the number of deleted lines.  This
-	   will indent all of the text to the right of the rectangle to the same
-	   column.  If more lines will be inserted than deleted, insert extra
-	   lines in the buffer at the end of the rectangle to make room for the
-	   additional lines in "text" */
-	nInsertedLines = countLines(text);
-	nDeletedLines = BufCountLines(start, end);
-	if (nInsertedLines < nDeletedLines) {
-
-		size_t insLen = traits_type::length(text);
-		insText = new char_type[insLen + nDeletedLines - nInsertedLines + 1];
-#ifdef USE_STRCPY
-		strcpy(insText, text);
-#else
-		std::copy_n(text, insLen, insText);
-#endif
-		char_type *insPtr = insText + insLen;
-		for (i = 0; i < nDeletedLines - nInsertedLines; i++) {
-			*insPtr++ = '\n';
-		}
-		*insPtr = '\0';
-	} else if (nDeletedLines < nInsertedLines) {
-		linesPadded = nInsertedLines - nDeletedLines;
-		for (i = 0; i < linesPadded; i++) {
-			insert(end, _T("\n"), 1);
-		}
-	} else /* nDeletedLines == nInsertedLines */ {
-	}
-
-	/* Save a copy of the text which will be modified for the modify CBs */
-	String deletedText = BufGetRange(start, end);
-
-	/* Delete then insert */
-	deleteRect(start, end, rectStart, rectEnd, &deleteInserted, &hint);
-	if (insText) {
-		insertCol(rectStart, start, insText, &insertDeleted, &insertInserted, &cursorPosHint_);
-		delete[] insText;
-	} else
-		insertCol(rectStart, start, text, &insertDeleted, &insertInserted, &cursorPosHint_);
-
-	/* Figure out how many chars were inserted and call modify callbacks */
-	assert(insertDeleted == deleteInserted + linesPadded && "Internal consistency check repl1 failed\n");
-
-	callModifyCBs(start, end - start, insertInserted, 0, deletedText.str);
+void TextBuffer::BufReplaceRect(pos_type start, pos_type end, int rectStart, int rectEnd, const char_type *text) {
+	const pos_type length = static_cast<pos_type>(traits_type::length(text));
+	BufReplaceRect(start, end, rectStart, rectEnd, text, length);
 }
 
 /*
 ** Remove a rectangular swath of characters between character positions start
 ** and end and horizontal displayed-character offsets rectStart and rectEnd.
 */
-void TextBuffer::BufRemoveRect(int start, int end, int rectStart, int rectEnd) {
+void TextBuffer::BufRemoveRect(pos_type start, pos_type end, int rectStart, int rectEnd) {
 
-	int nInserted;
+	pos_type nInserted;
 
 	start = BufStartOfLine(start);
 	end = BufEndOfLine(end);
 	callPreDeleteCBs(start, end - start);
-	String deletedText = BufGetRange(start, end);
+	pos_type nDeletedLines;
+	const String deletedText = saveDeletedText(start, end, &nDeletedLines);
 	deleteRect(start, end, rectStart, rectEnd, &nInserted, &cursorPosHint_);
-	callModifyCBs(start, end - start, nInserted, 0, deletedText.str);
+	callModifyCBs(start, end - start, nInserted, 0, nDeletedLines, deletedText.str);
 }
 
 /*
@@ -629,10 +1174,10 @@ void TextBuffer::BufRemoveRect(int start, int end, int rectStart, int rectEnd) {
 ** start and end and horizontal displayed-character offsets rectStart and
 ** rectEnd.
 */
-void TextBuffer::BufClearRect(int start, int end, int rectStart, int rectEnd) {
-	int i;
+void TextBuffer::BufClearRect(pos_type start, pos_type end, int rectStart, int rectEnd) {
+	pos_type i;
 
-	int nLines = BufCountLines(start, end);
+	pos_type nLines = BufCountLines(start, end);
 	auto newlineString = new char_type[nLines + 1];
 
 	for (i = 0; i < nLines; i++) {
@@ -644,27 +1189,22 @@ void TextBuffer::BufClearRect(int start, int end, int rectStart, int rectEnd) {
 	delete[] newlineString;
 }
 
-String TextBuffer::BufGetTextInRect(int start, int end, int rectStart, int rectEnd) const {
-	int selLeft;
-	int selRight;
+String TextBuffer::BufGetTextInRect(pos_type start, pos_type end, int rectStart, int rectEnd) const {
+	pos_type selLeft;
+	pos_type selRight;
 	int len;
 
 	start = BufStartOfLine(start);
 	end   = BufEndOfLine(end);
 
+	/* the selected part of each line is copied straight to the output */
 	auto textOut = new char_type[(end - start) + 1];
-	int lineStart = start;
+	pos_type lineStart = start;
 	char_type *outPtr = textOut;
 	while (lineStart <= end) {
 		findRectSelBoundariesForCopy(lineStart, rectStart, rectEnd, &selLeft, &selRight);
-		String  textIn = BufGetRange(selLeft, selRight);
-		len = selRight - selLeft;
-#ifdef USE_MEMCPY
-		memcpy(outPtr, textIn.str, len);
-#else
-		std::copy_n(textIn.str, len, outPtr);
-#endif
-		outPtr += len;
+		copyRange(selLeft, selRight, outPtr);
+		outPtr += selRight - selLeft;
 		lineStart = BufEndOfLine(selRight) + 1;
 		*outPtr++ = '\n';
 	}
@@ -677,6 +1217,10 @@ String TextBuffer::BufGetTextInRect(int start, int end, int rectStart, int rectE
 
 	/* If necessary, realign the tabs in the Selection as if the text were
 	   positioned at the left margin */
+	if (rectStart % tabDist_ == 0) {
+		return String(textOut, outPtr - textOut);
+	}
+
 	String retabbedStr = realignTabs(textOut, rectStart, 0, tabDist_, useTabs_, nullSubsChar_, &len);
 	delete[] textOut;
 	return retabbedStr;
@@ -704,17 +1248,16 @@ void TextBuffer::BufSetTabDistance(int tabDist) {
 	tabDist_ = tabDist;
 
 	/* Force any display routines to redisplay everything */
-	const char_type *const deletedText = BufAsString();
-	callModifyCBs(0, length_, length_, 0, deletedText);
+	callUnchangedModifyCBs();
 }
 
-void TextBuffer::BufCheckDisplay(int start, int end) {
+void TextBuffer::BufCheckDisplay(pos_type start, pos_type end) {
 
 	/* just to make sure colors in the selected region are up to date */
-	callModifyCBs(start, 0, 0, end - start, nullptr);
+	callModifyCBs(start, 0, 0, end - start, 0, nullptr);
 }
 
-void TextBuffer::BufSelect(int start, int end) {
+void TextBuffer::BufSelect(pos_type start, pos_type end) {
 
 	Selection oldSelection = primary_;
 
@@ -730,19 +1273,19 @@ void TextBuffer::BufUnselect() {
 	redisplaySelection(oldSelection, primary_);
 }
 
-void TextBuffer::BufRectSelect(int start, int end, int rectStart, int rectEnd) {
+void TextBuffer::BufRectSelect(pos_type start, pos_type end, int rectStart, int rectEnd) {
 	Selection oldSelection = primary_;
 
 	setRectSelect(&primary_, start, end, rectStart, rectEnd);
 	redisplaySelection(oldSelection, primary_);
 }
 
-bool TextBuffer::BufGetSelectionPos(int *start, int *end, bool *isRect, int *rectStart, int *rectEnd) const {
+bool TextBuffer::BufGetSelectionPos(pos_type *start, pos_type *end, bool *isRect, int *rectStart, int *rectEnd) const {
 	return getSelectionPos(primary_, start, end, isRect, rectStart, rectEnd);
 }
 
 /* Same as above, but also returns true for empty selections */
-bool TextBuffer::BufGetEmptySelectionPos(int *start, int *end, bool *isRect, int *rectStart, int *rectEnd) const {
+bool TextBuffer::BufGetEmptySelectionPos(pos_type *start, pos_type *end, bool *isRect, int *rectStart, int *rectEnd) const {
 	return getSelectionPos(primary_, start, end, isRect, rectStart, rectEnd) || primary_.zeroWidth;
 }
 
@@ -758,7 +1301,7 @@ void TextBuffer::BufReplaceSelected(const char_type *text) {
 	replaceSelected(&primary_, text);
 }
 
-void TextBuffer::BufSecondarySelect(int start, int end) {
+void TextBuffer::BufSecondarySelect(pos_type start, pos_type end) {
 	Selection oldSelection = secondary_;
 
 	setSelection(&secondary_, start, end);
@@ -773,14 +1316,14 @@ void TextBuffer::BufSecondaryUnselect() {
 	redisplaySelection(oldSelection, secondary_);
 }
 
-void TextBuffer::BufSecRectSelect(int start, int end, int rectStart, int rectEnd) {
+void TextBuffer::BufSecRectSelect(pos_type start, pos_type end, int rectStart, int rectEnd) {
 	Selection oldSelection = secondary_;
 
 	setRectSelect(&secondary_, start, end, rectStart, rectEnd);
 	redisplaySelection(oldSelection, secondary_);
 }
 
-bool TextBuffer::BufGetSecSelectPos(int *start, int *end, bool *isRect, int *rectStart, int *rectEnd) const {
+bool TextBuffer::BufGetSecSelectPos(pos_type *start, pos_type *end, bool *isRect, int *rectStart, int *rectEnd) const {
 	return getSelectionPos(secondary_, start, end, isRect, rectStart, rectEnd);
 }
 
@@ -796,7 +1339,7 @@ void TextBuffer::BufReplaceSecSelect(const char_type *text) {
 	replaceSelected(&secondary_, text);
 }
 
-void TextBuffer::BufHighlight(int start, int end) {
+void TextBuffer::BufHighlight(pos_type start, pos_type end) {
 	Selection oldSelection = highlight_;
 
 	setSelection(&highlight_, start, end);
@@ -811,14 +1354,14 @@ void TextBuffer::BufUnhighlight() {
 	redisplaySelection(oldSelection, highlight_);
 }
 
-void TextBuffer::BufRectHighlight(int start, int end, int rectStart, int rectEnd) {
+void TextBuffer::BufRectHighlight(pos_type start, pos_type end, int rectStart, int rectEnd) {
 	Selection oldSelection = highlight_;
 
 	setRectSelect(&highlight_, start, end, rectStart, rectEnd);
 	redisplaySelection(oldSelection, highlight_);
 }
 
-bool TextBuffer::BufGetHighlightPos(int *start, int *end, bool *isRect, int *rectStart, int *rectEnd) const {
+bool TextBuffer::BufGetHighlightPos(pos_type *start, pos_type *end, bool *isRect, int *rectStart, int *rectEnd) const {
 	return getSelectionPos(highlight_, start, end, isRect, rectStart, rectEnd);
 }
 
@@ -837,16 +1380,88 @@ void TextBuffer::BufAddHighPriorityModifyCB(IBufferModifiedHandler *handler) {
 	modifyProcs_.emplace_front(handler);
 }
 
+/*
+** Add a modify callback which is only interested in the text between "start"
+** and "end".  It is called (after the callbacks without a range) for changes
+** which touch the range, told through bufferShifted about changes before it,
+** which only move the text, and not called at all for changes after it.  The
+** range follows the text it covers as the buffer changes, and grows to take
+** in text inserted where it touches it; the callback can narrow it again with
+** BufSetModifyCBRange.  With many views or annotations on one buffer, each
+** change then only costs as much as the callbacks it really concerns.
+*/
+void TextBuffer::BufAddRangedModifyCB(IBufferModifiedHandler *handler, pos_type start, pos_type end) {
+
+	/* the range is in terms of the text as it is now, which a pending batch
+	   change hasn't been reported against yet */
+	flushBatch();
+	rangedModifyProcs_.push_back(RangedModifyCB{handler, start, end});
+}
+
+/*
+** Change the range of a callback added with BufAddRangedModifyCB
+*/
+void TextBuffer::BufSetModifyCBRange(IBufferModifiedHandler *handler, pos_type start, pos_type end) {
+
+	flushBatch();
+
+
+	for (RangedModifyCB &proc : rangedModifyProcs_) {
+		if (proc.handler == handler) {
+			proc.start = start;
+			proc.end = end;
+			return;
+		}
+	}
+
+	fprintf(stderr, "Internal Error: Can't find modify CB to set the range of\n");
+}
+
 void TextBuffer::BufRemoveModifyCB(IBufferModifiedHandler *handler) {
 
 	auto it = std::find(modifyProcs_.begin(), modifyProcs_.end(), handler);
+	auto ranged = std::find_if(rangedModifyProcs_.begin(), rangedModifyProcs_.end(), [handler](const RangedModifyCB &proc) {
+		return proc.handler == handler;
+	});
+
 	if (it != modifyProcs_.end()) {
 		modifyProcs_.erase(it);
+	} else if (ranged != rangedModifyProcs_.end()) {
+		rangedModifyProcs_.erase(ranged);
 	} else {
 		fprintf(stderr, "Internal Error: Can't find modify CB to remove\n");
 	}
 }
 
+/*
+** Start a batch of changes.  Until the matching BufEndBatch, the modify
+** callbacks are not called for each change; instead, BufEndBatch calls them
+** once, with a single event replacing the smallest range which covers all
+** of the changes (or, if no text changed, restyling it).  This lets an
+** operation made of many edits be reparsed and laid out once.  Batches may
+** be nested, only the outermost one counts.  The buffer itself is always up
+** to date, only the notification is delayed.  Pre-delete callbacks are still
+** called for each change.
+*/
+void TextBuffer::BufBeginBatch() {
+	batchDepth_++;
+}
+
+/*
+** End a batch of changes started with BufBeginBatch
+*/
+void TextBuffer::BufEndBatch() {
+
+	if (batchDepth_ == 0) {
+		fprintf(stderr, "Internal Error: BufEndBatch without BufBeginBatch\n");
+		return;
+	}
+
+	if (--batchDepth_ == 0) {
+		flushBatch();
+	}
+}
+
 /*
 ** Add a callback routine to be called before text is deleted from the buffer.
 */
@@ -864,11 +1479,70 @@ void TextBuffer::BufRemovePreDeleteCB(IPreDeleteHandler *handler) {
 	}
 }
 
+/*
+** Add a marker (a bookmark, error marker, diff hunk...) covering the text
+** from "start" to "end", returning its id.  Markers follow the text as the
+** buffer changes: text inserted at the end of a marker goes inside it, but
+** text inserted at its start goes before it (so an empty marker ends up
+** after anything typed at it), and a marker whose text is deleted shrinks to
+** where the text was.  An edit only costs as much as the markers it touches,
+** so a buffer may hold tens of thousands of them.  "type" is for the caller
+** to tell its markers apart.
+*/
+int TextBuffer::BufAddMarker(pos_type start, pos_type end, int type) {
+	start = std::min(std::max<pos_type>(start, 0), length_);
+	end = std::min(std::max(end, start), length_);
+	return markers_.add(start, end, type);
+}
+
+/*
+** Remove a marker added by BufAddMarker.  Its id may be reused.
+*/
+void TextBuffer::BufRemoveMarker(int id) {
+	markers_.remove(id);
+}
+
+/*
+** Get the current position of a marker, returning false if there is no
+** marker "id"
+*/
+bool TextBuffer::BufGetMarker(int id, pos_type *start, pos_type *end) const {
+	return markers_.get(id, start, end);
+}
+
+/*
+** Find the markers which touch the range from "start" to "end", in order of
+** their start positions (for drawing the markers in part of the buffer)
+*/
+void TextBuffer::BufGetMarkers(pos_type start, pos_type end, std::vector<Marker> *markers) const {
+	markers_.query(start, end, markers);
+}
+
+/*
+** Get the buffer's rangesets (sets of ranges of the text drawn in colors of
+** their own, see Rangeset), or nullptr if it has never had any
+*/
+RangesetTable *TextBuffer::BufGetRangesetTable() const {
+	return rangesetTable_;
+}
+
+/*
+** Get the buffer's rangesets, creating the (empty) table if need be
+*/
+RangesetTable *TextBuffer::BufCreateRangesetTable() {
+
+	if (!rangesetTable_) {
+		rangesetTable_ = new RangesetTable(this);
+	}
+
+	return rangesetTable_;
+}
+
 /*
 ** Find the position of the start of the line containing position "pos"
 */
-int TextBuffer::BufStartOfLine(int pos) const {
-	int startPos;
+pos_type TextBuffer::BufStartOfLine(pos_type pos) const {
+	pos_type startPos;
 
 	if (!searchBackward(pos, '\n', &startPos))
 		return 0;
@@ -880,8 +1554,8 @@ int TextBuffer::BufStartOfLine(int pos) const {
 ** (which is either a pointer to the newline character ending the line,
 ** or a pointer to one character beyond the end of the buffer)
 */
-int TextBuffer::BufEndOfLine(int pos) const {
-	int endPos;
+pos_type TextBuffer::BufEndOfLine(pos_type pos) const {
+	pos_type endPos;
 
 	if (!searchForward(pos, '\n', &endPos))
 		endPos = length_;
@@ -896,7 +1570,7 @@ int TextBuffer::BufEndOfLine(int pos) const {
 ** for figuring tabs.  Output string is guranteed to be shorter or
 ** equal in length to MAX_EXP_CHAR_LEN
 */
-int TextBuffer::BufGetExpandedChar(int pos, int indent, char_type *outStr) const {
+int TextBuffer::BufGetExpandedChar(pos_type pos, int indent, char_type *outStr) const {
 	return BufExpandCharacter(BufGetCharacter(pos), indent, outStr, tabDist_, nullSubsChar_);
 }
 
@@ -966,13 +1640,19 @@ int TextBuffer::BufCharWidth(char_type c, int indent, int tabDist, char_type nul
 ** shown on the screen to represent characters in the buffer, where tabs and
 ** control characters are expanded)
 */
-int TextBuffer::BufCountDispChars(int lineStartPos, int targetPos) const {
-	int pos, charCount = 0;
+int TextBuffer::BufCountDispChars(pos_type lineStartPos, pos_type targetPos) const {
+	int charCount = 0;
 	char_type expandedChar[MAX_EXP_CHAR_LEN];
 
-	pos = lineStartPos;
-	while (pos < targetPos && pos < length_)
+	pos_type pos = lineStartPos;
+	while (pos < targetPos && pos < length_) {
+		/* in UTF-8 mode, only the first byte of a character takes space */
+		if (utf8_ && isUtf8Continuation(BufGetCharacter(pos))) {
+			pos++;
+			continue;
+		}
 		charCount += BufGetExpandedChar(pos++, charCount, expandedChar);
+	}
 	return charCount;
 }
 
@@ -981,76 +1661,57 @@ int TextBuffer::BufCountDispChars(int lineStartPos, int targetPos) const {
 ** (displayed characters are the characters shown on the screen to represent
 ** characters in the buffer, where tabs and control characters are expanded)
 */
-int TextBuffer::BufCountForwardDispChars(int lineStartPos, int nChars) const {
+pos_type TextBuffer::BufCountForwardDispChars(pos_type lineStartPos, int nChars) const {
 	int charCount = 0;
 
-	int pos = lineStartPos;
+	pos_type pos = lineStartPos;
 	while (charCount < nChars && pos < length_) {
 		char_type c = BufGetCharacter(pos);
 		if (c == '\n')
 			return pos;
-		charCount += BufCharWidth(c, charCount, tabDist_, nullSubsChar_);
+		if (!utf8_ || !isUtf8Continuation(c))
+			charCount += BufCharWidth(c, charCount, tabDist_, nullSubsChar_);
 		pos++;
 	}
+
+	/* don't stop in the middle of a UTF-8 character */
+	while (utf8_ && pos < length_ && isUtf8Continuation(BufGetCharacter(pos)))
+		pos++;
 	return pos;
 }
 
 /*
 ** Count the number of newlines between startPos and endPos in buffer "buf".
-** The character at position "endPos" is not counted.
+** The character at position "endPos" is not counted.  (If endPos is before
+** startPos, counting continues to the end of the buffer)
 */
-int TextBuffer::BufCountLines(int startPos, int endPos) const {
-	const int gapLen = gapEnd_ - gapStart_;
+pos_type TextBuffer::BufCountLines(pos_type startPos, pos_type endPos) const {
 
-	int lineCount = 0;
+	startPos = std::max<pos_type>(0, std::min(startPos, length_));
 
-	int pos = startPos;
-
-	while (pos < gapStart_) {
-		if (pos == endPos)
-			return lineCount;
-		if (buf_[pos++] == '\n')
-			lineCount++;
+	if (endPos < startPos || endPos > length_) {
+		endPos = length_;
 	}
 
-	while (pos < length_) {
-		if (pos == endPos)
-			return lineCount;
-		if (buf_[pos++ + gapLen] == '\n')
-			lineCount++;
-	}
-	return lineCount;
+	return lineIndexPrefix(endPos) - lineIndexPrefix(startPos);
 }
 
 /*
 ** Find the first character of the line "nLines" forward from "startPos"
 ** in "buf" and return its position
 */
-int TextBuffer::BufCountForwardNLines(int startPos, unsigned nLines) const {
-	int pos;
-	int gapLen = gapEnd_ - gapStart_;
-	unsigned int lineCount = 0;
+pos_type TextBuffer::BufCountForwardNLines(pos_type startPos, unsigned nLines) const {
 
 	if (nLines == 0)
 		return startPos;
 
-	pos = startPos;
-	while (pos < gapStart_) {
-		if (buf_[pos++] == '\n') {
-			lineCount++;
-			if (lineCount == nLines)
-				return pos;
-		}
-	}
+	const pos_type linesBefore = lineIndexPrefix(std::max<pos_type>(0, std::min(startPos, length_)));
+	const pos_type totalLines = lineIndexPrefix(length_);
 
-	while (pos < length_) {
-		if (buf_[pos++ + gapLen] == '\n') {
-			lineCount++;
-			if (lineCount >= nLines)
-				return pos;
-		}
-	}
-	return pos;
+	if (nLines > totalLines - linesBefore)
+		return length_;
+
+	return lineIndexFind(linesBefore + nLines);
 }
 
 /*
@@ -1059,79 +1720,27 @@ int TextBuffer::BufCountForwardNLines(int startPos, unsigned nLines) const {
 ** that is a newline) in "buf".  nLines == 0 means find the beginning of
 ** the line
 */
-int TextBuffer::BufCountBackwardNLines(int startPos, int nLines) const {
-	int pos;
-	const int gapLen = gapEnd_ - gapStart_;
-	int lineCount = -1;
+pos_type TextBuffer::BufCountBackwardNLines(pos_type startPos, int nLines) const {
 
-	pos = startPos - 1;
-	if (pos <= 0)
+	if (startPos - 1 <= 0)
 		return 0;
 
-	while (pos >= gapStart_) {
-		if (buf_[pos + gapLen] == '\n') {
-			if (++lineCount >= nLines)
-				return pos + 1;
-		}
-		pos--;
-	}
-	while (pos >= 0) {
-		if (buf_[pos] == '\n') {
-			if (++lineCount >= nLines)
-				return pos + 1;
-		}
-		pos--;
-	}
-	return 0;
-}
+	/* the line we want starts after the (nLines + 1)th newline counting
+	   backwards from the character before startPos */
+	const pos_type target = lineIndexPrefix(std::min(startPos, length_)) - std::max(nLines, 0);
+	if (target <= 0)
+		return 0;
+
+	return lineIndexFind(target);
+}
 
 /*
 ** Search forwards in buffer "buf" for characters in "searchChars", starting
 ** with the character "startPos", and returning the result in "foundPos"
 ** returns true if found, false if not.
 */
-bool TextBuffer::BufSearchForward(int startPos, const char_type *searchChars, int *foundPos) const {
-	int pos;
-	const int gapLen = gapEnd_ - gapStart_;
-	const char_type *c;
-
-	pos = startPos;
-	while (pos < gapStart_) {
-#if 0
-		// NOTE(eteran): i think this could be (better yet, use trait_type::find)
-		if(strchr(searchChars, buf_[pos]) != nullptr) {
-			*foundPos = pos;
-			return true;
-		}
-#else
-		for (c = searchChars; *c != '\0'; c++) {
-			if (buf_[pos] == *c) {
-				*foundPos = pos;
-				return true;
-			}
-		}
-#endif
-		pos++;
-	}
-	while (pos < length_) {
-#if 0
-		// NOTE(eteran): i think this could be (better yet, use trait_type::find)
-		if(strchr(searchChars, buf_[pos + gapLen]) != nullptr) {
-			*foundPos = pos;
-			return true;
-		}
-#else
-		for (c = searchChars; *c != '\0'; c++) {
-			if (buf_[pos + gapLen] == *c) {
-				*foundPos = pos;
-				return true;
-			}
-		}
-#endif
-		pos++;
-	}
-	*foundPos = length_;
-	return false;
+bool TextBuffer::BufSearchForward(pos_type startPos, const char_type *searchChars, pos_type *foundPos) const {
+	return searchForward(startPos, CharSet(searchChars), foundPos);
 }
 
 /*
@@ -1139,36 +1748,8 @@ bool TextBuffer::BufSearchForward(int startPos, const char_type *searchChars, in
 ** with the character BEFORE "startPos", returning the result in "foundPos"
 ** returns true if found, false if not.
 */
-bool TextBuffer::BufSearchBackward(int startPos, const char_type *searchChars, int *foundPos) const {
-	int pos;
-	const int gapLen = gapEnd_ - gapStart_;
-	const char_type *c;
-
-	if (startPos == 0) {
-		*foundPos = 0;
-		return false;
-	}
-	pos = startPos == 0 ? 0 : startPos - 1;
-	while (pos >= gapStart_) {
-		for (c = searchChars; *c != '\0'; c++) {
-			if (buf_[pos + gapLen] == *c) {
-				*foundPos = pos;
-				return true;
-			}
-		}
-		pos--;
-	}
-	while (pos >= 0) {
-		for (c = searchChars; *c != '\0'; c++) {
-			if (buf_[pos] == *c) {
-				*foundPos = pos;
-				return true;
-			}
-		}
-		pos--;
-	}
-	*foundPos = 0;
-	return false;
+bool TextBuffer::BufSearchBackward(pos_type startPos, const char_type *searchChars, pos_type *foundPos) const {
+	return searchBackward(startPos, CharSet(searchChars), foundPos);
 }
 
 /*
@@ -1191,37 +1772,42 @@ bool TextBuffer::BufSearchBackward(int startPos, const char_type *searchChars, i
 ** substitution.  Returns false, if substitution is no longer possible
 ** because all non-printable characters are already in use.
 */
-bool TextBuffer::BufSubstituteNullChars(char_type *string, int length) {
-	char_type histogram[256];
-
-	/* Find out what characters the string contains */
-	histogramCharacters(string, length, histogram, true);
-
-	/* Does the string contain the null-substitute character?  If so, re-
-	   histogram the buffer text to find a character which is ok in both the
-	   string and the buffer, and change the buffer's null-substitution
-	   character.  If none can be found, give up and return false */
-	if (histogram[static_cast<uint8_t>(nullSubsChar_)] != 0) {
-	
-		/* here we know we can modify the file buffer directly,
-		   so we cast away constness */
-		auto bufString = const_cast<char_type *>(BufAsString());
-		
-		histogramCharacters(bufString, length_, histogram, false);
-		char_type newSubsChar = chooseNullSubsChar(histogram);
+bool TextBuffer::BufSubstituteNullChars(char_type *string, pos_type length) {
+
+	/* a mapped file's NULs are kept as they are, and so are those of text
+	   put into it (see BufLoadMapped) */
+	if (keepNulls_) {
+		return true;
+	}
+
+	/* Find out which control characters (the only possible substitutes) the
+	   string contains */
+	const uint32_t stringChars = findControlChars(string, length);
+
+	/* Does the string contain the null-substitute character?  If so, find a
+	   character which is ok in both the string and the buffer, and change the
+	   buffer's null-substitution character.  controlChars_ may include
+	   characters which have since been deleted, so only if none can be found
+	   that way are the buffer's characters looked at again.  If there still
+	   isn't one, give up and return false */
+	if (stringChars & controlCharBit(nullSubsChar_)) {
+		char_type newSubsChar = chooseNullSubsChar(stringChars | controlChars_);
+		if (newSubsChar == '\0') {
+			controlChars_ = bufControlChars();
+			newSubsChar = chooseNullSubsChar(stringChars | controlChars_);
+		}
+
 		if (newSubsChar == '\0') {
 			return false;
 		}
-		
-		/* bufString points to the buffer's data, so we substitute in situ */
-		subsChars(bufString, length_, nullSubsChar_, newSubsChar);
-		nullSubsChar_ = newSubsChar;
+
+		changeNullSubsChar(newSubsChar);
 	}
 
 	/* If the string contains null characters, substitute them with the
 	   buffer's null substitution character */
-	if (histogram[0] != 0) {
-		subsChars(string, length, '\0', nullSubsChar_);
+	if (stringChars & controlCharBit('\0')) {
+		replaceChars(string, length, '\0', nullSubsChar_);
 	}
 	return true;
 }
@@ -1237,11 +1823,7 @@ void TextBuffer::BufUnsubstituteNullChars(char_type *string) const {
 		return;
 	}
 
-	for (char_type *c = string; *c != '\0'; c++) {
-		if (*c == nullSubsChar_) {
-			*c = '\0';
-		}
-	}
+	replaceChars(string, traits_type::length(string), nullSubsChar_, '\0');
 }
 
 /*
@@ -1250,9 +1832,9 @@ void TextBuffer::BufUnsubstituteNullChars(char_type *string) const {
 ** != 0 otherwise.
 **
 */
-int TextBuffer::BufCmp(int pos, int len, const char_type *cmpText) const {
-	int posEnd;
-	int part1Length;
+int TextBuffer::BufCmp(pos_type pos, pos_type len, const char_type *cmpText) const {
+	pos_type posEnd;
+	pos_type part1Length;
 	int result;
 
 	posEnd = pos + len;
@@ -1263,6 +1845,20 @@ int TextBuffer::BufCmp(int pos, int len, const char_type *cmpText) const {
 		return (-1);
 	}
 
+	if (pieces_) {
+		while (pos < posEnd) {
+			pos_type spanLength;
+			const char_type *text = pieces_->span(pos, &spanLength);
+			spanLength = std::min(spanLength, posEnd - pos);
+			if ((result = traits_type::compare(text, cmpText, spanLength))) {
+				return result;
+			}
+			pos += spanLength;
+			cmpText += spanLength;
+		}
+		return 0;
+	}
+
 	if (posEnd <= gapStart_) {
 		return traits_type::compare(&buf_[pos], cmpText, len);
 	} else if (pos >= gapStart_) {
@@ -1284,8 +1880,8 @@ int TextBuffer::BufCmp(int pos, int len, const char_type *cmpText) const {
 ** on to call redisplay).  pos must be contiguous with the existing text in
 ** the buffer (i.e. not past the end).
 */
-int TextBuffer::insert(int pos, const char_type *text) {
-	const int length = static_cast<int>(traits_type::length(text));
+pos_type TextBuffer::insert(pos_type pos, const char_type *text) {
+	const pos_type length = static_cast<pos_type>(traits_type::length(text));
 	return insert(pos, text, length);
 }
 
@@ -1296,24 +1892,29 @@ int TextBuffer::insert(int pos, const char_type *text) {
 ** on to call redisplay).  pos must be contiguous with the existing text in
 ** the buffer (i.e. not past the end).
 */
-int TextBuffer::insert(int pos, const char_type *text, int length) {
+pos_type TextBuffer::insert(pos_type pos, const char_type *text, pos_type length) {
 
-	/* Prepare the buffer to receive the new text.  If the new text fits in
-	   the current buffer, just move the gap (if necessary) to where
-	   the text should be inserted.  If the new text is too large, reallocate
-	   the buffer with a gap large enough to accomodate the new text and a
-	   gap of PREFERRED_GAP_SIZE */
-	if (length > gapEnd_ - gapStart_)
-		reallocateBuf(pos, length + PREFERRED_GAP_SIZE);
-	else if (pos != gapStart_)
-		moveGap(pos);
+	controlChars_ |= findControlChars(text, length);
+
+	if (pieces_) {
+		pieces_->insert(pos, text, length);
+		flatText_ = String();
+		length_ += length;
+		updateSelections(pos, 0, length);
+		return length;
+	}
+
+	/* Prepare the buffer to receive the new text */
+	prepareGap(pos, length);
 
 	/* Insert the new text (pos now corresponds to the start of the gap) */
+	unshareBuf(pos, pos + length);
 #ifdef USE_MEMCPY
 	memcpy(&buf_[pos], text, length);
 #else
 	std::copy_n(text, length, &buf_[pos]);
 #endif
+	lineIndexUpdate(pos, pos + length, 1);
 	gapStart_ += length;
 	length_ += length;
 	updateSelections(pos, 0, length);
@@ -1326,13 +1927,26 @@ int TextBuffer::insert(int pos, const char_type *text, int length) {
 ** of the buffer between start and end (and moves the gap to the site of
 ** the delete).
 */
-void TextBuffer::deleteRange(int start, int end) {
+void TextBuffer::deleteRange(pos_type start, pos_type end) {
+
+	if (pieces_) {
+		pieces_->remove(start, end);
+		flatText_ = String();
+		length_ -= end - start;
+		updateSelections(start, end - start, 0);
+		return;
+	}
+
 	/* if the gap is not contiguous to the area to remove, move it there */
 	if (start > gapStart_)
 		moveGap(start);
 	else if (end < gapStart_)
 		moveGap(end);
 
+	/* the deleted characters (which now border the gap) leave the index */
+	lineIndexUpdate(start, gapStart_, -1);
+	lineIndexUpdate(gapEnd_, gapEnd_ + end - gapStart_, -1);
+
 	/* expand the gap to encompass the deleted characters */
 	gapEnd_ += end - gapStart_;
 	gapStart_ -= gapStart_ - start;
@@ -1352,49 +1966,51 @@ void TextBuffer::deleteRange(int start, int end) {
 ** at the start of the line containing "startPos".  "endPos" returns buffer
 ** position of the lower left edge of the inserted column (as a hint for
 ** routines which need to set a cursor position).
-*/
-void TextBuffer::insertCol(int column, int startPos, const char_type *insText, int *nDeleted, int *nInserted, int *endPos) {
-	int nLines, start, end, insWidth, lineStart;
-	int expReplLen, expInsLen, len, endOffset;
-	char_type *outStr;
-	char_type *outPtr;
-	const char_type *insPtr;
+**
+** Like the other rectangle operations, this works a line at a time: each
+** line of the buffer and of "insText" is copied to a scratch buffer which is
+** reused for the next one, the new line is written straight to the output,
+** and the output replaces the old lines in one go.  So the work is linear in
+** the size of the area, and the temporary memory is bounded by the longest
+** line (apart from the output itself).
+*/
+void TextBuffer::insertCol(int column, pos_type startPos, const char_type *insText, pos_type *nDeleted, pos_type *nInserted, pos_type *endPos) {
+	int len = 0;
+	int endOffset = 0;
 
 	if (column < 0)
 		column = 0;
 
-	/* Allocate a buffer for the replacement string large enough to hold
-	   possibly expanded tabs in both the inserted text and the replaced
-	   area, as well as per line: 1) an additional 2*MAX_EXP_CHAR_LEN
+	const pos_type start = BufStartOfLine(startPos);
+	const pos_type nLines = countLines(insText) + 1;
+	const int insWidth = textWidth(insText, tabDist_, nullSubsChar_);
+	const pos_type end = BufEndOfLine(BufCountForwardNLines(start, nLines - 1));
+
+	/* Each line of output needs room for the expanded tabs of both the
+	   line and the inserted text, and 1) an additional 2*MAX_EXP_CHAR_LEN
 	   characters for padding where tabs and control characters cross the
-	   column of the Selection, 2) up to "column" additional spaces per
-	   line for padding out to the position of "column", 3) padding up
-	   to the width of the inserted text if that must be padded to align
-	   the text beyond the inserted column.  (Space for additional
-	   newlines if the inserted text extends beyond the end of the buffer
-	   is counted with the length of insText) */
-	start = BufStartOfLine(startPos);
-	nLines = countLines(insText) + 1;
-	insWidth = textWidth(insText, tabDist_, nullSubsChar_);
-	end = BufEndOfLine(BufCountForwardNLines(start, nLines - 1));
-
-	String replText = BufGetRange(start, end);
-	String expText  = expandTabs(replText.str, 0, tabDist_, nullSubsChar_, &expReplLen);
-	expText         = expandTabs(insText, 0, tabDist_, nullSubsChar_, &expInsLen);
-
-	outStr = new char_type[expReplLen + expInsLen + nLines * (column + insWidth + MAX_EXP_CHAR_LEN) + 1];
+	   column of the Selection, 2) up to "column" additional spaces for
+	   padding out to the position of "column", 3) padding up to the width
+	   of the inserted text if that must be padded to align the text beyond
+	   the inserted column */
+	const int padding = column + insWidth + 2 * (MAX_EXP_CHAR_LEN + tabDist_) + 2;
+
+	std::vector<char_type> outStr(end - start + traits_type::length(insText) + 1);
+	std::vector<char_type> line;
+	std::vector<char_type> insLine;
+	size_t outLen = 0;
+	size_t lastLine = 0;
 
 	/* Loop over all lines in the buffer between start and end inserting
 	   text at column, splitting tabs and adding padding appropriately */
-	outPtr = outStr;
-	lineStart = start;
-	insPtr = insText;
+	pos_type lineStart = start;
+	const char_type *insPtr = insText;
 	while (true) {
-		int lineEnd    = BufEndOfLine(lineStart);
-		String line    = BufGetRange(lineStart, lineEnd);
-		String insLine = copyLine(insPtr, &len);
-		insPtr += len;
-		insertColInLine(line.str, insLine.str, column, insWidth, tabDist_, useTabs_, nullSubsChar_, outPtr, &len, &endOffset);
+		const pos_type lineEnd = copyBufLine(lineStart, &line);
+		insPtr += copyLine(insPtr, &insLine);
+
+		char_type *outPtr = reserveOutput(&outStr, outLen, expandedLength(line.data(), 0, tabDist_, nullSubsChar_) + expandedLength(insLine.data(), 0, tabDist_, nullSubsChar_) + padding);
+		insertColInLine(line.data(), insLine.data(), column, insWidth, tabDist_, useTabs_, nullSubsChar_, outPtr, &len, &endOffset);
 
 #if 0 /* Earlier comments claimed that trailing whitespace could multiply on
       the ends of lines, but insertColInLine looks like it should never
@@ -1406,24 +2022,22 @@ void TextBuffer::insertCol(int column, int startPos, const char_type *insText, i
                 len--;
         }
 #endif
-		outPtr += len;
-		*outPtr++ = '\n';
+		lastLine = outLen;
+		outLen += len;
+		outStr[outLen++] = '\n';
 		lineStart = lineEnd < length_ ? lineEnd + 1 : length_;
 		if (*insPtr == '\0')
 			break;
 		insPtr++;
 	}
-	if (outPtr != outStr)
-		outPtr--; /* trim back off extra newline */
-	*outPtr = '\0';
+	outLen--; /* trim back off extra newline */
 
 	/* replace the text between start and end with the new stuff */
 	deleteRange(start, end);
-	insert(start, outStr);
-	*nInserted = outPtr - outStr;
+	insert(start, outStr.data(), static_cast<pos_type>(outLen));
+	*nInserted = static_cast<pos_type>(outLen);
 	*nDeleted = end - start;
-	*endPos = start + (outPtr - outStr) - len + endOffset;
-	delete[] outStr;
+	*endPos = start + static_cast<pos_type>(lastLine) + endOffset;
 }
 
 /*
@@ -1434,48 +2048,45 @@ void TextBuffer::insertCol(int column, int startPos, const char_type *insText, i
 ** of the point in the last line where the text was removed (as a hint for
 ** routines which need to position the cursor after a delete operation)
 */
-void TextBuffer::deleteRect(int start, int end, int rectStart, int rectEnd, int *replaceLen, int *endPos) {
-	int nLines;
-	int lineStart;
-	int len;
+void TextBuffer::deleteRect(pos_type start, pos_type end, int rectStart, int rectEnd, pos_type *replaceLen, pos_type *endPos) {
+	int len = 0;
 	int endOffset = 0;
-	char_type *outStr;
-	char_type *outPtr;
 
-	/* allocate a buffer for the replacement string large enough to hold
-	   possibly expanded tabs as well as an additional  MAX_EXP_CHAR_LEN * 2
-	   characters per line for padding where tabs and control characters cross
-	   the edges of the Selection */
 	start = BufStartOfLine(start);
 	end = BufEndOfLine(end);
-	nLines = BufCountLines(start, end) + 1;
-	String text = BufGetRange(start, end);
-	String expText = expandTabs(text.str, 0, tabDist_, nullSubsChar_, &len);
 
-	outStr = new char_type[len + nLines * MAX_EXP_CHAR_LEN * 2 + 1];
+	/* each line of output needs room for the line with its tabs expanded, as
+	   well as an additional MAX_EXP_CHAR_LEN * 2 characters for padding
+	   where tabs and control characters cross the edges of the Selection */
+	const int padding = 2 * (MAX_EXP_CHAR_LEN + tabDist_) + 2;
+
+	std::vector<char_type> outStr(end - start + 1);
+	std::vector<char_type> line;
+	size_t outLen = 0;
+	size_t lastLine = 0;
 
 	/* loop over all lines in the buffer between start and end removing
 	   the text between rectStart and rectEnd and padding appropriately */
-	lineStart = start;
-	outPtr = outStr;
+	pos_type lineStart = start;
 	while (lineStart <= length_ && lineStart <= end) {
-		int lineEnd = BufEndOfLine(lineStart);
-		String line = BufGetRange(lineStart, lineEnd);
-		deleteRectFromLine(line.str, rectStart, rectEnd, tabDist_, useTabs_, nullSubsChar_, outPtr, &len, &endOffset);
-		outPtr += len;
-		*outPtr++ = '\n';
+		const pos_type lineEnd = copyBufLine(lineStart, &line);
+
+		char_type *outPtr = reserveOutput(&outStr, outLen, expandedLength(line.data(), 0, tabDist_, nullSubsChar_) + padding);
+		deleteRectFromLine(line.data(), rectStart, rectEnd, tabDist_, useTabs_, nullSubsChar_, outPtr, &len, &endOffset);
+
+		lastLine = outLen;
+		outLen += len;
+		outStr[outLen++] = '\n';
 		lineStart = lineEnd + 1;
 	}
-	if (outPtr != outStr)
-		outPtr--; /* trim back off extra newline */
-	*outPtr = '\0';
+	if (outLen != 0)
+		outLen--; /* trim back off extra newline */
 
 	/* replace the text between start and end with the newly created string */
 	deleteRange(start, end);
-	insert(start, outStr);
-	*replaceLen = outPtr - outStr;
-	*endPos = start + (outPtr - outStr) - len + endOffset;
-	delete[] outStr;
+	insert(start, outStr.data(), static_cast<pos_type>(outLen));
+	*replaceLen = static_cast<pos_type>(outLen);
+	*endPos = start + static_cast<pos_type>(lastLine) + endOffset;
 }
 
 /*
@@ -1485,71 +2096,131 @@ void TextBuffer::deleteRect(int start, int end, int rectStart, int rectEnd, int
 ** "endPos" returns buffer position of the lower left edge of the inserted
 ** column (as a hint for routines which need to set a cursor position).
 */
-void TextBuffer::overlayRect(int startPos, int rectStart, int rectEnd, const char_type *insText, int *nDeleted,
-                             int *nInserted, int *endPos) {
-    int lineStart;
-	int expInsLen, len, endOffset;
-	char_type *c;
-	char_type *outPtr;
-	const char_type *insPtr;
-
-	/* Allocate a buffer for the replacement string large enough to hold
-	   possibly expanded tabs in the inserted text, as well as per line: 1)
-	   an additional 2*MAX_EXP_CHAR_LEN characters for padding where tabs
-	   and control characters cross the column of the Selection, 2) up to
-	   "column" additional spaces per line for padding out to the position
-	   of "column", 3) padding up to the width of the inserted text if that
-	   must be padded to align the text beyond the inserted column.  (Space
-	   for additional newlines if the inserted text extends beyond the end
-	   of the buffer is counted with the length of insText) */
-	int start = BufStartOfLine(startPos);
-	int nLines = countLines(insText) + 1;
-	int end = BufEndOfLine(BufCountForwardNLines(start, nLines - 1));
-	String expText = expandTabs(insText, 0, tabDist_, nullSubsChar_, &expInsLen);
-	auto outStr = new char_type[end - start + expInsLen + nLines * (rectEnd + MAX_EXP_CHAR_LEN) + 1];
+void TextBuffer::overlayRect(pos_type startPos, int rectStart, int rectEnd, const char_type *insText, pos_type *nDeleted,
+                             pos_type *nInserted, pos_type *endPos) {
+	int len = 0;
+	int endOffset = 0;
+
+	const pos_type start = BufStartOfLine(startPos);
+	const pos_type nLines = countLines(insText) + 1;
+	const pos_type end = BufEndOfLine(BufCountForwardNLines(start, nLines - 1));
+
+	/* Each line of output needs room for the line and the expanded tabs of
+	   the inserted text, and 1) an additional 2*MAX_EXP_CHAR_LEN characters
+	   for padding where tabs and control characters cross the column of the
+	   Selection, 2) up to "rectEnd" additional spaces for padding out to the
+	   position of the inserted text and beyond it */
+	const int padding = rectEnd + 2 * (MAX_EXP_CHAR_LEN + tabDist_) + 2;
+
+	std::vector<char_type> outStr(end - start + traits_type::length(insText) + 1);
+	std::vector<char_type> line;
+	std::vector<char_type> insLine;
+	size_t outLen = 0;
+	size_t lastLine = 0;
 
 	/* Loop over all lines in the buffer between start and end overlaying the
 	   text between rectStart and rectEnd and padding appropriately.  Trim
 	   trailing space from line (whitespace at the ends of lines otherwise
 	   tends to multiply, since additional padding is added to maintain it */
-	outPtr = outStr;
-	lineStart = start;
-	insPtr = insText;
+	pos_type lineStart = start;
+	const char_type *insPtr = insText;
 	while (true) {
-		
-		int lineEnd    = BufEndOfLine(lineStart);
-		String line    = BufGetRange(lineStart, lineEnd);
-		String insLine = copyLine(insPtr, &len);
-		
-		insPtr += len;
-		overlayRectInLine(line.str, insLine.str, rectStart, rectEnd, tabDist_, useTabs_, nullSubsChar_, outPtr, &len,
+		const pos_type lineEnd = copyBufLine(lineStart, &line);
+		const int insLen = copyLine(insPtr, &insLine);
+		insPtr += insLen;
+
+		char_type *outPtr = reserveOutput(&outStr, outLen, (lineEnd - lineStart) + expandedLength(insLine.data(), 0, tabDist_, nullSubsChar_) + padding);
+		overlayRectInLine(line.data(), insLine.data(), rectStart, rectEnd, tabDist_, useTabs_, nullSubsChar_, outPtr, &len,
 						  &endOffset);
 
-		for (c = outPtr + len - 1; c > outPtr && (*c == ' ' || *c == '\t'); c--)
+		for (char_type *c = outPtr + len - 1; c > outPtr && (*c == ' ' || *c == '\t'); c--)
 			len--;
-		outPtr += len;
-		*outPtr++ = '\n';
+		lastLine = outLen;
+		outLen += len;
+		outStr[outLen++] = '\n';
 		lineStart = lineEnd < length_ ? lineEnd + 1 : length_;
 		if (*insPtr == '\0')
 			break;
 		insPtr++;
 	}
-	if (outPtr != outStr)
-		outPtr--; /* trim back off extra newline */
-	*outPtr = '\0';
+	outLen--; /* trim back off extra newline */
 
 	/* replace the text between start and end with the new stuff */
 	deleteRange(start, end);
-	insert(start, outStr);
-	*nInserted = outPtr - outStr;
+	insert(start, outStr.data(), static_cast<pos_type>(outLen));
+	*nInserted = static_cast<pos_type>(outLen);
 	*nDeleted = end - start;
-	*endPos = start + (outPtr - outStr) - len + endOffset;
-	delete[] outStr;
+	*endPos = start + static_cast<pos_type>(lastLine) + endOffset;
+}
+
+/*
+** Replace the rectangle between "rectStart" and "rectEnd" on the lines from
+** "start" to "end" (which must be the start and end of lines) with "insText",
+** without calling the modify callbacks.  This is deleteRect followed by
+** insertCol at "rectStart", done together a line at a time.  If "insText" has
+** fewer lines than the rectangle, it is treated as padded with empty lines,
+** so that the text to the right of the rectangle is all indented to the same
+** column.  If it has more, the rectangle is extended with empty lines.
+** "nInserted" returns the number of characters replacing those between start
+** and end, and "endPos" the lower left edge of the inserted text.
+*/
+void TextBuffer::replaceRect(pos_type start, pos_type end, int rectStart, int rectEnd, const char_type *insText, pos_type insLength, pos_type *nInserted, pos_type *endPos) {
+	int len = 0;
+	int endOffset = 0;
+	int hint;
+
+	const int column = std::max(rectStart, 0);
+	const pos_type nDeletedLines = BufCountLines(start, end);
+	const pos_type nInsertedLines = countLines(insText, insLength);
+	const int insWidth = textWidth(insText, tabDist_, nullSubsChar_);
+	const int padding = 2 * (MAX_EXP_CHAR_LEN + tabDist_) + 2;
+
+	std::vector<char_type> outStr(end - start + insLength + 1);
+	std::vector<char_type> line;
+	std::vector<char_type> remaining;
+	std::vector<char_type> insLine(1, '\0');
+	size_t outLen = 0;
+	size_t lastLine = 0;
+
+	pos_type lineStart = start;
+	const char_type *insPtr = insText;
+	for (pos_type i = 0; i <= std::max(nDeletedLines, nInsertedLines); i++) {
+
+		/* past the end of either the rectangle or the text, the lines are
+		   empty */
+		if (i <= nDeletedLines) {
+			lineStart = copyBufLine(lineStart, &line) + 1;
+		} else {
+			line.assign(1, '\0');
+		}
+
+		if (i <= nInsertedLines) {
+			insPtr += copyLine(insPtr, &insLine) + 1;
+		} else {
+			insLine.assign(1, '\0');
+		}
+
+		remaining.resize(expandedLength(line.data(), 0, tabDist_, nullSubsChar_) + padding);
+		deleteRectFromLine(line.data(), rectStart, rectEnd, tabDist_, useTabs_, nullSubsChar_, remaining.data(), &len, &hint);
+
+		char_type *outPtr = reserveOutput(&outStr, outLen, expandedLength(remaining.data(), 0, tabDist_, nullSubsChar_) + expandedLength(insLine.data(), 0, tabDist_, nullSubsChar_) + column + insWidth + padding);
+		insertColInLine(remaining.data(), insLine.data(), column, insWidth, tabDist_, useTabs_, nullSubsChar_, outPtr, &len, &endOffset);
+
+		lastLine = outLen;
+		outLen += len;
+		outStr[outLen++] = '\n';
+	}
+	outLen--; /* trim back off extra newline */
+
+	deleteRange(start, end);
+	insert(start, outStr.data(), static_cast<pos_type>(outLen));
+	*nInserted = static_cast<pos_type>(outLen);
+	*endPos = start + static_cast<pos_type>(lastLine) + endOffset;
 }
 
 String TextBuffer::getSelectionText(const Selection &sel) const {
-	int start;
-	int end;
+	pos_type start;
+	pos_type end;
 	bool isRect;
 	int rectStart;
 	int rectEnd;
@@ -1570,8 +2241,8 @@ String TextBuffer::getSelectionText(const Selection &sel) const {
 }
 
 void TextBuffer::removeSelected(const Selection &sel) {
-	int start;
-	int end;
+	pos_type start;
+	pos_type end;
 	bool isRect;
 	int rectStart;
 	int rectEnd;
@@ -1588,8 +2259,8 @@ void TextBuffer::removeSelected(const Selection &sel) {
 }
 
 void TextBuffer::replaceSelected(Selection *sel, const char_type *text) {
-	int start;
-	int end;
+	pos_type start;
+	pos_type end;
 	bool isRect;
 	int rectStart;
 	int rectEnd;
@@ -1613,58 +2284,359 @@ void TextBuffer::replaceSelected(Selection *sel, const char_type *text) {
 	redisplaySelection(oldSelection, *sel);
 }
 
+/*
+** Find out how much the modify callbacks need to know about deleted text
+*/
+DeletedTextNeeds TextBuffer::deletedTextNeeds() const {
+
+	DeletedTextNeeds needs = DELETED_NOTHING;
+	for (const auto &handler : modifyProcs_) {
+		needs = std::max(needs, handler->deletedTextNeeds());
+	}
+
+	for (const RangedModifyCB &proc : rangedModifyProcs_) {
+		needs = std::max(needs, proc.handler->deletedTextNeeds());
+	}
+
+	/* a batch works out the original text of everything it changed from
+	   the deleted text of each change, so the line count alone won't do */
+	if (batchDepth_ > 0 && needs == DELETED_LINE_COUNT) {
+		needs = DELETED_TEXT;
+	}
+
+	return needs;
+}
+
+/*
+** Gather what the modify callbacks need to know about the text between
+** "start" and "end", which is about to be deleted: the number of newlines
+** in it (returned in "nLines"), and a copy of it, but only when some
+** callback asks for the text itself.  The newlines are counted from the
+** line index, so deleting even a huge range copies nothing otherwise.
+*/
+String TextBuffer::saveDeletedText(pos_type start, pos_type end, pos_type *nLines) const {
+
+	const DeletedTextNeeds needs = deletedTextNeeds();
+
+	*nLines = (needs == DELETED_NOTHING || start >= end) ? 0 : BufCountLines(start, end);
+
+	if (needs != DELETED_TEXT) {
+		return String();
+	}
+
+	return BufGetRange(start, end);
+}
+
 /*
 ** Call the stored modify callback procedure(s) for this buffer to update the
-** changed area(s) on the screen and any other listeners.
+** changed area(s) on the screen and any other listeners.  Inside a batch (see
+** BufBeginBatch) the change is only recorded.
 */
-void TextBuffer::callModifyCBs(int pos, int nDeleted, int nInserted, int nRestyled, const char_type *deletedText) {
+void TextBuffer::callModifyCBs(pos_type pos, pos_type nDeleted, pos_type nInserted, pos_type nRestyled, pos_type nDeletedLines, const char_type *deletedText) {
+
+	if (batchDepth_ > 0) {
+		recordBatchChange(pos, nDeleted, nInserted, nRestyled, deletedText);
+		return;
+	}
+
+	notifyModifyCBs(pos, nDeleted, nInserted, nRestyled, nDeletedLines, deletedText, false);
+}
+
+/*
+** Tell the modify callbacks that the whole buffer was replaced by itself,
+** for a change which alters how the text is laid out but not the text
+*/
+void TextBuffer::callUnchangedModifyCBs() {
+
+	const DeletedTextNeeds needs = deletedTextNeeds();
+	const pos_type nLines = (needs == DELETED_NOTHING) ? 0 : BufCountLines(0, length_);
+	const char_type *const text = (needs == DELETED_TEXT) ? BufAsString() : nullptr;
+
+	callModifyCBs(0, length_, length_, 0, nLines, text);
+}
+
+/*
+** Tell the modify callbacks about a change, with bufferLoaded rather than
+** bufferModified if "loaded" is true (see BufLoad)
+*/
+void TextBuffer::notifyModifyCBs(pos_type pos, pos_type nDeleted, pos_type nInserted, pos_type nRestyled, pos_type nDeletedLines, const char_type *deletedText, bool loaded) {
 	ModifyEvent event;
 	event.pos = pos;
 	event.nDeleted = nDeleted;
 	event.nInserted = nInserted;
 	event.nRestyled = nRestyled;
+	event.nDeletedLines = nDeletedLines;
 	event.deletedText = deletedText;
 	event.buffer = this;
 
 	for (const auto &handler : modifyProcs_) {
-		handler->bufferModified(&event);
+		if (loaded) {
+			handler->bufferLoaded(&event);
+		} else {
+			handler->bufferModified(&event);
+		}
+	}
+
+	/* the ranged callbacks only hear about changes which touch their range
+	   (a restyle changes no positions, so they needn't hear of one before
+	   it either).  Ranges are moved before calling out, so a callback may
+	   set its own.  Indexing, rather than iterators, lets it do so safely. */
+	const bool changed = (nDeleted != 0 || nInserted != 0);
+	const pos_type end = pos + (changed ? nDeleted : nRestyled);
+	const pos_type delta = nInserted - nDeleted;
+
+	for (size_t i = 0; i < rangedModifyProcs_.size(); i++) {
+		RangedModifyCB &proc = rangedModifyProcs_[i];
+
+		if (pos > proc.end) {
+			continue;
+		}
+
+		if (end < proc.start) {
+			if (changed) {
+				proc.start += delta;
+				proc.end += delta;
+				proc.handler->bufferShifted(&event);
+			}
+			continue;
+		}
+
+		if (changed) {
+			proc.start = std::min(proc.start, pos);
+			proc.end = (proc.end >= end) ? proc.end + delta : pos + nInserted;
+		}
+
+		if (loaded) {
+			rangedModifyProcs_[i].handler->bufferLoaded(&event);
+		} else {
+			rangedModifyProcs_[i].handler->bufferModified(&event);
+		}
 	}
 }
 
+/*
+** Merge a change made inside a batch into the batch's pending change: the
+** smallest range of the buffer covering everything modified so far, along
+** with the text that range originally held.  Text outside the range is
+** unchanged, so it can be copied from the buffer whenever the range grows.
+** A change which comes without its deleted text (because no callback needs
+** it, see saveDeletedText) leaves only the extent of the range recorded.
+*/
+void TextBuffer::recordBatchChange(pos_type pos, pos_type nDeleted, pos_type nInserted, pos_type nRestyled, const char_type *deletedText) {
+
+	/* nothing asked for the deleted text, so don't gather any either */
+	const bool withoutText = (nDeleted != 0 && !deletedText) || deletedTextNeeds() == DELETED_NOTHING;
+
+	/* a pure restyle changes no text: extend the range over it */
+	if (nDeleted == 0 && nInserted == 0) {
+		const pos_type end = std::min(pos + nRestyled, length_);
+		pos = std::max<pos_type>(pos, 0);
+		nRestyled = end - pos;
+
+		if (nRestyled <= 0) {
+			return;
+		}
+
+		if (!batchPending_) {
+			batchPending_ = true;
+			batchChanged_ = false;
+			batchStart_ = pos;
+			batchEnd_ = pos + nRestyled;
+			return;
+		}
+
+		if (!batchChanged_) {
+			batchStart_ = std::min(batchStart_, pos);
+			batchEnd_ = std::max(batchEnd_, pos + nRestyled);
+			return;
+		}
+
+		nDeleted = nRestyled;
+		nInserted = nRestyled;
+		deletedText = nullptr;
+	}
+
+	/* Copy the text between "start" and "end" as it was just before this
+	   change (which replaced nDeleted characters at pos with nInserted) to
+	   "out".  "deletedText" may only be nullptr for a restyle, where the
+	   text before and after is the same (changes without their deleted
+	   text stop the batch from keeping text at all). */
+	auto copyPrevious = [&](pos_type start, pos_type end, char_type *out) {
+		const pos_type deletedEnd = pos + nDeleted;
+
+		if (start < std::min(end, pos)) {
+			copyRange(start, std::min(end, pos), out);
+			out += std::min(end, pos) - start;
+		}
+
+		for (pos_type i = std::max(start, pos); i < std::min(end, deletedEnd); i++) {
+			*out++ = deletedText ? deletedText[i - pos] : BufGetCharacter(i);
+		}
+
+		if (std::max(start, deletedEnd) < end) {
+			const pos_type from = std::max(start, deletedEnd);
+			copyRange(from - nDeleted + nInserted, end - nDeleted + nInserted, out);
+		}
+	};
+
+	if (!batchPending_) {
+		batchPending_ = true;
+		batchChanged_ = true;
+		batchStart_ = pos;
+		batchEnd_ = pos + nInserted;
+		batchDeleted_ = nDeleted;
+		batchHasText_ = !withoutText;
+		if (batchHasText_) {
+			batchText_.assign(deletedText, deletedText + nDeleted);
+		}
+		return;
+	}
+
+	/* the range so far only holds restyles, so its original text is what
+	   was there before this change */
+	if (!batchChanged_) {
+		batchDeleted_ = batchEnd_ - batchStart_;
+		batchHasText_ = !withoutText;
+		if (batchHasText_) {
+			batchText_.resize(batchDeleted_);
+			copyPrevious(batchStart_, batchEnd_, batchText_.data());
+		}
+	} else if (withoutText) {
+		batchHasText_ = false;
+		batchText_.clear();
+	}
+
+	/* grow the range to cover the change, and its original text with it */
+	if (pos < batchStart_) {
+		if (batchHasText_) {
+			batchText_.insert(batchText_.begin(), batchStart_ - pos, char_type());
+			copyPrevious(pos, batchStart_, batchText_.data());
+		}
+		batchDeleted_ += batchStart_ - pos;
+		batchStart_ = pos;
+	}
+
+	if (pos + nDeleted > batchEnd_) {
+		if (batchHasText_) {
+			const pos_type oldLength = static_cast<pos_type>(batchText_.size());
+			batchText_.resize(oldLength + pos + nDeleted - batchEnd_);
+			copyPrevious(batchEnd_, pos + nDeleted, batchText_.data() + oldLength);
+		}
+		batchDeleted_ += pos + nDeleted - batchEnd_;
+		batchEnd_ = pos + nDeleted;
+	}
+
+	batchEnd_ += nInserted - nDeleted;
+	batchChanged_ = true;
+}
+
+/*
+** Send the pending change of the current batch (if any) to the modify
+** callbacks
+*/
+void TextBuffer::flushBatch() {
+
+	if (!batchPending_) {
+		return;
+	}
+
+	batchPending_ = false;
+
+	if (batchChanged_ && batchHasText_) {
+		const pos_type nDeleted = static_cast<pos_type>(batchText_.size());
+		const pos_type nDeletedLines = countNewlines(batchText_.data(), batchText_.size());
+		batchText_.push_back(_T('\0'));
+		notifyModifyCBs(batchStart_, nDeleted, batchEnd_ - batchStart_, 0, nDeletedLines, batchText_.data(), false);
+	} else if (batchChanged_) {
+		notifyModifyCBs(batchStart_, batchDeleted_, batchEnd_ - batchStart_, 0, 0, nullptr, false);
+	} else {
+		notifyModifyCBs(batchStart_, 0, 0, batchEnd_ - batchStart_, 0, nullptr, false);
+	}
+
+	batchText_.clear();
+}
+
 /*
 ** Call the stored pre-delete callback procedure(s) for this buffer to update
 ** the changed area(s) on the screen and any other listeners.
 */
-void TextBuffer::callPreDeleteCBs(int pos, int nDeleted) {
+void TextBuffer::callPreDeleteCBs(pos_type pos, pos_type nDeleted) {
 
 	PreDeleteEvent event;
 	event.pos = pos;
 	event.nDeleted = nDeleted;
 	event.buffer = this;
 
+	/* a handler which needs to see the change that follows on its own
+	   stops the batch from merging it with the earlier ones */
+	if (batchPending_) {
+		for (const auto &handler : preDeleteProcs_) {
+			if (handler->preDeleteNeedsExactModify()) {
+				flushBatch();
+				break;
+			}
+		}
+	}
+
 	for (const auto &handler : preDeleteProcs_) {
 		handler->preDelete(&event);
 	}
 }
 
+/*
+** Copy the text between "start" and "end" to "outStr" (which is not
+** null-terminated)
+*/
+void TextBuffer::copyRange(pos_type start, pos_type end, char_type *outStr) const {
+	const pos_type length = end - start;
+	pos_type part1Length;
+
+	if (pieces_) {
+		pieces_->copy(start, end, outStr);
+		return;
+	}
+
+#ifdef USE_MEMCPY
+	if (end <= gapStart_) {
+		memcpy(outStr, &buf_[start], length);
+	} else if (start >= gapStart_) {
+		memcpy(outStr, &buf_[start + (gapEnd_ - gapStart_)], length);
+	} else {
+		part1Length = gapStart_ - start;
+		memcpy(outStr, &buf_[start], part1Length);
+		memcpy(&outStr[part1Length], &buf_[gapEnd_], length - part1Length);
+	}
+#else
+	if (end <= gapStart_) {
+		std::copy_n(&buf_[start], length, outStr);
+	} else if (start >= gapStart_) {
+		std::copy_n(&buf_[start + (gapEnd_ - gapStart_)], length, outStr);
+	} else {
+		part1Length = gapStart_ - start;
+		std::copy_n(&buf_[start], part1Length, outStr);
+		std::copy_n(&buf_[gapEnd_], length - part1Length, &outStr[part1Length]);
+	}
+#endif
+}
+
 /*
 ** Call the stored redisplay procedure(s) for this buffer to update the
 ** screen for a change in a Selection.
 */
 void TextBuffer::redisplaySelection(const Selection &oldSelection, const Selection &newSelection) {
 
-	int ch1Start;
-	int ch1End;
-	int ch2Start;
-	int ch2End;
+	pos_type ch1Start;
+	pos_type ch1End;
+	pos_type ch2Start;
+	pos_type ch2End;
 
 	/* If either Selection is rectangular, add an additional character to
 	   the end of the Selection to request the redraw routines to wipe out
 	   the parts of the Selection beyond the end of the line */
-	int oldStart = oldSelection.start;
-	int newStart = newSelection.start;
-	int oldEnd = oldSelection.end;
-	int newEnd = newSelection.end;
+	pos_type oldStart = oldSelection.start;
+	pos_type newStart = newSelection.start;
+	pos_type oldEnd = oldSelection.end;
+	pos_type newEnd = newSelection.end;
 
 	if (oldSelection.rectangular) {
 		++oldEnd;
@@ -1681,11 +2653,11 @@ void TextBuffer::redisplaySelection(const Selection &oldSelection, const Selecti
 	}
 
 	if (!oldSelection.selected) {
-		callModifyCBs(newStart, 0, 0, newEnd - newStart, nullptr);
+		callModifyCBs(newStart, 0, 0, newEnd - newStart, 0, nullptr);
 		return;
 	}
 	if (!newSelection.selected) {
-		callModifyCBs(oldStart, 0, 0, oldEnd - oldStart, nullptr);
+		callModifyCBs(oldStart, 0, 0, oldEnd - oldStart, 0, nullptr);
 		return;
 	}
 
@@ -1697,7 +2669,7 @@ void TextBuffer::redisplaySelection(const Selection &oldSelection, const Selecti
 	     ((oldSelection.rectStart != newSelection.rectStart) || (oldSelection.rectEnd != newSelection.rectEnd)))) {
 
 		callModifyCBs(std::min(oldStart, newStart), 0, 0, std::max(oldEnd, newEnd) - std::min(oldStart, newStart),
-		              nullptr);
+		              0, nullptr);
 
 		return;
 	}
@@ -1705,8 +2677,8 @@ void TextBuffer::redisplaySelection(const Selection &oldSelection, const Selecti
 	/* If the selections are non-contiguous, do two separate updates
 	   and return */
 	if (oldEnd < newStart || newEnd < oldStart) {
-		callModifyCBs(oldStart, 0, 0, oldEnd - oldStart, nullptr);
-		callModifyCBs(newStart, 0, 0, newEnd - newStart, nullptr);
+		callModifyCBs(oldStart, 0, 0, oldEnd - oldStart, 0, nullptr);
+		callModifyCBs(newStart, 0, 0, newEnd - newStart, 0, nullptr);
 		return;
 	}
 
@@ -1719,110 +2691,492 @@ void TextBuffer::redisplaySelection(const Selection &oldSelection, const Selecti
 	ch2Start = std::min(oldEnd, newEnd);
 
 	if (ch1Start != ch1End) {
-		callModifyCBs(ch1Start, 0, 0, ch1End - ch1Start, nullptr);
+		callModifyCBs(ch1Start, 0, 0, ch1End - ch1Start, 0, nullptr);
+	}
+
+	if (ch2Start != ch2End) {
+		callModifyCBs(ch2Start, 0, 0, ch2End - ch2Start, 0, nullptr);
+	}
+}
+
+/*
+** Move the gap to "pos" and make sure it can hold "length" more characters.
+** When the buffer has to be reallocated, the new gap gets room for a
+** proportion of the text (GAP_GROWTH_DIVISOR) on top of "length", so that the
+** cost of growing the buffer is amortized over many inserts.
+*/
+void TextBuffer::prepareGap(pos_type pos, pos_type length) {
+
+	if (length > gapEnd_ - gapStart_) {
+		const pos_type slack = std::max<pos_type>(PREFERRED_GAP_SIZE, (length_ + length) / GAP_GROWTH_DIVISOR);
+		reallocateBuf(pos, length + slack);
+	} else if (pos != gapStart_) {
+		moveGap(pos);
+	}
+}
+
+/*
+** Gap buffer part of BufReplaceMultiple.  With the gap at the start of the
+** first range, the text up to the end of the last one is walked once: the
+** unchanged text in between ranges is moved across the gap, the replaced
+** text is swallowed by the gap, and the new text is written at its start.
+*/
+void TextBuffer::replaceRanges(const TextReplacement *replacements, int nReplacements) {
+	const pos_type start = replacements[0].start;
+	const pos_type end = replacements[nReplacements - 1].end;
+
+	/* the gap must hold the most the text grows by at any point of the walk */
+	pos_type growth = 0;
+	pos_type maxGrowth = 0;
+	for (int i = 0; i < nReplacements; i++) {
+		growth += replacements[i].length - (replacements[i].end - replacements[i].start);
+		maxGrowth = std::max(maxGrowth, growth);
+	}
+
+	prepareGap(start, maxGrowth);
+	unshareBuf(gapStart_, gapEnd_ + (end - start));
+	lineIndexUpdate(gapEnd_, gapEnd_ + (end - start), -1);
+
+	pos_type pos = start;
+	for (int i = 0; i < nReplacements; i++) {
+		const TextReplacement &r = replacements[i];
+
+		std::copy_n(&buf_[gapEnd_], r.start - pos, &buf_[gapStart_]);
+		gapStart_ += r.start - pos;
+		gapEnd_ += r.end - pos;
+
+		std::copy_n(r.text, r.length, &buf_[gapStart_]);
+		gapStart_ += r.length;
+		pos = r.end;
+	}
+
+	lineIndexUpdate(start, gapStart_, 1);
+	length_ += growth;
+#ifdef PURIFY
+	std::fill_n(&buf_[gapStart_], gapEnd_ - gapStart_, '.');
+#endif
+}
+
+/*
+** Free the storage of the buffer (unless snapshots still share it)
+*/
+void TextBuffer::releaseBuf() {
+
+	if (bufOwner_) {
+		bufOwner_ = nullptr;
+	} else {
+		delete[] buf_;
+	}
+
+	buf_ = nullptr;
+}
+
+/*
+** Must be called before changing the characters between "physStart" and
+** "physEnd" of buf_.  If snapshots which can see them share the storage, the
+** buffer switches to a copy of its own.
+*/
+void TextBuffer::unshareBuf(pos_type physStart, pos_type physEnd) {
+
+	if (!bufOwner_ || (physStart >= sharedGapStart_ && physEnd <= sharedGapEnd_)) {
+		return;
+	}
+
+	if (bufOwner_.use_count() == 1) {
+		/* the snapshots are all gone */
+		sharedGapStart_ = 0;
+		sharedGapEnd_ = INT64_MAX;
+		return;
+	}
+
+	reallocateBuf(gapStart_, gapEnd_ - gapStart_);
+}
+
+/*
+** Give back the memory of a gap which has grown much larger than the text
+** (by deleting most of a big buffer), keeping room for a proportion of what
+** is left so that growing again is still amortized.
+*/
+void TextBuffer::shrinkGap() {
+	const pos_type gapLen = gapEnd_ - gapStart_;
+
+	if (!pieces_ && gapLen > GAP_SHRINK_THRESHOLD && gapLen > length_) {
+		reallocateBuf(gapStart_, std::max<pos_type>(PREFERRED_GAP_SIZE, length_ / (2 * GAP_GROWTH_DIVISOR)));
+	}
+}
+
+void TextBuffer::moveGap(pos_type pos) {
+	const pos_type gapLen = gapEnd_ - gapStart_;
+
+	if (pos > gapStart_) {
+		unshareBuf(gapStart_, pos);
+	} else {
+		unshareBuf(pos + gapLen, gapEnd_);
+	}
+
+	/* the characters which hop over the gap change blocks in the index */
+	if (pos > gapStart_) {
+		lineIndexUpdate(gapEnd_, pos + gapLen, -1);
+	} else {
+		lineIndexUpdate(pos, gapStart_, -1);
+	}
+
+#ifdef USE_MEMCPY
+	if (pos > gapStart_) {
+		memmove(&buf_[gapStart_], &buf_[gapEnd_], pos - gapStart_);
+	} else {
+		memmove(&buf_[pos + gapLen], &buf_[pos], gapStart_ - pos);
+	}
+#else
+	if (pos > gapStart_) {
+		//assert((gapEnd_ + pos - gapStart_) < gapEnd_);
+		std::copy_backward(&buf_[gapEnd_], &buf_[gapEnd_ + pos - gapStart_], &buf_[gapStart_ + pos - gapStart_]);
+	} else {
+		std::copy(&buf_[pos], &buf_[gapStart_], &buf_[pos + gapLen]);
+	}
+#endif
+
+	if (pos > gapStart_) {
+		lineIndexUpdate(gapStart_, pos, 1);
+	} else {
+		lineIndexUpdate(pos + gapLen, gapStart_ + gapLen, 1);
+	}
+
+	gapEnd_ += pos - gapStart_;
+	gapStart_ += pos - gapStart_;
+}
+
+/*
+** reallocate the text storage in "buf" to have a gap starting at "newGapStart"
+** and a gap size of "newGapLen", preserving the buffer's current contents.
+*/
+void TextBuffer::reallocateBuf(pos_type newGapStart, pos_type newGapLen) {
+
+	auto newBuf = new char_type[length_ + newGapLen + 1];
+	newBuf[length_ + newGapLen] = '\0';
+	pos_type newGapEnd = newGapStart + newGapLen;
+#ifdef USE_MEMCPY
+	if (newGapStart <= gapStart_) {
+		memcpy(newBuf, buf_, newGapStart);
+		memcpy(&newBuf[newGapEnd], &buf_[newGapStart], gapStart_ - newGapStart);
+		memcpy(&newBuf[newGapEnd + gapStart_ - newGapStart], &buf_[gapEnd_], length_ - gapStart_);
+	} else { /* newGapStart > gapStart_ */
+		memcpy(newBuf, buf_, gapStart_);
+		memcpy(&newBuf[gapStart_], &buf_[gapEnd_], newGapStart - gapStart_);
+		memcpy(&newBuf[newGapEnd], &buf_[gapEnd_ + newGapStart - gapStart_], length_ - newGapStart);
+	}
+#else
+	if (newGapStart <= gapStart_) {
+		std::copy_n(buf_, newGapStart, newBuf);
+		std::copy_n(&buf_[newGapStart], gapStart_ - newGapStart, &newBuf[newGapEnd]);
+		std::copy_n(&buf_[gapEnd_], length_ - gapStart_, &newBuf[newGapEnd + gapStart_ - newGapStart]);
+	} else { /* newGapStart > gapStart_ */
+		std::copy_n(buf_, gapStart_, newBuf);
+		std::copy_n(&buf_[gapEnd_], newGapStart - gapStart_, &newBuf[gapStart_]);
+		std::copy_n(&buf_[gapEnd_ + newGapStart - gapStart_], length_ - newGapStart, &newBuf[newGapEnd]);
+	}
+#endif
+	releaseBuf();
+	buf_ = newBuf;
+	gapStart_ = newGapStart;
+	gapEnd_ = newGapEnd;
+#ifdef PURIFY
+	std::fill_n(&buf_[gapStart_], gapEnd_ - gapStart_, '.');
+#endif
+	lineIndexRebuild();
+}
+
+/*
+** Build the line index (and in UTF-8 mode, the character index) from
+** scratch.  This is O(n), so it is only done when the buffer is (re)allocated
+** and everything has been copied anyway.
+*/
+void TextBuffer::lineIndexRebuild() {
+	blockIndexRebuild(&lineIndex_, countNewlines);
+
+	if (utf8_) {
+		blockIndexRebuild(&codePointIndex_, countCodePoints);
+	} else {
+		codePointIndex_.clear();
+	}
+
+	nullSubsBlocksRebuild();
+}
+
+/*
+** Add ("sign" == 1) or remove ("sign" == -1) the newlines (and characters)
+** stored in the allocated buffer between "physStart" and "physEnd" to/from
+** the indexes.  The range must not overlap the gap.
+*/
+void TextBuffer::lineIndexUpdate(pos_type physStart, pos_type physEnd, int sign) {
+	blockIndexUpdate(&lineIndex_, physStart, physEnd, sign, countNewlines);
+
+	if (!codePointIndex_.empty()) {
+		blockIndexUpdate(&codePointIndex_, physStart, physEnd, sign, countCodePoints);
+	}
+
+	if (sign > 0 && !nullSubsBlocks_.empty()) {
+		markNullSubsBlocks(physStart, physEnd);
+	}
+}
+
+/*
+** Return the number of newlines in the buffer before position "pos"
+*/
+pos_type TextBuffer::lineIndexPrefix(pos_type pos) const {
+
+	if (pieces_) {
+		return pieces_->countLines(pos);
+	}
+
+	return blockIndexPrefix(lineIndex_, pos, countNewlines);
+}
+
+/*
+** Return the position of the first character after the "nLines"th newline
+** in the buffer.  There must be at least "nLines" (>= 1) newlines.
+*/
+pos_type TextBuffer::lineIndexFind(pos_type nLines) const {
+
+	if (pieces_) {
+		return pieces_->findLine(nLines);
+	}
+
+	return blockIndexFind(lineIndex_, nLines, isNewline) + 1;
+}
+
+/*
+** Recount (using "count") the characters of interest in every block of the
+** allocated buffer, and build the Fenwick tree "index" of the counts
+*/
+void TextBuffer::blockIndexRebuild(std::vector<pos_type> *index, CountFunc count) {
+	const pos_type bufSize = length_ + (gapEnd_ - gapStart_);
+	const pos_type nBlocks = bufSize / LINE_INDEX_BLOCK_SIZE + 1;
+
+	index->assign(nBlocks + 1, 0);
+
+	for (pos_type block = 0; block < nBlocks; block++) {
+		const pos_type blockStart = block * LINE_INDEX_BLOCK_SIZE;
+		const pos_type blockEnd = std::min(blockStart + LINE_INDEX_BLOCK_SIZE, bufSize);
+
+		if (blockStart < gapStart_) {
+			(*index)[block + 1] += count(&buf_[blockStart], std::min(blockEnd, gapStart_) - blockStart);
+		}
+
+		if (blockEnd > gapEnd_) {
+			const pos_type from = std::max(blockStart, gapEnd_);
+			(*index)[block + 1] += count(&buf_[from], blockEnd - from);
+		}
+	}
+
+	makeFenwickTree(index);
+}
+
+void TextBuffer::blockIndexUpdate(std::vector<pos_type> *index, pos_type physStart, pos_type physEnd, int sign, CountFunc count) {
+	const pos_type nBlocks = static_cast<pos_type>(index->size()) - 1;
+
+	while (physStart < physEnd) {
+		const pos_type block = physStart / LINE_INDEX_BLOCK_SIZE;
+		const pos_type blockEnd = std::min((block + 1) * LINE_INDEX_BLOCK_SIZE, physEnd);
+
+		if (const pos_type n = count(&buf_[physStart], blockEnd - physStart)) {
+			for (pos_type i = block + 1; i <= nBlocks; i += i & -i) {
+				(*index)[i] += sign * n;
+			}
+		}
+
+		physStart = blockEnd;
+	}
+}
+
+/*
+** Return the number of characters counted by "count" before position "pos",
+** using the block index "index" built with the same function
+*/
+pos_type TextBuffer::blockIndexPrefix(const std::vector<pos_type> &index, pos_type pos, CountFunc count) const {
+	const pos_type physPos = (pos <= gapStart_) ? pos : pos + (gapEnd_ - gapStart_);
+	const pos_type block = physPos / LINE_INDEX_BLOCK_SIZE;
+	const pos_type blockStart = block * LINE_INDEX_BLOCK_SIZE;
+
+	pos_type total = 0;
+	for (pos_type i = block; i > 0; i -= i & -i) {
+		total += index[i];
+	}
+
+	/* count the rest one character at a time, skipping over the gap */
+	if (blockStart < gapStart_) {
+		total += count(&buf_[blockStart], std::min(physPos, gapStart_) - blockStart);
+	}
+
+	if (physPos > gapEnd_) {
+		const pos_type from = std::max(blockStart, gapEnd_);
+		total += count(&buf_[from], physPos - from);
+	}
+
+	return total;
+}
+
+/*
+** Return the position of the "n"th (>= 1) character for which "match" is
+** true, using the block index "index" of those characters.  There must be at
+** least "n" of them.
+*/
+pos_type TextBuffer::blockIndexFind(const std::vector<pos_type> &index, pos_type n, MatchFunc match) const {
+	const pos_type nBlocks = static_cast<pos_type>(index.size()) - 1;
+	const pos_type gapLen = gapEnd_ - gapStart_;
+
+	/* descend the tree to find the block holding the character */
+	pos_type step = 1;
+	while (step * 2 <= nBlocks) {
+		step *= 2;
+	}
+
+	pos_type block = 0;
+	for (; step != 0; step /= 2) {
+		if (block + step <= nBlocks && index[block + step] < n) {
+			block += step;
+			n -= index[block];
+		}
+	}
+
+	/* and then scan the block for it, skipping over the gap */
+	const pos_type blockStart = block * LINE_INDEX_BLOCK_SIZE;
+	const pos_type blockEnd = std::min(blockStart + LINE_INDEX_BLOCK_SIZE, length_ + gapLen);
+
+	for (pos_type physPos = blockStart; physPos < blockEnd; physPos++) {
+		if (physPos >= gapStart_ && physPos < gapEnd_) {
+			physPos = gapEnd_;
+			if (physPos >= blockEnd)
+				break;
+		}
+
+		if (match(buf_[physPos]) && --n == 0) {
+			return physPos < gapStart_ ? physPos : physPos - gapLen;
+		}
+	}
+
+	assert(!"Internal consistency check lindex1 failed");
+	return length_;
+}
+
+/*
+** Find out which LINE_INDEX_BLOCK_SIZE blocks of the allocated buffer hold
+** the null substitution character.  No blocks are tracked while there is no
+** substitution character, or in piece table mode.
+*/
+void TextBuffer::nullSubsBlocksRebuild() {
+
+	if (nullSubsChar_ == '\0' || pieces_) {
+		nullSubsBlocks_.clear();
+		return;
 	}
 
-	if (ch2Start != ch2End) {
-		callModifyCBs(ch2Start, 0, 0, ch2End - ch2Start, nullptr);
-	}
+	const pos_type bufSize = length_ + (gapEnd_ - gapStart_);
+	nullSubsBlocks_.assign(bufSize / LINE_INDEX_BLOCK_SIZE + 1, false);
+
+	markNullSubsBlocks(0, gapStart_);
+	markNullSubsBlocks(gapEnd_, bufSize);
 }
 
-void TextBuffer::moveGap(int pos) {
-	const int gapLen = gapEnd_ - gapStart_;
+/*
+** Mark the blocks which the null substitution characters stored between
+** "physStart" and "physEnd" are in.  Marks are only ever cleared by a
+** rebuild, so a marked block may no longer hold any, but an unmarked one
+** never does.
+*/
+void TextBuffer::markNullSubsBlocks(pos_type physStart, pos_type physEnd) {
+	const CharSet set(nullSubsChar_);
 
-#ifdef USE_MEMCPY
-	if (pos > gapStart_) {
-		memmove(&buf_[gapStart_], &buf_[gapEnd_], pos - gapStart_);
-	} else {
-		memmove(&buf_[pos + gapLen], &buf_[pos], gapStart_ - pos);
-	}
-#else
-	if (pos > gapStart_) {
-		//assert((gapEnd_ + pos - gapStart_) < gapEnd_);
-		std::copy_backward(&buf_[gapEnd_], &buf_[gapEnd_ + pos - gapStart_], &buf_[gapStart_ + pos - gapStart_]);
-	} else {
-		std::copy(&buf_[pos], &buf_[gapStart_], &buf_[pos + gapLen]);
-	}
-#endif
+	while (physStart < physEnd) {
+		const pos_type block = physStart / LINE_INDEX_BLOCK_SIZE;
+		const pos_type blockEnd = std::min((block + 1) * LINE_INDEX_BLOCK_SIZE, physEnd);
 
-	gapEnd_ += pos - gapStart_;
-	gapStart_ += pos - gapStart_;
+		if (!nullSubsBlocks_[block] && findFirstOf(&buf_[physStart], blockEnd - physStart, set)) {
+			nullSubsBlocks_[block] = true;
+		}
+
+		physStart = blockEnd;
+	}
 }
 
 /*
-** reallocate the text storage in "buf" to have a gap starting at "newGapStart"
-** and a gap size of "newGapLen", preserving the buffer's current contents.
+** Copy the line of the buffer starting at "lineStart" into "line" (null-
+** terminated, reusing its storage), and return the position of its end
 */
-void TextBuffer::reallocateBuf(int newGapStart, int newGapLen) {
+pos_type TextBuffer::copyBufLine(pos_type lineStart, std::vector<char_type> *line) const {
+	const pos_type lineEnd = BufEndOfLine(lineStart);
 
-	auto newBuf = new char_type[length_ + newGapLen + 1];
-	newBuf[length_ + PREFERRED_GAP_SIZE] = '\0';
-	int newGapEnd = newGapStart + newGapLen;
-#ifdef USE_MEMCPY
-	if (newGapStart <= gapStart_) {
-		memcpy(newBuf, buf_, newGapStart);
-		memcpy(&newBuf[newGapEnd], &buf_[newGapStart], gapStart_ - newGapStart);
-		memcpy(&newBuf[newGapEnd + gapStart_ - newGapStart], &buf_[gapEnd_], length_ - gapStart_);
-	} else { /* newGapStart > gapStart_ */
-		memcpy(newBuf, buf_, gapStart_);
-		memcpy(&newBuf[gapStart_], &buf_[gapEnd_], newGapStart - gapStart_);
-		memcpy(&newBuf[newGapEnd], &buf_[gapEnd_ + newGapStart - gapStart_], length_ - newGapStart);
-	}
-#else
-	if (newGapStart <= gapStart_) {
-		std::copy_n(buf_, newGapStart, newBuf);
-		std::copy_n(&buf_[newGapStart], gapStart_ - newGapStart, &newBuf[newGapEnd]);
-		std::copy_n(&buf_[gapEnd_], length_ - gapStart_, &newBuf[newGapEnd + gapStart_ - newGapStart]);
-	} else { /* newGapStart > gapStart_ */
-		std::copy_n(buf_, gapStart_, newBuf);
-		std::copy_n(&buf_[gapEnd_], newGapStart - gapStart_, &newBuf[gapStart_]);
-		std::copy_n(&buf_[gapEnd_ + newGapStart - gapStart_], length_ - newGapStart, &newBuf[newGapEnd]);
-	}
-#endif
-	delete[] buf_;
-	buf_ = newBuf;
-	gapStart_ = newGapStart;
-	gapEnd_ = newGapEnd;
-#ifdef PURIFY
-	std::fill_n(&buf_[gapStart_], gapEnd_ - gapStart_, '.');
-#endif
+	line->resize(lineEnd - lineStart + 1);
+	copyRange(lineStart, lineEnd, line->data());
+	(*line)[lineEnd - lineStart] = '\0';
+	return lineEnd;
 }
 
 /*
-** Update all of the selections in "buf" for changes in the buffer's text
+** Update all of the selections (and markers and rangesets) in "buf" for
+** changes in the buffer's text
 */
-void TextBuffer::updateSelections(int pos, int nDeleted, int nInserted) {
+void TextBuffer::updateSelections(pos_type pos, pos_type nDeleted, pos_type nInserted) {
 	updateSelection(&primary_, pos, nDeleted, nInserted);
 	updateSelection(&secondary_, pos, nDeleted, nInserted);
 	updateSelection(&highlight_, pos, nDeleted, nInserted);
+	markers_.update(pos, nDeleted, nInserted);
+
+	if (rangesetTable_) {
+		rangesetTable_->update(pos, nDeleted, nInserted);
+	}
 }
 
 /*
 ** Search forwards in buffer "buf" for character "searchChar", starting
 ** with the character "startPos", and returning the result in "foundPos"
-** returns true if found, false if not.  (The difference between this and
-** BufSearchForward is that it's optimized for single characters.  The
-** overall performance of the text widget is dependent on its ability to
-** count lines quickly, hence searching for a single character: newline)
-*/
-bool TextBuffer::searchForward(int startPos, char_type searchChar, int *foundPos) const {
-	int pos, gapLen = gapEnd_ - gapStart_;
-
-	pos = startPos;
-	while (pos < gapStart_) {
-		if (buf_[pos] == searchChar) {
-			*foundPos = pos;
+** returns true if found, false if not.  (The overall performance of the
+** text widget is dependent on its ability to find line boundaries quickly,
+** hence searching for a single character: newline)
+*/
+bool TextBuffer::searchForward(pos_type startPos, char_type searchChar, pos_type *foundPos) const {
+	return searchForward(startPos, CharSet(searchChar), foundPos);
+}
+
+/*
+** Search forwards in buffer "buf" for characters in "set", starting with the
+** character "startPos", and returning the result in "foundPos" returns true
+** if found, false if not.  Each side of the gap (or each piece) is scanned
+** with the vectorized findFirstOf.
+*/
+bool TextBuffer::searchForward(pos_type startPos, const CharSet &set, pos_type *foundPos) const {
+	pos_type pos = std::max<pos_type>(startPos, 0);
+
+	if (pieces_) {
+		while (pos < length_) {
+			pos_type spanLength;
+			const char_type *text = pieces_->span(pos, &spanLength);
+			if (const char_type *found = findFirstOf(text, spanLength, set)) {
+				*foundPos = pos + static_cast<pos_type>(found - text);
+				return true;
+			}
+			pos += spanLength;
+		}
+		*foundPos = length_;
+		return false;
+	}
+
+	if (pos < gapStart_) {
+		if (const char_type *found = findFirstOf(&buf_[pos], gapStart_ - pos, set)) {
+			*foundPos = static_cast<pos_type>(found - buf_);
 			return true;
 		}
-		pos++;
+		pos = gapStart_;
 	}
-	while (pos < length_) {
-		if (buf_[pos + gapLen] == searchChar) {
-			*foundPos = pos;
+
+	if (pos < length_) {
+		const pos_type gapLen = gapEnd_ - gapStart_;
+		if (const char_type *found = findFirstOf(&buf_[pos + gapLen], length_ - pos, set)) {
+			*foundPos = static_cast<pos_type>(found - buf_) - gapLen;
 			return true;
 		}
-		pos++;
 	}
+
 	*foundPos = length_;
 	return false;
 }
@@ -1830,33 +3184,53 @@ bool TextBuffer::searchForward(int startPos, char_type searchChar, int *foundPos
 /*
 ** Search backwards in buffer "buf" for character "searchChar", starting
 ** with the character BEFORE "startPos", returning the result in "foundPos"
-** returns true if found, false if not.  (The difference between this and
-** BufSearchBackward is that it's optimized for single characters.  The
-** overall performance of the text widget is dependent on its ability to
-** count lines quickly, hence searching for a single character: newline)
+** returns true if found, false if not.  (The overall performance of the
+** text widget is dependent on its ability to find line boundaries quickly,
+** hence searching for a single character: newline)
+*/
+bool TextBuffer::searchBackward(pos_type startPos, char_type searchChar, pos_type *foundPos) const {
+	return searchBackward(startPos, CharSet(searchChar), foundPos);
+}
+
+/*
+** Search backwards in buffer "buf" for characters in "set", starting with
+** the character BEFORE "startPos", returning the result in "foundPos"
+** returns true if found, false if not.  Each side of the gap (or each piece)
+** is scanned with the vectorized findLastOf.
 */
-bool TextBuffer::searchBackward(int startPos, char_type searchChar, int *foundPos) const {
-	int pos, gapLen = gapEnd_ - gapStart_;
+bool TextBuffer::searchBackward(pos_type startPos, const CharSet &set, pos_type *foundPos) const {
+	pos_type pos = std::min(startPos, length_);
 
-	if (startPos == 0) {
+	if (pieces_) {
+		while (pos > 0) {
+			pos_type spanLength;
+			const char_type *text = pieces_->spanBefore(pos, &spanLength);
+			if (const char_type *found = findLastOf(text, spanLength, set)) {
+				*foundPos = pos - spanLength + static_cast<pos_type>(found - text);
+				return true;
+			}
+			pos -= spanLength;
+		}
 		*foundPos = 0;
 		return false;
 	}
-	pos = startPos == 0 ? 0 : startPos - 1;
-	while (pos >= gapStart_) {
-		if (buf_[pos + gapLen] == searchChar) {
-			*foundPos = pos;
+
+	if (pos > gapStart_) {
+		const pos_type gapLen = gapEnd_ - gapStart_;
+		if (const char_type *found = findLastOf(&buf_[gapEnd_], pos - gapStart_, set)) {
+			*foundPos = static_cast<pos_type>(found - buf_) - gapLen;
 			return true;
 		}
-		pos--;
+		pos = gapStart_;
 	}
-	while (pos >= 0) {
-		if (buf_[pos] == searchChar) {
-			*foundPos = pos;
+
+	if (pos > 0) {
+		if (const char_type *found = findLastOf(buf_, pos, set)) {
+			*foundPos = static_cast<pos_type>(found - buf_);
 			return true;
 		}
-		pos--;
 	}
+
 	*foundPos = 0;
 	return false;
 }
@@ -1875,9 +3249,10 @@ bool TextBuffer::searchBackward(int startPos, char_type searchChar, int *foundPo
 ** that there are other characters in the Selection to establish the right
 ** margin for subsequent columnar pastes of this data.
 */
-void TextBuffer::findRectSelBoundariesForCopy(int lineStartPos, int rectStart, int rectEnd, int *selStart,
-                                              int *selEnd) const {
-	int pos, width, indent = 0;
+void TextBuffer::findRectSelBoundariesForCopy(pos_type lineStartPos, int rectStart, int rectEnd, pos_type *selStart,
+                                              pos_type *selEnd) const {
+	pos_type pos;
+	int width, indent = 0;
 	char_type c;
 
 	/* find the start of the Selection */
@@ -1914,7 +3289,7 @@ void TextBuffer::findRectSelBoundariesForCopy(int lineStartPos, int rectStart, i
 	*selEnd = pos;
 }
 
-int TextBuffer::BufGetLength() const {
+pos_type TextBuffer::BufGetLength() const {
 	return length_;
 }
 
@@ -1934,10 +3309,50 @@ Selection &TextBuffer::BufGetHighlight() {
 	return highlight_;
 }
 
-int TextBuffer::BufGetCursorPosHint() const {
+pos_type TextBuffer::BufGetCursorPosHint() const {
 	return cursorPosHint_;
 }
 
+bool TextBuffer::BufGetUsePieceTable() const {
+	return pieces_ != nullptr;
+}
+
+/*
+** Switch the buffer between storing its text in a gap buffer (the default,
+** best for ordinary editing) and in a piece table (for very large texts,
+** where edits far away from each other would otherwise mean moving the gap
+** over megabytes of text).  The contents of the buffer don't change, so no
+** callbacks are called.
+*/
+void TextBuffer::BufSetUsePieceTable(bool value) {
+
+	if (value && !pieces_) {
+		pieces_ = new PieceTable(BufAsString(), length_);
+
+		releaseBuf();
+		buf_ = nullptr;
+		gapStart_ = 0;
+		gapEnd_ = 0;
+		lineIndex_.clear();
+		codePointIndex_.clear();
+		nullSubsBlocks_.clear();
+	} else if (!value && pieces_) {
+		buf_ = new char_type[length_ + PREFERRED_GAP_SIZE + 1];
+		buf_[length_ + PREFERRED_GAP_SIZE] = '\0';
+		pieces_->copy(0, length_, buf_);
+		gapStart_ = length_;
+		gapEnd_ = gapStart_ + PREFERRED_GAP_SIZE;
+
+		delete pieces_;
+		pieces_ = nullptr;
+		flatText_ = String();
+#ifdef PURIFY
+		std::fill_n(&buf_[gapStart_], gapEnd_ - gapStart_, '.');
+#endif
+		lineIndexRebuild();
+	}
+}
+
 bool TextBuffer::BufGetUseTabs() const {
 	return useTabs_;
 }
@@ -1946,6 +3361,82 @@ void TextBuffer::BufSetUseTabs(bool value) {
 	useTabs_ = value;
 }
 
+bool TextBuffer::BufGetUtf8() const {
+	return utf8_;
+}
+
+/*
+** Set whether the text of the buffer is UTF-8 encoded.  Buffer positions
+** are still byte offsets (so nothing about them changes, and newlines are
+** still single bytes), but the display column functions (BufCountDispChars,
+** BufCountForwardDispChars) count a multi-byte character as one column, and
+** an index of the characters is kept so that BufCodePointIndex and
+** BufCodePointPos can convert between byte positions and character numbers
+** in O(log n).  Wide character (USE_WCHAR) builds have no use for it.
+**
+** This is only the buffer's part: the NirvanaQt widget doesn't turn the mode
+** on, as its drawing and column code (measureVisLine, TextDPositionToXY,
+** xyToPos, rectangular selections) still takes a byte to be a column, and
+** would draw multi-byte characters wrong.
+*/
+void TextBuffer::BufSetUtf8(bool value) {
+
+	if (value == utf8_) {
+		return;
+	}
+
+	/* the layout of the text changes, as with a new tab distance */
+	callPreDeleteCBs(0, length_);
+
+	utf8_ = value;
+	if (!pieces_) {
+		lineIndexRebuild();
+	}
+
+	callUnchangedModifyCBs();
+}
+
+/*
+** Return the number of characters before (byte) position "pos": the same as
+** "pos", unless the buffer is in UTF-8 mode
+*/
+pos_type TextBuffer::BufCodePointIndex(pos_type pos) const {
+
+	pos = std::max<pos_type>(0, std::min(pos, length_));
+
+	if (!utf8_) {
+		return pos;
+	}
+
+	if (pieces_) {
+		return pieces_->codePointIndex(pos);
+	}
+
+	return blockIndexPrefix(codePointIndex_, pos, countCodePoints);
+}
+
+/*
+** Return the (byte) position of character number "index" (counting from 0),
+** or the length of the buffer if there are not that many characters.  The
+** inverse of BufCodePointIndex.
+*/
+pos_type TextBuffer::BufCodePointPos(pos_type index) const {
+
+	if (index <= 0) {
+		return 0;
+	}
+
+	if (!utf8_) {
+		return std::min(index, length_);
+	}
+
+	if (pieces_) {
+		return (index < pieces_->codePointIndex(length_)) ? pieces_->findCodePoint(index) : length_;
+	}
+
+	return (index < blockIndexPrefix(codePointIndex_, length_, countCodePoints)) ? blockIndexFind(codePointIndex_, index + 1, startsCodePoint) : length_;
+}
+
 /*
 ** Overlay characters from single-line string "insLine" on single-line string
 ** "line" between displayed character offsets "rectStart" and "rectEnd".
@@ -2019,12 +3510,11 @@ void TextBuffer::overlayRectInLine(const char_type *line, const char_type *insLi
 	/* Copy the text from "insLine" (if any), recalculating the tabs as if
 	   the inserted string began at column 0 to its new column destination */
 	if (*insLine != '\0') {
-		String retabbedStr = realignTabs(insLine, 0, rectStart, tabDist, useTabs, nullSubsChar, &len);
-		for (char_type *c = retabbedStr.str; *c != '\0'; c++) {
-			*outPtr++ = *c;
-			len = BufCharWidth(*c, outIndent, tabDist, nullSubsChar);
-			outIndent += len;
+		const int insLen = realignTabs(insLine, 0, rectStart, tabDist, useTabs, nullSubsChar, outPtr);
+		for (const char_type *c = outPtr; c < outPtr + insLen; c++) {
+			outIndent += BufCharWidth(*c, outIndent, tabDist, nullSubsChar);
 		}
+		outPtr += insLen;
 	}
 
 	/* If the original line did not extend past "rectStart", that's all */
@@ -2054,51 +3544,37 @@ void TextBuffer::overlayRectInLine(const char_type *line, const char_type *insLi
 
 /*
 ** Copy from "text" to end up to but not including newline (or end of "text")
-** and return the copy as the function value, and the length of the line in
-** "lineLen"
+** into "line" (null-terminated, reusing its storage), and return the length
+** of the line
 */
-String TextBuffer::copyLine(const char_type *text, int *lineLen) {
+int TextBuffer::copyLine(const char_type *text, std::vector<char_type> *line) {
 
 	assert(text);
-	assert(lineLen);
+	assert(line);
 
 	int len = 0;
 	for (const char_type *c = text; *c != '\0' && *c != '\n'; c++) {
 		len++;
 	}
 
-	auto outStr = new char_type[len + 1];
-#ifdef USE_STRCPY
-	strncpy(outStr, text, len);
-#else
-	std::copy_n(text, len, outStr);
-#endif
-	outStr[len] = '\0';
-
-	*lineLen = len;
-	return String(outStr, len);
+	line->resize(len + 1);
+	std::copy_n(text, len, line->data());
+	(*line)[len] = '\0';
+	return len;
 }
 
 /*
 ** Count the number of newlines in a null-terminated text string;
 */
-int TextBuffer::countLines(const char_type *string) {
-	int lineCount = 0;
-
-	for (const char_type *c = string; *c != '\0'; c++) {
-		if (*c == '\n') {
-			lineCount++;
-		}
-	}
-
-	return lineCount;
+pos_type TextBuffer::countLines(const char_type *string) {
+	return countNewlines(string, traits_type::length(string));
 }
 
 /*
-** Count the number of newlines in a null-terminated text string;
+** Count the number of newlines in the first "length" characters of a string
 */
-int TextBuffer::countLines(const char_type *string, size_t length) {
-	return static_cast<int>(std::count(string, string + length, '\n'));
+pos_type TextBuffer::countLines(const char_type *string, size_t length) {
+	return countNewlines(string, length);
 }
 
 /*
@@ -2121,49 +3597,117 @@ int TextBuffer::textWidth(const char_type *text, int tabDist, char_type nullSubs
 }
 
 /*
-** Create a pseudo-histogram of the characters in a string (don't actually
-** count, because we don't want overflow, just mark the character's presence
-** with a 1).  If init is true, initialize the histogram before acumulating.
-** if not, add the new data to an existing histogram.
+** Search through ascii control characters not in the "controlChars" mask
+** (see findControlChars) in order of least likelihood of use, find an unused
+** character to use as a stand-in for a null.  If the character set is full
+** (no available characters outside of the printable set, return the null
+** character.
 */
-void TextBuffer::histogramCharacters(const char_type *string, int length, char_type hist[256], bool init) {
-	if (init) {
-		for (int i = 0; i < 256; i++) {
-			hist[i] = 0;
-		}
-	}
-
-	for (const char_type *c = string; c < &string[length]; c++) {
-		hist[*reinterpret_cast<const uint8_t *>(c)] |= 1;
-	}
+char_type TextBuffer::chooseNullSubsChar(uint32_t controlChars) {
+#define N_REPLACEMENTS 25
+	static char_type replacements[N_REPLACEMENTS] = {1,  2,  3,  4,  5,  6,  14, 15, 16, 17, 18, 19, 20,
+												21, 22, 23, 24, 25, 26, 28, 29, 30, 31, 11, 7};
+	int i;
+	for (i = 0; i < N_REPLACEMENTS; i++)
+		if (!(controlChars & controlCharBit(replacements[i])))
+			return replacements[i];
+	return '\0';
 }
 
 /*
-** Substitute fromChar with toChar in string.
+** Return the findControlChars mask of the whole text of the buffer
 */
-void TextBuffer::subsChars(char_type *string, int length, char_type fromChar, char_type toChar) {
-	for (char_type  *c = string; c < &string[length]; c++) {
-		if (*c == fromChar) {
-			*c = toChar;
+uint32_t TextBuffer::bufControlChars() const {
+
+	if (pieces_) {
+		uint32_t mask = 0;
+		for (pos_type pos = 0; pos < length_;) {
+			pos_type spanLength;
+			const char_type *text = pieces_->span(pos, &spanLength);
+			mask |= findControlChars(text, spanLength);
+			pos += spanLength;
 		}
+		return mask;
 	}
+
+	return findControlChars(buf_, gapStart_) | findControlChars(&buf_[gapEnd_], length_ - gapStart_);
 }
 
 /*
-** Search through ascii control characters in histogram in order of least
-** likelihood of use, find an unused character to use as a stand-in for a
-** null.  If the character set is full (no available characters outside of
-** the printable set, return the null character.
+** Replace the buffer's null substitution character with "newSubsChar"
+** everywhere in the text.  Only the blocks which may hold the old one are
+** rewritten, and nothing at all if the text can't contain it.
 */
-char_type TextBuffer::chooseNullSubsChar(char_type hist[256]) {
-#define N_REPLACEMENTS 25
-	static char_type replacements[N_REPLACEMENTS] = {1,  2,  3,  4,  5,  6,  14, 15, 16, 17, 18, 19, 20,
-												21, 22, 23, 24, 25, 26, 28, 29, 30, 31, 11, 7};
-	int i;
-	for (i = 0; i < N_REPLACEMENTS; i++)
-		if (hist[static_cast<uint8_t>(replacements[i])] == 0)
-			return replacements[i];
-	return '\0';
+void TextBuffer::changeNullSubsChar(char_type newSubsChar) {
+	const char_type oldSubsChar = nullSubsChar_;
+	const uint32_t oldBit = controlCharBit(oldSubsChar);
+
+	if (!(controlChars_ & oldBit)) {
+		nullSubsChar_ = newSubsChar;
+		if (!pieces_) {
+			nullSubsBlocks_.assign(lineIndex_.size() - 1, false);
+		}
+		return;
+	}
+
+	controlChars_ = (controlChars_ & ~oldBit) | controlCharBit(newSubsChar);
+
+	if (pieces_) {
+		/* the pieces are immutable, so each one which holds the old character
+		   is replaced by a copy holding the new one.  Pieces are short, and
+		   the rest of the text is only read. */
+		std::vector<char_type> chunk;
+		for (pos_type pos = 0; pos < length_;) {
+			pos_type spanLength;
+			const char_type *const text = pieces_->span(pos, &spanLength);
+			if (traits_type::find(text, static_cast<size_t>(spanLength), oldSubsChar)) {
+				chunk.assign(text, text + spanLength);
+				replaceChars(chunk.data(), spanLength, oldSubsChar, newSubsChar);
+				pieces_->remove(pos, pos + spanLength);
+				pieces_->insert(pos, chunk.data(), spanLength);
+			}
+			pos += spanLength;
+		}
+
+		flatText_ = String();
+		nullSubsChar_ = newSubsChar;
+		return;
+	}
+
+	/* copy the buffer away from any snapshots first (the copy rebuilds the
+	   marks, which have to be for the old character).  The characters are
+	   all control characters, which the line and character indexes don't
+	   count, so the indexes stay as they are. */
+	const pos_type bufSize = length_ + (gapEnd_ - gapStart_);
+	unshareBuf(0, bufSize);
+
+	if (oldSubsChar == '\0') {
+		replaceChars(buf_, gapStart_, oldSubsChar, newSubsChar);
+		replaceChars(&buf_[gapEnd_], bufSize - gapEnd_, oldSubsChar, newSubsChar);
+		nullSubsChar_ = newSubsChar;
+		nullSubsBlocksRebuild();
+		return;
+	}
+
+	for (pos_type block = 0; block < static_cast<pos_type>(nullSubsBlocks_.size()); block++) {
+		if (!nullSubsBlocks_[block]) {
+			continue;
+		}
+
+		const pos_type blockStart = block * LINE_INDEX_BLOCK_SIZE;
+		const pos_type blockEnd = std::min(blockStart + LINE_INDEX_BLOCK_SIZE, bufSize);
+
+		if (blockStart < gapStart_) {
+			replaceChars(&buf_[blockStart], std::min(blockEnd, gapStart_) - blockStart, oldSubsChar, newSubsChar);
+		}
+
+		if (blockEnd > gapEnd_) {
+			const pos_type from = std::max(blockStart, gapEnd_);
+			replaceChars(&buf_[from], blockEnd - from, oldSubsChar, newSubsChar);
+		}
+	}
+
+	nullSubsChar_ = newSubsChar;
 }
 
 /*
@@ -2172,46 +3716,63 @@ char_type TextBuffer::chooseNullSubsChar(char_type hist[256]) {
 ** beginning at column "startIndent"
 */
 String TextBuffer::expandTabs(const char_type *text, int startIndent, int tabDist, char_type nullSubsChar, int *newLen) {
-	char_type *outStr, *outPtr;
-	const char_type *c;
-	int indent, len, outLen = 0;
+	const int outLen = expandedLength(text, startIndent, tabDist, nullSubsChar);
+	auto outStr = new char_type[outLen + 1];
 
-	/* rehearse the expansion to figure out length for output string */
-	indent = startIndent;
-	for (c = text; *c != '\0'; c++) {
+	expandTabs(text, startIndent, tabDist, nullSubsChar, outStr);
+	*newLen = outLen;
+	return String(outStr, outLen);
+}
+
+/*
+** As above, writing the expanded (and null-terminated) text to "outStr",
+** which must have room for expandedLength() + 1 characters.  Returns the
+** length of the expanded text.
+*/
+int TextBuffer::expandTabs(const char_type *text, int startIndent, int tabDist, char_type nullSubsChar, char_type *outStr) {
+	char_type *outPtr = outStr;
+	int indent = startIndent;
+	int len;
+
+	for (const char_type *c = text; *c != '\0'; c++) {
 		if (*c == '\t') {
-			len = BufCharWidth(*c, indent, tabDist, nullSubsChar);
-			outLen += len;
+			len = BufExpandCharacter(*c, indent, outPtr, tabDist, nullSubsChar);
+			outPtr += len;
 			indent += len;
 		} else if (*c == '\n') {
 			indent = startIndent;
-			outLen++;
+			*outPtr++ = *c;
 		} else {
 			indent += BufCharWidth(*c, indent, tabDist, nullSubsChar);
-			outLen++;
+			*outPtr++ = *c;
 		}
 	}
+	*outPtr = '\0';
+	return outPtr - outStr;
+}
 
-	/* do the expansion */
-	outStr = new char_type[outLen + 1];
-	outPtr = outStr;
-	indent = startIndent;
-	for (c = text; *c != '\0'; c++) {
+/*
+** Return the length "text" will have once expandTabs has expanded it
+*/
+int TextBuffer::expandedLength(const char_type *text, int startIndent, int tabDist, char_type nullSubsChar) {
+	int indent = startIndent;
+	int outLen = 0;
+	int len;
+
+	for (const char_type *c = text; *c != '\0'; c++) {
 		if (*c == '\t') {
-			len = BufExpandCharacter(*c, indent, outPtr, tabDist, nullSubsChar);
-			outPtr += len;
+			len = BufCharWidth(*c, indent, tabDist, nullSubsChar);
+			outLen += len;
 			indent += len;
 		} else if (*c == '\n') {
 			indent = startIndent;
-			*outPtr++ = *c;
+			outLen++;
 		} else {
 			indent += BufCharWidth(*c, indent, tabDist, nullSubsChar);
-			*outPtr++ = *c;
+			outLen++;
 		}
 	}
-	outStr[outLen] = '\0';
-	*newLen = outLen;
-	return String(outStr, outLen);
+	return outLen;
 }
 
 /*
@@ -2220,18 +3781,32 @@ String TextBuffer::expandTabs(const char_type *text, int startIndent, int tabDis
 ** converting double spaces after a period withing a block of text.
 */
 String TextBuffer::unexpandTabs(const char_type *text, int startIndent, int tabDist, char_type nullSubsChar, int *newLen) {
-	char_type *outStr, *outPtr, expandedChar[MAX_EXP_CHAR_LEN];
+	auto outStr = new char_type[traits_type::length(text) + 1];
+
+	*newLen = unexpandTabs(text, startIndent, tabDist, nullSubsChar, outStr);
+	return String(outStr, *newLen);
+}
+
+/*
+** As above, writing the result (which is never longer) to "outStr" and
+** returning its length.  "outStr" may be "text" itself.
+*/
+int TextBuffer::unexpandTabs(const char_type *text, int startIndent, int tabDist, char_type nullSubsChar, char_type *outStr) {
+	char_type *outPtr;
 	const char_type *c;
 	int indent;
 	int len;
 
-	outStr = new char_type[traits_type::length(text) + 1];
 	outPtr = outStr;
 	indent = startIndent;
 	for (c = text; *c != '\0';) {
 		if (*c == ' ') {
-			len = BufExpandCharacter('\t', indent, expandedChar, tabDist, nullSubsChar);
-			if (len >= 3 && !traits_type::compare(c, expandedChar, len)) {
+			/* (stopping at the end of the text, which may come first) */
+			len = BufCharWidth('\t', indent, tabDist, nullSubsChar);
+			int nSpaces = 1;
+			while (nSpaces < len && c[nSpaces] == ' ')
+				nSpaces++;
+			if (len >= 3 && nSpaces == len) {
 				c += len;
 				*outPtr++ = '\t';
 				indent += len;
@@ -2248,8 +3823,7 @@ String TextBuffer::unexpandTabs(const char_type *text, int startIndent, int tabD
 		}
 	}
 	*outPtr = '\0';
-	*newLen = outPtr - outStr;
-	return String(outStr, outPtr - outStr);
+	return outPtr - outStr;
 }
 
 /*
@@ -2259,33 +3833,36 @@ String TextBuffer::unexpandTabs(const char_type *text, int startIndent, int tabD
 ** which must be freed by the caller with delete[].
 */
 String TextBuffer::realignTabs(const char_type *text, int origIndent, int newIndent, int tabDist, bool useTabs, char_type nullSubsChar, int *newLength) {
+	auto outStr = new char_type[expandedLength(text, origIndent, tabDist, nullSubsChar) + 1];
+
+	*newLength = realignTabs(text, origIndent, newIndent, tabDist, useTabs, nullSubsChar, outStr);
+	return String(outStr, *newLength);
+}
 
+/*
+** As above, writing the (null-terminated) result to "outStr", which must
+** not overlap "text" and must have room for
+** expandedLength("text", "origIndent") + 1 characters.  Returns the length
+** of the result.
+*/
+int TextBuffer::realignTabs(const char_type *text, int origIndent, int newIndent, int tabDist, bool useTabs, char_type nullSubsChar, char_type *outStr) {
 
 	/* If the tabs settings are the same, retain original tabs */
 	if (origIndent % tabDist == newIndent % tabDist) {
-		int len = static_cast<int>(traits_type::length(text));
-		auto outStr = new char_type[len + 1];
-#ifdef USE_STRCPY
-		strcpy(outStr, text);
-#else
+		const int len = static_cast<int>(traits_type::length(text));
 		std::copy_n(text, len, outStr);
 		outStr[len] = '\0';
-#endif
-		*newLength = len;
-		return String(outStr, len);
+		return len;
 	}
 
 	/* If the tab settings are not the same, brutally convert tabs to
-	   spaces, then back to tabs in the new position */
-	int len;
-	String expStr = expandTabs(text, origIndent, tabDist, nullSubsChar, &len);
+	   spaces, then back to tabs in the new position (in place) */
+	const int len = expandTabs(text, origIndent, tabDist, nullSubsChar, outStr);
 	if (!useTabs) {
-		*newLength = len;
-		return expStr;
+		return len;
 	}
 
-	auto outStr = unexpandTabs(expStr.str, newIndent, tabDist, nullSubsChar, newLength);
-	return outStr;
+	return unexpandTabs(outStr, newIndent, tabDist, nullSubsChar, outStr);
 }
 
 /*
@@ -2342,13 +3919,12 @@ void TextBuffer::insertColInLine(const char_type *line, const char_type *insLine
 	/* Copy the text from "insLine" (if any), recalculating the tabs as if
 	   the inserted string began at column 0 to its new column destination */
 	if (*insLine != '\0') {
-		String retabbedStr = realignTabs(insLine, 0, indent, tabDist, useTabs, nullSubsChar, &len);
+		const int insLen = realignTabs(insLine, 0, indent, tabDist, useTabs, nullSubsChar, outPtr);
 
-		for (char_type *c = retabbedStr.str; *c != '\0'; c++) {
-			*outPtr++ = *c;
-			len = BufCharWidth(*c, indent, tabDist, nullSubsChar);
-			indent += len;
+		for (const char_type *c = outPtr; c < outPtr + insLen; c++) {
+			indent += BufCharWidth(*c, indent, tabDist, nullSubsChar);
 		}
+		outPtr += insLen;
 	}
 
 	/* If the original line did not extend past "column", that's all */
@@ -2365,13 +3941,7 @@ void TextBuffer::insertColInLine(const char_type *line, const char_type *insLine
 	indent = toIndent;
 
 	/* realign tabs for text beyond "column" and write it out */
-	String retabbedStr = realignTabs(linePtr, postColIndent, indent, tabDist, useTabs, nullSubsChar, &len);
-#ifdef USE_STRCPY
-	strcpy(outPtr, retabbedStr.str);
-#else
-	std::copy_n(retabbedStr.str, len, outPtr);
-	outPtr[len] = '\0';
-#endif
+	len = realignTabs(linePtr, postColIndent, indent, tabDist, useTabs, nullSubsChar, outPtr);
 
 	*endOffset = outPtr - outStr;
 	*outLen = (outPtr - outStr) + len;
@@ -2390,7 +3960,6 @@ void TextBuffer::deleteRectFromLine(const char_type *line, int rectStart, int re
 	int indent, preRectIndent, postRectIndent, len;
 	const char_type *c;
 	char_type *outPtr;
-	String retabbedStr;
 
 	/* copy the line up to rectStart */
 	outPtr = outStr;
@@ -2428,13 +3997,7 @@ void TextBuffer::deleteRectFromLine(const char_type *line, int rectStart, int re
 	/* Copy the rest of the line.  If the indentation has changed, preserve
 	   the position of non-whitespace characters by converting tabs to
 	   spaces, then back to tabs with the correct offset */
-	retabbedStr = realignTabs(c, postRectIndent, indent, tabDist, useTabs, nullSubsChar, &len);
-#ifdef USE_STRCPY
-	strcpy(outPtr, retabbedStr.str);
-#else
-	std::copy_n(retabbedStr.str, len, outPtr);
-	outPtr[len] = '\0';
-#endif
+	len = realignTabs(c, postRectIndent, indent, tabDist, useTabs, nullSubsChar, outPtr);
 
 	*endOffset = outPtr - outStr;
 	*outLen = (outPtr - outStr) + len;
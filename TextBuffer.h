@@ -3,26 +3,31 @@
 #define TEXT_BUFFER_H_
 
 #include "Types.h"
+#include "IBufferModifiedHandler.h"
+#include "MarkerStore.h"
 #include "Selection.h"
+#include <cstdint>
 #include <deque>
+#include <memory>
 #include <string>
+#include <vector>
 
-class IBufferModifiedHandler;
+class CharSet;
 class IPreDeleteHandler;
+class PieceTable;
+class RangesetTable;
 
 /* Maximum length in characters of a tab or control character expansion
    of a single buffer character */
 #define MAX_EXP_CHAR_LEN 20
 
-// class RangesetTable;
-
 class String {
 public:
 	String() : str(nullptr), len(0) {
 	}
 	
 	// NOTE: TAKES OWNERSHIP OF STRING
-	String(char_type *string, int length) : str(string), len(length) {
+	String(char_type *string, pos_type length) : str(string), len(length) {
 	}
 	
 	String(String &&other) : str(other.str), len(other.len) {
@@ -67,13 +72,88 @@ public:
 	
 public:
 	char_type *str;
-	int        len;
+	pos_type   len;
+};
+
+/* A read-only view of a range of buffer text which avoids copying it.  The
+   text is in (at most) two contiguous parts, one either side of the gap.  A
+   view is only valid until its buffer is next modified. */
+class TextView {
+public:
+	TextView() : text1(nullptr), text2(nullptr), length1(0), length2(0) {
+	}
+
+public:
+	char_type operator[](pos_type index) const {
+		return (index < length1) ? text1[index] : text2[index - length1];
+	}
+
+	pos_type length() const {
+		return length1 + length2;
+	}
+
+	void copy(char_type *outStr) const;
+
+public:
+	const char_type *text1; // first part of the text
+	const char_type *text2; // rest of the text (nullptr if there is none)
+	pos_type length1;
+	pos_type length2;
+	String storage;         // piece table mode only: a copy of text which is
+	                        // split over more than two pieces
+};
+
+/* An unchanging copy of the text of a TextBuffer, made by BufSnapshot.  The
+   text isn't actually copied: in piece table mode the snapshot shares the
+   (immutable) tree of pieces, otherwise it shares the buffer's storage, which
+   the buffer copies before changing any character the snapshot can see.  A
+   snapshot stays valid however the buffer is edited afterwards, and can be
+   read from another thread while the buffer is in use (copies of a snapshot
+   may be handed to different threads, one snapshot object may not). */
+class TextSnapshot {
+public:
+	TextSnapshot();
+
+public:
+	String range(pos_type start, pos_type end) const;
+	char_type at(pos_type pos) const;
+	const char_type *span(pos_type pos, pos_type *spanLength) const;
+	pos_type length() const;
+	void copy(pos_type start, pos_type end, char_type *outStr) const;
+
+private:
+	friend class TextBuffer;
+
+	std::shared_ptr<const char_type> block_;  // gap buffer mode: the storage...
+	std::shared_ptr<const PieceTable> pieces_; // ...or piece table mode: the pieces
+	pos_type gapStart_;
+	pos_type gapEnd_;
+	pos_type length_;
+};
+
+/* One of the ranges changed by TextBuffer::BufReplaceMultiple */
+struct TextReplacement {
+	pos_type start;
+	pos_type end;
+	const char_type *text; // replacement text (need not be null-terminated)
+	pos_type length;
+};
+
+/* Memory used by a TextBuffer, in bytes (see TextBuffer::BufMemoryUsage) */
+struct TextBufferMemoryUsage {
+	size_t text;    // the characters of the text (in piece table mode, just its length:
+	                // the blocks may also hold deleted text)
+	size_t gap;     // allocated but unused: the gap, or the rest of the current add block
+	size_t indexes; // line, character and null substitution indexes, or the piece tree
+	size_t markers; // markers and rangesets
+	size_t other;   // copies of the text made for BufAsString and batches
+	size_t total;
 };
 
 class TextBuffer {
 public:
 	TextBuffer();
-	explicit TextBuffer(int requestedSize);
+	explicit TextBuffer(pos_type requestedSize);
 	~TextBuffer();
 
 private:
@@ -88,136 +168,239 @@ public:
 	Selection &BufGetHighlight();
 	Selection &BufGetPrimarySelection();
 	Selection &BufGetSecondarySelection();
-	bool BufGetEmptySelectionPos(int *start, int *end, bool *isRect, int *rectStart, int *rectEnd) const;
-	bool BufGetHighlightPos(int *start, int *end, bool *isRect, int *rectStart, int *rectEnd) const;
-	bool BufGetSecSelectPos(int *start, int *end, bool *isRect, int *rectStart, int *rectEnd) const;
-	bool BufGetSelectionPos(int *start, int *end, bool *isRect, int *rectStart, int *rectEnd) const;
+	bool BufGetEmptySelectionPos(pos_type *start, pos_type *end, bool *isRect, int *rectStart, int *rectEnd) const;
+	bool BufGetMarker(int id, pos_type *start, pos_type *end) const;
+	bool BufGetHighlightPos(pos_type *start, pos_type *end, bool *isRect, int *rectStart, int *rectEnd) const;
+	bool BufGetSecSelectPos(pos_type *start, pos_type *end, bool *isRect, int *rectStart, int *rectEnd) const;
+	bool BufGetSelectionPos(pos_type *start, pos_type *end, bool *isRect, int *rectStart, int *rectEnd) const;
+	bool BufGetUsePieceTable() const;
 	bool BufGetUseTabs() const;
-	bool BufSearchBackward(int startPos, const char_type *searchChars, int *foundPos) const;
-	bool BufSearchForward(int startPos, const char_type *searchChars, int *foundPos) const;
-	bool BufSubstituteNullChars(char_type *string, int length);
+	bool BufGetUtf8() const;
+	bool BufLoadMapped(const char *path);
+	bool BufSearchBackward(pos_type startPos, const char_type *searchChars, pos_type *foundPos) const;
+	bool BufSearchForward(pos_type startPos, const char_type *searchChars, pos_type *foundPos) const;
+	bool BufSubstituteNullChars(char_type *string, pos_type length);
 	String BufGetAll() const;
-	String BufGetRange(int start, int end) const;
+	String BufGetRange(pos_type start, pos_type end) const;
 	String BufGetSecSelectText() const;
 	String BufGetSelectionText() const;
-	String BufGetTextInRect(int start, int end, int rectStart, int rectEnd) const;
-	char_type BufGetCharacter(int pos) const;
+	String BufGetTextInRect(pos_type start, pos_type end, int rectStart, int rectEnd) const;
+	TextBufferMemoryUsage BufMemoryUsage() const;
+	TextSnapshot BufSnapshot();
+	TextView BufGetView(pos_type start, pos_type end) const;
+	char_type BufGetCharacter(pos_type pos) const;
 	char_type BufGetNullSubsChar() const;
 	const char_type *BufAsString();
-	int BufCmp(int pos, int len, const char_type *cmpText) const;
-	int BufCountBackwardNLines(int startPos, int nLines) const;
-	int BufCountDispChars(int lineStartPos, int targetPos) const;
-	int BufCountForwardDispChars(int lineStartPos, int nChars) const;
-	int BufCountForwardNLines(int startPos, unsigned nLines) const;
-	int BufCountLines(int startPos, int endPos) const;
-	int BufEndOfLine(int pos) const;
-	int BufGetCursorPosHint() const;
-	int BufGetExpandedChar(int pos, int indent, char_type *outStr) const;
-	int BufGetLength() const;
+	RangesetTable *BufCreateRangesetTable();
+	RangesetTable *BufGetRangesetTable() const;
+	int BufAddMarker(pos_type start, pos_type end, int type);
+	int BufCmp(pos_type pos, pos_type len, const char_type *cmpText) const;
+	pos_type BufCodePointIndex(pos_type pos) const;
+	pos_type BufCodePointPos(pos_type index) const;
+	pos_type BufCountBackwardNLines(pos_type startPos, int nLines) const;
+	int BufCountDispChars(pos_type lineStartPos, pos_type targetPos) const;
+	pos_type BufCountForwardDispChars(pos_type lineStartPos, int nChars) const;
+	pos_type BufCountForwardNLines(pos_type startPos, unsigned nLines) const;
+	pos_type BufCountLines(pos_type startPos, pos_type endPos) const;
+	pos_type BufEndOfLine(pos_type pos) const;
+	pos_type BufGetCursorPosHint() const;
+	int BufGetExpandedChar(pos_type pos, int indent, char_type *outStr) const;
+	pos_type BufGetLength() const;
 	int BufGetTabDistance() const;
-	int BufStartOfLine(int pos) const;
+	pos_type BufStartOfLine(pos_type pos) const;
 	void BufAddHighPriorityModifyCB(IBufferModifiedHandler *handler);
 	void BufAddModifyCB(IBufferModifiedHandler *handler);
 	void BufAddPreDeleteCB(IPreDeleteHandler *handler);
-	void BufCheckDisplay(int start, int end);
-	void BufClearRect(int start, int end, int rectStart, int rectEnd);
-	void BufCopyFromBuf(TextBuffer *toBuf, int fromStart, int fromEnd, int toPos);
-	void BufHighlight(int start, int end);
-	void BufInsert(int pos, const char_type *text);
-	void BufInsert(int pos, const char_type *text, int length);
-	void BufInsertCol(int column, int startPos, const char_type *text, int *charsInserted, int *charsDeleted);
-	void BufOverlayRect(int startPos, int rectStart, int rectEnd, const char_type *text, int *charsInserted, int *charsDeleted);
-	void BufRectHighlight(int start, int end, int rectStart, int rectEnd);
-	void BufRectSelect(int start, int end, int rectStart, int rectEnd);
-	void BufRemove(int start, int end);
+	void BufAddRangedModifyCB(IBufferModifiedHandler *handler, pos_type start, pos_type end);
+	void BufAppend(const char_type *text, pos_type length);
+	void BufBeginBatch();
+	void BufCheckDisplay(pos_type start, pos_type end);
+	void BufClearRect(pos_type start, pos_type end, int rectStart, int rectEnd);
+	void BufCompact();
+	void BufCopyFromBuf(TextBuffer *toBuf, pos_type fromStart, pos_type fromEnd, pos_type toPos);
+	void BufEndBatch();
+	void BufGetMarkers(pos_type start, pos_type end, std::vector<Marker> *markers) const;
+	void BufHighlight(pos_type start, pos_type end);
+	void BufInsert(pos_type pos, const char_type *text);
+	void BufInsert(pos_type pos, const char_type *text, pos_type length);
+	void BufInsertCol(int column, pos_type startPos, const char_type *text, pos_type *charsInserted, pos_type *charsDeleted);
+	void BufLoad(const char_type *text, pos_type length);
+	void BufLoadFilled(char_type ch, pos_type length);
+	void BufOverlayRect(pos_type startPos, int rectStart, int rectEnd, const char_type *text, pos_type *charsInserted, pos_type *charsDeleted);
+	void BufRectHighlight(pos_type start, pos_type end, int rectStart, int rectEnd);
+	void BufRectSelect(pos_type start, pos_type end, int rectStart, int rectEnd);
+	void BufRemove(pos_type start, pos_type end);
+	void BufRemoveMarker(int id);
 	void BufRemoveModifyCB(IBufferModifiedHandler *handler);
 	void BufRemovePreDeleteCB(IPreDeleteHandler *handler);
-	void BufRemoveRect(int start, int end, int rectStart, int rectEnd);
+	void BufRemoveRect(pos_type start, pos_type end, int rectStart, int rectEnd);
 	void BufRemoveSecSelect();
 	void BufRemoveSelected();
-	void BufReplace(int start, int end, const char_type *text);
-	void BufReplace(int start, int end, const char_type *text, int length);
-	void BufReplaceRect(int start, int end, int rectStart, int rectEnd, const char_type *text);
-	void BufReplaceRect(int start, int end, int rectStart, int rectEnd, const char_type *text, int length);
+	void BufReplace(pos_type start, pos_type end, const char_type *text);
+	void BufReplace(pos_type start, pos_type end, const char_type *text, pos_type length);
+	void BufReplaceRect(pos_type start, pos_type end, int rectStart, int rectEnd, const char_type *text);
+	void BufReplaceRect(pos_type start, pos_type end, int rectStart, int rectEnd, const char_type *text, pos_type length);
 	void BufReplaceSecSelect(const char_type *text);
+	void BufReplaceMultiple(const TextReplacement *replacements, int nReplacements);
 	void BufReplaceSelected(const char_type *text);
-	void BufSecRectSelect(int start, int end, int rectStart, int rectEnd);
-	void BufSecondarySelect(int start, int end);
+	void BufReserve(pos_type length);
+	void BufSecRectSelect(pos_type start, pos_type end, int rectStart, int rectEnd);
+	void BufSecondarySelect(pos_type start, pos_type end);
 	void BufSecondaryUnselect();
-	void BufSelect(int start, int end);
+	void BufSelect(pos_type start, pos_type end);
 	void BufSetAll(const char_type *text);
-	void BufSetAll(const char_type *text, int length);
-	void BufSetCharacter(int pos, char_type ch);
+	void BufSetAll(const char_type *text, pos_type length);
+	void BufSetCharacter(pos_type pos, char_type ch);
+	void BufSetModifyCBRange(IBufferModifiedHandler *handler, pos_type start, pos_type end);
 	void BufSetTabDistance(int tabDist);
+	void BufSetUsePieceTable(bool value);
 	void BufSetUseTabs(bool value);
+	void BufSetUtf8(bool value);
 	void BufUnhighlight();
 	void BufUnselect();
 	void BufUnsubstituteNullChars(char_type *string) const;
 
 
 private:
-	bool searchBackward(int startPos, char_type searchChar, int *foundPos) const;
-	bool searchForward(int startPos, char_type searchChar, int *foundPos) const;
+	typedef pos_type (*CountFunc)(const char_type *, size_t);
+	typedef bool (*MatchFunc)(char_type);
+
+	/* A modify callback which is only interested in part of the buffer
+	   (see BufAddRangedModifyCB) */
+	struct RangedModifyCB {
+		IBufferModifiedHandler *handler;
+		pos_type start;
+		pos_type end;
+	};
+
+private:
+	bool searchBackward(pos_type startPos, char_type searchChar, pos_type *foundPos) const;
+	bool searchBackward(pos_type startPos, const CharSet &set, pos_type *foundPos) const;
+	bool searchForward(pos_type startPos, char_type searchChar, pos_type *foundPos) const;
+	bool searchForward(pos_type startPos, const CharSet &set, pos_type *foundPos) const;
 	String getSelectionText(const Selection &sel) const;
-	int insert(int pos, const char_type *text);
-	int insert(int pos, const char_type *text, int length);
-	void callModifyCBs(int pos, int nDeleted, int nInserted, int nRestyled, const char_type *deletedText);
-	void callPreDeleteCBs(int pos, int nDeleted);
-	void deleteRange(int start, int end);
-	void deleteRect(int start, int end, int rectStart, int rectEnd, int *replaceLen, int *endPos);
-	void findRectSelBoundariesForCopy(int lineStartPos, int rectStart, int rectEnd, int *selStart, int *selEnd) const;
-	void insertCol(int column, int startPos, const char_type *insText, int *nDeleted, int *nInserted, int *endPos);
-	void moveGap(int pos);
-	void overlayRect(int startPos, int rectStart, int rectEnd, const char_type *insText, int *nDeleted, int *nInserted, int *endPos);
-	void reallocateBuf(int newGapStart, int newGapLen);
+	uint32_t bufControlChars() const;
+	pos_type insert(pos_type pos, const char_type *text);
+	pos_type insert(pos_type pos, const char_type *text, pos_type length);
+	DeletedTextNeeds deletedTextNeeds() const;
+	String saveDeletedText(pos_type start, pos_type end, pos_type *nLines) const;
+	void callModifyCBs(pos_type pos, pos_type nDeleted, pos_type nInserted, pos_type nRestyled, pos_type nDeletedLines, const char_type *deletedText);
+	void callPreDeleteCBs(pos_type pos, pos_type nDeleted);
+	void callUnchangedModifyCBs();
+	void changeNullSubsChar(char_type newSubsChar);
+	pos_type copyBufLine(pos_type lineStart, std::vector<char_type> *line) const;
+	void copyRange(pos_type start, pos_type end, char_type *outStr) const;
+	void deleteRange(pos_type start, pos_type end);
+	void deleteRect(pos_type start, pos_type end, int rectStart, int rectEnd, pos_type *replaceLen, pos_type *endPos);
+	void findRectSelBoundariesForCopy(pos_type lineStartPos, int rectStart, int rectEnd, pos_type *selStart, pos_type *selEnd) const;
+	void flushBatch();
+	void insertCol(int column, pos_type startPos, const char_type *insText, pos_type *nDeleted, pos_type *nInserted, pos_type *endPos);
+	pos_type blockIndexFind(const std::vector<pos_type> &index, pos_type n, MatchFunc match) const;
+	pos_type blockIndexPrefix(const std::vector<pos_type> &index, pos_type pos, CountFunc count) const;
+	void blockIndexRebuild(std::vector<pos_type> *index, CountFunc count);
+	void blockIndexUpdate(std::vector<pos_type> *index, pos_type physStart, pos_type physEnd, int sign, CountFunc count);
+	pos_type lineIndexFind(pos_type nLines) const;
+	pos_type lineIndexPrefix(pos_type pos) const;
+	void lineIndexRebuild();
+	void lineIndexUpdate(pos_type physStart, pos_type physEnd, int sign);
+	void loadText(const char_type *text, char_type fill, pos_type length);
+	void markNullSubsBlocks(pos_type physStart, pos_type physEnd);
+	void moveGap(pos_type pos);
+	void nullSubsBlocksRebuild();
+	void notifyModifyCBs(pos_type pos, pos_type nDeleted, pos_type nInserted, pos_type nRestyled, pos_type nDeletedLines, const char_type *deletedText, bool loaded);
+	void overlayRect(pos_type startPos, int rectStart, int rectEnd, const char_type *insText, pos_type *nDeleted, pos_type *nInserted, pos_type *endPos);
+	void prepareGap(pos_type pos, pos_type length);
+	void reallocateBuf(pos_type newGapStart, pos_type newGapLen);
+	void releaseBuf();
+	void recordBatchChange(pos_type pos, pos_type nDeleted, pos_type nInserted, pos_type nRestyled, const char_type *deletedText);
 	void redisplaySelection(const Selection &oldSelection, const Selection &newSelection);
 	void removeSelected(const Selection &sel);
+	void replaceRect(pos_type start, pos_type end, int rectStart, int rectEnd, const char_type *insText, pos_type insLength, pos_type *nInserted, pos_type *endPos);
+	void replaceRanges(const TextReplacement *replacements, int nReplacements);
 	void replaceSelected(Selection *sel, const char_type *text);
-	void updateSelections(int pos, int nDeleted, int nInserted);
+	void shrinkGap();
+	void unshareBuf(pos_type physStart, pos_type physEnd);
+	void updateSelections(pos_type pos, pos_type nDeleted, pos_type nInserted);
 
 private:
-	static String copyLine(const char_type *text, int *lineLen);
 	static String expandTabs(const char_type *text, int startIndent, int tabDist, char_type nullSubsChar, int *newLen);
 	static String realignTabs(const char_type *text, int origIndent, int newIndent, int tabDist, bool useTabs, char_type nullSubsChar, int *newLength);
 	static String unexpandTabs(const char_type *text, int startIndent, int tabDist, char_type nullSubsChar, int *newLen);
-	static char_type chooseNullSubsChar(char_type hist[256]);
-	static int countLines(const char_type *string);
-	static int countLines(const char_type *string, size_t length);
+	static char_type chooseNullSubsChar(uint32_t controlChars);
+	static int copyLine(const char_type *text, std::vector<char_type> *line);
+	static pos_type countLines(const char_type *string);
+	static pos_type countLines(const char_type *string, size_t length);
+	static int expandTabs(const char_type *text, int startIndent, int tabDist, char_type nullSubsChar, char_type *outStr);
+	static int expandedLength(const char_type *text, int startIndent, int tabDist, char_type nullSubsChar);
+	static int realignTabs(const char_type *text, int origIndent, int newIndent, int tabDist, bool useTabs, char_type nullSubsChar, char_type *outStr);
 	static int textWidth(const char_type *text, int tabDist, char_type nullSubsChar);
+	static int unexpandTabs(const char_type *text, int startIndent, int tabDist, char_type nullSubsChar, char_type *outStr);
 	static void addPadding(char_type *string, int startIndent, int toIndent, int tabDist, bool useTabs, char_type nullSubsChar, int *charsAdded);
 	static void deleteRectFromLine(const char_type *line, int rectStart, int rectEnd, int tabDist, bool useTabs, char_type nullSubsChar, char_type *outStr, int *outLen, int *endOffset);
-	static void histogramCharacters(const char_type *string, int length, char_type hist[], bool init);
 	static void insertColInLine(const char_type *line, const char_type *insLine, int column, int insWidth, int tabDist, bool useTabs, char_type nullSubsChar, char_type *outStr, int *outLen, int *endOffset);
 	static void overlayRectInLine(const char_type *line, const char_type *insLine, int rectStart, int rectEnd, int tabDist, bool useTabs, char_type nullSubsChar, char_type *outStr, int *outLen, int *endOffset);
-	static void subsChars(char_type *string, int length, char_type fromChar, char_type toChar);
 
 private:
-	// RangesetTable *rangesetTable_;             // current range sets
+	RangesetTable *rangesetTable_;                     // current range sets, nullptr until
+	                                                   // the first is wanted
 	Selection highlight_; // highlighted areas
 	Selection primary_;
 	Selection secondary_;
+	MarkerStore markers_;                              // positions kept up to date across edits
 	bool useTabs_;                                     // True if buffer routines are allowed to use tabs for padding
 	                                                   // in rectangular operations
+	bool utf8_;                                        // True if the text is UTF-8 encoded (see BufSetUtf8)
 	std::deque<IBufferModifiedHandler *> modifyProcs_; // procedures to call when
 	                                                   // buffer is modified to
 	                                                   // redisplay contents
+	std::vector<RangedModifyCB> rangedModifyProcs_;    // procedures to call when the
+	                                                   // buffer is modified in or
+	                                                   // before a range of it
 	std::deque<IPreDeleteHandler *> preDeleteProcs_;   // procedures to call before
 	                                                   // text is deleted from the
 	                                                   // buffer; at most one is
 	                                                   // supported.
+	PieceTable *pieces_;                               // when not nullptr, the text is stored here
+	                                                   // instead of in buf_ (which is then unused)
+	String flatText_;                                  // piece table mode: the copy of the text handed
+	                                                   // out by BufAsString(), empty when out of date
+	std::vector<char_type> batchText_;                 // original text of the range changed by the
+	                                                   // current batch (see BufBeginBatch)
+	std::vector<pos_type> codePointIndex_;             // UTF-8 mode: like lineIndex_, counting the bytes
+	                                                   // which start a character
+	std::vector<bool> nullSubsBlocks_;                 // the blocks (as for lineIndex_) of buf_ which may
+	                                                   // hold the null substitution character, empty when
+	                                                   // there is none (see BufSubstituteNullChars)
+	std::vector<pos_type> lineIndex_;                  // Fenwick tree of the newline counts in each
+	                                                   // LINE_INDEX_BLOCK_SIZE block of buf_ (the
+	                                                   // contents of the gap are never counted)
+	std::shared_ptr<char_type> bufOwner_;              // owns buf_ once it has been shared with a snapshot
 	char_type *buf_;                                        // allocated memory where the text is stored
 	char_type nullSubsChar_;                                // NEdit is based on C null-terminated strings, so
 	                                                   // ascii-nul characters must be substituted with
 	// something else.  This is the else, but of course, things get quite messy
 	// when you use it
-	int cursorPosHint_; // hint for reasonable cursor position after a buffer
-	                    // modification operation
-	int gapEnd_;        // points to the first character after the gap
-	int gapStart_;      // points to the first character of the gap
-	int length_;        // length of the text in the buffer (the length of the buffer
-	                    // itself must be calculated: gapEnd -
-	                    // gapStart + length)
-	int tabDist_;       // equiv. number of characters in a tab
+	bool batchChanged_; // true if the batch changed text (not just styles)
+	bool batchHasText_; // true if batchText_ holds the original text of the range
+	bool batchPending_; // true if the batch has a change to report
+	bool keepNulls_;    // true if NULs are kept in the text as they are, rather than
+	                    // substituted (see BufLoadMapped)
+	int batchDepth_;    // nesting level of BufBeginBatch calls
+	uint32_t controlChars_; // findControlChars mask of the text: it includes every control
+	                        // character of the text, and maybe some which were deleted
+	pos_type batchDeleted_;  // original length of the range changed by the current batch
+	pos_type batchEnd_;      // end of the range changed by the current batch
+	pos_type batchStart_;    // start of the range changed by the current batch
+	pos_type cursorPosHint_; // hint for reasonable cursor position after a buffer
+	                         // modification operation
+	pos_type gapEnd_;        // points to the first character after the gap
+	pos_type gapStart_;      // points to the first character of the gap
+	pos_type length_;        // length of the text in the buffer (the length of the buffer
+	                         // itself must be calculated: gapEnd -
+	                         // gapStart + length)
+	pos_type sharedGapEnd_;   // while buf_ is shared with snapshots, the part of it
+	pos_type sharedGapStart_; // which none of them can see (so may be written)
+	int tabDist_;            // equiv. number of characters in a tab
 };
 
 #endif
@@ -0,0 +1,567 @@
+
+#include "TextScan.h"
+#include <algorithm>
+#include <cstdint>
+
+#if !defined(USE_WCHAR) && (defined(__x86_64__) || defined(_M_X64) || (defined(__i386__) && defined(__SSE2__)))
+#define USE_SSE2
+#include <emmintrin.h>
+#if defined(__GNUC__) || defined(__clang__)
+#define USE_SSSE3
+#define USE_AVX2
+#include <immintrin.h>
+#endif
+#endif
+
+namespace {
+
+typedef int (*CountFunc)(const char_type *, size_t);
+typedef const char_type *(*FindFunc)(const char_type *, size_t, const CharSet &);
+typedef uint32_t (*ControlFunc)(const char_type *, size_t);
+typedef void (*ReplaceFunc)(char_type *, size_t, char_type, char_type);
+
+/* the control characters findControlChars leaves out */
+const uint32_t CommonControlChars = (1u << '\t') | (1u << '\n') | (1u << '\r');
+
+uint32_t findControlCharsScalar(const char_type *text, size_t length) {
+	uint32_t mask = 0;
+	for (size_t i = 0; i < length; i++) {
+#ifdef USE_WCHAR
+		const auto c = static_cast<unsigned>(text[i]);
+#else
+		const auto c = static_cast<uint8_t>(text[i]);
+#endif
+		if (c < 32) {
+			mask |= 1u << c;
+		}
+	}
+	return mask & ~CommonControlChars;
+}
+
+void replaceCharsScalar(char_type *text, size_t length, char_type from, char_type to) {
+	std::replace(text, text + length, from, to);
+}
+
+int countNewlinesScalar(const char_type *text, size_t length) {
+	return static_cast<int>(std::count(text, text + length, '\n'));
+}
+
+int countCodePointsScalar(const char_type *text, size_t length) {
+	return static_cast<int>(std::count_if(text, text + length, [](char_type ch) { return !isUtf8Continuation(ch); }));
+}
+
+#ifdef USE_SSE2
+/*
+** Count newlines 16 characters at a time.  The matches are accumulated in
+** 8 bit lanes (which can't overflow in 255 rounds) and then added up into the
+** total with psadbw.
+*/
+int countNewlinesSSE2(const char_type *text, size_t length) {
+	const __m128i newline = _mm_set1_epi8('\n');
+	const __m128i zero = _mm_setzero_si128();
+	__m128i total = zero;
+	size_t i = 0;
+
+	while (length - i >= 16) {
+		const size_t end = i + std::min<size_t>((length - i) / 16, 255) * 16;
+		__m128i counts = zero;
+
+		for (; i < end; i += 16) {
+			const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(text + i));
+			counts = _mm_sub_epi8(counts, _mm_cmpeq_epi8(chunk, newline));
+		}
+
+		total = _mm_add_epi64(total, _mm_sad_epu8(counts, zero));
+	}
+
+	/* the count fits in an int, so the low halves of the two sums will do */
+	const int count = _mm_cvtsi128_si32(total) + _mm_cvtsi128_si32(_mm_srli_si128(total, 8));
+	return count + countNewlinesScalar(text + i, length - i);
+}
+
+/*
+** As countNewlinesSSE2, counting the bytes which are not UTF-8 continuation
+** bytes (0x80 - 0xbf, which as signed bytes are all smaller than -64)
+*/
+int countCodePointsSSE2(const char_type *text, size_t length) {
+	const __m128i limit = _mm_set1_epi8(-65);
+	const __m128i zero = _mm_setzero_si128();
+	__m128i total = zero;
+	size_t i = 0;
+
+	while (length - i >= 16) {
+		const size_t end = i + std::min<size_t>((length - i) / 16, 255) * 16;
+		__m128i counts = zero;
+
+		for (; i < end; i += 16) {
+			const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(text + i));
+			counts = _mm_sub_epi8(counts, _mm_cmpgt_epi8(chunk, limit));
+		}
+
+		total = _mm_add_epi64(total, _mm_sad_epu8(counts, zero));
+	}
+
+	const int count = _mm_cvtsi128_si32(total) + _mm_cvtsi128_si32(_mm_srli_si128(total, 8));
+	return count + countCodePointsScalar(text + i, length - i);
+}
+
+/*
+** Find the control characters 16 at a time.  Most text has none apart from
+** tabs and newlines, so chunks without any others are passed over, and the
+** few which have some are looked at one character at a time.
+*/
+uint32_t findControlCharsSSE2(const char_type *text, size_t length) {
+	const __m128i limit = _mm_set1_epi8(31);
+	const __m128i tab = _mm_set1_epi8('\t');
+	const __m128i newline = _mm_set1_epi8('\n');
+	const __m128i cr = _mm_set1_epi8('\r');
+	uint32_t mask = 0;
+	size_t i = 0;
+
+	for (; length - i >= 16; i += 16) {
+		const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(text + i));
+		const __m128i control = _mm_cmpeq_epi8(_mm_min_epu8(chunk, limit), chunk);
+		const __m128i common = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, tab), _mm_cmpeq_epi8(chunk, newline)), _mm_cmpeq_epi8(chunk, cr));
+		if (_mm_movemask_epi8(_mm_andnot_si128(common, control))) {
+			mask |= findControlCharsScalar(text + i, 16);
+		}
+	}
+
+	return mask | findControlCharsScalar(text + i, length - i);
+}
+
+/*
+** Replace characters 16 at a time, only writing back the chunks which change
+*/
+void replaceCharsSSE2(char_type *text, size_t length, char_type from, char_type to) {
+	const __m128i fromChar = _mm_set1_epi8(from);
+	const __m128i toChar = _mm_set1_epi8(to);
+	size_t i = 0;
+
+	for (; length - i >= 16; i += 16) {
+		const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(text + i));
+		const __m128i match = _mm_cmpeq_epi8(chunk, fromChar);
+		if (_mm_movemask_epi8(match)) {
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(text + i), _mm_or_si128(_mm_and_si128(match, toChar), _mm_andnot_si128(match, chunk)));
+		}
+	}
+
+	replaceCharsScalar(text + i, length - i, from, to);
+}
+#endif
+
+#ifdef USE_AVX2
+/*
+** As countNewlinesSSE2, 32 characters at a time
+*/
+__attribute__((target("avx2"))) int countNewlinesAVX2(const char_type *text, size_t length) {
+	const __m256i newline = _mm256_set1_epi8('\n');
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i total = zero;
+	size_t i = 0;
+
+	while (length - i >= 32) {
+		const size_t end = i + std::min<size_t>((length - i) / 32, 255) * 32;
+		__m256i counts = zero;
+
+		for (; i < end; i += 32) {
+			const __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(text + i));
+			counts = _mm256_sub_epi8(counts, _mm256_cmpeq_epi8(chunk, newline));
+		}
+
+		total = _mm256_add_epi64(total, _mm256_sad_epu8(counts, zero));
+	}
+
+	const __m128i sum = _mm_add_epi64(_mm256_castsi256_si128(total), _mm256_extracti128_si256(total, 1));
+	const int count = _mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_srli_si128(sum, 8));
+	return count + countNewlinesScalar(text + i, length - i);
+}
+
+/*
+** As countCodePointsSSE2, 32 characters at a time
+*/
+__attribute__((target("avx2"))) int countCodePointsAVX2(const char_type *text, size_t length) {
+	const __m256i limit = _mm256_set1_epi8(-65);
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i total = zero;
+	size_t i = 0;
+
+	while (length - i >= 32) {
+		const size_t end = i + std::min<size_t>((length - i) / 32, 255) * 32;
+		__m256i counts = zero;
+
+		for (; i < end; i += 32) {
+			const __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(text + i));
+			counts = _mm256_sub_epi8(counts, _mm256_cmpgt_epi8(chunk, limit));
+		}
+
+		total = _mm256_add_epi64(total, _mm256_sad_epu8(counts, zero));
+	}
+
+	const __m128i sum = _mm_add_epi64(_mm256_castsi256_si128(total), _mm256_extracti128_si256(total, 1));
+	const int count = _mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_srli_si128(sum, 8));
+	return count + countCodePointsScalar(text + i, length - i);
+}
+
+/*
+** As findControlCharsSSE2, 32 characters at a time
+*/
+__attribute__((target("avx2"))) uint32_t findControlCharsAVX2(const char_type *text, size_t length) {
+	const __m256i limit = _mm256_set1_epi8(31);
+	const __m256i tab = _mm256_set1_epi8('\t');
+	const __m256i newline = _mm256_set1_epi8('\n');
+	const __m256i cr = _mm256_set1_epi8('\r');
+	uint32_t mask = 0;
+	size_t i = 0;
+
+	for (; length - i >= 32; i += 32) {
+		const __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(text + i));
+		const __m256i control = _mm256_cmpeq_epi8(_mm256_min_epu8(chunk, limit), chunk);
+		const __m256i common = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, tab), _mm256_cmpeq_epi8(chunk, newline)), _mm256_cmpeq_epi8(chunk, cr));
+		if (_mm256_movemask_epi8(_mm256_andnot_si256(common, control))) {
+			mask |= findControlCharsScalar(text + i, 32);
+		}
+	}
+
+	return mask | findControlCharsScalar(text + i, length - i);
+}
+
+/*
+** As replaceCharsSSE2, 32 characters at a time
+*/
+__attribute__((target("avx2"))) void replaceCharsAVX2(char_type *text, size_t length, char_type from, char_type to) {
+	const __m256i fromChar = _mm256_set1_epi8(from);
+	const __m256i toChar = _mm256_set1_epi8(to);
+	size_t i = 0;
+
+	for (; length - i >= 32; i += 32) {
+		const __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(text + i));
+		const __m256i match = _mm256_cmpeq_epi8(chunk, fromChar);
+		if (_mm256_movemask_epi8(match)) {
+			_mm256_storeu_si256(reinterpret_cast<__m256i *>(text + i), _mm256_blendv_epi8(chunk, toChar, match));
+		}
+	}
+
+	replaceCharsScalar(text + i, length - i, from, to);
+}
+#endif
+
+const char_type *findFirstOfScalar(const char_type *text, size_t length, const CharSet &set) {
+	for (size_t i = 0; i < length; i++) {
+		if (set.contains(text[i])) {
+			return text + i;
+		}
+	}
+	return nullptr;
+}
+
+const char_type *findLastOfScalar(const char_type *text, size_t length, const CharSet &set) {
+	for (size_t i = length; i != 0; i--) {
+		if (set.contains(text[i - 1])) {
+			return text + i - 1;
+		}
+	}
+	return nullptr;
+}
+
+#ifdef USE_SSSE3
+/*
+** Return a mask with bit n set if character n of "chunk" is in the set.
+** The low nibble of each character selects a row of the set's tables (with
+** pshufb), and the high nibble the bit of the row to test.
+*/
+__attribute__((target("ssse3"))) int matchSSSE3(__m128i chunk, __m128i lowTable, __m128i highTable) {
+	const __m128i nibble = _mm_set1_epi8(0x0f);
+	const __m128i bits = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+
+	const __m128i lo = _mm_and_si128(chunk, nibble);
+	const __m128i hi = _mm_and_si128(_mm_srli_epi16(chunk, 4), nibble);
+	const __m128i high = _mm_cmpgt_epi8(hi, _mm_set1_epi8(7));
+
+	const __m128i row = _mm_or_si128(_mm_and_si128(high, _mm_shuffle_epi8(highTable, lo)),
+	                                 _mm_andnot_si128(high, _mm_shuffle_epi8(lowTable, lo)));
+	const __m128i bit = _mm_shuffle_epi8(bits, hi);
+
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(row, bit), bit));
+}
+
+__attribute__((target("ssse3"))) const char_type *findFirstOfSSSE3(const char_type *text, size_t length, const CharSet &set) {
+	const __m128i lowTable = _mm_loadu_si128(reinterpret_cast<const __m128i *>(set.lowTable));
+	const __m128i highTable = _mm_loadu_si128(reinterpret_cast<const __m128i *>(set.highTable));
+	size_t i = 0;
+
+	for (; length - i >= 16; i += 16) {
+		const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(text + i));
+		if (const int mask = matchSSSE3(chunk, lowTable, highTable)) {
+			return text + i + __builtin_ctz(mask);
+		}
+	}
+
+	return findFirstOfScalar(text + i, length - i, set);
+}
+
+__attribute__((target("ssse3"))) const char_type *findLastOfSSSE3(const char_type *text, size_t length, const CharSet &set) {
+	const __m128i lowTable = _mm_loadu_si128(reinterpret_cast<const __m128i *>(set.lowTable));
+	const __m128i highTable = _mm_loadu_si128(reinterpret_cast<const __m128i *>(set.highTable));
+	size_t i = length;
+
+	for (; i >= 16; i -= 16) {
+		const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(text + i - 16));
+		if (const int mask = matchSSSE3(chunk, lowTable, highTable)) {
+			return text + i - 16 + (31 - __builtin_clz(mask));
+		}
+	}
+
+	return findLastOfScalar(text, i, set);
+}
+#endif
+
+#ifdef USE_AVX2
+/*
+** As matchSSSE3, 32 characters at a time (vpshufb works on each 128 bit lane
+** separately, so the tables are repeated in both)
+*/
+__attribute__((target("avx2"))) uint32_t matchAVX2(__m256i chunk, __m256i lowTable, __m256i highTable) {
+	const __m256i nibble = _mm256_set1_epi8(0x0f);
+	const __m256i bits = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128,
+	                                      1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+
+	const __m256i lo = _mm256_and_si256(chunk, nibble);
+	const __m256i hi = _mm256_and_si256(_mm256_srli_epi16(chunk, 4), nibble);
+	const __m256i high = _mm256_cmpgt_epi8(hi, _mm256_set1_epi8(7));
+
+	const __m256i row = _mm256_blendv_epi8(_mm256_shuffle_epi8(lowTable, lo), _mm256_shuffle_epi8(highTable, lo), high);
+	const __m256i bit = _mm256_shuffle_epi8(bits, hi);
+
+	return static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(row, bit), bit)));
+}
+
+__attribute__((target("avx2"))) const char_type *findFirstOfAVX2(const char_type *text, size_t length, const CharSet &set) {
+	const __m256i lowTable = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(set.lowTable)));
+	const __m256i highTable = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(set.highTable)));
+	size_t i = 0;
+
+	for (; length - i >= 32; i += 32) {
+		const __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(text + i));
+		if (const uint32_t mask = matchAVX2(chunk, lowTable, highTable)) {
+			return text + i + __builtin_ctz(mask);
+		}
+	}
+
+	return findFirstOfScalar(text + i, length - i, set);
+}
+
+__attribute__((target("avx2"))) const char_type *findLastOfAVX2(const char_type *text, size_t length, const CharSet &set) {
+	const __m256i lowTable = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(set.lowTable)));
+	const __m256i highTable = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(set.highTable)));
+	size_t i = length;
+
+	for (; i >= 32; i -= 32) {
+		const __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(text + i - 32));
+		if (const uint32_t mask = matchAVX2(chunk, lowTable, highTable)) {
+			return text + i - 32 + (31 - __builtin_clz(mask));
+		}
+	}
+
+	return findLastOfScalar(text, i, set);
+}
+
+bool haveAVX2() {
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+#endif
+
+#ifdef USE_SSSE3
+bool haveSSSE3() {
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("ssse3");
+}
+#endif
+
+CountFunc selectCountNewlines() {
+#ifdef USE_AVX2
+	if (haveAVX2()) {
+		return countNewlinesAVX2;
+	}
+#endif
+#ifdef USE_SSE2
+	return countNewlinesSSE2;
+#else
+	return countNewlinesScalar;
+#endif
+}
+
+CountFunc selectCountCodePoints() {
+#ifdef USE_AVX2
+	if (haveAVX2()) {
+		return countCodePointsAVX2;
+	}
+#endif
+#ifdef USE_SSE2
+	return countCodePointsSSE2;
+#else
+	return countCodePointsScalar;
+#endif
+}
+
+/*
+** The counting kernels add up in (at most) 32 bits, so long texts are
+** counted a piece at a time
+*/
+pos_type countInChunks(CountFunc count, const char_type *text, size_t length) {
+	const size_t chunkSize = size_t(1) << 30;
+	pos_type total = 0;
+
+	for (; length > chunkSize; text += chunkSize, length -= chunkSize) {
+		total += count(text, chunkSize);
+	}
+
+	return total + count(text, length);
+}
+
+ControlFunc selectFindControlChars() {
+#ifdef USE_AVX2
+	if (haveAVX2()) {
+		return findControlCharsAVX2;
+	}
+#endif
+#ifdef USE_SSE2
+	return findControlCharsSSE2;
+#else
+	return findControlCharsScalar;
+#endif
+}
+
+ReplaceFunc selectReplaceChars() {
+#ifdef USE_AVX2
+	if (haveAVX2()) {
+		return replaceCharsAVX2;
+	}
+#endif
+#ifdef USE_SSE2
+	return replaceCharsSSE2;
+#else
+	return replaceCharsScalar;
+#endif
+}
+
+FindFunc selectFindFirstOf() {
+#ifdef USE_AVX2
+	if (haveAVX2()) {
+		return findFirstOfAVX2;
+	}
+#endif
+#ifdef USE_SSSE3
+	if (haveSSSE3()) {
+		return findFirstOfSSSE3;
+	}
+#endif
+	return findFirstOfScalar;
+}
+
+FindFunc selectFindLastOf() {
+#ifdef USE_AVX2
+	if (haveAVX2()) {
+		return findLastOfAVX2;
+	}
+#endif
+#ifdef USE_SSSE3
+	if (haveSSSE3()) {
+		return findLastOfSSSE3;
+	}
+#endif
+	return findLastOfScalar;
+}
+
+}
+
+/*
+** Compile the null-terminated string of characters "chars" into a set
+*/
+CharSet::CharSet(const char_type *chars) {
+	std::fill_n(lowTable, 16, 0);
+	std::fill_n(highTable, 16, 0);
+
+	for (const char_type *c = chars; *c != '\0'; c++) {
+		insert(*c);
+	}
+}
+
+/*
+** Make a set of the one character "ch"
+*/
+CharSet::CharSet(char_type ch) {
+	std::fill_n(lowTable, 16, 0);
+	std::fill_n(highTable, 16, 0);
+
+	insert(ch);
+}
+
+void CharSet::insert(char_type ch) {
+#ifdef USE_WCHAR
+	if (static_cast<unsigned>(ch) > 0xff) {
+		wideChars.push_back(ch);
+		return;
+	}
+#endif
+	const uint8_t c = static_cast<uint8_t>(ch);
+	uint8_t *const table = (c < 0x80) ? lowTable : highTable;
+	table[c & 0x0f] |= 1 << ((c >> 4) & 7);
+}
+
+/*
+** Return a pointer to the first character of the "length" characters of
+** "text" which is in "set", or nullptr if there is none
+*/
+const char_type *findFirstOf(const char_type *text, size_t length, const CharSet &set) {
+	static const FindFunc func = selectFindFirstOf();
+	return func(text, length, set);
+}
+
+/*
+** Return a pointer to the last character of the "length" characters of
+** "text" which is in "set", or nullptr if there is none
+*/
+const char_type *findLastOf(const char_type *text, size_t length, const CharSet &set) {
+	static const FindFunc func = selectFindLastOf();
+	return func(text, length, set);
+}
+
+/*
+** Return the number of newlines in the first "length" characters of "text"
+*/
+pos_type countNewlines(const char_type *text, size_t length) {
+	static const CountFunc func = selectCountNewlines();
+	return countInChunks(func, text, length);
+}
+
+/*
+** Return the number of UTF-8 encoded characters in the first "length" bytes
+** of "text" (the number of bytes which start a character).  In wide
+** character builds every character counts.
+*/
+pos_type countCodePoints(const char_type *text, size_t length) {
+	static const CountFunc func = selectCountCodePoints();
+	return countInChunks(func, text, length);
+}
+
+/*
+** Return a mask with bit c set for each control character c (0 - 31) found
+** in the first "length" characters of "text".  Tab, newline and carriage
+** return are left out: they are everywhere, so nobody needs to look for them
+** this way.
+*/
+uint32_t findControlChars(const char_type *text, size_t length) {
+	static const ControlFunc func = selectFindControlChars();
+	return func(text, length);
+}
+
+/*
+** Replace every "from" character in the first "length" characters of "text"
+** with "to"
+*/
+void replaceChars(char_type *text, size_t length, char_type from, char_type to) {
+	static const ReplaceFunc func = selectReplaceChars();
+	func(text, length, from, to);
+}
@@ -0,0 +1,60 @@
+
+#ifndef TEXT_SCAN_H_
+#define TEXT_SCAN_H_
+
+#include "Types.h"
+#include <cstddef>
+#include <cstdint>
+
+/* A set of characters to search for, precompiled into a pair of nibble
+   lookup tables (the layout the vectorized searches use directly) */
+class CharSet {
+public:
+	explicit CharSet(const char_type *chars);
+	explicit CharSet(char_type ch);
+
+public:
+	bool contains(char_type ch) const {
+#ifdef USE_WCHAR
+		if (static_cast<unsigned>(ch) > 0xff) {
+			return wideChars.find(ch) != std::basic_string<char_type>::npos;
+		}
+#endif
+		const uint8_t c = static_cast<uint8_t>(ch);
+		const uint8_t row = (c < 0x80) ? lowTable[c & 0x0f] : highTable[c & 0x0f];
+		return (row >> ((c >> 4) & 7)) & 1;
+	}
+
+private:
+	void insert(char_type ch);
+
+public:
+	uint8_t lowTable[16];  // bit n of entry i is set if character (n << 4) | i is in the set
+	uint8_t highTable[16]; // bit n of entry i is set if character ((n + 8) << 4) | i is in the set
+#ifdef USE_WCHAR
+	std::basic_string<char_type> wideChars; // characters too big for the tables
+#endif
+};
+
+/* True if "ch" is a UTF-8 continuation byte (never the case for wide
+   characters, which are whole characters already) */
+inline bool isUtf8Continuation(char_type ch) {
+#ifdef USE_WCHAR
+	(void)ch;
+	return false;
+#else
+	return (static_cast<uint8_t>(ch) & 0xc0) == 0x80;
+#endif
+}
+
+/* Scanning kernels for buffer text.  On x86 these are vectorized (SSE2,
+   SSSE3 or AVX2, depending on what the CPU running the program supports,
+   which is checked the first time each one is called) */
+const char_type *findFirstOf(const char_type *text, size_t length, const CharSet &set);
+const char_type *findLastOf(const char_type *text, size_t length, const CharSet &set);
+pos_type countCodePoints(const char_type *text, size_t length);
+pos_type countNewlines(const char_type *text, size_t length);
+uint32_t findControlChars(const char_type *text, size_t length);
+void replaceChars(char_type *text, size_t length, char_type from, char_type to);
+
+#endif
@@ -2,6 +2,7 @@
 #ifndef TYPES_H_
 #define TYPES_H_
 
+#include <cstdint>
 #include <string>
 
 //#define USE_WCHAR
@@ -30,4 +31,8 @@ typedef std::char_traits<char_type> traits_type;
 
 #endif
 
+/* Positions and lengths of text (64 bit, so that files bigger than 2 GB can
+   be edited) */
+typedef int64_t pos_type;
+
 #endif
@@ -0,0 +1,559 @@
+
+#include "UndoJournal.h"
+#include "LzCompress.h"
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#elif defined(_WIN32)
+#include <io.h>
+#endif
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+/* The writer syncs what it has written every SYNC_INTERVAL, or (when sync
+   is called) as soon as MIN_SYNC_INTERVAL has passed since the last sync */
+const std::chrono::milliseconds SYNC_INTERVAL(1000);
+const std::chrono::milliseconds MIN_SYNC_INTERVAL(100);
+
+/* Most bytes written to the journal a second, and most held in its queue
+   waiting to be written before it gives up */
+const size_t MAX_WRITE_RATE   = 32 << 20;
+const size_t MAX_QUEUED_BYTES = 256 << 20;
+
+/* Entries whose text takes at least this many bytes have it compressed */
+const size_t COMPRESS_THRESHOLD = 65536;
+
+/* The header: a magic number, then the length and hash of the saved text */
+const char MAGIC[4] = { 'N', 'Q', 'J', '1' };
+const size_t HEADER_SIZE = sizeof(MAGIC) + 8 + 8;
+
+/* Each entry is its length (4 bytes), its body, then a checksum of the body
+   (4 bytes).  The body is the kind, flags, the position, the number of
+   characters deleted and the number inserted (as variable length numbers),
+   then the text inserted. */
+const size_t ENTRY_OVERHEAD = 4 + 4;
+const uint8_t FLAG_COMPRESSED = 1;
+
+void putFixed(std::vector<uint8_t> *bytes, uint64_t value, int size) {
+	for (int i = 0; i < size; i++) {
+		bytes->push_back(static_cast<uint8_t>(value >> (i * 8)));
+	}
+}
+
+uint64_t getFixed(const uint8_t *p, int size) {
+	uint64_t value = 0;
+	for (int i = 0; i < size; i++) {
+		value |= static_cast<uint64_t>(p[i]) << (i * 8);
+	}
+	return value;
+}
+
+/*
+** Write a number 7 bits to a byte, with the top bit set on all but the last
+*/
+void putNumber(std::vector<uint8_t> *bytes, uint64_t value) {
+	while (value >= 0x80) {
+		bytes->push_back(static_cast<uint8_t>(value | 0x80));
+		value >>= 7;
+	}
+	bytes->push_back(static_cast<uint8_t>(value));
+}
+
+bool getNumber(const uint8_t **p, const uint8_t *end, uint64_t *value) {
+	*value = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		if (*p == end) {
+			return false;
+		}
+
+		const uint8_t b = *(*p)++;
+		*value |= static_cast<uint64_t>(b & 0x7f) << shift;
+		if (!(b & 0x80)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+** FNV-1a, 32 bits for the checksums of entries, 64 for the hash of the text
+*/
+uint32_t checksum(const uint8_t *p, size_t length) {
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < length; i++) {
+		hash = (hash ^ p[i]) * 16777619u;
+	}
+	return hash;
+}
+
+uint64_t hashText(const TextSnapshot &text) {
+	uint64_t hash = 14695981039346656037ull;
+	pos_type pos = 0;
+	pos_type spanLength;
+	while (const char_type *span = text.span(pos, &spanLength)) {
+		const uint8_t *p = reinterpret_cast<const uint8_t *>(span);
+		const size_t length = static_cast<size_t>(spanLength) * sizeof(char_type);
+		for (size_t i = 0; i < length; i++) {
+			hash = (hash ^ p[i]) * 1099511628211ull;
+		}
+		pos += spanLength;
+	}
+	return hash;
+}
+
+void encodeHeader(const TextSnapshot &text, std::vector<uint8_t> *bytes) {
+	bytes->assign(MAGIC, MAGIC + sizeof(MAGIC));
+	putFixed(bytes, static_cast<uint64_t>(text.length()), 8);
+	putFixed(bytes, hashText(text), 8);
+}
+
+size_t queuedSize(const JournalEntry &entry) {
+	return sizeof(entry) + entry.text.size() * sizeof(char_type);
+}
+
+void encodeEntry(const JournalEntry &entry, std::vector<uint8_t> *bytes) {
+
+	const uint8_t *const text = reinterpret_cast<const uint8_t *>(entry.text.data());
+	const size_t textBytes = entry.text.size() * sizeof(char_type);
+
+	bytes->assign(4, 0);
+	bytes->push_back(static_cast<uint8_t>(entry.kind));
+	bytes->push_back(0);
+	putNumber(bytes, static_cast<uint64_t>(entry.pos));
+	putNumber(bytes, static_cast<uint64_t>(entry.nDeleted));
+	putNumber(bytes, entry.text.size());
+
+	const size_t payload = bytes->size();
+	bool compressed = false;
+
+	if (textBytes >= COMPRESS_THRESHOLD) {
+		bytes->resize(payload + lzCompressBound(textBytes));
+		const size_t compressedBytes = lzCompress(text, textBytes, bytes->data() + payload);
+		if (compressedBytes < textBytes) {
+			bytes->resize(payload + compressedBytes);
+			(*bytes)[5] = FLAG_COMPRESSED;
+			compressed = true;
+		}
+	}
+
+	if (!compressed) {
+		bytes->resize(payload);
+		bytes->insert(bytes->end(), text, text + textBytes);
+	}
+
+	const size_t bodyLength = bytes->size() - 4;
+	for (int i = 0; i < 4; i++) {
+		(*bytes)[i] = static_cast<uint8_t>(bodyLength >> (i * 8));
+	}
+	putFixed(bytes, checksum(bytes->data() + 4, bodyLength), 4);
+}
+
+bool decodeEntry(const uint8_t *body, size_t length, JournalEntry *entry) {
+
+	const uint8_t *p = body + 2;
+	const uint8_t *const end = body + length;
+	uint64_t pos;
+	uint64_t nDeleted;
+	uint64_t nInserted;
+
+	if (length < 2 || body[0] > JOURNAL_TRIM || !getNumber(&p, end, &pos) || !getNumber(&p, end, &nDeleted) || !getNumber(&p, end, &nInserted)) {
+		return false;
+	}
+
+	/* guard against sizes no entry this long could have come from */
+	if (nInserted > static_cast<uint64_t>(MAX_QUEUED_BYTES) || pos > static_cast<uint64_t>(INT64_MAX) || nDeleted > static_cast<uint64_t>(INT64_MAX)) {
+		return false;
+	}
+
+	entry->kind     = static_cast<JournalKind>(body[0]);
+	entry->pos      = static_cast<pos_type>(pos);
+	entry->nDeleted = static_cast<pos_type>(nDeleted);
+	entry->text.resize(static_cast<size_t>(nInserted));
+
+	uint8_t *const text = reinterpret_cast<uint8_t *>(entry->text.data());
+	const size_t textBytes = entry->text.size() * sizeof(char_type);
+	const size_t payloadBytes = static_cast<size_t>(end - p);
+
+	if (body[1] & FLAG_COMPRESSED) {
+		return lzDecompress(p, payloadBytes, text, textBytes);
+	}
+
+	if (payloadBytes != textBytes) {
+		return false;
+	}
+
+	if (textBytes != 0) {
+		std::memcpy(text, p, textBytes);
+	}
+	return true;
+}
+
+bool writeAll(std::FILE *file, const std::vector<uint8_t> &bytes) {
+	return std::fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size();
+}
+
+/*
+** Flush what has been written to "file" out of the C library's buffers and
+** the system's, onto the disk
+*/
+bool syncFile(std::FILE *file) {
+	if (std::fflush(file) != 0) {
+		return false;
+	}
+
+#if defined(__unix__) || defined(__APPLE__)
+	return fsync(fileno(file)) == 0;
+#elif defined(_WIN32)
+	return _commit(_fileno(file)) == 0;
+#else
+	return true;
+#endif
+}
+
+bool truncateFile(std::FILE *file, int64_t length) {
+#if defined(__unix__) || defined(__APPLE__)
+	return ftruncate(fileno(file), static_cast<off_t>(length)) == 0;
+#elif defined(_WIN32)
+	return _chsize_s(_fileno(file), length) == 0;
+#else
+	(void)file;
+	(void)length;
+	return false;
+#endif
+}
+
+}
+
+/* The state shared by a journal and the thread writing it, which lives for
+   as long as either of them needs it */
+struct UndoJournal::Writer {
+	Writer() : queuedBytes(0), failed(false), stopping(false), syncRequested(false), finished(false) {
+	}
+
+	void run(TextSnapshot base, int64_t length);
+	void waitUntilFinished();
+
+	std::string path;
+	std::shared_ptr<Writer> previous; // the last journal's writer, which has to be
+	                                  // done with its file before this one starts
+	std::mutex mutex;                 // guards everything below
+	std::condition_variable wake;
+	std::deque<JournalEntry> queue;   // entries not yet written
+	size_t queuedBytes;
+	bool failed;                      // the file couldn't be opened or written
+	bool stopping;                    // the journal has been closed
+	bool syncRequested;
+	bool finished;                    // the file has been closed
+};
+
+UndoJournal::UndoJournal() : complete_(true) {
+}
+
+UndoJournal::~UndoJournal() {
+	close();
+}
+
+/*
+** Read the journal at "path", returning false unless it is a journal of
+** changes to "text".  Returns the entries which could be read in "entries"
+** (anything after them being a write torn by a crash), and in "offsets" the
+** length of the journal up to each of them: the first is the length of the
+** header alone, and the one after each entry is the length up to its end.
+*/
+bool UndoJournal::read(const char *path, const TextSnapshot &text, std::vector<JournalEntry> *entries, std::vector<int64_t> *offsets) {
+
+	std::FILE *const file = std::fopen(path, "rb");
+	if (!file) {
+		return false;
+	}
+
+	std::vector<uint8_t> bytes;
+	uint8_t block[65536];
+	size_t n;
+	while ((n = std::fread(block, 1, sizeof(block), file)) != 0) {
+		bytes.insert(bytes.end(), block, block + n);
+	}
+	std::fclose(file);
+
+	if (bytes.size() < HEADER_SIZE || std::memcmp(bytes.data(), MAGIC, sizeof(MAGIC)) != 0) {
+		return false;
+	}
+
+	if (getFixed(&bytes[sizeof(MAGIC)], 8) != static_cast<uint64_t>(text.length()) || getFixed(&bytes[sizeof(MAGIC) + 8], 8) != hashText(text)) {
+		return false;
+	}
+
+	entries->clear();
+	offsets->assign(1, static_cast<int64_t>(HEADER_SIZE));
+
+	size_t offset = HEADER_SIZE;
+	while (bytes.size() - offset >= ENTRY_OVERHEAD) {
+		const uint8_t *const body = &bytes[offset + 4];
+		const size_t bodyLength = static_cast<size_t>(getFixed(&bytes[offset], 4));
+
+		if (bodyLength > bytes.size() - offset - ENTRY_OVERHEAD || getFixed(body + bodyLength, 4) != checksum(body, bodyLength)) {
+			break;
+		}
+
+		JournalEntry entry;
+		if (!decodeEntry(body, bodyLength, &entry)) {
+			break;
+		}
+
+		entries->push_back(std::move(entry));
+		offset += bodyLength + ENTRY_OVERHEAD;
+		offsets->push_back(static_cast<int64_t>(offset));
+	}
+
+	return true;
+}
+
+/*
+** Whether every modification recorded since the journal was started has
+** been (or will be) written to it
+*/
+bool UndoJournal::complete() const {
+
+	if (!writer_) {
+		return complete_;
+	}
+
+	std::lock_guard<std::mutex> lock(writer_->mutex);
+	return complete_ && !writer_->failed;
+}
+
+bool UndoJournal::isOpen() const {
+	return writer_ != nullptr;
+}
+
+/*
+** Start a new journal at "path" (replacing any file there) of changes to
+** "text", which should be the text as it was just saved
+*/
+void UndoJournal::start(const char *path, const TextSnapshot &text) {
+	startWriter(path, text, -1);
+}
+
+/*
+** Carry on with the journal at "path", as read (and replayed) by read,
+** dropping anything after its first "length" bytes (one of the offsets
+** read returned)
+*/
+void UndoJournal::resume(const char *path, int64_t length) {
+	startWriter(path, TextSnapshot(), length);
+}
+
+/*
+** Close the journal (if one is open) and start a writer thread for the one
+** at "path": a new one of changes to "base" if "length" is negative, else
+** the existing one cut to "length" bytes
+*/
+void UndoJournal::startWriter(const char *path, const TextSnapshot &base, int64_t length) {
+
+	close();
+
+	writer_ = std::make_shared<Writer>();
+	writer_->path = path;
+	writer_->previous = std::move(previous_);
+	complete_ = true;
+
+	std::thread(&Writer::run, writer_, base, length).detach();
+}
+
+/*
+** Stop journaling.  The writer thread carries on by itself until it has
+** written and synced everything queued, so this never waits for the disk.
+*/
+void UndoJournal::close() {
+
+	if (!writer_) {
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(writer_->mutex);
+		writer_->stopping = true;
+	}
+
+	writer_->wake.notify_all();
+	previous_ = std::move(writer_);
+}
+
+/*
+** Queue a modification to be written to the journal
+*/
+void UndoJournal::record(JournalKind kind, pos_type pos, pos_type nDeleted, std::vector<char_type> &&text) {
+
+	if (!writer_ || !complete_) {
+		return;
+	}
+
+	JournalEntry entry;
+	entry.kind     = kind;
+	entry.pos      = pos;
+	entry.nDeleted = nDeleted;
+	entry.text     = std::move(text);
+
+	{
+		std::lock_guard<std::mutex> lock(writer_->mutex);
+
+		if (writer_->failed || writer_->queuedBytes + queuedSize(entry) > MAX_QUEUED_BYTES) {
+			complete_ = false;
+			return;
+		}
+
+		writer_->queuedBytes += queuedSize(entry);
+		writer_->queue.push_back(std::move(entry));
+	}
+
+	writer_->wake.notify_all();
+}
+
+/*
+** Ask for what has been recorded to be synced to disk soon, rather than at
+** the next SYNC_INTERVAL
+*/
+void UndoJournal::sync() {
+
+	if (!writer_) {
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(writer_->mutex);
+		writer_->syncRequested = true;
+	}
+
+	writer_->wake.notify_all();
+}
+
+/*
+** The writer thread: opens the journal (writing the header of a new one,
+** or cutting an existing one to "length") once the last journal's writer is
+** done, then writes the queued entries, keeping within MAX_WRITE_RATE and
+** syncing no more often than it has to.  Once the journal is closed, it
+** writes and syncs everything left without waiting, and closes the file.
+*/
+void UndoJournal::Writer::run(TextSnapshot base, int64_t length) {
+
+	std::vector<uint8_t> bytes;
+
+	/* the hash is taken first, so that the snapshot can be let go of (and
+	   the buffer needn't copy any text it edits to keep it intact) */
+	if (length < 0) {
+		encodeHeader(base, &bytes);
+		base = TextSnapshot();
+	}
+
+	if (previous) {
+		previous->waitUntilFinished();
+		previous = nullptr;
+	}
+
+	bool written;
+	std::FILE *file;
+
+	if (length < 0) {
+		file = std::fopen(path.c_str(), "wb");
+		written = file && writeAll(file, bytes) && syncFile(file);
+	} else {
+		file = std::fopen(path.c_str(), "r+b");
+		written = file && truncateFile(file, length) && std::fseek(file, 0, SEEK_END) == 0;
+	}
+
+	std::unique_lock<std::mutex> lock(mutex);
+	failed = !written;
+
+	Clock::time_point lastSync    = Clock::now();
+	Clock::time_point windowStart = lastSync;
+	size_t windowBytes = 0;
+	bool dirty = false;
+
+	while (!failed) {
+		const Clock::time_point now = Clock::now();
+		if (now - windowStart >= std::chrono::seconds(1)) {
+			windowStart = now;
+			windowBytes = 0;
+		}
+
+		const bool throttled = windowBytes >= MAX_WRITE_RATE && !stopping;
+
+		if (!queue.empty() && !throttled) {
+			JournalEntry entry = std::move(queue.front());
+			queue.pop_front();
+			queuedBytes -= queuedSize(entry);
+
+			lock.unlock();
+			encodeEntry(entry, &bytes);
+			written = writeAll(file, bytes);
+			lock.lock();
+
+			failed = !written;
+			windowBytes += bytes.size();
+			dirty = true;
+			continue;
+		}
+
+		const Clock::time_point syncDue = lastSync + (syncRequested ? MIN_SYNC_INTERVAL : SYNC_INTERVAL);
+
+		if (dirty && (stopping || now >= syncDue)) {
+			lock.unlock();
+			written = syncFile(file);
+			lock.lock();
+
+			failed = !written;
+			syncRequested = false;
+			lastSync = Clock::now();
+			dirty = false;
+			continue;
+		}
+
+		if (stopping) {
+			break;
+		}
+
+		/* sleep until there is more to write, the next sync is due, or the
+		   second which used up the write budget is over */
+		if (throttled) {
+			const Clock::time_point windowEnd = windowStart + std::chrono::seconds(1);
+			wake.wait_until(lock, (dirty && syncDue < windowEnd) ? syncDue : windowEnd);
+		} else if (dirty) {
+			wake.wait_until(lock, syncDue);
+		} else {
+			wake.wait(lock);
+		}
+	}
+
+	/* after a failure nothing more can be written */
+	queue.clear();
+	queuedBytes = 0;
+	lock.unlock();
+
+	if (file) {
+		std::fclose(file);
+	}
+
+	lock.lock();
+	finished = true;
+	lock.unlock();
+	wake.notify_all();
+}
+
+/*
+** Wait (on the thread of the next journal's writer) until this writer has
+** closed its file
+*/
+void UndoJournal::Writer::waitUntilFinished() {
+	std::unique_lock<std::mutex> lock(mutex);
+	wake.wait(lock, [this] { return finished; });
+}
@@ -0,0 +1,75 @@
+
+#ifndef UNDO_JOURNAL_H_
+#define UNDO_JOURNAL_H_
+
+#include "Types.h"
+#include "TextBuffer.h"
+#include <memory>
+#include <vector>
+
+enum JournalKind {
+	JOURNAL_EDIT,   // an edit, recorded for undo
+	JOURNAL_UNDO,   // the undoing of the newest undo record
+	JOURNAL_REDO,   // the redoing of the newest redo record
+	JOURNAL_APPEND, // text appended without being recorded for undo
+	JOURNAL_TRIM    // old text dropped from the start (see UndoList::cutHead)
+};
+
+/* One modification of the text: "nDeleted" characters at "pos" replaced by
+   "text" */
+struct JournalEntry {
+	JournalKind kind;
+	pos_type pos;
+	pos_type nDeleted;
+	std::vector<char_type> text;
+};
+
+/* An append-only log of the modifications made to a text since it was last
+   saved, from which the text (and its undo history back to that save) can
+   be rebuilt after a crash or a restart.  The journal starts with the length
+   and a hash of the saved text, so that it is only ever replayed onto that
+   text, followed by one checksummed entry per modification; a write torn by
+   a crash only loses the entries after it.
+
+   Entries are queued by the UI thread, and all of the file I/O (opening the
+   journal included) is done by a writer thread of its own, which writes at
+   most MAX_WRITE_RATE bytes a second and syncs the file to disk at most once
+   every SYNC_INTERVAL, however fast modifications come in.  Closing the
+   journal doesn't wait for the writer: it goes on to write out what is
+   queued, sync and close the file by itself, and the writer of the next
+   journal started waits for it to finish with the file first.  If a writer
+   falls so far behind that its queue passes MAX_QUEUED_BYTES, the journal
+   stops there (complete() returns false): what it has written can still be
+   replayed, but goes no further. */
+class UndoJournal {
+public:
+	UndoJournal();
+	~UndoJournal();
+	UndoJournal(const UndoJournal &) = delete;
+	UndoJournal &operator=(const UndoJournal &) = delete;
+
+public:
+	static bool read(const char *path, const TextSnapshot &text, std::vector<JournalEntry> *entries, std::vector<int64_t> *offsets);
+
+public:
+	bool complete() const;
+	bool isOpen() const;
+	void close();
+	void record(JournalKind kind, pos_type pos, pos_type nDeleted, std::vector<char_type> &&text);
+	void resume(const char *path, int64_t length);
+	void start(const char *path, const TextSnapshot &text);
+	void sync();
+
+private:
+	struct Writer;
+
+private:
+	void startWriter(const char *path, const TextSnapshot &base, int64_t length);
+
+private:
+	std::shared_ptr<Writer> writer_;   // shared with its thread, which outlives it
+	std::shared_ptr<Writer> previous_; // the last writer closed, which may not be done yet
+	bool complete_;
+};
+
+#endif
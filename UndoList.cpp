@@ -0,0 +1,635 @@
+
+#include "UndoList.h"
+#include "LzCompress.h"
+#include "TextScan.h"
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <iterator>
+
+/* Smallest the rings are made when they are first needed */
+#define MIN_RECORDS 16
+#define MIN_TEXT_SIZE 4096
+
+/* A cleared list keeps a text ring up to this size for reuse, and a ring any
+   bigger is shrunk once it is less than a quarter full */
+#define KEEP_TEXT_SIZE 65536
+
+/* Records with at least this much text have it compressed, in independent
+   chunks of COMPRESS_CHUNK_SIZE characters (so the buffers needed for it
+   stay small however big the record is) */
+#define COMPRESS_THRESHOLD 65536
+#define COMPRESS_CHUNK_SIZE (1 << 20)
+
+namespace {
+
+/* Each compressed chunk starts with its size in bytes (a uint32_t), taking
+   this many characters of the ring */
+const size_t CHUNK_HEADER_SIZE = (sizeof(uint32_t) + sizeof(char_type) - 1) / sizeof(char_type);
+
+/*
+** Characters of the ring taken up by "bytes" bytes
+*/
+size_t bytesToChars(size_t bytes) {
+	return (bytes + sizeof(char_type) - 1) / sizeof(char_type);
+}
+
+/*
+** Length of the longest common prefix of "a" and "b"
+*/
+pos_type commonPrefix(const char_type *a, const char_type *b, pos_type length) {
+	return std::mismatch(a, a + length, b).first - a;
+}
+
+/*
+** Length of the longest common suffix of the "length" characters before "a"
+** and those before "b"
+*/
+pos_type commonSuffix(const char_type *a, const char_type *b, pos_type length) {
+	pos_type n = 0;
+	while (n < length && a[-n - 1] == b[-n - 1]) {
+		n++;
+	}
+	return n;
+}
+
+/*
+** Add the replacement of "oldLength" characters of old text at "oldOffset"
+** by "newLength" at "pos" to "deltas", leaving out what the two have in
+** common at either end, and joining it to the last delta if it follows on
+** from it
+*/
+void addDelta(std::vector<UndoDelta> *deltas, pos_type pos, const char_type *oldText, pos_type oldOffset, pos_type oldLength, const char_type *newText, pos_type newLength) {
+
+	const pos_type prefix = commonPrefix(oldText + oldOffset, newText, std::min(oldLength, newLength));
+	const pos_type suffix = commonSuffix(oldText + oldOffset + oldLength, newText + newLength, std::min(oldLength, newLength) - prefix);
+
+	UndoDelta delta;
+	delta.pos = pos + prefix;
+	delta.oldLen = oldLength - prefix - suffix;
+	delta.newLen = newLength - prefix - suffix;
+	delta.oldOffset = oldOffset + prefix;
+
+	if (delta.oldLen == 0 && delta.newLen == 0) {
+		return;
+	}
+
+	if (!deltas->empty() && deltas->back().pos + deltas->back().newLen == delta.pos) {
+		deltas->back().oldLen += delta.oldLen;
+		deltas->back().newLen += delta.newLen;
+	} else {
+		deltas->push_back(delta);
+	}
+}
+
+void putNumber(std::vector<char_type> *payload, uint64_t n) {
+	while (n >= 0x80) {
+		payload->push_back(static_cast<char_type>(static_cast<uint8_t>(n | 0x80)));
+		n >>= 7;
+	}
+	payload->push_back(static_cast<char_type>(static_cast<uint8_t>(n)));
+}
+
+uint64_t getNumber(const std::vector<char_type> &payload, size_t *index) {
+	uint64_t n = 0;
+	for (int shift = 0;; shift += 7) {
+		const uint8_t b = static_cast<uint8_t>(payload[(*index)++]);
+		n |= static_cast<uint64_t>(b & 0x7f) << shift;
+		if ((b & 0x80) == 0) {
+			return n;
+		}
+	}
+}
+
+}
+
+/*
+** Find the ranges which really changed when the "oldLength" characters of
+** "oldText" at "pos" were replaced by the "newLength" of "newText".  Things
+** like shifting or filling a selection, done as one replacement of all of
+** it, usually change only a little of each line.  So a replacement with as
+** many lines as it replaced is compared line by line, one line with the
+** line it replaced; otherwise only what the two have in common at either
+** end is left out.  The deltas are in order, with positions after the
+** replacement.
+*/
+void findDeltas(pos_type pos, const char_type *oldText, pos_type oldLength, const char_type *newText, pos_type newLength, std::vector<UndoDelta> *deltas) {
+
+	deltas->clear();
+
+	if (countNewlines(oldText, static_cast<size_t>(oldLength)) != countNewlines(newText, static_cast<size_t>(newLength))) {
+		addDelta(deltas, pos, oldText, 0, oldLength, newText, newLength);
+		return;
+	}
+
+	pos_type oldPos = 0;
+	pos_type newPos = 0;
+
+	while (oldPos < oldLength || newPos < newLength) {
+		const char_type *oldEnd = traits_type::find(oldText + oldPos, static_cast<size_t>(oldLength - oldPos), _T('\n'));
+		const char_type *newEnd = traits_type::find(newText + newPos, static_cast<size_t>(newLength - newPos), _T('\n'));
+		const pos_type oldLine = oldEnd ? (oldEnd - oldText) + 1 - oldPos : oldLength - oldPos;
+		const pos_type newLine = newEnd ? (newEnd - newText) + 1 - newPos : newLength - newPos;
+
+		addDelta(deltas, pos + newPos, oldText, oldPos, oldLine, newText + newPos, newLine);
+		oldPos += oldLine;
+		newPos += newLine;
+	}
+}
+
+/*
+** Pack "deltas", with their text from "oldText", into the text of a
+** MULTI_REPLACE record starting at "pos": for each, its distance from the
+** end of the one before (the first, from "pos"), its old and new lengths
+** (as variable length numbers), and its old text.  Nothing in it depends on
+** where the record is, so moving the record moves its deltas.
+*/
+void packDeltas(pos_type pos, const std::vector<UndoDelta> &deltas, const char_type *oldText, std::vector<char_type> *payload) {
+
+	pos_type end = pos;
+	payload->clear();
+
+	for (const UndoDelta &delta : deltas) {
+		putNumber(payload, static_cast<uint64_t>(delta.pos - end));
+		putNumber(payload, static_cast<uint64_t>(delta.oldLen));
+		putNumber(payload, static_cast<uint64_t>(delta.newLen));
+		payload->insert(payload->end(), oldText + delta.oldOffset, oldText + delta.oldOffset + delta.oldLen);
+		end = delta.pos + delta.newLen;
+	}
+}
+
+/*
+** Unpack the text of a MULTI_REPLACE record starting at "pos" (see
+** packDeltas) into the deltas and their old text
+*/
+void unpackDeltas(pos_type pos, const std::vector<char_type> &payload, std::vector<UndoDelta> *deltas, std::vector<char_type> *oldText) {
+
+	pos_type end = pos;
+	size_t index = 0;
+	deltas->clear();
+	oldText->clear();
+
+	while (index < payload.size()) {
+		UndoDelta delta;
+		delta.pos = end + static_cast<pos_type>(getNumber(payload, &index));
+		delta.oldLen = static_cast<pos_type>(getNumber(payload, &index));
+		delta.newLen = static_cast<pos_type>(getNumber(payload, &index));
+		delta.oldOffset = static_cast<pos_type>(oldText->size());
+
+		oldText->insert(oldText->end(), payload.begin() + index, payload.begin() + index + delta.oldLen);
+		index += static_cast<size_t>(delta.oldLen);
+		end = delta.pos + delta.newLen;
+		deltas->push_back(delta);
+	}
+}
+
+UndoList::UndoList() : first_(0), count_(0), textStart_(0), textEnd_(0) {
+}
+
+/*
+** The newest record (the list must not be empty)
+*/
+UndoInfo &UndoList::newest() {
+	assert(count_ > 0);
+	return record(count_ - 1).info;
+}
+
+bool UndoList::empty() const {
+	return count_ == 0;
+}
+
+/*
+** Number of records in the list
+*/
+int UndoList::size() const {
+	return count_;
+}
+
+/*
+** Bytes taken up by the records and their text, which is what the list is
+** trimmed by (see NirvanaQt::addUndoItem)
+*/
+size_t UndoList::bytesUsed() const {
+	const size_t textLength = static_cast<size_t>(textEnd_ - textStart_) + prepended_.size();
+	return count_ * sizeof(Record) + textLength * sizeof(char_type);
+}
+
+/*
+** Bytes allocated by the list, spare room in the rings included
+*/
+size_t UndoList::memoryUsage() const {
+	return sizeof(UndoList) + records_.capacity() * sizeof(Record) +
+	       (text_.capacity() + prepended_.capacity()) * sizeof(char_type);
+}
+
+/*
+** Add a record to the new end of the list, with the "length" characters of
+** "text" that it replaced
+*/
+void UndoList::push(const UndoInfo &info, const char_type *text, pos_type length) {
+
+	/* the newest record is sealed now, its text can't grow any more */
+	seal();
+	compressNewest();
+	reserveRecords(count_ + 1);
+
+	Record &r = records_[(first_ + count_) % records_.size()];
+	r.info = info;
+	r.info.oldLen = length;
+	r.text = textEnd_;
+	r.compressed = false;
+	count_++;
+
+	if (length >= COMPRESS_THRESHOLD && writeCompressed(text, static_cast<size_t>(length))) {
+		r.compressed = true;
+		return;
+	}
+
+	reserveText(static_cast<size_t>(length));
+	copyIn(textEnd_, text, static_cast<size_t>(length));
+	textEnd_ += length;
+}
+
+/*
+** Add text to the end of that of the newest record.  Being the newest, its
+** text is the last in the ring, so there is nothing to move.
+*/
+void UndoList::appendText(const char_type *text, pos_type length) {
+
+	expandNewest();
+	reserveText(static_cast<size_t>(length));
+	copyIn(textEnd_, text, static_cast<size_t>(length));
+	textEnd_ += length;
+	newest().oldLen += length;
+}
+
+/*
+** Add text to the start of that of the newest record.  That can't be done
+** in place, so it is collected (backwards, for a run of backspaces to cost
+** O(1) each) and only moved into the ring when the record is sealed.
+*/
+void UndoList::prependText(const char_type *text, pos_type length) {
+
+	expandNewest();
+	prepended_.insert(prepended_.end(), std::reverse_iterator<const char_type *>(text + length),
+	                  std::reverse_iterator<const char_type *>(text));
+	newest().oldLen += length;
+}
+
+/*
+** Get the text replaced by the newest record
+*/
+void UndoList::newestText(std::vector<char_type> *text) {
+
+	seal();
+
+	const Record &r = record(count_ - 1);
+	if (r.compressed) {
+		text->resize(static_cast<size_t>(r.info.oldLen));
+		readCompressed(r.text, text->size(), text->data());
+	} else {
+		text->resize(static_cast<size_t>(textEnd_ - r.text));
+		copyOut(r.text, text->size(), text->data());
+	}
+}
+
+/*
+** Remove the newest record
+*/
+void UndoList::popNewest() {
+
+	if (count_ == 0) {
+		return;
+	}
+
+	prepended_.clear();
+	textEnd_ = record(count_ - 1).text;
+	count_--;
+	shrinkIfSparse();
+}
+
+/*
+** Remove the oldest record
+*/
+void UndoList::popOldest() {
+
+	if (count_ == 0) {
+		return;
+	}
+
+	if (count_ == 1) {
+		popNewest();
+		return;
+	}
+
+	first_ = (first_ + 1) % static_cast<int>(records_.size());
+	count_--;
+	textStart_ = record(0).text;
+	shrinkIfSparse();
+}
+
+/*
+** Remove all of the records
+*/
+void UndoList::clear() {
+
+	first_ = 0;
+	count_ = 0;
+	textStart_ = 0;
+	textEnd_ = 0;
+	prepended_.clear();
+
+	if (text_.size() > KEEP_TEXT_SIZE) {
+		std::vector<char_type>().swap(text_);
+	}
+}
+
+/*
+** Clear the restoresToSaved flag of every record
+*/
+void UndoList::clearRestoresToSaved() {
+	for (int i = 0; i < count_; i++) {
+		record(i).info.restoresToSaved = false;
+	}
+}
+
+/*
+** Move the records back for "cut" characters having been removed from the
+** start of the text.  Records which changed any of those characters are
+** dropped, along with all of those older, which can't be undone without
+** them.
+*/
+void UndoList::cutHead(pos_type cut) {
+
+	int kept = 0;
+	while (kept < count_ && record(count_ - 1 - kept).info.startPos >= cut) {
+		kept++;
+	}
+
+	while (count_ > kept) {
+		popOldest();
+	}
+
+	for (int i = 0; i < count_; i++) {
+		record(i).info.startPos -= cut;
+		record(i).info.endPos -= cut;
+	}
+}
+
+/*
+** Give back the spare room in the rings
+*/
+void UndoList::compact() {
+
+	seal();
+	resizeText(static_cast<size_t>(textEnd_ - textStart_));
+	std::vector<char_type>().swap(prepended_);
+
+	std::vector<Record> records;
+	records.reserve(count_);
+	for (int i = 0; i < count_; i++) {
+		records.push_back(record(i));
+	}
+
+	records_.swap(records);
+	first_ = 0;
+}
+
+/*
+** Move any text prepended to the newest record into the ring, in front of
+** the rest of its text
+*/
+void UndoList::seal() {
+
+	if (prepended_.empty()) {
+		return;
+	}
+
+	Record &r = record(count_ - 1);
+	std::vector<char_type> text(prepended_.rbegin(), prepended_.rend());
+	text.resize(text.size() + static_cast<size_t>(textEnd_ - r.text));
+	copyOut(r.text, static_cast<size_t>(textEnd_ - r.text), text.data() + prepended_.size());
+
+	reserveText(prepended_.size());
+	copyIn(r.text, text.data(), text.size());
+	textEnd_ = r.text + text.size();
+	prepended_.clear();
+}
+
+/*
+** Compress the text of the newest record, if it has grown big enough
+*/
+void UndoList::compressNewest() {
+
+	if (count_ == 0) {
+		return;
+	}
+
+	Record &r = record(count_ - 1);
+	const size_t length = static_cast<size_t>(textEnd_ - r.text);
+
+	if (r.compressed || length < COMPRESS_THRESHOLD) {
+		return;
+	}
+
+	std::vector<char_type> text(length);
+	copyOut(r.text, length, text.data());
+	textEnd_ = r.text;
+
+	if (writeCompressed(text.data(), length)) {
+		r.compressed = true;
+	} else {
+		copyIn(textEnd_, text.data(), length);
+		textEnd_ += length;
+	}
+}
+
+/*
+** Store the text of the newest record uncompressed again, so that it can
+** be added to
+*/
+void UndoList::expandNewest() {
+
+	Record &r = record(count_ - 1);
+	if (!r.compressed) {
+		return;
+	}
+
+	std::vector<char_type> text;
+	newestText(&text);
+
+	textEnd_ = r.text;
+	reserveText(text.size());
+	copyIn(textEnd_, text.data(), text.size());
+	textEnd_ += text.size();
+	r.compressed = false;
+}
+
+/*
+** Add "text" to the end of the ring compressed, a chunk at a time, each
+** chunk being its size followed by the compressed data.  Returns false,
+** having added nothing, if the first chunk shows that the text doesn't
+** compress well enough to be worth it.
+*/
+bool UndoList::writeCompressed(const char_type *text, size_t length) {
+
+	const uint64_t start = textEnd_;
+	std::vector<char_type> chunk;
+
+	for (size_t done = 0; done < length;) {
+		const size_t n = std::min<size_t>(length - done, COMPRESS_CHUNK_SIZE);
+
+		chunk.resize(CHUNK_HEADER_SIZE + bytesToChars(lzCompressBound(n * sizeof(char_type))));
+		uint8_t *const bytes = reinterpret_cast<uint8_t *>(chunk.data());
+		const uint32_t size = static_cast<uint32_t>(
+		    lzCompress(reinterpret_cast<const uint8_t *>(text + done), n * sizeof(char_type), bytes + CHUNK_HEADER_SIZE * sizeof(char_type)));
+		std::memcpy(bytes, &size, sizeof(size));
+
+		const size_t chunkSize = CHUNK_HEADER_SIZE + bytesToChars(size);
+		if (done == 0 && chunkSize > n - n / 8) {
+			textEnd_ = start;
+			return false;
+		}
+
+		reserveText(chunkSize);
+		copyIn(textEnd_, chunk.data(), chunkSize);
+		textEnd_ += chunkSize;
+		done += n;
+	}
+
+	return true;
+}
+
+/*
+** Decompress "length" characters of text stored by writeCompressed at
+** offset "offset" of the ring into "text"
+*/
+void UndoList::readCompressed(uint64_t offset, size_t length, char_type *text) const {
+
+	std::vector<char_type> chunk;
+
+	for (size_t done = 0; done < length;) {
+		const size_t n = std::min<size_t>(length - done, COMPRESS_CHUNK_SIZE);
+
+		char_type header[CHUNK_HEADER_SIZE];
+		uint32_t size;
+		copyOut(offset, CHUNK_HEADER_SIZE, header);
+		std::memcpy(&size, header, sizeof(size));
+
+		chunk.resize(bytesToChars(size));
+		copyOut(offset + CHUNK_HEADER_SIZE, chunk.size(), chunk.data());
+
+		const bool ok = lzDecompress(reinterpret_cast<const uint8_t *>(chunk.data()), size,
+		                             reinterpret_cast<uint8_t *>(text + done), n * sizeof(char_type));
+		assert(ok);
+		(void)ok;
+
+		offset += CHUNK_HEADER_SIZE + chunk.size();
+		done += n;
+	}
+}
+
+/*
+** Record "index" counting from the oldest
+*/
+UndoList::Record &UndoList::record(int index) {
+	return records_[(first_ + index) % records_.size()];
+}
+
+/*
+** Where text offset "offset" is in the text ring
+*/
+size_t UndoList::textAt(uint64_t offset) const {
+	return static_cast<size_t>(offset % text_.size());
+}
+
+/*
+** Copy "length" characters of "text" into the ring at offset "offset"
+*/
+void UndoList::copyIn(uint64_t offset, const char_type *text, size_t length) {
+
+	if (length == 0) {
+		return;
+	}
+
+	const size_t pos = textAt(offset);
+	const size_t first = std::min(length, text_.size() - pos);
+	std::copy_n(text, first, text_.begin() + pos);
+	std::copy_n(text + first, length - first, text_.begin());
+}
+
+/*
+** Copy "length" characters from the ring at offset "offset" into "text"
+*/
+void UndoList::copyOut(uint64_t offset, size_t length, char_type *text) const {
+
+	if (length == 0) {
+		return;
+	}
+
+	const size_t pos = textAt(offset);
+	const size_t first = std::min(length, text_.size() - pos);
+	std::copy_n(text_.begin() + pos, first, text);
+	std::copy_n(text_.begin(), length - first, text + first);
+}
+
+/*
+** Make room in the record ring for "count" records
+*/
+void UndoList::reserveRecords(int count) {
+
+	if (count <= static_cast<int>(records_.size())) {
+		return;
+	}
+
+	std::vector<Record> records;
+	records.reserve(std::max<size_t>(MIN_RECORDS, 2 * records_.size()));
+	for (int i = 0; i < count_; i++) {
+		records.push_back(record(i));
+	}
+
+	records.resize(records.capacity());
+	records_.swap(records);
+	first_ = 0;
+}
+
+/*
+** Make room in the text ring for "length" more characters
+*/
+void UndoList::reserveText(size_t length) {
+
+	const size_t needed = static_cast<size_t>(textEnd_ - textStart_) + length;
+	if (needed > text_.size()) {
+		resizeText(std::max<size_t>({needed, 2 * text_.size(), MIN_TEXT_SIZE}));
+	}
+}
+
+/*
+** Move the text into a ring of "capacity" characters.  Offsets stay the
+** same, only where they are in the ring changes.
+*/
+void UndoList::resizeText(size_t capacity) {
+
+	std::vector<char_type> ring(capacity);
+	ring.swap(text_);
+
+	for (uint64_t offset = textStart_; offset < textEnd_;) {
+		const size_t pos = static_cast<size_t>(offset % ring.size());
+		const size_t n = std::min<size_t>(static_cast<size_t>(textEnd_ - offset), ring.size() - pos);
+		copyIn(offset, &ring[pos], n);
+		offset += n;
+	}
+}
+
+/*
+** Shrink the text ring once it is mostly empty, so that one big record
+** doesn't leave a big ring behind it
+*/
+void UndoList::shrinkIfSparse() {
+
+	const size_t used = static_cast<size_t>(textEnd_ - textStart_);
+
+	if (text_.size() > KEEP_TEXT_SIZE && used < text_.size() / 4) {
+		resizeText(std::max<size_t>(2 * used, KEEP_TEXT_SIZE));
+	}
+}
@@ -0,0 +1,115 @@
+
+#ifndef UNDO_LIST_H_
+#define UNDO_LIST_H_
+
+#include "Types.h"
+#include <cstddef>
+#include <vector>
+
+enum UndoTypes {
+	UNDO_NOOP,
+	ONE_CHAR_INSERT,
+	ONE_CHAR_REPLACE,
+	ONE_CHAR_DELETE,
+	BLOCK_INSERT,
+	BLOCK_REPLACE,
+	BLOCK_DELETE,
+	MULTI_REPLACE
+};
+
+/* Record on undo list */
+struct UndoInfo {
+	UndoTypes type;
+	pos_type startPos;
+	pos_type endPos;
+	pos_type oldLen;      /* length of the text replaced, which is kept
+	                         by the UndoList (for a MULTI_REPLACE, of its
+	                         packed deltas, see packDeltas) */
+	bool inUndo;          /* flag to indicate undo command on
+	                     this record in progress.  Redirects
+	                     SaveUndoInfo to save the next mod-
+	                     ifications on the redo list instead
+	                     of the undo list. */
+	bool restoresToSaved; /* flag to indicate undoing this
+	                                 operation will restore file to
+	                                 last saved (unmodified) state */
+};
+
+/* One of the ranges changed by a MULTI_REPLACE: "newLen" characters at
+   "pos" replaced "oldLen" others, found at "oldOffset" in the old text */
+struct UndoDelta {
+	pos_type pos;
+	pos_type oldLen;
+	pos_type newLen;
+	pos_type oldOffset;
+};
+
+void findDeltas(pos_type pos, const char_type *oldText, pos_type oldLength, const char_type *newText, pos_type newLength, std::vector<UndoDelta> *deltas);
+void packDeltas(pos_type pos, const std::vector<UndoDelta> &deltas, const char_type *oldText, std::vector<char_type> *payload);
+void unpackDeltas(pos_type pos, const std::vector<char_type> &payload, std::vector<UndoDelta> *deltas, std::vector<char_type> *oldText);
+
+/* A list of undo (or redo) records, newest first, with the text each one
+   replaced.  Rather than allocating each record and its text separately,
+   the records are kept in one ring and all of their text in another, both
+   growing by doubling.  Records are only ever added or removed at the ends
+   of the list, so adding one costs a copy of its text, removing one (from
+   either end, as undoing and trimming do) costs O(1), and editing for as
+   long as you like leaves the heap no more fragmented than one record.
+   The text of big records (a select all and paste, say) is kept compressed,
+   so that they can still be undone without the list holding on to another
+   copy of the whole file. */
+class UndoList {
+public:
+	UndoList();
+
+public:
+	UndoInfo &newest();
+	bool empty() const;
+	int size() const;
+	size_t bytesUsed() const;
+	size_t memoryUsage() const;
+	void appendText(const char_type *text, pos_type length);
+	void clear();
+	void clearRestoresToSaved();
+	void compact();
+	void cutHead(pos_type cut);
+	void newestText(std::vector<char_type> *text);
+	void popNewest();
+	void popOldest();
+	void prependText(const char_type *text, pos_type length);
+	void push(const UndoInfo &info, const char_type *text, pos_type length);
+
+private:
+	struct Record {
+		UndoInfo info;
+		uint64_t text;   // where its text starts in the text ring (see textAt)
+		bool compressed; // if the text is stored compressed (see writeCompressed)
+	};
+
+private:
+	Record &record(int index);
+	bool writeCompressed(const char_type *text, size_t length);
+	size_t textAt(uint64_t offset) const;
+	void compressNewest();
+	void copyIn(uint64_t offset, const char_type *text, size_t length);
+	void copyOut(uint64_t offset, size_t length, char_type *text) const;
+	void expandNewest();
+	void readCompressed(uint64_t offset, size_t length, char_type *text) const;
+	void reserveRecords(int count);
+	void reserveText(size_t length);
+	void resizeText(size_t capacity);
+	void seal();
+	void shrinkIfSparse();
+
+private:
+	std::vector<Record> records_;    // ring of records, the oldest at index first_
+	int first_;
+	int count_;
+	std::vector<char_type> text_;    // ring of text: the text from offset textStart_
+	uint64_t textStart_;             // up to textEnd_ (offsets which only ever grow,
+	uint64_t textEnd_;               // taken modulo the size of the ring)
+	std::vector<char_type> prepended_; // text prepended to the newest record, in
+	                                   // reverse order, not yet moved into the ring
+};
+
+#endif
@@ -2256,6 +2256,16 @@ RegexMatch* Regex::ExecRE(const char *string, const char *end, Direction directi
 
 
 
+/*----------------------------------------------------------------------*
+ * MemoryUsage
+ *
+ * Bytes used by the compiled regex: the object, its program and a copy of
+ * the source.
+ *----------------------------------------------------------------------*/
+size_t Regex::MemoryUsage() const {
+	return sizeof(Regex) + (Reg_Size + 1) * sizeof(prog_type) + regex_.size() * sizeof(QChar);
+}
+
 /*----------------------------------------------------------------------*
  * SetREDefaultWordDelimiters
  *
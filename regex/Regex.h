@@ -96,6 +96,12 @@ public:
 	RegexMatch* ExecRE(const char *string, const char *end, Direction direction, char prev_char, char succ_char,
 	           const char *delimiters, const char *look_behind_to, const char *match_till);
 
+	/**
+	 * @brief MemoryUsage - Bytes used by the compiled regex, program included.
+	 * @return
+	 */
+	size_t MemoryUsage() const;
+
 private:
 	// for CompileRE
 	prog_type *alternative(int *flag_param, len_range *range_param);
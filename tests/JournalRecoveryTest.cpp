@@ -0,0 +1,142 @@
+
+#include "NirvanaQt.h"
+#include <QApplication>
+#include <QKeyEvent>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+
+/*
+** Checks that the text and undo history an editor journaled can be
+** recovered by another, undoing past the save the journal started at
+** included.  Edits are made as a user would, with key presses.  Takes the
+** directory to make the journal in as its argument (the system's temporary
+** directory if none).
+*/
+
+namespace {
+
+/* Longest to wait for the journal's writer to write what it was given */
+const std::chrono::seconds MAX_WRITE_WAIT(10);
+
+int failures = 0;
+
+#define CHECK(condition)                                                       \
+	do {                                                                       \
+		if (!(condition)) {                                                    \
+			std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+			failures++;                                                        \
+		}                                                                      \
+	} while (0)
+
+std::string all(const NirvanaQt &editor) {
+	const String text = editor.buffer()->BufGetAll();
+	return std::string(text.str, static_cast<size_t>(text.len));
+}
+
+void press(NirvanaQt *editor, int key, Qt::KeyboardModifiers modifiers = Qt::NoModifier, const QString &text = QString()) {
+	QKeyEvent event(QEvent::KeyPress, key, modifiers, text);
+	QApplication::sendEvent(editor, &event);
+}
+
+void type(NirvanaQt *editor, const char *text) {
+	for (const char *p = text; *p; p++) {
+		press(editor, Qt::Key_unknown, Qt::NoModifier, QString(QLatin1Char(*p)));
+	}
+}
+
+void undo(NirvanaQt *editor) {
+	press(editor, Qt::Key_Z, Qt::ControlModifier);
+}
+
+/*
+** Wait for the journal at "path", of changes to "saved", to hold "count"
+** entries, returning false if it doesn't in time
+*/
+bool waitForEntries(const std::string &path, const char *saved, size_t count) {
+	TextBuffer text;
+	text.BufSetAll(saved);
+
+	const auto started = std::chrono::steady_clock::now();
+	for (;;) {
+		std::vector<JournalEntry> entries;
+		std::vector<int64_t> offsets;
+		if (UndoJournal::read(path.c_str(), text.BufSnapshot(), &entries, &offsets) && entries.size() >= count) {
+			return entries.size() == count;
+		}
+
+		if (std::chrono::steady_clock::now() - started > MAX_WRITE_WAIT) {
+			return false;
+		}
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+}
+
+/*
+** Undoing edits made before the save journals undos for records an editor
+** recovering from it never has.  They, and everything after, must still
+** come out as they were made.
+*/
+void testUndoPastSave(const std::string &path) {
+
+	/* two edits, "abc" typed then "c" deleted, saved after */
+	NirvanaQt editor;
+	type(&editor, "abc");
+	press(&editor, Qt::Key_Backspace);
+	CHECK(all(editor) == "ab");
+	editor.startJournal(QString::fromLocal8Bit(path.c_str()));
+
+	/* both undone, then more typed, deleted and undone */
+	undo(&editor);
+	undo(&editor);
+	CHECK(all(editor) == "");
+	type(&editor, "xyz");
+	press(&editor, Qt::Key_Backspace);
+	undo(&editor);
+	CHECK(all(editor) == "xyz");
+	editor.stopJournal();
+
+	/* 2 undos, 3 characters typed, 1 deleted and 1 undo */
+	CHECK(waitForEntries(path, "ab", 7));
+
+	/* recovered onto the saved text, without the editor's history */
+	NirvanaQt recovered;
+	recovered.appendText("ab", 2);
+	CHECK(recovered.recoverFromJournal(QString::fromLocal8Bit(path.c_str())));
+	CHECK(all(recovered) == "xyz");
+
+	/* the typing after the save can still be undone */
+	undo(&recovered);
+	CHECK(all(recovered) == "");
+	recovered.stopJournal();
+}
+
+}
+
+int main(int argc, char *argv[]) {
+
+	if (qgetenv("QT_QPA_PLATFORM").isEmpty()) {
+		qputenv("QT_QPA_PLATFORM", "offscreen");
+	}
+
+	QApplication app(argc, argv);
+
+	/* QApplication takes the arguments meant for Qt out of argv */
+	const char *dir = (argc > 1) ? argv[1] : std::getenv("TMPDIR");
+	const std::string path = std::string(dir ? dir : "/tmp") + "/NirvanaQtJournalRecoveryTest.journal";
+
+	std::remove(path.c_str());
+	testUndoPastSave(path);
+	std::remove(path.c_str());
+
+	if (failures != 0) {
+		std::fprintf(stderr, "%d checks failed\n", failures);
+		return 1;
+	}
+
+	std::printf("all checks passed\n");
+	return 0;
+}
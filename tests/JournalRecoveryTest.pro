@@ -0,0 +1,46 @@
+
+TEMPLATE = app
+TARGET = JournalRecoveryTest
+DEPENDPATH  += . ..
+INCLUDEPATH += ..
+QT += xml
+CONFIG += console
+CONFIG -= app_bundle
+
+include(../qmake/clean-objects.pri)
+include(../qmake/c++11.pri)
+include(../qmake/qt5-gui.pri)
+
+linux-g++ {
+    QMAKE_CXXFLAGS += -W -Wall -pedantic
+}
+
+*msvc* {
+    DEFINES += _CRT_SECURE_NO_WARNINGS _SCL_SECURE_NO_WARNINGS
+}
+
+# The whole editor widget, run on the offscreen platform unless another is
+# asked for, with the directory to make its journal in as its argument
+HEADERS += \
+    ../NirvanaQt.h
+
+SOURCES += \
+    JournalRecoveryTest.cpp \
+    ../NirvanaQt.cpp \
+    ../TextBuffer.cpp \
+    ../PieceTable.cpp \
+    ../MarkerStore.cpp \
+    ../LzCompress.cpp \
+    ../Rangeset.cpp \
+    ../UndoList.cpp \
+    ../UndoJournal.cpp \
+    ../TextScan.cpp \
+    ../Selection.cpp \
+    ../SyntaxHighlighter.cpp \
+    ../X11Colors.cpp \
+    ../regex/Regex.cpp \
+    ../regex/RegexMatch.cpp \
+    ../regex/RegexCommon.cpp
+
+RESOURCES += \
+    ../NirvanaQt.qrc
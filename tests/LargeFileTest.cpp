@@ -0,0 +1,155 @@
+
+#include "TextBuffer.h"
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/*
+** Checks that a buffer bigger than 4 GB can be edited near its end, and
+** that doing so costs no more than it would in a small one.  The text is a
+** sparse file (taking next to no disk space) mapped by BufLoadMapped, with
+** a line at the start and a few at the end.  Takes the directory to make
+** the file in as its argument (the system's temporary directory if none).
+*/
+
+namespace {
+
+const pos_type FILE_SIZE = (pos_type(9) << 29) + 12345; // 4.5 GB and a bit
+const char HEAD[] = "first line\n";
+const char TAIL[] = "next to last\nlast line\n";
+
+/* Most time editing near the end may take, well above what it takes for a
+   buffer of any size, but far below what copying 4 GB would */
+const double MAX_EDIT_SECONDS = 2.0;
+const int N_EDITS = 10000;
+
+int failures = 0;
+
+#define CHECK(condition)                                                       \
+	do {                                                                       \
+		if (!(condition)) {                                                    \
+			std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+			failures++;                                                        \
+		}                                                                      \
+	} while (0)
+
+std::string range(const TextBuffer &buf, pos_type start, pos_type end) {
+	const String text = buf.BufGetRange(start, end);
+	return std::string(text.str, static_cast<size_t>(text.len));
+}
+
+/*
+** Make a sparse file of FILE_SIZE bytes, HEAD at its start and TAIL at its
+** end, returning false if the system can't
+*/
+bool makeFile(const std::string &path) {
+#if defined(__unix__) || defined(__APPLE__)
+	const int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1) {
+		return false;
+	}
+
+	const off_t tailPos = static_cast<off_t>(FILE_SIZE - (sizeof(TAIL) - 1));
+	const bool ok = ftruncate(fd, static_cast<off_t>(FILE_SIZE)) == 0 &&
+	                pwrite(fd, HEAD, sizeof(HEAD) - 1, 0) == static_cast<ssize_t>(sizeof(HEAD) - 1) &&
+	                pwrite(fd, TAIL, sizeof(TAIL) - 1, tailPos) == static_cast<ssize_t>(sizeof(TAIL) - 1);
+	close(fd);
+	return ok;
+#else
+	(void)path;
+	return false;
+#endif
+}
+
+}
+
+int main(int argc, char *argv[]) {
+
+	const char *dir = (argc > 1) ? argv[1] : std::getenv("TMPDIR");
+	const std::string path = std::string(dir ? dir : "/tmp") + "/NirvanaQtLargeFileTest.txt";
+
+	if (!makeFile(path)) {
+		std::fprintf(stderr, "can't make a %lld byte sparse file at %s, skipped\n", static_cast<long long>(FILE_SIZE), path.c_str());
+		return 0;
+	}
+
+	TextBuffer buf;
+	const bool loaded = buf.BufLoadMapped(path.c_str());
+	CHECK(loaded);
+
+	if (loaded) {
+		const pos_type tailStart = FILE_SIZE - static_cast<pos_type>(sizeof(TAIL) - 1);
+		const pos_type lastLine = FILE_SIZE - static_cast<pos_type>(sizeof("last line\n") - 1);
+
+		/* positions past 4 GB read and count right */
+		CHECK(buf.BufGetLength() == FILE_SIZE);
+		CHECK(tailStart > pos_type(UINT_MAX));
+		CHECK(range(buf, 0, sizeof(HEAD) - 1) == HEAD);
+		CHECK(range(buf, tailStart, FILE_SIZE) == TAIL);
+		CHECK(buf.BufGetCharacter(lastLine) == 'l');
+		CHECK(buf.BufCountLines(0, FILE_SIZE) == 3);
+		CHECK(buf.BufStartOfLine(FILE_SIZE - 1) == lastLine);
+		CHECK(buf.BufEndOfLine(tailStart) == lastLine - 1);
+		CHECK(buf.BufCountForwardNLines(0, 2) == lastLine);
+
+		pos_type found;
+		CHECK(buf.BufSearchBackward(FILE_SIZE - 1, "x", &found) && found == tailStart + 2);
+
+		const int marker = buf.BufAddMarker(lastLine, FILE_SIZE - 1, 0);
+
+		/* edit near the end, as appending to a log or fixing its last lines
+		   would, timing it */
+		const auto started = std::chrono::steady_clock::now();
+
+		for (int i = 0; i < N_EDITS; i++) {
+			buf.BufInsert(lastLine, "x\n", 2);
+			buf.BufReplace(lastLine, lastLine + 1, "y", 1);
+			buf.BufRemove(lastLine + 1, lastLine + 2);
+			buf.BufRemove(lastLine, lastLine + 1);
+			buf.BufCountLines(0, buf.BufGetLength());
+		}
+
+		buf.BufInsert(FILE_SIZE, "appended\n", 9);
+		buf.BufReplace(tailStart, tailStart + 4, "NEXT", 4);
+		buf.BufInsert(lastLine, "inserted\n", 9);
+
+		const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+		std::printf("%d edits near the end of a %lld byte buffer took %.3f s\n", N_EDITS * 4 + 3, static_cast<long long>(FILE_SIZE), seconds);
+		CHECK(seconds < MAX_EDIT_SECONDS);
+
+		/* the edits all landed where they should have, and everything after
+		   them moved */
+		CHECK(buf.BufGetLength() == FILE_SIZE + 18);
+		CHECK(range(buf, tailStart, buf.BufGetLength()) == "NEXT to last\ninserted\nlast line\nappended\n");
+		CHECK(buf.BufCountLines(0, buf.BufGetLength()) == 5);
+		CHECK(buf.BufStartOfLine(buf.BufGetLength() - 1) == FILE_SIZE + 9);
+		CHECK(range(buf, 0, sizeof(HEAD) - 1) == HEAD);
+
+		pos_type markerStart;
+		pos_type markerEnd;
+		CHECK(buf.BufGetMarker(marker, &markerStart, &markerEnd) && markerStart == lastLine + 9 && markerEnd == FILE_SIZE + 8);
+
+		/* the mapped file is still the text: nothing copied it, and all the
+		   buffer holds besides is the piece tree and the text of the edits */
+		const TextBufferMemoryUsage usage = buf.BufMemoryUsage();
+		CHECK(usage.other == 0);
+		CHECK(usage.indexes + usage.gap < static_cast<size_t>(FILE_SIZE / 16));
+	}
+
+	std::remove(path.c_str());
+
+	if (failures != 0) {
+		std::fprintf(stderr, "%d checks failed\n", failures);
+		return 1;
+	}
+
+	std::printf("all checks passed\n");
+	return 0;
+}
@@ -0,0 +1,29 @@
+
+TEMPLATE = app
+TARGET = LargeFileTest
+DEPENDPATH  += . ..
+INCLUDEPATH += ..
+CONFIG += console
+CONFIG -= qt app_bundle
+
+include(../qmake/clean-objects.pri)
+include(../qmake/c++11.pri)
+
+linux-g++ {
+    QMAKE_CXXFLAGS += -W -Wall -pedantic
+}
+
+*msvc* {
+    DEFINES += _CRT_SECURE_NO_WARNINGS _SCL_SECURE_NO_WARNINGS
+}
+
+# Only the text buffer and what it uses, no Qt: run it on a 64 bit system,
+# with the directory to make its 4.5 GB sparse file in as its argument
+SOURCES += \
+    LargeFileTest.cpp \
+    ../TextBuffer.cpp \
+    ../PieceTable.cpp \
+    ../TextScan.cpp \
+    ../MarkerStore.cpp \
+    ../Rangeset.cpp \
+    ../Selection.cpp
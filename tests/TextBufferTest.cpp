@@ -0,0 +1,102 @@
+
+#include "TextBuffer.h"
+#include "Rangeset.h"
+#include <cstdio>
+#include <string>
+
+/*
+** Checks of TextBuffer edits and of what they do to the positions kept
+** alongside the text.  Each check runs with the text in a gap buffer and
+** again in a piece table.
+*/
+
+namespace {
+
+int failures = 0;
+
+#define CHECK(condition)                                                       \
+	do {                                                                       \
+		if (!(condition)) {                                                    \
+			std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+			failures++;                                                        \
+		}                                                                      \
+	} while (0)
+
+std::string all(const TextBuffer &buf) {
+	const String text = buf.BufGetAll();
+	return std::string(text.str, static_cast<size_t>(text.len));
+}
+
+/*
+** BufReplaceMultiple moves a marker on the text in between two of the
+** ranges it replaces by what the ranges before it grew or shrank by
+*/
+void testReplaceMultipleMarkers(bool usePieceTable) {
+	TextBuffer buf;
+	buf.BufSetUsePieceTable(usePieceTable);
+	buf.BufSetAll("aaaa XXXX bbbb YYYY cccc");
+
+	const int before  = buf.BufAddMarker(0, 4, 0);
+	const int between = buf.BufAddMarker(10, 14, 0);
+	const int after   = buf.BufAddMarker(20, 24, 0);
+
+	const TextReplacement replacements[] = {
+		{  5,  9, "Z",     1 },
+		{ 15, 19, "WWWWW", 5 }
+	};
+	buf.BufReplaceMultiple(replacements, 2);
+
+	CHECK(all(buf) == "aaaa Z bbbb WWWWW cccc");
+
+	pos_type start;
+	pos_type end;
+	CHECK(buf.BufGetMarker(before, &start, &end) && start == 0 && end == 4);
+	CHECK(buf.BufGetMarker(between, &start, &end) && start == 7 && end == 11);
+	CHECK(buf.BufGetMarker(after, &start, &end) && start == 18 && end == 22);
+}
+
+/*
+** ...and a rangeset's ranges there, rather than deleting them
+*/
+void testReplaceMultipleRangesets(bool usePieceTable) {
+	TextBuffer buf;
+	buf.BufSetUsePieceTable(usePieceTable);
+	buf.BufSetAll("aaaa XXXX bbbb YYYY cccc");
+
+	RangesetTable *table = buf.BufCreateRangesetTable();
+	Rangeset *rangeset = table->rangeset(table->create());
+	rangeset->add(0, 4);
+	rangeset->add(10, 14);
+	rangeset->add(20, 24);
+
+	const TextReplacement replacements[] = {
+		{  5,  9, "Z",     1 },
+		{ 15, 19, "WWWWW", 5 }
+	};
+	buf.BufReplaceMultiple(replacements, 2);
+
+	pos_type start;
+	pos_type end;
+	CHECK(rangeset->count() == 3);
+	CHECK(rangeset->range(0, &start, &end) && start == 0 && end == 4);
+	CHECK(rangeset->range(1, &start, &end) && start == 7 && end == 11);
+	CHECK(rangeset->range(2, &start, &end) && start == 18 && end == 22);
+}
+
+}
+
+int main() {
+
+	for (int usePieceTable = 0; usePieceTable < 2; usePieceTable++) {
+		testReplaceMultipleMarkers(usePieceTable != 0);
+		testReplaceMultipleRangesets(usePieceTable != 0);
+	}
+
+	if (failures != 0) {
+		std::fprintf(stderr, "%d checks failed\n", failures);
+		return 1;
+	}
+
+	std::printf("all checks passed\n");
+	return 0;
+}
@@ -0,0 +1,28 @@
+
+TEMPLATE = app
+TARGET = TextBufferTest
+DEPENDPATH  += . ..
+INCLUDEPATH += ..
+CONFIG += console
+CONFIG -= qt app_bundle
+
+include(../qmake/clean-objects.pri)
+include(../qmake/c++11.pri)
+
+linux-g++ {
+    QMAKE_CXXFLAGS += -W -Wall -pedantic
+}
+
+*msvc* {
+    DEFINES += _CRT_SECURE_NO_WARNINGS _SCL_SECURE_NO_WARNINGS
+}
+
+# Only the text buffer and what it uses, no Qt
+SOURCES += \
+    TextBufferTest.cpp \
+    ../TextBuffer.cpp \
+    ../PieceTable.cpp \
+    ../TextScan.cpp \
+    ../MarkerStore.cpp \
+    ../Rangeset.cpp \
+    ../Selection.cpp